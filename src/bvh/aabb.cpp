@@ -3,6 +3,12 @@
 namespace rtr {
 
 bool AABB::intersect(const Ray& ray, float t_min, float t_max) const {
+  float t_enter;
+  return intersect(ray, t_min, t_max, t_enter);
+}
+
+bool AABB::intersect(const Ray& ray, float t_min, float t_max,
+                     float& t_enter) const {
   float t0 = t_min;
   float t1 = t_max;
 
@@ -30,6 +36,7 @@ bool AABB::intersect(const Ray& ray, float t_min, float t_max) const {
     }
   }
 
+  t_enter = t0;
   return t0 <= t_max && t1 >= t_min;
 }
 
@@ -22,6 +22,19 @@ struct AABB {
   }
 
   bool intersect(const Ray& ray, float t_min, float t_max) const;
+  /// @brief Also gives the distance the ray enters the box, t_min if it
+  /// starts inside
+  bool intersect(const Ray& ray, float t_min, float t_max,
+                 float& t_enter) const;
+
+  [[nodiscard]] bool empty() const { return (min.array() > max.array()).any(); }
+
+  /// @brief Zero for an empty box
+  [[nodiscard]] float surface_area() const {
+    Eigen::Vector3f extent = (max - min).cwiseMax(0.0f);
+    return 2.0f * (extent.x() * extent.y() + extent.y() * extent.z() +
+                   extent.z() * extent.x());
+  }
 
   void clear() {
     min = Eigen::Vector3f::Constant(std::numeric_limits<float>::max());
@@ -1,12 +1,72 @@
 #include "bvh.h"
 
 #include <algorithm>
+#include <cmath>
+#include <cstring>
 #include <execution>
 #include <future>
 #include <numeric>
 
+#include "arena.h"
+
 namespace rtr {
 
+/// @brief Node of the tree before flattening, nodes and leaf indices live in
+/// the arena of the build
+struct BVHAccel::BuildNode {
+  AABB bbox;
+  BuildNode* left = nullptr;
+  BuildNode* right = nullptr;
+  std::span<const VertexIndex> triangle_indices;
+  bool is_leaf = false;
+};
+
+/// @brief State shared by the nodes of a build with spatial splits
+struct BVHAccel::SplitBuild {
+  Arena& arena;
+  // spatial splits are tried once the children of the object split overlap
+  // by this much of the root area
+  float min_overlap = 0.0f;
+};
+
+namespace {
+
+constexpr int split_bins = 32;
+constexpr size_t max_leaf_triangles = 8;
+// keeps the traversal stacks of 64 entries enough
+constexpr int max_split_depth = 48;
+// references below which the children are built on the calling thread
+constexpr size_t parallel_references = 4096;
+// deepest node the traversal stacks of 64 entries hold the path to
+constexpr int max_traversal_depth = 62;
+
+/// @brief Children of inner nodes follow them within the node array and
+/// leaves lie within the leaf indices, see BVHAccel::is_consistent
+template <typename Node>
+bool consistent_nodes(std::span<const Node> nodes, size_t index_count) {
+  std::vector<uint8_t> depths(nodes.size(), 0);
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    const Node& node = nodes[i];
+    if (node.count > 0) {
+      if (node.offset % 3 != 0 || node.count % 3 != 0 ||
+          uint64_t(node.offset) + node.count > index_count)
+        return false;
+      continue;
+    }
+    // a right child after the left subtree also rules out cycles
+    if (node.offset <= i + 1 || node.offset >= nodes.size())
+      return false;
+    uint8_t depth = depths[i] + 1;
+    if (depth > max_traversal_depth)
+      return false;
+    depths[i + 1] = std::max(depths[i + 1], depth);
+    depths[node.offset] = std::max(depths[node.offset], depth);
+  }
+  return true;
+}
+
+}  // namespace
+
 Vector3f min_point(const Vector3f& v1, const Vector3f& v2, const Vector3f& v3) {
   return v1.cwiseMin(v2).cwiseMin(v3);
 }
@@ -19,7 +79,7 @@ AABB compute_bbox(const std::array<Eigen::Vector3f, 3>& p) {
   return AABB(min_point(p[0], p[1], p[2]), max_point(p[0], p[1], p[2]));
 }
 
-AABB compute_bbox(const std::vector<BVHTriangle>& triangles) {
+AABB compute_bbox(std::span<const BVHTriangle> triangles) {
   AABB bbox;
   for (const auto& triangle : triangles) {
     bbox.expand(triangle.bbox);
@@ -27,70 +87,660 @@ AABB compute_bbox(const std::vector<BVHTriangle>& triangles) {
   return bbox;
 }
 
-std::vector<size_t> join_indices(const std::vector<BVHTriangle>& triangles) {
-  std::vector<size_t> result;
-  result.reserve(3 * triangles.size());
-
+std::span<const VertexIndex> join_indices(
+    std::span<const BVHTriangle> triangles, Arena& arena) {
+  auto result = arena.allocate_array<VertexIndex>(3 * triangles.size());
+  auto out = result.begin();
   for (const auto& triangle : triangles) {
-    result.insert(result.end(), triangle.indices.begin(),
-                  triangle.indices.end());
+    out = std::copy(triangle.indices.begin(), triangle.indices.end(), out);
+  }
+  return result;
+}
+
+template <typename Position>
+std::vector<BVHTriangle> make_triangles(const Position& position,
+                                        std::span<const VertexIndex> indices) {
+  std::vector<BVHTriangle> triangles;
+  triangles.reserve(indices.size() / 3);
+  for (size_t i = 0; i < indices.size(); i += 3) {
+    auto i1 = indices[i];
+    auto i2 = indices[i + 1];
+    auto i3 = indices[i + 2];
+
+    std::array<Eigen::Vector3f, 3> points{position(i1), position(i2),
+                                          position(i3)};
+
+    triangles.push_back(BVHTriangle{{i1, i2, i3}, points,
+                                    (points[0] + points[1] + points[2]) / 3.f,
+                                    compute_bbox(points)});
+  }
+  return triangles;
+}
+
+/// @brief Node areas relative to the root
+std::vector<float> relative_areas(const std::vector<BVHNode>& nodes) {
+  std::vector<float> result(nodes.size(), 0.0f);
+  float root_area = nodes.empty() ? 0.0f : nodes[0].bbox.surface_area();
+  if (root_area > 0.0f) {
+    for (size_t i = 0; i < nodes.size(); ++i) {
+      result[i] = nodes[i].bbox.surface_area() / root_area;
+    }
+  }
+  return result;
+}
+
+/// @brief SAH cost with unit costs of a traversal step and of a triangle
+float sah_cost(const std::vector<BVHNode>& nodes,
+               const std::vector<float>& areas) {
+  float cost = 0.0f;
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    cost += areas[i] * (nodes[i].count > 0 ? nodes[i].count / 3.0f : 1.0f);
+  }
+  return cost;
+}
+
+/// @brief Index past the last node of the subtree
+uint32_t subtree_end(const std::vector<BVHNode>& nodes, uint32_t index) {
+  while (nodes[index].count == 0) {
+    index = nodes[index].offset;
+  }
+  return index + 1;
+}
+
+/// @brief Range of the leaf indices of the subtree
+std::pair<uint32_t, uint32_t> leaf_range(const std::vector<BVHNode>& nodes,
+                                         uint32_t index) {
+  uint32_t first = index;
+  while (nodes[first].count == 0) {
+    ++first;
   }
+  const BVHNode& last = nodes[subtree_end(nodes, index) - 1];
+  return {nodes[first].offset, last.offset + last.count};
+}
 
-  return std::move(result);
+/// @brief Inner bounds from the children, children follow their parent
+void refit_inner(std::vector<BVHNode>& nodes) {
+  for (size_t i = nodes.size(); i-- > 0;) {
+    if (nodes[i].count > 0)
+      continue;
+    AABB bbox = nodes[i + 1].bbox;
+    bbox.expand(nodes[nodes[i].offset].bbox);
+    nodes[i].bbox = bbox;
+  }
+}
+
+/// @brief Bounds of the part of the reference on each side of the plane,
+/// within its current bounds
+void split_reference(const BVHTriangle& reference, int axis, float position,
+                     AABB& left, AABB& right) {
+  left.clear();
+  right.clear();
+  for (int i = 0; i < 3; ++i) {
+    const Eigen::Vector3f& v0 = reference.vertexes[i];
+    const Eigen::Vector3f& v1 = reference.vertexes[(i + 1) % 3];
+    float p0 = v0[axis];
+    float p1 = v1[axis];
+    if (p0 <= position)
+      left.expand(AABB(v0, v0));
+    if (p0 >= position)
+      right.expand(AABB(v0, v0));
+    if ((p0 < position && position < p1) || (p1 < position && position < p0)) {
+      Eigen::Vector3f p = v0 + (v1 - v0) * ((position - p0) / (p1 - p0));
+      p[axis] = position;
+      left.expand(AABB(p, p));
+      right.expand(AABB(p, p));
+    }
+  }
+  left.min = left.min.cwiseMax(reference.bbox.min);
+  left.max = left.max.cwiseMin(reference.bbox.max);
+  left.max[axis] = std::min(left.max[axis], position);
+  right.min = right.min.cwiseMax(reference.bbox.min);
+  right.max = right.max.cwiseMin(reference.bbox.max);
+  right.min[axis] = std::max(right.min[axis], position);
+}
+
+/// @brief Flags of the triangles referenced by more than one leaf, empty if
+/// there are none. The flagged triangles are moved to the end of their
+/// leaves.
+std::vector<uint8_t> mark_split_references(
+    const std::vector<BVHNode>& nodes, std::vector<VertexIndex>& leaf_indices) {
+  size_t count = leaf_indices.size() / 3;
+  auto triangle = [&](size_t i) {
+    return std::tie(leaf_indices[3 * i], leaf_indices[3 * i + 1],
+                    leaf_indices[3 * i + 2]);
+  };
+  std::vector<uint32_t> order(count);
+  std::iota(order.begin(), order.end(), 0);
+  std::sort(std::execution::par, order.begin(), order.end(),
+            [&](uint32_t a, uint32_t b) { return triangle(a) < triangle(b); });
+
+  std::vector<uint8_t> flags(count, 0);
+  bool split = false;
+  for (size_t i = 1; i < count; ++i) {
+    if (triangle(order[i]) == triangle(order[i - 1])) {
+      flags[order[i]] = flags[order[i - 1]] = 1;
+      split = true;
+    }
+  }
+  if (!split)
+    return {};
+
+  std::vector<std::pair<std::array<VertexIndex, 3>, uint8_t>> leaf;
+  for (const auto& node : nodes) {
+    if (node.count == 0)
+      continue;
+    size_t first = node.offset / 3;
+    leaf.clear();
+    for (size_t i = first; i < first + node.count / 3; ++i) {
+      leaf.push_back({{leaf_indices[3 * i], leaf_indices[3 * i + 1],
+                       leaf_indices[3 * i + 2]},
+                      flags[i]});
+    }
+    std::stable_partition(leaf.begin(), leaf.end(),
+                          [](const auto& entry) { return !entry.second; });
+    for (size_t i = 0; i < leaf.size(); ++i) {
+      std::copy(leaf[i].first.begin(), leaf[i].first.end(),
+                leaf_indices.begin() + 3 * (first + i));
+      flags[first + i] = leaf[i].second;
+    }
+  }
+  return flags;
 }
 
 size_t IntersectIndices::size() const {
   if (offsets.empty())
-    return 0;
-  return *offsets.rbegin() + (*indices_ptrs.rbegin())->size();
+    return shared.size();
+  return *offsets.rbegin() + spans.rbegin()->size() + shared.size();
 }
 
 void IntersectIndices::update_offsets() {
   offsets.clear();
   size_t current = 0;
-  for (const auto& ptr : indices_ptrs) {
+  for (const auto& span : spans) {
     offsets.push_back(current);
-    current += ptr->size();
+    current += span.size();
   }
 }
 
-size_t IntersectIndices::operator[](size_t global_index) const {
+void IntersectIndices::clear() {
+  spans.clear();
+  offsets.clear();
+  shared.clear();
+}
+
+void IntersectIndices::merge_shared() {
+  if (shared.size() <= 3)
+    return;
+  // sorted as triangles in place, without a copy
+  auto* begin = reinterpret_cast<std::array<VertexIndex, 3>*>(shared.data());
+  auto* end = begin + shared.size() / 3;
+  std::sort(begin, end);
+  end = std::unique(begin, end);
+  shared.resize(3 * (end - begin));
+}
+
+VertexIndex IntersectIndices::operator[](size_t global_index) const {
+  size_t span_size = offsets.empty() ? 0 : offsets.back() + spans.back().size();
+  if (global_index >= span_size)
+    return shared[global_index - span_size];
   auto it = std::upper_bound(offsets.begin(), offsets.end(), global_index);
   size_t segment = std::distance(offsets.begin(), it) - 1;
-  return (*indices_ptrs[segment])[global_index - offsets[segment]];
+  return spans[segment][global_index - offsets[segment]];
 }
 
-BVHAccel::BVHAccel(const std::vector<PackedVertex>& vertices,
-                   const std::vector<size_t>& indices) {
-  TriangleVector triangles;
-  triangles.reserve(indices.size() / 3);
-  for (size_t i = 0; i < indices.size(); i += 3) {
-    auto i1 = indices[i];
-    auto i2 = indices[i + 1];
-    auto i3 = indices[i + 2];
+BVHAccel::BVHAccel(std::span<const PackedVertex> vertices,
+                   std::span<const VertexIndex> indices,
+                   const BVHBuildOptions& options)
+    : options_(options) {
+  auto triangles = make_triangles(
+      [&](VertexIndex i) { return vertices[i].get_position(); }, indices);
+  build(triangles, indices.size());
+}
 
-    std::array<Eigen::Vector3f, 3> points{vertices[i1].get_position(),
-                                          vertices[i2].get_position(),
-                                          vertices[i3].get_position()};
+BVHAccel::BVHAccel(std::span<const std::array<float, 3>> positions,
+                   std::span<const VertexIndex> indices,
+                   const BVHBuildOptions& options)
+    : options_(options) {
+  auto triangles = make_triangles(
+      [&](VertexIndex i) {
+        const auto& p = positions[i];
+        return Eigen::Vector3f(p[0], p[1], p[2]);
+      },
+      indices);
+  build(triangles, indices.size());
+}
 
-    triangles.push_back(BVHTriangle{std::array<size_t, 3>{i1, i2, i3}, points,
-                                    (points[0] + points[1] + points[2]) / 3.f,
-                                    compute_bbox(points)});
+BVHAccel::BVHAccel(Buffer<BVHNode> nodes, Buffer<VertexIndex> leaf_indices,
+                   Buffer<uint8_t> split_references,
+                   const BVHBuildOptions& options)
+    : nodes_(std::move(nodes)),
+      leaf_indices_(std::move(leaf_indices)),
+      split_references_(std::move(split_references)),
+      options_(options) {
+  if (!nodes_.empty()) {
+    root_bbox_ = nodes_[0].bbox;
   }
-  root_ = build_node(triangles);
 }
+
+BVHAccel::BVHAccel(Buffer<QuantizedBVHNode> nodes, const AABB& root_bbox,
+                   Buffer<VertexIndex> leaf_indices,
+                   Buffer<uint8_t> split_references,
+                   const BVHBuildOptions& options)
+    : quantized_nodes_(std::move(nodes)),
+      root_bbox_(root_bbox),
+      leaf_indices_(std::move(leaf_indices)),
+      split_references_(std::move(split_references)),
+      options_(options) {}
+
+void BVHAccel::move_to(const std::shared_ptr<Arena>& arena) {
+  Arena::move_to(arena, nodes_);
+  Arena::move_to(arena, quantized_nodes_);
+  Arena::move_to(arena, leaf_indices_);
+  Arena::move_to(arena, split_references_);
+}
+
+bool BVHAccel::is_consistent(size_t vertex_count) const {
+  if (leaf_indices_.size() % 3 != 0)
+    return false;
+  if (!split_references_.empty() &&
+      split_references_.size() != leaf_indices_.size() / 3)
+    return false;
+  for (VertexIndex index : leaf_indices_) {
+    if (index >= vertex_count)
+      return false;
+  }
+  if (is_quantized())
+    return consistent_nodes(quantized_nodes_.span(), leaf_indices_.size());
+  if (nodes_.empty())
+    return leaf_indices_.empty();
+  return consistent_nodes(nodes_.span(), leaf_indices_.size());
+}
+
+void BVHAccel::quantize() {
+  if (is_quantized() || nodes_.empty())
+    return;
+
+  // Children are quantized inside the decoded bounds of their parent, the
+  // decoded bounds are checked so rounding never shrinks them
+  std::vector<QuantizedBVHNode> quantized(nodes_.size());
+  std::vector<std::pair<uint32_t, AABB>> stack{{0, root_bbox_}};
+  while (!stack.empty()) {
+    auto [index, parent] = stack.back();
+    stack.pop_back();
+    const BVHNode& node = nodes_[index];
+    QuantizedBVHNode& q = quantized[index];
+    q.offset = node.offset;
+    q.count = node.count;
+
+    Eigen::Vector3f step = (parent.max - parent.min) / 255.0f;
+    for (int axis = 0; axis < 3; ++axis) {
+      auto steps = [&](float distance) {
+        return step[axis] > 0.0f
+                   ? int(std::clamp(std::floor(distance / step[axis]), 0.0f,
+                                    255.0f))
+                   : 0;
+      };
+      int lo = steps(node.bbox.min[axis] - parent.min[axis]);
+      while (lo > 0 &&
+             parent.min[axis] + lo * step[axis] > node.bbox.min[axis]) {
+        --lo;
+      }
+      int hi = steps(parent.max[axis] - node.bbox.max[axis]);
+      while (hi > 0 &&
+             parent.max[axis] - hi * step[axis] < node.bbox.max[axis]) {
+        --hi;
+      }
+      q.min[axis] = uint8_t(lo);
+      q.max[axis] = uint8_t(hi);
+    }
+
+    if (node.count == 0) {
+      AABB bbox = dequantize(q, parent);
+      stack.push_back({index + 1, bbox});
+      stack.push_back({node.offset, bbox});
+    }
+  }
+
+  quantized_nodes_ = std::move(quantized);
+  nodes_ = Buffer<BVHNode>();
+}
+
+std::vector<BVHNode> BVHAccel::decode_nodes() const {
+  if (!is_quantized())
+    return {nodes_.begin(), nodes_.end()};
+
+  std::vector<BVHNode> result(quantized_nodes_.size());
+  std::vector<std::pair<uint32_t, AABB>> stack{{0, root_bbox_}};
+  while (!stack.empty()) {
+    auto [index, parent] = stack.back();
+    stack.pop_back();
+    const QuantizedBVHNode& q = quantized_nodes_[index];
+    BVHNode& node = result[index];
+    // the root is stored against its own bounds
+    node.bbox = dequantize(q, parent);
+    node.offset = q.offset;
+    node.count = q.count;
+    if (q.count == 0) {
+      stack.push_back({index + 1, node.bbox});
+      stack.push_back({q.offset, node.bbox});
+    }
+  }
+  return result;
+}
+
+RefitResult BVHAccel::refit(std::span<const PackedVertex> vertices,
+                            float rebuild_threshold) {
+  return refit_nodes(
+      [&](VertexIndex i) { return vertices[i].get_position(); },
+      rebuild_threshold);
+}
+
+RefitResult BVHAccel::refit(std::span<const std::array<float, 3>> positions,
+                            float rebuild_threshold) {
+  return refit_nodes(
+      [&](VertexIndex i) {
+        const auto& p = positions[i];
+        return Eigen::Vector3f(p[0], p[1], p[2]);
+      },
+      rebuild_threshold);
+}
+
+void BVHAccel::remap_vertices(std::span<const VertexIndex> remap) {
+  auto& leaf_indices = leaf_indices_.vector();
+  std::transform(std::execution::par, leaf_indices.begin(),
+                 leaf_indices.end(), leaf_indices.begin(),
+                 [&](VertexIndex i) { return remap[i]; });
+}
+
+float BVHAccel::sah_cost() const {
+  auto nodes = decode_nodes();
+  return rtr::sah_cost(nodes, relative_areas(nodes));
+}
+
+template <typename Position>
+RefitResult BVHAccel::refit_nodes(const Position& position,
+                                  float rebuild_threshold) {
+  if (leaf_indices_.empty())
+    return RefitResult::Refitted;
+
+  bool quantized = is_quantized();
+  std::vector<BVHNode> nodes =
+      quantized ? decode_nodes() : std::move(nodes_.vector());
+  if (build_areas_.empty()) {
+    // the bounds are still the built ones
+    build_areas_ = relative_areas(nodes);
+    build_cost_ = rtr::sah_cost(nodes, build_areas_);
+  }
+
+  // Leaves read the vertexes and are refitted in parallel, the inner nodes
+  // only merge two boxes each
+  std::vector<uint32_t> ids(nodes.size());
+  std::iota(ids.begin(), ids.end(), 0);
+  std::for_each(std::execution::par, ids.begin(), ids.end(), [&](uint32_t i) {
+    BVHNode& node = nodes[i];
+    if (node.count == 0)
+      return;
+    AABB bbox;
+    for (uint32_t k = node.offset; k < node.offset + node.count; ++k) {
+      Eigen::Vector3f p = position(leaf_indices_[k]);
+      bbox.expand(AABB(p, p));
+    }
+    node.bbox = bbox;
+  });
+  refit_inner(nodes);
+
+  RefitResult result = RefitResult::Refitted;
+  float limit = 1.0f + rebuild_threshold;
+  auto areas = relative_areas(nodes);
+  if (rebuild_threshold > 0.0f &&
+      rtr::sah_cost(nodes, areas) > build_cost_ * limit) {
+    // topmost subtrees whose relative area has grown past the threshold
+    std::vector<std::pair<uint32_t, int>> degraded;
+    std::vector<std::pair<uint32_t, int>> stack{{0, 0}};
+    size_t degraded_indices = 0;
+    while (!stack.empty()) {
+      auto [index, depth] = stack.back();
+      stack.pop_back();
+      if (areas[index] > build_areas_[index] * limit) {
+        auto [begin, end] = leaf_range(nodes, index);
+        degraded.push_back({index, depth});
+        degraded_indices += end - begin;
+        continue;
+      }
+      if (nodes[index].count == 0) {
+        stack.push_back({nodes[index].offset, depth + 1});
+        stack.push_back({index + 1, depth + 1});
+      }
+    }
+
+    auto& leaf_indices = leaf_indices_.vector();
+    if (options_.spatial_split_budget > 0.0f) {
+      // subtree rebuilds rely on median splits keeping the node and index
+      // ranges
+      rebuild(position);
+      nodes = std::move(nodes_.vector());
+      build_areas_ = relative_areas(nodes);
+      result = RefitResult::FullRebuild;
+    } else if (degraded.empty() ||
+               2 * degraded_indices > leaf_indices.size()) {
+      // the cost is spread over the tree
+      rebuild_subtree(position, nodes, leaf_indices, 0, 0);
+      build_areas_ = relative_areas(nodes);
+      result = RefitResult::FullRebuild;
+    } else {
+      for (auto [index, depth] : degraded) {
+        rebuild_subtree(position, nodes, leaf_indices, index, depth);
+      }
+      refit_inner(nodes);
+      areas = relative_areas(nodes);
+      for (auto [index, depth] : degraded) {
+        std::copy(areas.begin() + index,
+                  areas.begin() + subtree_end(nodes, index),
+                  build_areas_.begin() + index);
+      }
+      result = RefitResult::PartialRebuild;
+    }
+    build_cost_ = rtr::sah_cost(nodes, build_areas_);
+  }
+
+  root_bbox_ = nodes[0].bbox;
+  nodes_ = std::move(nodes);
+  if (quantized) {
+    quantized_nodes_ = Buffer<QuantizedBVHNode>();
+    quantize();
+  }
+  return result;
+}
+
+template <typename Position>
+void BVHAccel::rebuild_subtree(const Position& position,
+                               std::vector<BVHNode>& nodes,
+                               std::vector<VertexIndex>& leaf_indices,
+                               uint32_t index, int depth) {
+  auto [begin_index, end_index] = leaf_range(nodes, index);
+
+  auto triangles = make_triangles(
+      position, std::span<const VertexIndex>(leaf_indices)
+                    .subspan(begin_index, end_index - begin_index));
+  Arena arena;
+  auto* root = build_node(triangles, arena, depth);
+
+  std::vector<BVHNode> subtree;
+  std::vector<VertexIndex> subtree_indices;
+  subtree_indices.reserve(end_index - begin_index);
+  flatten(*root, subtree, subtree_indices);
+
+  for (size_t i = 0; i < subtree.size(); ++i) {
+    BVHNode node = subtree[i];
+    node.offset += node.count > 0 ? begin_index : index;
+    nodes[index + i] = node;
+  }
+  std::copy(subtree_indices.begin(), subtree_indices.end(),
+            leaf_indices.begin() + begin_index);
+}
+
+void BVHAccel::add_leaf(IntersectIndices& result, uint32_t offset,
+                        uint32_t count) const {
+  if (split_references_.empty()) {
+    result.spans.push_back(leaf_indices_.span().subspan(offset, count));
+    return;
+  }
+
+  // the split triangles are at the end of the leaf
+  uint32_t first = offset / 3;
+  uint32_t shared = first + count / 3;
+  while (shared > first && split_references_[shared - 1]) {
+    --shared;
+  }
+  if (shared > first) {
+    result.spans.push_back(
+        leaf_indices_.span().subspan(offset, 3 * (shared - first)));
+  }
+  for (uint32_t i = shared; i < first + count / 3; ++i) {
+    result.add_shared(leaf_indices_.span().subspan(3 * i, 3));
+  }
+}
+
 IntersectIndices BVHAccel::get_intersect_indices(const Ray& ray, float t_min,
                                                  float t_max) const {
-  return get_intersect_node_indices(root_.get(), ray, t_min, t_max);
+  IntersectIndices result;
+  get_intersect_indices(ray, t_min, t_max, result);
+  return result;
+}
+
+void BVHAccel::get_intersect_indices(const Ray& ray, float t_min, float t_max,
+                                     IntersectIndices& result) const {
+  result.clear();
+  if (leaf_indices_.empty())
+    return;
+
+  if (is_quantized()) {
+    // entries carry the decoded parent bounds
+    std::pair<uint32_t, AABB> stack[64];
+    int top = 0;
+    stack[top++] = {0, root_bbox_};
+
+    while (top > 0) {
+      auto [index, parent] = stack[--top];
+      const auto& node = quantized_nodes_[index];
+      AABB bbox = dequantize(node, parent);
+      if (!bbox.intersect(ray, t_min, t_max))
+        continue;
+
+      if (node.count > 0) {
+        add_leaf(result, node.offset, node.count);
+        continue;
+      }
+
+      stack[top++] = {node.offset, bbox};
+      stack[top++] = {index + 1, bbox};
+    }
+
+    result.update_offsets();
+    result.merge_shared();
+    return;
+  }
+
+  uint32_t stack[64];
+  int top = 0;
+  stack[top++] = 0;
+
+  while (top > 0) {
+    uint32_t index = stack[--top];
+    const auto& node = nodes_[index];
+    if (!node.bbox.intersect(ray, t_min, t_max))
+      continue;
+
+    if (node.count > 0) {
+      add_leaf(result, node.offset, node.count);
+      continue;
+    }
+
+    stack[top++] = node.offset;
+    stack[top++] = index + 1;
+  }
+
+  result.update_offsets();
+  result.merge_shared();
+}
+
+void BVHAccel::build(TriangleVector& triangles, size_t index_count) {
+  bool spatial_splits = options_.spatial_split_budget > 0.0f;
+  Arena arena;
+  BuildNode* root;
+  if (spatial_splits) {
+    SplitBuild state{arena};
+    state.min_overlap = 1e-5f * compute_bbox(triangles).surface_area();
+    root = build_split_node(
+        triangles, state,
+        int64_t(options_.spatial_split_budget * triangles.size()), 0);
+  } else {
+    root = build_node(triangles, arena);
+  }
+
+  std::vector<BVHNode> nodes;
+  std::vector<VertexIndex> leaf_indices;
+  leaf_indices.reserve(index_count);
+  flatten(*root, nodes, leaf_indices);
+  root_bbox_ = nodes[0].bbox;
+  split_references_ = spatial_splits
+                          ? mark_split_references(nodes, leaf_indices)
+                          : std::vector<uint8_t>();
+  nodes_ = std::move(nodes);
+  leaf_indices_ = std::move(leaf_indices);
+}
+
+template <typename Position>
+void BVHAccel::rebuild(const Position& position) {
+  // every triangle once, the references of the split ones are merged
+  std::vector<VertexIndex> indices;
+  std::vector<std::array<VertexIndex, 3>> split;
+  indices.reserve(leaf_indices_.size());
+  for (size_t i = 0; i < leaf_indices_.size() / 3; ++i) {
+    std::array<VertexIndex, 3> triangle{leaf_indices_[3 * i],
+                                        leaf_indices_[3 * i + 1],
+                                        leaf_indices_[3 * i + 2]};
+    if (!split_references_.empty() && split_references_[i]) {
+      split.push_back(triangle);
+    } else {
+      indices.insert(indices.end(), triangle.begin(), triangle.end());
+    }
+  }
+  std::sort(split.begin(), split.end());
+  split.erase(std::unique(split.begin(), split.end()), split.end());
+  for (const auto& triangle : split) {
+    indices.insert(indices.end(), triangle.begin(), triangle.end());
+  }
+
+  auto triangles = make_triangles(position, indices);
+  build(triangles, indices.size());
+}
+
+void BVHAccel::flatten(const BuildNode& node, std::vector<BVHNode>& nodes,
+                       std::vector<VertexIndex>& leaf_indices) const {
+  size_t index = nodes.size();
+  nodes.push_back({node.bbox});
+
+  if (node.is_leaf) {
+    nodes[index].offset = static_cast<uint32_t>(leaf_indices.size());
+    nodes[index].count = static_cast<uint32_t>(node.triangle_indices.size());
+    leaf_indices.insert(leaf_indices.end(), node.triangle_indices.begin(),
+                        node.triangle_indices.end());
+    return;
+  }
+
+  flatten(*node.left, nodes, leaf_indices);
+  nodes[index].offset = static_cast<uint32_t>(nodes.size());
+  flatten(*node.right, nodes, leaf_indices);
 }
 
-std::unique_ptr<BVHNode> BVHAccel::build_node(TriangleVector& triangles,
-                                              int depth) {
-  auto node = std::make_unique<BVHNode>();
+BVHAccel::BuildNode* BVHAccel::build_node(std::span<BVHTriangle> triangles,
+                                          Arena& arena, int depth) {
+  auto* node = arena.create<BuildNode>();
   node->bbox = compute_bbox(triangles);
 
   if (triangles.size() <= 4 || depth > 20) {
-    node->triangle_indices = join_indices(triangles);
+    node->triangle_indices = join_indices(triangles, arena);
     node->is_leaf = true;
     return node;
   }
@@ -106,50 +756,275 @@ std::unique_ptr<BVHNode> BVHAccel::build_node(TriangleVector& triangles,
   std::sort(std::execution::par, triangles.begin(), triangles.end(),
             comparator);
 
-  auto mid = triangles.begin() + triangles.size() / 2;
-  TriangleVector left_triangles(triangles.begin(), mid);
-  TriangleVector right_triangles(mid, triangles.end());
-
+  // the halves are sorted in place, the children don't copy them
+  size_t mid = triangles.size() / 2;
   auto left_future = std::async(std::launch::async, [&]() {
-    return build_node(left_triangles, depth + 1);
+    return build_node(triangles.first(mid), arena, depth + 1);
   });
   auto right_future = std::async(std::launch::async, [&]() {
-    return build_node(right_triangles, depth + 1);
+    return build_node(triangles.subspan(mid), arena, depth + 1);
   });
 
-  node->left = std::move(left_future.get());
-  node->right = std::move(right_future.get());
+  node->left = left_future.get();
+  node->right = right_future.get();
 
   return node;
 }
 
-IntersectIndices BVHAccel::get_intersect_node_indices(const BVHNode* node,
-                                                      const Ray& ray,
-                                                      float t_min,
-                                                      float t_max) const {
-  if (!node->bbox.intersect(ray, t_min, t_max))
-    return {};
+BVHAccel::BuildNode* BVHAccel::build_split_node(
+    std::span<BVHTriangle> references, const SplitBuild& state,
+    int64_t budget, int depth) {
+  auto* node = state.arena.create<BuildNode>();
+  node->bbox = compute_bbox(references);
+  size_t count = references.size();
+  if (count <= 2 || depth >= max_split_depth) {
+    node->triangle_indices = join_indices(references, state.arena);
+    node->is_leaf = true;
+    return node;
+  }
 
-  IntersectIndices result;
+  // Costs are relative to the node area, a traversal step and a triangle
+  // test cost 1 each
+  float area = node->bbox.surface_area();
+  float best_cost = std::numeric_limits<float>::max();
+  int best_axis = -1;
+  int best_bin = 0;
+  bool spatial = false;
+  AABB object_left;
+  AABB object_right;
+
+  struct Bin {
+    AABB bbox;
+    size_t entries = 0;  // references starting in the bin
+    size_t exits = 0;    // references ending in the bin
+  };
+  // Sweeps the bins, a plane between bins i - 1 and i has left_count(i)
+  // references on its left and right_count(i) on its right
+  auto sweep = [&](const std::array<Bin, split_bins>& bins, auto&& on_plane) {
+    std::array<AABB, split_bins> right_bounds;
+    std::array<size_t, split_bins> right_counts{};
+    AABB right;
+    size_t right_count = 0;
+    for (int i = split_bins - 1; i > 0; --i) {
+      right.expand(bins[i].bbox);
+      right_count += bins[i].exits;
+      right_bounds[i] = right;
+      right_counts[i] = right_count;
+    }
+    AABB left;
+    size_t left_count = 0;
+    for (int i = 1; i < split_bins; ++i) {
+      left.expand(bins[i - 1].bbox);
+      left_count += bins[i - 1].entries;
+      if (left_count == 0 || right_counts[i] == 0)
+        continue;
+      float cost = 1.0f + (left.surface_area() * left_count +
+                           right_bounds[i].surface_area() * right_counts[i]) /
+                              area;
+      on_plane(i, cost, left, right_bounds[i], left_count, right_counts[i]);
+    }
+  };
 
-  if (node->is_leaf) {
-    result.add(node->triangle_indices);
-    return result;
+  // object split, binned by the reference centers
+  AABB centers;
+  for (const auto& reference : references) {
+    centers.expand(AABB(reference.center, reference.center));
+  }
+  auto center_bin = [&](const BVHTriangle& reference, int axis) {
+    float extent = centers.max[axis] - centers.min[axis];
+    int bin = int((reference.center[axis] - centers.min[axis]) / extent *
+                  split_bins);
+    return std::clamp(bin, 0, split_bins - 1);
+  };
+  for (int axis = 0; area > 0.0f && axis < 3; ++axis) {
+    if (centers.max[axis] <= centers.min[axis])
+      continue;
+    std::array<Bin, split_bins> bins;
+    for (const auto& reference : references) {
+      Bin& bin = bins[center_bin(reference, axis)];
+      bin.bbox.expand(reference.bbox);
+      ++bin.entries;
+      ++bin.exits;
+    }
+    sweep(bins, [&](int i, float cost, const AABB& left, const AABB& right,
+                    size_t, size_t) {
+      if (cost < best_cost) {
+        best_cost = cost;
+        best_axis = axis;
+        best_bin = i;
+        object_left = left;
+        object_right = right;
+      }
+    });
   }
 
-  auto left = get_intersect_node_indices(node->left.get(), ray, t_min, t_max);
-  auto right = get_intersect_node_indices(node->right.get(), ray, t_min, t_max);
+  // spatial split, tried where the object split children overlap
+  AABB overlap(object_left.min.cwiseMax(object_right.min),
+               object_left.max.cwiseMin(object_right.max));
+  bool overlapping =
+      best_axis < 0 || (!overlap.empty() &&
+                        overlap.surface_area() > state.min_overlap);
+  float best_position = 0.0f;
+  for (int axis = 0; area > 0.0f && overlapping && budget > 0 && axis < 3;
+       ++axis) {
+    float lo = node->bbox.min[axis];
+    float extent = node->bbox.max[axis] - lo;
+    if (extent <= 0.0f)
+      continue;
+    auto plane = [&](int i) { return lo + extent * i / split_bins; };
+    auto bin_of = [&](float position) {
+      return std::clamp(int((position - lo) / extent * split_bins), 0,
+                        split_bins - 1);
+    };
 
-  result.indices_ptrs.reserve(left.indices_ptrs.size() +
-                              right.indices_ptrs.size());
-  result.indices_ptrs.insert(result.indices_ptrs.end(),
-                             left.indices_ptrs.begin(),
-                             left.indices_ptrs.end());
-  result.indices_ptrs.insert(result.indices_ptrs.end(),
-                             right.indices_ptrs.begin(),
-                             right.indices_ptrs.end());
-  result.update_offsets();
-  return result;
+    // each reference is clipped into the bins it crosses
+    std::array<Bin, split_bins> bins;
+    for (const auto& reference : references) {
+      int first = bin_of(reference.bbox.min[axis]);
+      int last = bin_of(reference.bbox.max[axis]);
+      ++bins[first].entries;
+      ++bins[last].exits;
+      BVHTriangle piece = reference;
+      for (int i = first; i < last; ++i) {
+        AABB left, right;
+        split_reference(piece, axis, plane(i + 1), left, right);
+        bins[i].bbox.expand(left);
+        piece.bbox = right;
+      }
+      bins[last].bbox.expand(piece.bbox);
+    }
+    sweep(bins, [&](int i, float cost, const AABB&, const AABB&,
+                    size_t left_count, size_t right_count) {
+      if (cost < best_cost &&
+          int64_t(left_count + right_count - count) <= budget) {
+        best_cost = cost;
+        best_axis = axis;
+        best_position = plane(i);
+        spatial = true;
+      }
+    });
+  }
+
+  if (count <= max_leaf_triangles && best_cost >= float(count)) {
+    node->triangle_indices = join_indices(references, state.arena);
+    node->is_leaf = true;
+    return node;
+  }
+
+  // object splits partition the references in place, the children of a
+  // spatial split get copies since the straddling references are duplicated
+  TriangleVector children;
+  std::span<BVHTriangle> left_references;
+  std::span<BVHTriangle> right_references;
+  if (spatial) {
+    // the straddling references go to both sides, or to one of them if
+    // that's cheaper than the duplicate
+    AABB left_bbox, right_bbox;
+    std::vector<std::pair<AABB, AABB>> parts(count);
+    std::vector<uint8_t> sides(count);  // 1 left, 2 right, 3 both
+    for (size_t i = 0; i < count; ++i) {
+      const auto& bbox = references[i].bbox;
+      if (bbox.max[best_axis] <= best_position) {
+        sides[i] = 1;
+        left_bbox.expand(bbox);
+      } else if (bbox.min[best_axis] >= best_position) {
+        sides[i] = 2;
+        right_bbox.expand(bbox);
+      } else {
+        sides[i] = 3;
+        split_reference(references[i], best_axis, best_position,
+                        parts[i].first, parts[i].second);
+        left_bbox.expand(parts[i].first);
+        right_bbox.expand(parts[i].second);
+      }
+    }
+    size_t left_count = std::count_if(sides.begin(), sides.end(),
+                                      [](uint8_t side) { return side & 1; });
+    size_t right_count = std::count_if(sides.begin(), sides.end(),
+                                       [](uint8_t side) { return side & 2; });
+    for (size_t i = 0; i < count; ++i) {
+      if (sides[i] != 3)
+        continue;
+      const auto& bbox = references[i].bbox;
+      AABB left_whole = left_bbox;
+      left_whole.expand(bbox);
+      AABB right_whole = right_bbox;
+      right_whole.expand(bbox);
+      float split_cost = left_bbox.surface_area() * left_count +
+                         right_bbox.surface_area() * right_count;
+      float left_cost = left_whole.surface_area() * left_count +
+                        right_bbox.surface_area() * (right_count - 1);
+      float right_cost = left_bbox.surface_area() * (left_count - 1) +
+                         right_whole.surface_area() * right_count;
+      if (left_cost < split_cost && left_cost <= right_cost) {
+        sides[i] = 1;
+        left_bbox = left_whole;
+        --right_count;
+      } else if (right_cost < split_cost) {
+        sides[i] = 2;
+        right_bbox = right_whole;
+        --left_count;
+      }
+    }
+
+    if (left_count > 0 && right_count > 0) {
+      children.resize(left_count + right_count);
+      size_t left_end = 0;
+      size_t right_end = left_count;
+      for (size_t i = 0; i < count; ++i) {
+        if (sides[i] != 3) {
+          children[sides[i] == 1 ? left_end++ : right_end++] = references[i];
+          continue;
+        }
+        BVHTriangle& left = children[left_end++];
+        left = references[i];
+        left.bbox = parts[i].first;
+        left.center = (left.bbox.min + left.bbox.max) / 2.0f;
+        BVHTriangle& right = children[right_end++];
+        right = references[i];
+        right.bbox = parts[i].second;
+        right.center = (right.bbox.min + right.bbox.max) / 2.0f;
+      }
+      left_references = std::span(children).first(left_count);
+      right_references = std::span(children).subspan(left_count);
+      budget -= int64_t(left_count + right_count - count);
+    }
+  } else if (best_axis >= 0) {
+    auto mid = std::partition(
+        references.begin(), references.end(),
+        [&](const BVHTriangle& reference) {
+          return center_bin(reference, best_axis) < best_bin;
+        });
+    left_references = references.first(mid - references.begin());
+    right_references = references.subspan(mid - references.begin());
+  }
+
+  if (left_references.empty() || right_references.empty()) {
+    // no usable plane, e.g. coinciding centers: halved by count
+    left_references = references.first(count / 2);
+    right_references = references.subspan(count / 2);
+  }
+
+  // the rest of the budget is shared by the reference counts, so the first
+  // subtrees don't use up the budget of the others
+  int64_t left_budget = budget * int64_t(left_references.size()) /
+                        int64_t(left_references.size() +
+                                right_references.size());
+  int64_t right_budget = budget - left_budget;
+  if (count >= parallel_references) {
+    auto left_future = std::async(std::launch::async, [&]() {
+      return build_split_node(left_references, state, left_budget, depth + 1);
+    });
+    node->right =
+        build_split_node(right_references, state, right_budget, depth + 1);
+    node->left = left_future.get();
+  } else {
+    node->left =
+        build_split_node(left_references, state, left_budget, depth + 1);
+    node->right =
+        build_split_node(right_references, state, right_budget, depth + 1);
+  }
+  return node;
 }
 
-}  // namespace rtr
\ No newline at end of file
+}  // namespace rtr
@@ -1,52 +1,105 @@
 #pragma once
 
 #include <array>
+#include <cstdint>
 #include <eigen3/Eigen/Core>
 #include <memory>
+#include <span>
 #include <vector>
 
 #include "aabb.h"
+#include "buffer.h"
 #include "vertex.h"
 
 namespace rtr {
 
+class Arena;
+
+/// @brief Node of the flattened hierarchy, in depth-first order
 struct BVHNode {
   AABB bbox;
-  std::unique_ptr<BVHNode> left;
-  std::unique_ptr<BVHNode> right;
-  std::vector<size_t> triangle_indices;
-  bool is_leaf = false;
+  // leaf: first index in the leaf indices; inner: index of the right child
+  uint32_t offset = 0;
+  // leaf: number of indices; inner: 0 (left child is the next node)
+  uint32_t count = 0;
+};
+
+/// @brief Node with its bounds quantized to 8 bits per coordinate inside
+/// the decoded bounds of its parent, rounded outwards. Same order and
+/// offsets as BVHNode, half the size.
+struct QuantizedBVHNode {
+  std::array<uint8_t, 3> min;  // steps up from the parent min
+  std::array<uint8_t, 3> max;  // steps down from the parent max
+  uint16_t reserved = 0;
+  uint32_t offset = 0;
+  uint32_t count = 0;
+};
+
+/// @brief Bounds of a quantized node, the parent bounds are decoded too
+inline AABB dequantize(const QuantizedBVHNode& node, const AABB& parent) {
+  Eigen::Vector3f step = (parent.max - parent.min) / 255.0f;
+  AABB result;
+  for (int axis = 0; axis < 3; ++axis) {
+    result.min[axis] = parent.min[axis] + node.min[axis] * step[axis];
+    result.max[axis] = parent.max[axis] - node.max[axis] * step[axis];
+  }
+  return result;
+}
+
+/// @brief Outcome of BVHAccel::refit
+enum class RefitResult {
+  Refitted,        // bounds updated, topology kept
+  PartialRebuild,  // the degraded subtrees were rebuilt
+  FullRebuild,     // the whole hierarchy was rebuilt
+};
+
+/// @brief Construction mode of BVHAccel
+struct BVHBuildOptions {
+  // extra triangle references spatial splits may add, as a fraction of the
+  // triangles. 0 builds by median object splits only; above it the builder
+  // uses the surface area heuristic and splits the references of triangles
+  // that straddle a plane when that pays off.
+  float spatial_split_budget = 0.0f;
 };
 
 struct BVHTriangle {
-  std::array<size_t, 3> indices;
+  std::array<VertexIndex, 3> indices;
   std::array<Eigen::Vector3f, 3> vertexes;
   Eigen::Vector3f center;
   AABB bbox;
 };
 
 struct IntersectIndices {
-  std::vector<const std::vector<size_t>*> indices_ptrs;
+  std::vector<std::span<const VertexIndex>> spans;
   std::vector<size_t> offsets;
+  // corners of the triangles referenced by several of the leaves, each
+  // triangle once; they follow the spans
+  std::vector<VertexIndex> shared;
 
   IntersectIndices() = default;
-  IntersectIndices(const std::vector<size_t>& indices)
-      : indices_ptrs{&indices} {
+  IntersectIndices(std::span<const VertexIndex> indices) : spans{indices} {
     update_offsets();
   }
-  IntersectIndices(std::initializer_list<const std::vector<size_t>*> lists)
-      : indices_ptrs(lists) {
+  IntersectIndices(std::initializer_list<std::span<const VertexIndex>> lists)
+      : spans(lists) {
     update_offsets();
   }
 
-  void add(const std::vector<size_t>& vec) {
-    indices_ptrs.push_back(&vec);
+  void add(std::span<const VertexIndex> indices) {
+    spans.push_back(indices);
     update_offsets();
   }
+  void add_shared(std::span<const VertexIndex> triangle) {
+    shared.insert(shared.end(), triangle.begin(), triangle.end());
+  }
+  /// @brief Drops the repeated shared triangles
+  void merge_shared();
+  /// @brief Empties the lists, their capacity is kept for the next query
+  void clear();
   void update_offsets();
-  [[nodiscard]] bool empty() const { return indices_ptrs.empty(); }
+  [[nodiscard]] bool empty() const { return spans.empty() && shared.empty(); }
   [[nodiscard]] size_t size() const;
-  [[nodiscard]] size_t operator[](size_t global_index) const;
+  [[nodiscard]] VertexIndex operator[](size_t global_index) const;
 };
 
 class BVHAccel {
@@ -54,24 +107,122 @@ class BVHAccel {
   using TriangleVector = std::vector<BVHTriangle>;
 
  public:
-  BVHAccel(const std::vector<PackedVertex>& vertices,
-           const std::vector<size_t>& indices);
+  BVHAccel(std::span<const PackedVertex> vertices,
+           std::span<const VertexIndex> indices,
+           const BVHBuildOptions& options = {});
+  BVHAccel(std::span<const std::array<float, 3>> positions,
+           std::span<const VertexIndex> indices,
+           const BVHBuildOptions& options = {});
+  /// @brief Uses an already built hierarchy, e.g. from a cache. options are
+  /// the ones it was built with.
+  BVHAccel(Buffer<BVHNode> nodes, Buffer<VertexIndex> leaf_indices,
+           Buffer<uint8_t> split_references = {},
+           const BVHBuildOptions& options = {});
+  BVHAccel(Buffer<QuantizedBVHNode> nodes, const AABB& root_bbox,
+           Buffer<VertexIndex> leaf_indices,
+           Buffer<uint8_t> split_references = {},
+           const BVHBuildOptions& options = {});
 
   [[nodiscard]] IntersectIndices get_intersect_indices(const Ray& ray,
                                                        float t_min,
                                                        float t_max) const;
-
-  [[nodiscard]] AABB get_root_bbox() const { return root_->bbox; }
+  /// @brief Same as above into a reused result, it doesn't allocate once the
+  /// result has grown to the largest query
+  void get_intersect_indices(const Ray& ray, float t_min, float t_max,
+                             IntersectIndices& result) const;
+
+  [[nodiscard]] AABB get_root_bbox() const { return root_bbox_; }
+
+  /// @brief Replaces the nodes by quantized ones
+  void quantize();
+  /// @brief Whether traversal stays within the nodes and leaf indices and
+  /// reads vertexes below vertex_count only, e.g. for a hierarchy read from
+  /// a file. Linear in the nodes and indices.
+  [[nodiscard]] bool is_consistent(size_t vertex_count) const;
+  /// @brief Moves the nodes and indices it owns into the arena
+  void move_to(const std::shared_ptr<Arena>& arena);
+  [[nodiscard]] bool is_quantized() const { return !quantized_nodes_.empty(); }
+
+  /// @brief Recomputes the bounds bottom-up after the vertex positions
+  /// changed; topology and leaf indices are kept. With a positive
+  /// rebuild_threshold the SAH cost is compared with the one of the last
+  /// build, and once it has grown by more than that fraction the degraded
+  /// subtrees, or the whole tree, are rebuilt. A tree built with spatial
+  /// splits is always rebuilt whole. Quantized nodes stay quantized.
+  RefitResult refit(std::span<const PackedVertex> vertices,
+                    float rebuild_threshold = 0.0f);
+  RefitResult refit(std::span<const std::array<float, 3>> positions,
+                    float rebuild_threshold = 0.0f);
+
+  /// @brief Renumbers the vertexes the leaves refer to, remap[i] is the new
+  /// index of vertex i. Nodes are kept.
+  void remap_vertices(std::span<const VertexIndex> remap);
+
+  /// @brief Surface area heuristic cost, relative to the root bounds
+  [[nodiscard]] float sah_cost() const;
+
+  /// @brief Float nodes, empty if quantized
+  [[nodiscard]] const Buffer<BVHNode>& get_nodes() const { return nodes_; }
+  [[nodiscard]] const Buffer<QuantizedBVHNode>& get_quantized_nodes() const {
+    return quantized_nodes_;
+  }
+  [[nodiscard]] const Buffer<VertexIndex>& get_leaf_indices() const {
+    return leaf_indices_;
+  }
+  /// @brief Per triangle of the leaf indices, nonzero if another leaf
+  /// references it too. Empty if no triangle was split.
+  [[nodiscard]] const Buffer<uint8_t>& get_split_references() const {
+    return split_references_;
+  }
+  [[nodiscard]] const BVHBuildOptions& get_options() const { return options_; }
 
  private:
-  std::unique_ptr<BVHNode> build_node(TriangleVector& triangles, int depth = 0);
-
-  IntersectIndices get_intersect_node_indices(const BVHNode* node,
-                                              const Ray& ray, float t_min,
-                                              float t_max) const;
+  struct BuildNode;
+  struct SplitBuild;
+
+  /// @brief Median split node, the triangles are reordered in place
+  BuildNode* build_node(std::span<BVHTriangle> triangles, Arena& arena,
+                        int depth = 0);
+  /// @brief Node by the cheapest of the object and spatial splits, the
+  /// references are reordered. budget: references the spatial splits in the
+  /// subtree may add.
+  BuildNode* build_split_node(std::span<BVHTriangle> references,
+                              const SplitBuild& state, int64_t budget,
+                              int depth);
+  void build(TriangleVector& triangles, size_t index_count);
+  void flatten(const BuildNode& node, std::vector<BVHNode>& nodes,
+               std::vector<VertexIndex>& leaf_indices) const;
+
+  template <typename Position>
+  RefitResult refit_nodes(const Position& position, float rebuild_threshold);
+  /// @brief Rebuilds the subtree in place, it keeps its node and index
+  /// ranges since the build splits by count only
+  template <typename Position>
+  void rebuild_subtree(const Position& position, std::vector<BVHNode>& nodes,
+                       std::vector<VertexIndex>& leaf_indices, uint32_t index,
+                       int depth);
+  /// @brief Builds the tree again over each triangle once
+  template <typename Position>
+  void rebuild(const Position& position);
+  /// @brief Float nodes, decoded if quantized
+  [[nodiscard]] std::vector<BVHNode> decode_nodes() const;
+  /// @brief Appends the leaf, its split triangles go to the shared ones
+  void add_leaf(IntersectIndices& result, uint32_t offset,
+                uint32_t count) const;
 
  private:
-  std::unique_ptr<BVHNode> root_;
+  Buffer<BVHNode> nodes_;
+  Buffer<QuantizedBVHNode> quantized_nodes_;
+  AABB root_bbox_;
+  // triangle corners of all leaves, in node order
+  Buffer<VertexIndex> leaf_indices_;
+  // split triangles come last in their leaves
+  Buffer<uint8_t> split_references_;
+  BVHBuildOptions options_;
+  // relative node areas and SAH cost of the last build, taken by the first
+  // refit from the bounds it replaces
+  std::vector<float> build_areas_;
+  float build_cost_ = 0.0f;
 };
 
 }  // namespace rtr
\ No newline at end of file
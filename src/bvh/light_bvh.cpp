@@ -0,0 +1,83 @@
+#include "light_bvh.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace rtr {
+
+constexpr uint32_t max_lights_in_leaf = 4;
+
+LightBVH::LightBVH(const std::vector<Light>& lights, float cutoff) {
+  spheres_.reserve(lights.size());
+  order_.reserve(lights.size());
+
+  for (size_t i = 0; i < lights.size(); ++i) {
+    float radius = influence_radius(lights[i], cutoff);
+    spheres_.emplace_back(lights[i].position.x(), lights[i].position.y(),
+                          lights[i].position.z(), radius * radius);
+    if (radius > 0.0f) {
+      order_.push_back(static_cast<uint32_t>(i));
+    }
+  }
+
+  if (!order_.empty()) {
+    nodes_.reserve(2 * order_.size() / max_lights_in_leaf + 1);
+    build_node(0, static_cast<uint32_t>(order_.size()));
+  }
+}
+
+float LightBVH::influence_radius(const Light& light, float cutoff) {
+  if (cutoff <= 0.0f)
+    return std::numeric_limits<float>::infinity();
+
+  // intensity * attenuation(r) == cutoff
+  // => 0.01 r^2 + 0.1 r + 1 - intensity / cutoff == 0
+  float ratio = light.intensity.maxCoeff() / cutoff;
+  if (ratio <= 1.0f)
+    return 0.0f;
+
+  float discriminant = 0.01f - 0.04f * (1.0f - ratio);
+  return (-0.1f + std::sqrt(discriminant)) / 0.02f;
+}
+
+uint32_t LightBVH::build_node(uint32_t begin, uint32_t end) {
+  uint32_t index = static_cast<uint32_t>(nodes_.size());
+  nodes_.emplace_back();
+
+  AABB bbox;
+  AABB centers;
+  for (uint32_t i = begin; i < end; ++i) {
+    const auto& sphere = spheres_[order_[i]];
+    Eigen::Vector3f center = sphere.head<3>();
+    float radius = std::sqrt(sphere.w());
+    bbox.expand(AABB(center.array() - radius, center.array() + radius));
+    centers.expand(AABB(center, center));
+  }
+  nodes_[index].bbox = bbox;
+
+  if (end - begin <= max_lights_in_leaf) {
+    nodes_[index].offset = begin;
+    nodes_[index].count = end - begin;
+    return index;
+  }
+
+  Eigen::Vector3f extent = centers.max - centers.min;
+  int axis = (extent[0] > extent[1] && extent[0] > extent[2]) ? 0
+             : (extent[1] > extent[2])                        ? 1
+                                                              : 2;
+
+  uint32_t mid = begin + (end - begin) / 2;
+  std::nth_element(order_.begin() + begin, order_.begin() + mid,
+                   order_.begin() + end, [this, axis](uint32_t a, uint32_t b) {
+                     return spheres_[a][axis] < spheres_[b][axis];
+                   });
+
+  build_node(begin, mid);
+  uint32_t right = build_node(mid, end);
+  nodes_[index].offset = right;
+  nodes_[index].count = 0;
+  return index;
+}
+
+}  // namespace rtr
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <cstdint>
+#include <eigen3/Eigen/Core>
+#include <vector>
+
+#include "aabb.h"
+#include "ray.h"
+
+namespace rtr {
+
+/// @brief Distance attenuation of point lights
+inline float light_attenuation(float distance) {
+  return 1.0f / (1.0f + 0.1f * distance + 0.01f * distance * distance);
+}
+
+struct LightBVHNode {
+  AABB bbox;
+  // leaf: first light in order; inner: index of the right child
+  uint32_t offset = 0;
+  // leaf: number of lights; inner: 0 (left child is the next node)
+  uint32_t count = 0;
+};
+
+/// @brief Hierarchy over the spheres of influence of point lights
+///
+/// A light influences a point only while its attenuated intensity is above
+/// the cutoff. With cutoff <= 0 every light has an infinite radius and the
+/// hierarchy degenerates to a flat list.
+class LightBVH {
+ public:
+  LightBVH() = default;
+  LightBVH(const std::vector<Light>& lights, float cutoff);
+
+  [[nodiscard]] static float influence_radius(const Light& light,
+                                              float cutoff);
+
+  /// @brief Calls f(light_index) for each light reaching the point
+  template <typename F>
+  void for_each_light(const Eigen::Vector3f& point, F&& f) const;
+
+  [[nodiscard]] bool empty() const { return nodes_.empty(); }
+
+ private:
+  uint32_t build_node(uint32_t begin, uint32_t end);
+
+ private:
+  std::vector<LightBVHNode> nodes_;
+  // per light sphere of influence: center and squared radius
+  std::vector<Eigen::Vector4f> spheres_;
+  std::vector<uint32_t> order_;
+};
+
+template <typename F>
+void LightBVH::for_each_light(const Eigen::Vector3f& point, F&& f) const {
+  if (nodes_.empty())
+    return;
+
+  auto contains = [&point](const AABB& bbox) {
+    return (point.array() >= bbox.min.array()).all() &&
+           (point.array() <= bbox.max.array()).all();
+  };
+
+  uint32_t stack[64];
+  int top = 0;
+  stack[top++] = 0;
+
+  while (top > 0) {
+    const auto& node = nodes_[stack[--top]];
+    if (!contains(node.bbox))
+      continue;
+
+    if (node.count > 0) {
+      for (uint32_t i = node.offset; i < node.offset + node.count; ++i) {
+        const auto& sphere = spheres_[order_[i]];
+        if ((sphere.head<3>() - point).squaredNorm() <= sphere.w())
+          f(order_[i]);
+      }
+      continue;
+    }
+
+    uint32_t left = static_cast<uint32_t>(&node - nodes_.data()) + 1;
+    stack[top++] = node.offset;
+    stack[top++] = left;
+  }
+}
+
+}  // namespace rtr
@@ -42,6 +42,7 @@ class Camera {
   [[nodiscard]] const Vector3f& get_up() const { return up_; }
   [[nodiscard]] float get_yaw() const { return yaw_; }
   [[nodiscard]] float get_pitch() const { return pitch_; }
+  [[nodiscard]] float get_fov() const { return fov_; }
 
  private:
   void update_vectors();
@@ -1,4 +1,7 @@
+#include <algorithm>
 #include <boost/program_options.hpp>
+#include <chrono>
+#include <cmath>
 #include <format>
 #include <fstream>
 #include <iostream>
@@ -7,10 +10,12 @@
 #include <sstream>
 #include <string>
 
+#include "batch_renderer.h"
 #include "camera.h"
 #include "model.h"
 #include "ppm.h"
 #include "renderer.h"
+#include "scene.h"
 
 using namespace std::string_view_literals;
 using namespace rtr;
@@ -84,7 +89,43 @@ int main(const int argc, const char* argv[]) {
       "Camera direction vector")(
       "width,w", po::value<size_t>()->default_value(400), "Viewport width")(
       "height,g", po::value<size_t>()->default_value(300), "Viewport height")(
-      "threads,t", po::value<size_t>()->default_value(4), "Used thread count");
+      "threads,t", po::value<size_t>()->default_value(4), "Used thread count")(
+      "time-budget,b", po::value<size_t>()->default_value(0),
+      "Render time limit in milliseconds, 0 renders without a limit")(
+      "views,n", po::value<size_t>()->default_value(1),
+      "Number of views on an orbit around the model, written as "
+      "<output>_NNN.ppm")(
+      "cache,c", po::value<std::string>()->default_value("on"),
+      "Binary model cache next to the model file: on, off or refresh")(
+      "texture-memory,x", po::value<size_t>()->default_value(0),
+      "Texture memory limit in MiB, textures are streamed on demand within "
+      "it. 0 decodes all textures on load")(
+      "compress-textures,z", po::bool_switch(),
+      "Keep textures block compressed in memory, 6 times smaller at a small "
+      "loss of quality")(
+      "compact-geometry,k", po::bool_switch(),
+      "Keep meshes in the compact format: quantized normals, texture "
+      "coordinates and BVH nodes")(
+      "instances,i", po::value<size_t>()->default_value(1),
+      "Number of copies of the model placed in a grid, all of them share "
+      "its geometry")(
+      "defer-bvh,l", po::bool_switch(),
+      "Build the BVH of a mesh when a ray first reaches it, meshes out of "
+      "view are never built. The cache stores meshes without BVHs then")(
+      "geometry-memory,y", po::value<size_t>()->default_value(0),
+      "Geometry memory limit in MiB, meshes are kept in cluster files next "
+      "to the model and paged in within it. 0 keeps all geometry in memory, "
+      "the cache isn't used otherwise")(
+      "lod-levels,e", po::value<size_t>()->default_value(0),
+      "Number of simplified levels of detail built per mesh, distant meshes "
+      "and preview passes are traced at them within a pixel of error")(
+      "spatial-splits,s", po::value<float>()->default_value(0.0f),
+      "Extra triangle references the BVH builder may add by splitting long "
+      "triangles, as a fraction of the triangle count. 0 builds without "
+      "spatial splits")(
+      "huge-pages,a", po::bool_switch(),
+      "Map the arena holding the model geometry with huge pages, fewer TLB "
+      "misses on large models");
 
   try {
     po::store(po::parse_command_line(argc, argv, desc), vm);
@@ -108,18 +149,151 @@ int main(const int argc, const char* argv[]) {
   auto w = vm["width"].as<size_t>();
   auto h = vm["height"].as<size_t>();
   auto t = vm["threads"].as<size_t>();
+  auto budget = vm["time-budget"].as<size_t>();
+  auto views = vm["views"].as<size_t>();
+  auto cache_option = vm["cache"].as<std::string>();
+  auto texture_memory_limit = vm["texture-memory"].as<size_t>();
+  auto compress_textures = vm["compress-textures"].as<bool>();
+  auto compact_geometry = vm["compact-geometry"].as<bool>();
+  auto instances = vm["instances"].as<size_t>();
+  auto defer_bvh = vm["defer-bvh"].as<bool>();
+  auto geometry_memory_limit = vm["geometry-memory"].as<size_t>();
+  auto lod_levels = vm["lod-levels"].as<size_t>();
+  auto spatial_splits = vm["spatial-splits"].as<float>();
+  auto huge_pages = vm["huge-pages"].as<bool>();
+
+  ImportOptions import_options;
+  if (cache_option == "on"sv) {
+    import_options.cache = CacheMode::On;
+  } else if (cache_option == "off"sv) {
+    import_options.cache = CacheMode::Off;
+  } else if (cache_option == "refresh"sv) {
+    import_options.cache = CacheMode::Refresh;
+  } else {
+    std::cout << "ERR: Unknown cache mode " << cache_option << std::endl;
+    return 1;
+  }
 
   auto camera = std::make_shared<Camera>(Camera{{pos.x, pos.y, pos.z},
                                                 {dir.x, dir.y, dir.z},
                                                 {up.x, up.y, up.z},
                                                 60.f,
                                                 float(w) / h});
-  auto model = Model::import(m);
+  if (compress_textures) {
+    import_options.texture_format = TextureFormat::BC1;
+  }
+  if (compact_geometry) {
+    import_options.vertex_format = VertexFormat::Compact;
+  }
+  import_options.defer_bvh = defer_bvh;
+  import_options.lod_levels = lod_levels;
+  import_options.bvh.spatial_split_budget = std::max(spatial_splits, 0.0f);
+  import_options.huge_pages = huge_pages;
+  if (texture_memory_limit > 0) {
+    import_options.texture_streamer = std::make_shared<TextureStreamer>(
+        texture_memory_limit << 20, import_options.texture_format);
+  }
+  if (geometry_memory_limit > 0) {
+    fs::path model_path(m);
+    import_options.geometry_pager = std::make_shared<GeometryPager>(
+        geometry_memory_limit << 20,
+        model_path.parent_path() / (model_path.stem().string() + ".clusters"));
+  }
+  auto print_streaming_stats = [&] {
+    if (auto pager = import_options.geometry_pager) {
+      auto stats = pager->get_stats();
+      std::cout << std::format(
+                       "Geometry paging: {} hits, {} misses, {} evictions, "
+                       "{:.1f}/{:.1f} MiB resident",
+                       stats.hits, stats.misses, stats.evictions,
+                       stats.resident_bytes / (1024.0 * 1024.0),
+                       stats.budget / (1024.0 * 1024.0))
+                << std::endl;
+    }
+    if (!import_options.texture_streamer)
+      return;
+    auto stats = import_options.texture_streamer->get_stats();
+    std::cout << std::format(
+                     "Texture streaming: {} hits, {} misses, {} evictions, "
+                     "{:.1f}/{:.1f} MiB resident",
+                     stats.hits, stats.misses, stats.evictions,
+                     stats.resident_bytes / (1024.0 * 1024.0),
+                     stats.budget / (1024.0 * 1024.0))
+              << std::endl;
+  };
+
+  auto model = Model::import(m, import_options);
   if (!model.has_value()) {
     std::cout << "ERR: Can't open model file " << m << std::endl;
     return 2;
   }
-  Renderer renderer(std::make_shared<const Model>(model.value()), camera, w, h);
+  std::cout << std::format("Geometry memory: {:.1f} MiB",
+                           model->get_geometry_memory() / (1024.0 * 1024.0))
+            << std::endl;
+  if (size_t texture_memory = model->get_texture_memory()) {
+    std::cout << std::format("Texture memory: {:.1f} MiB",
+                             texture_memory / (1024.0 * 1024.0))
+              << std::endl;
+  }
+  auto shared_model = std::make_shared<const Model>(model.value());
+
+  auto scene = std::make_shared<Scene>(shared_model);
+  if (instances > 1) {
+    // square grid on the xz plane, a quarter of the model size apart
+    AABB bbox = scene->get_bbox();
+    Eigen::Vector3f step = (bbox.max - bbox.min) * 1.25f;
+    size_t columns = size_t(std::ceil(std::sqrt(double(instances))));
+    for (size_t i = 1; i < instances; ++i) {
+      Eigen::Vector3f offset(step.x() * (i % columns), 0.0f,
+                             step.z() * (i / columns));
+      scene->add_instance(shared_model,
+                          Eigen::Affine3f(Eigen::Translation3f(offset)));
+    }
+    scene->build();
+    std::cout << std::format("Instances: {}, {:.1f} KiB", instances,
+                             scene->get_instance_memory() / 1024.0)
+              << std::endl;
+  }
+
+  if (views > 1) {
+    // the views are rendered in flight together, each in full
+    if (budget > 0) {
+      std::cout << "WARN: --time-budget is ignored when rendering several "
+                   "views"
+                << std::endl;
+    }
+    BatchRenderer batch(scene, w, h, t);
+    if (lod_levels > 0) {
+      batch.set_setup_callback(
+          [](RayTracer& tracer) { tracer.set_lod_error(1.0f); });
+    }
+    auto bbox = batch.get_root_bbox();
+    if (!p.has_value()) {
+      camera->zoom_to_fit(bbox);
+    }
+
+    auto cameras = make_orbit(*camera, (bbox.min + bbox.max) * 0.5f, views,
+                              {up.x, up.y, up.z});
+    fs::path output(o);
+    batch.render(cameras, [&](size_t index, const FrameBuffer& frame) {
+      auto path = output.parent_path() /
+                  std::format("{}_{:03}{}", output.stem().string(), index,
+                              output.extension().string());
+      std::ofstream ofs(path, std::ios::binary);
+      ppm_export(ofs, frame);
+      std::cout << "Rendered views: " << index + 1 << "/" << views << "\r"
+                << std::flush;
+    });
+    std::cout << std::endl;
+    print_streaming_stats();
+    return 0;
+  }
+
+  Renderer renderer(scene, camera, w, h);
+  if (lod_levels > 0) {
+    renderer.get_ray_tracer().set_lod_error(1.0f);
+    renderer.set_preview_lod(true);
+  }
   if (!p.has_value()) {
     camera->zoom_to_fit(renderer.get_root_bbox());
   }
@@ -127,11 +301,23 @@ int main(const int argc, const char* argv[]) {
   auto progress_callback = [](float progress) {
     std::cout << "Progress: " << int(progress * 100) << "%\r" << std::flush;
   };
-  renderer.render(t, progress_callback);
+  if (budget > 0) {
+    auto deadline = Renderer::Clock::now() + std::chrono::milliseconds(budget);
+    auto quality = renderer.render(deadline, t, progress_callback);
+    std::cout << "Quality level: " << quality.level << " ("
+              << quality.samples_per_pixel << " spp, depth "
+              << quality.max_depth << "), refined tiles: "
+              << quality.refined_tiles << "/" << quality.total_tiles
+              << ", elapsed: " << quality.elapsed.count() << " ms"
+              << std::endl;
+  } else {
+    renderer.render(t, progress_callback);
+  }
 
   const auto& frame_buffer = renderer.get_frame_buffer();
   std::ofstream ofs(o.data(), std::ios::binary);
   ppm_export(ofs, frame_buffer);
+  print_streaming_stats();
 
   return 0;
 }
\ No newline at end of file
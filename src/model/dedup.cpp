@@ -0,0 +1,96 @@
+#include "dedup.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <execution>
+#include <numeric>
+
+namespace rtr {
+
+// 40 bytes per corner; with the head positions this is all the scratch
+// memory of a deduplication
+struct CornerKey {
+  uint32_t hash;    // once sorted: the vertex id, for group heads
+  uint32_t corner;  // corner counts fit VertexIndex
+  std::array<uint32_t, 8> bits;
+};
+
+void deduplicate_vertices(const std::vector<PackedVertex>& corners,
+                          std::vector<PackedVertex>& vertexes,
+                          std::vector<VertexIndex>& indices) {
+  const size_t count = corners.size();
+  vertexes.clear();
+  indices.assign(count, 0);
+  if (count == 0) {
+    return;
+  }
+
+  // the parallel passes iterate the keys, a key's position is its offset
+  std::vector<CornerKey> keys(count);
+  auto position = [&keys](const CornerKey& key) {
+    return static_cast<size_t>(&key - keys.data());
+  };
+
+  // 1. hash
+  std::for_each(std::execution::par, keys.begin(), keys.end(),
+                [&](CornerKey& key) {
+                  size_t i = position(key);
+                  key.bits = vertex_bits(corners[i]);
+                  uint64_t hash = hash_vertex_bits(key.bits);
+                  key.hash = static_cast<uint32_t>(hash ^ (hash >> 32));
+                  key.corner = static_cast<uint32_t>(i);
+                });
+
+  // 2. sort, equal vertices become neighbours with the first use leading
+  std::sort(std::execution::par, keys.begin(), keys.end(),
+            [](const CornerKey& a, const CornerKey& b) {
+              if (a.hash != b.hash)
+                return a.hash < b.hash;
+              if (a.bits != b.bits)
+                return a.bits < b.bits;
+              return a.corner < b.corner;
+            });
+
+  // 3. unique, position of the group head for every sorted key
+  std::vector<uint32_t> heads(count);
+  std::for_each(std::execution::par, keys.begin(), keys.end(),
+                [&](const CornerKey& key) {
+                  size_t k = position(key);
+                  bool head = k == 0 || keys[k - 1].hash != key.hash ||
+                              keys[k - 1].bits != key.bits;
+                  heads[k] = head ? static_cast<uint32_t>(k) : 0;
+                });
+  std::inclusive_scan(std::execution::par, heads.begin(), heads.end(),
+                      heads.begin(),
+                      [](uint32_t a, uint32_t b) { return std::max(a, b); });
+
+  // 4. number unique vertices in order of first use: the indices flag the
+  // first uses and are scanned in place into counts, a first use gets id
+  // count - 1
+  std::for_each(std::execution::par, keys.begin(), keys.end(),
+                [&](const CornerKey& key) {
+                  if (heads[position(key)] == position(key)) {
+                    indices[key.corner] = 1;
+                  }
+                });
+  std::inclusive_scan(std::execution::par, indices.begin(), indices.end(),
+                      indices.begin());
+  const size_t unique_count = indices.back();
+
+  // 5. remap: the heads keep their vertex id in place of the hash, which
+  // the other corners of the group then read
+  vertexes.resize(unique_count);
+  std::for_each(std::execution::par, keys.begin(), keys.end(),
+                [&](CornerKey& key) {
+                  if (heads[position(key)] == position(key)) {
+                    key.hash = indices[key.corner] - 1;
+                    vertexes[key.hash] = corners[key.corner];
+                  }
+                });
+  std::for_each(std::execution::par, keys.begin(), keys.end(),
+                [&](const CornerKey& key) {
+                  indices[key.corner] = keys[heads[position(key)]].hash;
+                });
+}
+
+}  // namespace rtr
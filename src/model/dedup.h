@@ -0,0 +1,18 @@
+#pragma once
+
+#include <vector>
+
+#include "vertex.h"
+
+namespace rtr {
+
+/// @brief Parallel vertex deduplication by hashing and sorting
+///
+/// Builds the unique vertices of the triangle corners and the index of each
+/// corner. Vertices are stored in order of first use, so the result doesn't
+/// depend on thread scheduling.
+void deduplicate_vertices(const std::vector<PackedVertex>& corners,
+                          std::vector<PackedVertex>& vertexes,
+                          std::vector<VertexIndex>& indices);
+
+}  // namespace rtr
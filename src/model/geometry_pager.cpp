@@ -0,0 +1,263 @@
+#include "geometry_pager.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <utility>
+
+#include "mesh.h"
+
+namespace rtr {
+
+namespace {
+
+constexpr uint32_t no_vertex = std::numeric_limits<uint32_t>::max();
+
+/// @brief Reads exactly size bytes at offset
+bool read_at(int fd, void* data, size_t size, uint64_t offset) {
+  auto* out = static_cast<char*>(data);
+  while (size > 0) {
+    ssize_t n = ::pread(fd, out, size, static_cast<off_t>(offset));
+    if (n <= 0)
+      return false;
+    out += n;
+    size -= static_cast<size_t>(n);
+    offset += static_cast<uint64_t>(n);
+  }
+  return true;
+}
+
+/// @brief Cuts a mesh BVH into clusters and writes them
+class ClusterWriter {
+ public:
+  ClusterWriter(const Mesh& mesh, const BVHAccel& bvh, size_t max_indices,
+                std::ofstream& out)
+      : mesh_(mesh),
+        nodes_(bvh.get_nodes().span()),
+        leaf_indices_(bvh.get_leaf_indices().span()),
+        max_indices_(max_indices),
+        out_(out),
+        local_(mesh.vertex_count(), no_vertex) {
+    // extents bottom-up, children follow their parent in the array
+    end_.resize(nodes_.size());
+    first_.resize(nodes_.size());
+    last_.resize(nodes_.size());
+    for (size_t i = nodes_.size(); i-- > 0;) {
+      const BVHNode& node = nodes_[i];
+      if (node.count > 0) {
+        end_[i] = uint32_t(i + 1);
+        first_[i] = node.offset;
+        last_[i] = node.offset + node.count;
+      } else {
+        end_[i] = end_[node.offset];
+        first_[i] = std::min(first_[i + 1], first_[node.offset]);
+        last_[i] = std::max(last_[i + 1], last_[node.offset]);
+      }
+    }
+  }
+
+  /// @brief Appends the top node of the subtree, returns its index
+  uint32_t cut(uint32_t index) {
+    const BVHNode& node = nodes_[index];
+    uint32_t top = uint32_t(top_nodes.size());
+    if (node.count > 0 || last_[index] - first_[index] <= max_indices_) {
+      top_nodes.push_back({node.bbox, uint32_t(records.size()), 1});
+      write_cluster(index);
+      return top;
+    }
+
+    top_nodes.push_back({node.bbox, 0, 0});
+    cut(index + 1);
+    uint32_t right = cut(node.offset);
+    top_nodes[top].offset = right;
+    return top;
+  }
+
+  std::vector<BVHNode> top_nodes;
+  std::vector<ClusteredGeometry::Record> records;
+
+ private:
+  /// @brief Subtree with its offsets made local and the vertexes it uses
+  void write_cluster(uint32_t index) {
+    uint32_t first = first_[index];
+    std::vector<PackedVertex> vertexes;
+    std::vector<VertexIndex> indices;
+    indices.reserve(last_[index] - first);
+    for (uint32_t i = first; i < last_[index]; ++i) {
+      VertexIndex global = leaf_indices_[i];
+      if (local_[global] == no_vertex) {
+        local_[global] = uint32_t(vertexes.size());
+        vertexes.push_back(mesh_.get_vertex(global));
+      }
+      indices.push_back(local_[global]);
+    }
+    for (uint32_t i = first; i < last_[index]; ++i) {
+      local_[leaf_indices_[i]] = no_vertex;
+    }
+
+    std::vector<BVHNode> nodes(nodes_.begin() + index,
+                               nodes_.begin() + end_[index]);
+    for (auto& node : nodes) {
+      node.offset -= node.count > 0 ? first : index;
+    }
+
+    ClusteredGeometry::Record record;
+    record.bbox = nodes_[index].bbox;
+    record.offset = static_cast<uint64_t>(out_.tellp());
+    record.vertex_count = uint32_t(vertexes.size());
+    record.node_count = uint32_t(nodes.size());
+    record.index_count = uint32_t(indices.size());
+    out_.write(reinterpret_cast<const char*>(vertexes.data()),
+               vertexes.size() * sizeof(PackedVertex));
+    out_.write(reinterpret_cast<const char*>(nodes.data()),
+               nodes.size() * sizeof(BVHNode));
+    out_.write(reinterpret_cast<const char*>(indices.data()),
+               indices.size() * sizeof(VertexIndex));
+    records.push_back(record);
+  }
+
+ private:
+  const Mesh& mesh_;
+  std::span<const BVHNode> nodes_;
+  std::span<const VertexIndex> leaf_indices_;
+  size_t max_indices_;
+  std::ofstream& out_;
+  // subtree end and leaf index range per node
+  std::vector<uint32_t> end_, first_, last_;
+  // cluster index of each mesh vertex while a cluster is written
+  std::vector<uint32_t> local_;
+};
+
+}  // namespace
+
+GeometryPager::GeometryPager(size_t budget, fs::path directory,
+                             size_t cluster_triangles)
+    : directory_(std::move(directory)),
+      cluster_triangles_(std::max<size_t>(cluster_triangles, 1)),
+      residency_(budget) {}
+
+GeometryPager::~GeometryPager() {
+  // the geometries keep the pager alive, so their files are gone
+  std::error_code error;
+  fs::remove(directory_, error);
+}
+
+std::shared_ptr<ClusteredGeometry> GeometryPager::page_out(const Mesh& mesh) {
+  // the clusters are cut from a float hierarchy, the mesh's own if it has
+  // one
+  std::shared_ptr<BVHAccel> owned;
+  const BVHAccel* bvh = mesh.get_built_bvh();
+  if (!bvh || bvh->is_quantized()) {
+    owned = mesh.vertex_format == VertexFormat::Compact
+                ? std::make_shared<BVHAccel>(mesh.positions.span(),
+                                             mesh.indices.span())
+                : std::make_shared<BVHAccel>(mesh.vertexes.span(),
+                                             mesh.indices.span());
+    bvh = owned.get();
+  }
+
+  fs::path path;
+  {
+    std::lock_guard lock(mutex_);
+    path = directory_ / ("clusters_" + std::to_string(next_file_++) + ".bin");
+  }
+
+  std::error_code error;
+  fs::create_directories(directory_, error);
+  std::ofstream out(path, std::ios::binary | std::ios::trunc);
+  if (!out) {
+    std::cerr << "ERR: Failed to write clusters: " << path.string() << "\n";
+    return nullptr;
+  }
+
+  ClusterWriter writer(mesh, *bvh, 3 * cluster_triangles_, out);
+  if (!bvh->get_nodes().empty()) {
+    writer.cut(0);
+  }
+  out.close();
+  if (!out) {
+    std::cerr << "ERR: Failed to write clusters: " << path.string() << "\n";
+    fs::remove(path, error);
+    return nullptr;
+  }
+
+  return std::make_shared<ClusteredGeometry>(shared_from_this(), path,
+                                             std::move(writer.top_nodes),
+                                             std::move(writer.records));
+}
+
+ClusteredGeometry::ClusteredGeometry(std::shared_ptr<GeometryPager> pager,
+                                     fs::path path, std::vector<BVHNode> nodes,
+                                     std::vector<Record> records)
+    : pager_(std::move(pager)),
+      path_(std::move(path)),
+      nodes_(std::move(nodes)),
+      records_(std::move(records)),
+      slots_(std::make_unique<Slot[]>(records_.size())) {
+  fd_ = ::open(path_.c_str(), O_RDONLY);
+  if (fd_ < 0) {
+    std::cerr << "ERR: Failed to open clusters: " << path_.string() << "\n";
+  }
+  pager_->residency_.attach(counters_);
+}
+
+ClusteredGeometry::~ClusteredGeometry() {
+  for (size_t i = 0; i < records_.size(); ++i) {
+    pager_->residency_.remove(slots_[i]);
+  }
+  pager_->residency_.detach(counters_);
+
+  if (fd_ >= 0) {
+    ::close(fd_);
+  }
+  std::error_code error;
+  fs::remove(path_, error);
+}
+
+std::shared_ptr<const GeometryCluster> ClusteredGeometry::find(
+    uint32_t id) const {
+  return Residency::find(slots_[id], counters_);
+}
+
+std::shared_ptr<const GeometryCluster> ClusteredGeometry::acquire(
+    uint32_t id) {
+  return pager_->residency_.acquire(slots_[id], counters_, [&] {
+    return std::pair(read(id), records_[id].size());
+  });
+}
+
+size_t ClusteredGeometry::memory_usage() const {
+  return nodes_.size() * sizeof(BVHNode) + records_.size() * sizeof(Record);
+}
+
+std::shared_ptr<const GeometryCluster> ClusteredGeometry::read(
+    uint32_t id) const {
+  const Record& record = records_[id];
+  std::vector<PackedVertex> vertexes(record.vertex_count);
+  std::vector<BVHNode> nodes(record.node_count);
+  std::vector<VertexIndex> indices(record.index_count);
+
+  uint64_t offset = record.offset;
+  size_t vertex_bytes = vertexes.size() * sizeof(PackedVertex);
+  size_t node_bytes = nodes.size() * sizeof(BVHNode);
+  bool ok = fd_ >= 0 && read_at(fd_, vertexes.data(), vertex_bytes, offset) &&
+            read_at(fd_, nodes.data(), node_bytes, offset + vertex_bytes) &&
+            read_at(fd_, indices.data(), indices.size() * sizeof(VertexIndex),
+                    offset + vertex_bytes + node_bytes);
+  if (!ok) {
+    // an empty cluster, the file isn't read again
+    std::cerr << "ERR: Failed to read clusters: " << path_.string() << "\n";
+    return std::make_shared<GeometryCluster>(GeometryCluster{
+        {}, BVHAccel(Buffer<BVHNode>(), Buffer<VertexIndex>())});
+  }
+
+  return std::make_shared<GeometryCluster>(GeometryCluster{
+      std::move(vertexes), BVHAccel(Buffer<BVHNode>(std::move(nodes)),
+                                    Buffer<VertexIndex>(std::move(indices)))});
+}
+
+}  // namespace rtr
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "aabb.h"
+#include "bvh.h"
+#include "residency.h"
+#include "vertex.h"
+
+namespace fs = std::filesystem;
+
+namespace rtr {
+
+struct Mesh;
+class ClusteredGeometry;
+
+/// @brief Spatially coherent part of a mesh paged in from disk: its
+/// vertexes and the subtree of the mesh BVH over them
+struct GeometryCluster {
+  std::vector<PackedVertex> vertexes;
+  BVHAccel bvh;  // leaf indices refer to vertexes
+};
+
+/// @brief Pages meshes out to cluster files in its directory and reads the
+/// clusters back on demand, Residency decides which stay in memory
+///
+/// A read from disk only blocks the readers of its own cluster.
+class GeometryPager : public std::enable_shared_from_this<GeometryPager> {
+ public:
+  /// @brief budget: bytes of resident clusters, see Residency. directory:
+  /// where the cluster files are written, they are removed with their
+  /// meshes. cluster_triangles: upper bound of triangles per cluster.
+  GeometryPager(size_t budget, fs::path directory,
+                size_t cluster_triangles = 1 << 14);
+  /// @brief Removes the directory if it's empty
+  ~GeometryPager();
+
+  /// @brief Writes the geometry of the mesh as clusters to a new file.
+  /// Returns null if the file can't be written.
+  [[nodiscard]] std::shared_ptr<ClusteredGeometry> page_out(const Mesh& mesh);
+
+  [[nodiscard]] ResidencyStats get_stats() const {
+    return residency_.get_stats();
+  }
+
+ private:
+  friend class ClusteredGeometry;
+
+ private:
+  const fs::path directory_;
+  const size_t cluster_triangles_;
+  std::mutex mutex_;  // guards next_file_
+  uint64_t next_file_ = 0;
+  Residency residency_;
+};
+
+/// @brief Geometry of a mesh kept on disk as clusters
+///
+/// The nodes of the mesh BVH above the clusters stay resident, with the
+/// cluster bounds as their leaves: a ray finds the clusters it crosses
+/// without reading any of them.
+class ClusteredGeometry {
+ public:
+  /// @brief Location of a cluster in the file
+  struct Record {
+    AABB bbox;
+    uint64_t offset = 0;  // bytes from the file start
+    uint32_t vertex_count = 0;
+    uint32_t node_count = 0;
+    uint32_t index_count = 0;
+
+    [[nodiscard]] size_t size() const {
+      return vertex_count * sizeof(PackedVertex) +
+             node_count * sizeof(BVHNode) + index_count * sizeof(VertexIndex);
+    }
+  };
+
+  /// @brief nodes: top of the hierarchy with the cluster bounds as leaves,
+  /// a leaf's offset is the first of its count clusters
+  ClusteredGeometry(std::shared_ptr<GeometryPager> pager, fs::path path,
+                    std::vector<BVHNode> nodes, std::vector<Record> records);
+  ~ClusteredGeometry();
+
+  ClusteredGeometry(const ClusteredGeometry&) = delete;
+  ClusteredGeometry& operator=(const ClusteredGeometry&) = delete;
+
+  [[nodiscard]] AABB get_bbox() const {
+    return nodes_.empty() ? AABB() : nodes_.front().bbox;
+  }
+  [[nodiscard]] size_t cluster_count() const { return records_.size(); }
+  [[nodiscard]] const Record& get_record(uint32_t id) const {
+    return records_[id];
+  }
+
+  /// @brief Calls f(id, t_enter) for the clusters whose bounds the ray
+  /// enters before t_max; t_max may shrink between the calls
+  template <typename F>
+  void for_each_cluster(const Ray& ray, float t_min, const float& t_max,
+                        F&& f) const;
+
+  /// @brief Resident cluster or null, never reads the file
+  [[nodiscard]] std::shared_ptr<const GeometryCluster> find(uint32_t id) const;
+  /// @brief Cluster, read from the file if it isn't resident. Concurrent
+  /// misses of one cluster read it once.
+  [[nodiscard]] std::shared_ptr<const GeometryCluster> acquire(uint32_t id);
+
+  /// @brief Bytes of the resident hierarchy and records, clusters are
+  /// counted by the pager
+  [[nodiscard]] size_t memory_usage() const;
+
+ private:
+  friend class GeometryPager;
+
+  using Slot = Residency::Slot<const GeometryCluster>;
+
+  [[nodiscard]] std::shared_ptr<const GeometryCluster> read(
+      uint32_t id) const;
+
+ private:
+  std::shared_ptr<GeometryPager> pager_;
+  fs::path path_;
+  int fd_ = -1;
+  std::vector<BVHNode> nodes_;
+  std::vector<Record> records_;
+  std::unique_ptr<Slot[]> slots_;
+  mutable Residency::Counters counters_;
+};
+
+template <typename F>
+void ClusteredGeometry::for_each_cluster(const Ray& ray, float t_min,
+                                         const float& t_max, F&& f) const {
+  if (nodes_.empty())
+    return;
+
+  uint32_t stack[64];
+  int top = 0;
+  stack[top++] = 0;
+  while (top > 0) {
+    const BVHNode& node = nodes_[stack[--top]];
+    float t_enter;
+    if (!node.bbox.intersect(ray, t_min, t_max, t_enter))
+      continue;
+
+    if (node.count > 0) {
+      for (uint32_t id = node.offset; id < node.offset + node.count; ++id) {
+        f(id, t_enter);
+      }
+      continue;
+    }
+
+    stack[top++] = node.offset;
+    stack[top++] = static_cast<uint32_t>(&node - nodes_.data()) + 1;
+  }
+}
+
+}  // namespace rtr
@@ -0,0 +1,307 @@
+#include "mesh.h"
+
+#include <algorithm>
+#include <execution>
+#include <limits>
+#include <numeric>
+#include <set>
+
+#include "simplify.h"
+
+namespace rtr {
+
+BVHAccel* DeferredBVH::get(const Mesh& mesh) {
+  std::call_once(once_, [&] {
+    bvh_ = mesh.build_bvh(options_);
+    built_.store(true, std::memory_order_release);
+  });
+  return bvh_.get();
+}
+
+std::shared_ptr<BVHAccel> Mesh::build_bvh(
+    const BVHBuildOptions& options) const {
+  if (vertex_format != VertexFormat::Compact)
+    return std::make_shared<BVHAccel>(vertexes.span(), indices.span(),
+                                      options);
+
+  auto result =
+      std::make_shared<BVHAccel>(positions.span(), indices.span(), options);
+  result->quantize();
+  return result;
+}
+
+AABB Mesh::get_bbox() const {
+  if (clusters)
+    return bbox;
+  if (const auto* built = get_built_bvh())
+    return built->get_root_bbox();
+  return deferred_bvh ? bbox : compute_bbox();
+}
+
+AABB Mesh::compute_bbox() const {
+  AABB result;
+  for (size_t i = 0; i < vertex_count(); ++i) {
+    Eigen::Vector3f position = get_position(static_cast<VertexIndex>(i));
+    result.expand(AABB(position, position));
+  }
+  return result;
+}
+
+size_t Mesh::memory_usage() const {
+  size_t result = vertexes.size() * sizeof(PackedVertex) +
+                  positions.size() * sizeof(positions[0]) +
+                  attributes.size() * sizeof(CompactAttributes) +
+                  indices.size() * sizeof(VertexIndex);
+  if (clusters) {
+    result += clusters->memory_usage();
+  }
+  for (const auto& lod : lods) {
+    result += lod.vertexes.size() * sizeof(PackedVertex) +
+              lod.indices.size() * sizeof(VertexIndex) +
+              lod.bvh->get_nodes().size() * sizeof(BVHNode) +
+              lod.bvh->get_leaf_indices().size() * sizeof(VertexIndex);
+  }
+  if (const auto* built = get_built_bvh()) {
+    result += built->get_nodes().size() * sizeof(BVHNode) +
+              built->get_quantized_nodes().size() * sizeof(QuantizedBVHNode) +
+              built->get_leaf_indices().size() * sizeof(VertexIndex) +
+              built->get_split_references().size();
+  }
+  return result;
+}
+
+RefitResult Mesh::refit(float rebuild_threshold) {
+  // simplified from the old positions
+  lods.clear();
+  // the clusters on disk aren't rewritten
+  if (clusters)
+    return RefitResult::Refitted;
+
+  auto* built = get_built_bvh();
+  if (!built) {
+    // a deferred BVH is built over the new positions, copies of the mesh
+    // keep theirs
+    if (deferred_bvh) {
+      bbox = compute_bbox();
+      deferred_bvh =
+          std::make_shared<DeferredBVH>(deferred_bvh->get_options());
+    }
+    return RefitResult::Refitted;
+  }
+  return vertex_format == VertexFormat::Compact
+             ? built->refit(positions.span(), rebuild_threshold)
+             : built->refit(vertexes.span(), rebuild_threshold);
+}
+
+/// @brief Interleaves the bits of the coordinates, each in [0, 1]
+uint32_t morton_code(const Eigen::Vector3f& p) {
+  auto spread = [](float coordinate) {
+    uint32_t v = uint32_t(std::clamp(coordinate, 0.0f, 1.0f) * 1023.0f);
+    v = (v | (v << 16)) & 0x030000ff;
+    v = (v | (v << 8)) & 0x0300f00f;
+    v = (v | (v << 4)) & 0x030c30c3;
+    v = (v | (v << 2)) & 0x09249249;
+    return v;
+  };
+  return spread(p.x()) | (spread(p.y()) << 1) | (spread(p.z()) << 2);
+}
+
+void Mesh::optimize_layout() {
+  if (clusters || indices.empty())
+    return;
+
+  size_t triangle_count = indices.size() / 3;
+  std::vector<VertexIndex> ordered;
+  ordered.reserve(indices.size());
+  auto* built = get_built_bvh();
+  if (built) {
+    // a triangle split between leaves is placed at its first leaf
+    const auto& leaf_indices = built->get_leaf_indices();
+    const auto& split = built->get_split_references();
+    std::set<std::array<VertexIndex, 3>> placed;
+    for (size_t i = 0; i < leaf_indices.size() / 3; ++i) {
+      std::array<VertexIndex, 3> triangle{leaf_indices[3 * i],
+                                          leaf_indices[3 * i + 1],
+                                          leaf_indices[3 * i + 2]};
+      if (!split.empty() && split[i] && !placed.insert(triangle).second)
+        continue;
+      ordered.insert(ordered.end(), triangle.begin(), triangle.end());
+    }
+  } else {
+    AABB bounds = deferred_bvh ? bbox : compute_bbox();
+    Eigen::Vector3f scale =
+        (bounds.max - bounds.min).cwiseMax(1e-20f).cwiseInverse();
+    std::vector<std::pair<uint32_t, uint32_t>> codes(triangle_count);
+    std::vector<size_t> ids(triangle_count);
+    std::iota(ids.begin(), ids.end(), 0);
+    std::for_each(std::execution::par, ids.begin(), ids.end(), [&](size_t t) {
+      Eigen::Vector3f center = (get_position(indices[3 * t]) +
+                                get_position(indices[3 * t + 1]) +
+                                get_position(indices[3 * t + 2])) /
+                               3.0f;
+      codes[t] = {morton_code((center - bounds.min).cwiseProduct(scale)),
+                  uint32_t(t)};
+    });
+    std::sort(std::execution::par, codes.begin(), codes.end());
+    for (auto [code, t] : codes) {
+      ordered.insert(ordered.end(), indices.begin() + 3 * t,
+                     indices.begin() + 3 * t + 3);
+    }
+  }
+
+  // vertexes in order of first use, unused ones last
+  constexpr VertexIndex unused = std::numeric_limits<VertexIndex>::max();
+  std::vector<VertexIndex> remap(vertex_count(), unused);
+  VertexIndex next = 0;
+  for (auto& index : ordered) {
+    if (remap[index] == unused) {
+      remap[index] = next++;
+    }
+    index = remap[index];
+  }
+  for (auto& index : remap) {
+    if (index == unused) {
+      index = next++;
+    }
+  }
+
+  auto permute = [&]<typename T>(Buffer<T>& buffer) {
+    if (buffer.empty())
+      return;
+    std::vector<T> result(buffer.size());
+    for (size_t i = 0; i < buffer.size(); ++i) {
+      result[remap[i]] = buffer[i];
+    }
+    buffer = std::move(result);
+  };
+  permute(vertexes);
+  permute(positions);
+  permute(attributes);
+  indices = std::move(ordered);
+  if (built) {
+    built->remap_vertices(remap);
+  }
+}
+
+void Mesh::build_lods(size_t count) {
+  lods.clear();
+  if (clusters)
+    return;
+
+  std::vector<PackedVertex> source(vertex_count());
+  for (size_t i = 0; i < source.size(); ++i) {
+    source[i] = get_vertex(static_cast<VertexIndex>(i));
+  }
+  std::vector<VertexIndex> source_indices(indices.begin(), indices.end());
+
+  for (size_t level = 0; level < count; ++level) {
+    size_t triangles = source_indices.size() / 3;
+    std::vector<PackedVertex> lod_vertexes;
+    std::vector<VertexIndex> lod_indices;
+    float error = simplify(source, source_indices, triangles / 4,
+                           lod_vertexes, lod_indices);
+    if (lod_indices.empty() || lod_indices.size() / 3 > triangles * 3 / 4)
+      break;
+
+    // errors add up along the chain
+    MeshLOD lod;
+    lod.error = error + (lods.empty() ? 0.0f : lods.back().error);
+    lod.bvh = std::make_shared<BVHAccel>(std::span(lod_vertexes),
+                                         std::span(lod_indices));
+    source = lod_vertexes;
+    source_indices = lod_indices;
+    lod.vertexes = std::move(lod_vertexes);
+    lod.indices = std::move(lod_indices);
+    lods.push_back(std::move(lod));
+  }
+}
+
+bool Mesh::page_out(GeometryPager& pager) {
+  if (clusters)
+    return true;
+
+  AABB bounds = get_bbox();
+  auto paged = pager.page_out(*this);
+  if (!paged)
+    return false;
+
+  clusters = std::move(paged);
+  bbox = bounds;
+  vertex_format = VertexFormat::Full;
+  vertexes = {};
+  positions = {};
+  attributes = {};
+  indices = {};
+  bvh.reset();
+  deferred_bvh.reset();
+  return true;
+}
+
+void Mesh::compact() {
+  // clusters are read in the full format
+  if (vertex_format == VertexFormat::Compact || clusters)
+    return;
+  // a deferred BVH is quantized when it's built
+  if (auto* built = get_built_bvh()) {
+    built->quantize();
+  }
+
+  // texcoords are quantized over their range in the mesh
+  std::array<float, 2> lo = {std::numeric_limits<float>::max(),
+                             std::numeric_limits<float>::max()};
+  std::array<float, 2> hi = {std::numeric_limits<float>::lowest(),
+                             std::numeric_limits<float>::lowest()};
+  for (const auto& vertex : vertexes) {
+    for (int c = 0; c < 2; ++c) {
+      lo[c] = std::min(lo[c], vertex.texcoord[c]);
+      hi[c] = std::max(hi[c], vertex.texcoord[c]);
+    }
+  }
+  for (int c = 0; c < 2; ++c) {
+    texcoord_min[c] = vertexes.empty() ? 0.0f : lo[c];
+    texcoord_scale[c] = vertexes.empty() ? 0.0f : (hi[c] - lo[c]) / 65535.0f;
+  }
+
+  std::vector<std::array<float, 3>> new_positions(vertexes.size());
+  std::vector<CompactAttributes> new_attributes(vertexes.size());
+  std::vector<size_t> ids(vertexes.size());
+  std::iota(ids.begin(), ids.end(), 0);
+  std::for_each(std::execution::par, ids.begin(), ids.end(), [&](size_t i) {
+    const PackedVertex& vertex = vertexes[i];
+    new_positions[i] = vertex.position;
+
+    CompactAttributes& a = new_attributes[i];
+    a.normal = encode_octahedral(vertex.get_normal());
+    for (int c = 0; c < 2; ++c) {
+      float q = texcoord_scale[c] > 0.0f
+                    ? (vertex.texcoord[c] - texcoord_min[c]) / texcoord_scale[c]
+                    : 0.0f;
+      a.texcoord[c] = static_cast<uint16_t>(
+          std::clamp(std::round(q), 0.0f, 65535.0f));
+    }
+  });
+
+  positions = std::move(new_positions);
+  attributes = std::move(new_attributes);
+  vertexes = Buffer<PackedVertex>();
+  vertex_format = VertexFormat::Compact;
+}
+
+void Mesh::move_to(const std::shared_ptr<Arena>& arena) {
+  Arena::move_to(arena, vertexes);
+  Arena::move_to(arena, positions);
+  Arena::move_to(arena, attributes);
+  Arena::move_to(arena, indices);
+  if (auto* built = get_built_bvh()) {
+    built->move_to(arena);
+  }
+  for (auto& lod : lods) {
+    Arena::move_to(arena, lod.vertexes);
+    Arena::move_to(arena, lod.indices);
+    if (lod.bvh) {
+      lod.bvh->move_to(arena);
+    }
+  }
+}
+
+}  // namespace rtr
@@ -1,19 +1,166 @@
 #pragma once
 
+#include <atomic>
+#include <cstdint>
 #include <memory>
+#include <mutex>
 #include <vector>
 
+#include "arena.h"
+#include "buffer.h"
 #include "bvh.h"
+#include "geometry_pager.h"
 #include "material.h"
 #include "vertex.h"
 
 namespace rtr {
 
+/// @brief Vertex storage of a mesh
+enum class VertexFormat : uint32_t {
+  Full,     // PackedVertex, 32 bytes
+  Compact,  // positions apart from CompactAttributes, 20 bytes, with
+            // quantized BVH nodes
+};
+
+struct Mesh;
+
+/// @brief BVH of a mesh built when a ray first reaches the mesh bounds
+///
+/// Shared by the copies of a mesh. One thread builds it, the concurrent
+/// first users wait for that build.
+class DeferredBVH {
+ public:
+  explicit DeferredBVH(const BVHBuildOptions& options = {})
+      : options_(options) {}
+
+  /// @brief Built BVH, builds it on the first call
+  [[nodiscard]] BVHAccel* get(const Mesh& mesh);
+  /// @brief Built BVH or null, never builds
+  [[nodiscard]] BVHAccel* get_built() const {
+    return built_.load(std::memory_order_acquire) ? bvh_.get() : nullptr;
+  }
+  [[nodiscard]] const BVHBuildOptions& get_options() const { return options_; }
+
+ private:
+  const BVHBuildOptions options_;
+  std::once_flag once_;
+  std::atomic<bool> built_{false};
+  std::shared_ptr<BVHAccel> bvh_;
+};
+
+/// @brief Simplified version of a mesh, always in the full format
+struct MeshLOD {
+  Buffer<PackedVertex> vertexes;
+  Buffer<VertexIndex> indices;
+  std::shared_ptr<BVHAccel> bvh;
+  float error = 0.0f;  // estimated distance to the full mesh, object space
+};
+
 struct Mesh {
-  std::vector<PackedVertex> vertexes;
-  std::vector<size_t> indices;
+  VertexFormat vertex_format = VertexFormat::Full;
+  Buffer<PackedVertex> vertexes;  // full format
+  // compact format: positions are read by intersection, attributes only
+  // for the closest hit
+  Buffer<std::array<float, 3>> positions;
+  Buffer<CompactAttributes> attributes;
+  std::array<float, 2> texcoord_min = {0.0f, 0.0f};
+  std::array<float, 2> texcoord_scale = {0.0f, 0.0f};  // per unit of 16 bits
+
+  Buffer<VertexIndex> indices;
   std::weak_ptr<Material> material;
+  int32_t material_id = -1;  // index in Model::get_materials()
   std::shared_ptr<BVHAccel> bvh;
+  // built on first use instead of bvh, with the mesh bounds as a coarse
+  // test until then
+  std::shared_ptr<DeferredBVH> deferred_bvh;
+  AABB bbox;
+  // out-of-core geometry, replaces the vertexes, indices and BVH
+  std::shared_ptr<ClusteredGeometry> clusters;
+  // levels of detail, coarser with each level; kept in memory when the
+  // mesh is paged out
+  std::vector<MeshLOD> lods;
+
+  [[nodiscard]] size_t vertex_count() const {
+    return vertex_format == VertexFormat::Compact ? positions.size()
+                                                  : vertexes.size();
+  }
+
+  [[nodiscard]] Eigen::Vector3f get_position(VertexIndex index) const {
+    if (vertex_format == VertexFormat::Compact) {
+      const auto& p = positions[index];
+      return {p[0], p[1], p[2]};
+    }
+    return vertexes[index].get_position();
+  }
+
+  /// @brief Vertex in the full format, decoded if the mesh is compact
+  [[nodiscard]] PackedVertex get_vertex(VertexIndex index) const {
+    if (vertex_format != VertexFormat::Compact)
+      return vertexes[index];
+
+    const auto& a = attributes[index];
+    Eigen::Vector3f normal = decode_octahedral(a.normal);
+    return {positions[index],
+            {normal.x(), normal.y(), normal.z()},
+            {texcoord_min[0] + a.texcoord[0] * texcoord_scale[0],
+             texcoord_min[1] + a.texcoord[1] * texcoord_scale[1]}};
+  }
+
+  /// @brief BVH of the mesh, a deferred one is built now. Null if the mesh
+  /// has none.
+  [[nodiscard]] BVHAccel* get_bvh() const {
+    if (bvh)
+      return bvh.get();
+    return deferred_bvh ? deferred_bvh->get(*this) : nullptr;
+  }
+  /// @brief BVH of the mesh if it's built
+  [[nodiscard]] BVHAccel* get_built_bvh() const {
+    if (bvh)
+      return bvh.get();
+    return deferred_bvh ? deferred_bvh->get_built() : nullptr;
+  }
+  /// @brief Builds a BVH over the positions, quantized for compact meshes
+  [[nodiscard]] std::shared_ptr<BVHAccel> build_bvh(
+      const BVHBuildOptions& options = {}) const;
+
+  /// @brief Bounds of the positions, taken from the BVH if it's built
+  [[nodiscard]] AABB get_bbox() const;
+  /// @brief Bounds of the positions, reads every vertex
+  [[nodiscard]] AABB compute_bbox() const;
+
+  /// @brief Bytes of the vertexes, indices, BVH and levels of detail. Of
+  /// out-of-core geometry only the resident hierarchy above the clusters is
+  /// counted.
+  [[nodiscard]] size_t memory_usage() const;
+
+  /// @brief Refits the BVH to the changed positions, see BVHAccel::refit.
+  /// The levels of detail are dropped.
+  RefitResult refit(float rebuild_threshold = 0.0f);
+
+  /// @brief Reorders the triangles for locality of the vertex reads: to the
+  /// leaf order of the built BVH, or along a Morton curve without one. The
+  /// vertexes follow in order of first use and the BVH is renumbered to
+  /// match. Out-of-core meshes are left as they are.
+  void optimize_layout();
+
+  /// @brief Builds up to count levels of detail, each with about a quarter
+  /// of the triangles of the previous one. Stops once a level hardly
+  /// shrinks.
+  void build_lods(size_t count);
+
+  /// @brief Moves the geometry to cluster files of the pager and frees the
+  /// vertexes, indices and BVH. The bounds are kept. Fails if the clusters
+  /// can't be written, the mesh is left as is then.
+  bool page_out(GeometryPager& pager);
+
+  /// @brief Converts the vertexes to the compact format and quantizes the
+  /// BVH nodes, indices are kept
+  void compact();
+
+  /// @brief Moves the vertexes, indices and built BVHs it owns, with those
+  /// of the levels of detail, into the arena. Views such as cached data are
+  /// left in place.
+  void move_to(const std::shared_ptr<Arena>& arena);
 };
 
-}  // namespace rtr
\ No newline at end of file
+}  // namespace rtr
@@ -1,50 +1,395 @@
 #include "model.h"
 
-#include <stb_image.h>
 #include <tiny_obj_loader.h>
 #include <algorithm>
+#include <atomic>
+#include <cctype>
 #include <execution>
+#include <fstream>
 #include <iostream>
-#include <mutex>
-#include <unordered_map>
+#include <map>
+#include <numeric>
+#include <span>
+#include <unordered_set>
+
+#include "dedup.h"
+#include "obj_parser.h"
+#include "texture_cache.h"
 
 #define TINYOBJLOADER_IMPLEMENTATION
 
 namespace rtr {
 
-std::shared_ptr<Image> load_texture(const fs::path& base, fs::path tex) {
-  std::shared_ptr<Image> result;
+/// @brief Faces per task when bucketing faces by material
+constexpr size_t face_block_size = 1 << 16;
+
+/// @brief Material with textures decoded in the background
+struct PendingMaterial {
+  std::shared_ptr<Material> material;
+  TextureCache::TextureFuture ambient_texture;
+  TextureCache::TextureFuture diffuse_texture;
+};
+
+PendingMaterial make_material(const tinyobj::material_t& mat,
+                              const fs::path& base, TextureCache& textures) {
+  auto material = std::make_shared<Material>(Material{
+      {mat.ambient[0], mat.ambient[1], mat.ambient[2]},
+      {mat.diffuse[0], mat.diffuse[1], mat.diffuse[2]},
+      {mat.specular[0], mat.specular[1], mat.specular[2]},
+      {mat.transmittance[0], mat.transmittance[1], mat.transmittance[2]},
+      {mat.emission[0], mat.emission[1], mat.emission[2]},
+      mat.ior,
+      mat.shininess,
+      1 - mat.dissolve,
+  });
+
+  // reflectivity prop
+  if (mat.illum == 5 || mat.illum == 7) {  // metal
+    material->reflectivity = 0.8f;
+  } else if (material->specular.norm() > 0.8f &&
+             mat.shininess > 50.0f) {  // mirror
+    material->reflectivity = 0.9f;
+  } else if (material->transparency > 0.1f && mat.ior > 1.2f) {  // glass
+    material->reflectivity = 0.1f;
+  } else {  // default
+    material->reflectivity =
+        std::max({mat.specular[0], mat.specular[1], mat.specular[2]});
+  }
+
+  // textures
+  return {material, textures.load(base, mat.ambient_texname),
+          textures.load(base, mat.diffuse_texname)};
+}
 
-  {
-    std::string s = tex.string();
-    std::replace(s.begin(), s.end(), '\\', '/');
-    tex = s;
+/// @brief Waits for the textures of the materials
+std::vector<std::shared_ptr<Material>> finish_materials(
+    const std::vector<PendingMaterial>& pending) {
+  std::vector<std::shared_ptr<Material>> materials;
+  materials.reserve(pending.size());
+  for (const auto& [material, ambient, diffuse] : pending) {
+    material->ambient_texture = ambient.get();
+    material->diffuse_texture = diffuse.get();
+    materials.push_back(material);
   }
+  return materials;
+}
 
-  fs::path path = tex;
-  while (!fs::exists(path) && !tex.empty()) {
-    fs::path rel = tex.relative_path();
-    path = base / rel;
-    tex = rel.lexically_relative(*rel.begin());
+/// @brief Appends the materials of an MTL file, ids follow the file order
+bool read_mtl(const fs::path& mtl_path,
+              std::map<std::string, int>& material_map,
+              std::vector<tinyobj::material_t>& materials) {
+  std::ifstream stream(mtl_path);
+  if (!stream) {
+    std::cout << "WARN: Material file not found: " << mtl_path.string()
+              << std::endl;
+    return false;
   }
 
-  if (!path.empty()) {
-    std::string texture_path = path.string();
-    int w, h, channels;
-    unsigned char* data = stbi_load(texture_path.c_str(), &w, &h, &channels, 3);
+  std::string warning, error;
+  tinyobj::LoadMtl(&material_map, &materials, &stream, &warning, &error);
+  if (!warning.empty()) {
+    std::cout << "WARN: " << warning << std::endl;
+  }
+  if (!error.empty()) {
+    std::cerr << "ERR: " << error << std::endl;
+  }
+  return true;
+}
 
-    if (data) {
-      result = std::make_shared<Image>(w, h, data);
-      stbi_image_free(data);
-    } else {
-      std::cerr << "ERR: Failed to load texture: " << texture_path << "\n";
+/// @brief Builds one mesh per non-empty bucket of triangle corners
+///
+/// Bucket i holds the triangles of materials[i], the last bucket those
+/// without a material. Meshes are built concurrently, with a pager each
+/// is paged out once built.
+std::vector<Mesh> build_meshes(
+    const std::vector<std::shared_ptr<Material>>& materials,
+    std::span<const float> vertices, std::span<const float> normals,
+    std::span<const float> texcoords,
+    const std::vector<std::vector<ObjIndex>>& buckets,
+    const ImportOptions& options) {
+  std::vector<size_t> mesh_buckets;
+  for (size_t bucket = 0; bucket < buckets.size(); ++bucket) {
+    if (!buckets[bucket].empty()) {
+      mesh_buckets.push_back(bucket);
+    }
+  }
+  std::vector<Mesh> meshes(mesh_buckets.size());
+  std::vector<size_t> mesh_ids(mesh_buckets.size());
+  std::iota(mesh_ids.begin(), mesh_ids.end(), 0);
+
+  std::for_each(
+      std::execution::par, mesh_ids.begin(), mesh_ids.end(),
+      [&](size_t mesh_id) {
+        Mesh& mesh = meshes[mesh_id];
+        size_t bucket = mesh_buckets[mesh_id];
+        if (bucket < materials.size()) {
+          mesh.material = materials[bucket];
+          mesh.material_id = bucket;
+        }
+
+        const auto& indices = buckets[bucket];
+        std::vector<PackedVertex> corners(indices.size());
+        std::vector<size_t> positions(indices.size());
+        std::iota(positions.begin(), positions.end(), 0);
+
+        std::for_each(
+            std::execution::par, positions.begin(), positions.end(),
+            [&](size_t i) {
+              const auto& idx = indices[i];
+
+              PackedVertex& vertex = corners[i];
+              memcpy(vertex.position.data(),
+                     &vertices[3 * idx.vertex_index], 12);
+              if (idx.normal_index >= 0)
+                memcpy(vertex.normal.data(), &normals[3 * idx.normal_index],
+                       12);
+              if (idx.texcoord_index >= 0)
+                memcpy(vertex.texcoord.data(),
+                       &texcoords[2 * idx.texcoord_index], 8);
+            });
+
+        deduplicate_vertices(corners, mesh.vertexes.vector(),
+                             mesh.indices.vector());
+
+        // simplified before the full geometry may be paged out
+        if (options.lod_levels > 0) {
+          mesh.build_lods(options.lod_levels);
+        }
+
+        // the clusters carry their own BVHs, a failed page out keeps the
+        // mesh in memory
+        if (options.geometry_pager && mesh.page_out(*options.geometry_pager))
+          return;
+        if (options.defer_bvh) {
+          mesh.bbox = mesh.compute_bbox();
+          mesh.deferred_bvh = std::make_shared<DeferredBVH>(options.bvh);
+        } else {
+          mesh.bvh = std::make_shared<BVHAccel>(mesh.vertexes, mesh.indices,
+                                                options.bvh);
+        }
+        if (options.optimize_layout) {
+          mesh.optimize_layout();
+        }
+      });
+
+  return meshes;
+}
+
+size_t Model::get_texture_memory() const {
+  std::unordered_set<const Image*> textures;
+  size_t result = 0;
+  for (const auto& material : materials) {
+    for (const auto* texture : {material->ambient_texture.get(),
+                                material->diffuse_texture.get()}) {
+      if (texture && textures.insert(texture).second) {
+        result += texture->data.size();
+      }
     }
   }
+  return result;
+}
 
+size_t Model::get_geometry_memory() const {
+  size_t result = 0;
+  for (const auto& mesh : meshes) {
+    result += mesh.memory_usage();
+  }
   return result;
 }
 
-std::optional<Model> Model::import(const fs::path& path) {
+std::vector<fs::path> Model::get_material_sources() const {
+  std::vector<fs::path> result;
+  for (const auto& source : sources) {
+    std::string extension = source.extension().string();
+    std::transform(extension.begin(), extension.end(), extension.begin(),
+                   [](unsigned char c) { return std::tolower(c); });
+    if (extension == ".mtl") {
+      result.push_back(source);
+    }
+  }
+  return result;
+}
+
+bool Model::reload_materials() {
+  auto mtl_paths = get_material_sources();
+  if (mtl_paths.empty() || !textures) {
+    std::cout << "WARN: No material files to reload" << std::endl;
+    return false;
+  }
+
+  std::map<std::string, int> material_map;
+  std::vector<tinyobj::material_t> mtl_materials;
+  for (const auto& mtl_path : mtl_paths) {
+    read_mtl(mtl_path, material_map, mtl_materials);
+  }
+  // materials are matched by name, ones no mesh uses may be gone
+  std::vector<const tinyobj::material_t*> reloaded(materials.size(), nullptr);
+  for (const auto& [name, id] : material_ids) {
+    auto it = material_map.find(name);
+    if (it != material_map.end() && size_t(id) < reloaded.size()) {
+      reloaded[id] = &mtl_materials[it->second];
+    }
+  }
+  for (const auto& mesh : meshes) {
+    if (mesh.material_id < 0 || size_t(mesh.material_id) >= reloaded.size() ||
+        reloaded[mesh.material_id])
+      continue;
+    for (const auto& [name, id] : material_ids) {
+      if (id == mesh.material_id) {
+        std::cout << "WARN: Material removed: " << name
+                  << ", import the model again" << std::endl;
+      }
+    }
+    return false;
+  }
+
+  // textures already in the cache are reused, the others decode in
+  // parallel
+  fs::path base = sources.front().parent_path();
+  std::vector<size_t> ids;
+  std::vector<PendingMaterial> pending;
+  for (size_t i = 0; i < reloaded.size(); ++i) {
+    if (reloaded[i]) {
+      ids.push_back(i);
+      pending.push_back(make_material(*reloaded[i], base, *textures));
+    }
+  }
+  auto finished = finish_materials(pending);
+  for (size_t i = 0; i < ids.size(); ++i) {
+    *materials[ids[i]] = *finished[i];
+  }
+  textures->release_unused();
+  return true;
+}
+
+std::optional<Model> Model::import(const fs::path& path,
+                                   const ImportOptions& options) {
+  fs::path cache_file = cache_path(path);
+  // a cached model would be loaded in memory
+  if (options.cache == CacheMode::On && !options.geometry_pager) {
+    if (auto model = load_cache(cache_file, options)) {
+      if (options.lod_levels > 0) {
+        std::for_each(std::execution::par, model->meshes.begin(),
+                      model->meshes.end(), [&](Mesh& mesh) {
+                        mesh.build_lods(options.lod_levels);
+                      });
+      }
+      if (options.pack_geometry) {
+        model->pack_geometry(options.huge_pages);
+      }
+      return model;
+    }
+  }
+
+  auto model = import_obj(path, options);
+  if (!model) {
+    std::cout << "WARN: Falling back to tinyobjloader" << std::endl;
+    model = import_tinyobj(path, options);
+  }
+
+  if (model && options.vertex_format == VertexFormat::Compact &&
+      !options.geometry_pager) {
+    std::for_each(std::execution::par, model->meshes.begin(),
+                  model->meshes.end(), [](Mesh& mesh) { mesh.compact(); });
+  }
+
+  if (model && options.cache != CacheMode::Off && !options.geometry_pager &&
+      !model->sources.empty()) {
+    if (!model->save_cache(cache_file)) {
+      std::cout << "WARN: Failed to write cache " << cache_file.string()
+                << std::endl;
+    }
+  }
+
+  if (model && options.pack_geometry) {
+    model->pack_geometry(options.huge_pages);
+  }
+  return model;
+}
+
+void Model::pack_geometry(bool huge_pages) {
+  auto packed = std::make_shared<Arena>(size_t(1) << 20, huge_pages);
+  std::for_each(std::execution::par, meshes.begin(), meshes.end(),
+                [&](Mesh& mesh) { mesh.move_to(packed); });
+  // geometry mapped from the cache leaves the arena empty
+  if (packed->used_bytes() > 0) {
+    arena = std::move(packed);
+  }
+}
+
+std::optional<Model> Model::import_obj(const fs::path& path,
+                                       const ImportOptions& options) {
+  Model model;
+  model.sources.push_back(path);
+
+  // Materials are read and their textures decoded while faces are parsed
+  model.textures = std::make_shared<TextureCache>(options.texture_streamer,
+                                                  options.texture_format);
+  std::map<std::string, int> material_map;
+  std::vector<tinyobj::material_t> materials;
+  std::vector<PendingMaterial> pending;
+  auto load_materials = [&](const std::vector<std::string>& mtllibs) {
+    for (const auto& mtllib : mtllibs) {
+      fs::path mtl_path = path.parent_path() / mtllib;
+      if (read_mtl(mtl_path, material_map, materials)) {
+        model.sources.push_back(mtl_path);
+      }
+    }
+
+    for (const auto& mat : materials) {
+      pending.push_back(
+          make_material(mat, path.parent_path(), *model.textures));
+    }
+  };
+
+  auto obj = parse_obj(path, load_materials);
+  if (!obj)
+    return {};
+
+  if (obj->skipped_faces > 0) {
+    std::cout << "WARN: Faces with less than three vertices: "
+              << obj->skipped_faces << std::endl;
+  }
+
+  model.materials = finish_materials(pending);
+  model.material_ids = material_map;
+  auto texture_paths = model.textures->get_paths();
+  model.sources.insert(model.sources.end(), texture_paths.begin(),
+                       texture_paths.end());
+
+  // usemtl groups to material buckets, unknown names default to 0
+  std::vector<std::vector<ObjIndex>> buckets(materials.size() + 1);
+  for (size_t group = 0; group < obj->groups.size(); ++group) {
+    int mat_id = -1;
+    if (group < obj->materials.size()) {
+      auto it = material_map.find(obj->materials[group]);
+      if (it != material_map.end()) {
+        mat_id = it->second;
+      } else {
+        std::cout << "WARN: Material not found: " << obj->materials[group]
+                  << std::endl;
+      }
+    }
+    size_t bucket = std::min<size_t>(std::max(0, mat_id), materials.size());
+
+    auto& triangles = obj->groups[group];
+    if (buckets[bucket].empty()) {
+      buckets[bucket] = std::move(triangles);
+    } else {
+      buckets[bucket].insert(buckets[bucket].end(), triangles.begin(),
+                             triangles.end());
+    }
+  }
+  obj->groups.clear();
+
+  model.meshes = build_meshes(model.materials, obj->vertices, obj->normals,
+                              obj->texcoords, buckets, options);
+
+  return model;
+}
+
+std::optional<Model> Model::import_tinyobj(const fs::path& path,
+                                           const ImportOptions& options) {
   tinyobj::ObjReaderConfig reader_config;
   tinyobj::ObjReader reader;
 
@@ -62,122 +407,128 @@ std::optional<Model> Model::import(const fs::path& path) {
   const auto& attrib = reader.GetAttrib();
   const auto& materials = reader.GetMaterials();
 
-  // Materials
-  model.materials.reserve(materials.size());
+  // Materials, textures are decoded while faces are bucketed. The MTL
+  // files read by tinyobjloader are unknown, so the sources stay empty and
+  // such a model isn't cached.
+  model.textures = std::make_shared<TextureCache>(options.texture_streamer,
+                                                  options.texture_format);
+  std::vector<PendingMaterial> pending;
   for (const auto& mat : materials) {
-    auto material = std::make_shared<Material>(Material{
-        {mat.ambient[0], mat.ambient[1], mat.ambient[2]},
-        {mat.diffuse[0], mat.diffuse[1], mat.diffuse[2]},
-        {mat.specular[0], mat.specular[1], mat.specular[2]},
-        {mat.transmittance[0], mat.transmittance[1], mat.transmittance[2]},
-        {mat.emission[0], mat.emission[1], mat.emission[2]},
-        mat.ior,
-        mat.shininess,
-        1 - mat.dissolve,
-    });
-
-    // reflectivity prop
-    if (mat.illum == 5 || mat.illum == 7) {  // metal
-      material->reflectivity = 0.8f;
-    } else if (material->specular.norm() > 0.8f &&
-               mat.shininess > 50.0f) {  // mirror
-      material->reflectivity = 0.9f;
-    } else if (material->transparency > 0.1f && mat.ior > 1.2f) {  // glass
-      material->reflectivity = 0.1f;
-    } else {  // default
-      material->reflectivity =
-          std::max({mat.specular[0], mat.specular[1], mat.specular[2]});
-    }
-
-    // textures
-    material->ambient_texture =
-        load_texture(path.parent_path(), mat.ambient_texname);
-    material->diffuse_texture =
-        load_texture(path.parent_path(), mat.diffuse_texname);
+    pending.push_back(
+        make_material(mat, path.parent_path(), *model.textures));
+  }
 
-    model.materials.push_back(material);
+  // Faces are bucketed by material in two parallel passes over blocks of
+  // faces: count, then scatter at prefix-summed offsets. The file order of
+  // faces is kept within every material.
+  const auto& shapes = reader.GetShapes();
+  std::vector<size_t> shape_faces(shapes.size() + 1, 0);
+  for (size_t s = 0; s < shapes.size(); ++s) {
+    shape_faces[s + 1] =
+        shape_faces[s] + shapes[s].mesh.num_face_vertices.size();
   }
+  std::vector<size_t> shape_ids(shapes.size());
+  std::iota(shape_ids.begin(), shape_ids.end(), 0);
+  std::vector<std::vector<size_t>> index_offsets(shapes.size());
+  std::for_each(std::execution::par, shape_ids.begin(), shape_ids.end(),
+                [&](size_t s) {
+                  const auto& counts = shapes[s].mesh.num_face_vertices;
+                  index_offsets[s].resize(counts.size());
+                  std::exclusive_scan(counts.begin(), counts.end(),
+                                      index_offsets[s].begin(), size_t(0));
+                });
+
+  const size_t face_count = shape_faces.back();
+  const size_t block_count =
+      (face_count + face_block_size - 1) / face_block_size;
+  // the last bucket collects faces with unknown materials
+  const size_t bucket_count = materials.size() + 1;
+  std::vector<size_t> blocks(block_count);
+  std::iota(blocks.begin(), blocks.end(), 0);
+
+  // calls f(bucket, corners) for every face of the block, corners is null
+  // for faces that aren't triangles
+  auto for_each_face = [&](size_t block, auto&& f) {
+    size_t begin = block * face_block_size;
+    size_t end = std::min(begin + face_block_size, face_count);
+    size_t s = std::upper_bound(shape_faces.begin(), shape_faces.end(), begin) -
+               shape_faces.begin() - 1;
+
+    for (size_t face = begin; face < end; ++face) {
+      while (face >= shape_faces[s + 1]) {
+        ++s;
+      }
+      const auto& mesh = shapes[s].mesh;
+      size_t f_index = face - shape_faces[s];
 
-  std::unordered_map<int, std::vector<tinyobj::index_t>> material_triangles;
-  for (const auto& shape : reader.GetShapes()) {
-    size_t index_offset = 0;
-    for (size_t f = 0; f < shape.mesh.num_face_vertices.size(); f++) {
-      int mat_id = std::max(0, shape.mesh.material_ids[f]);  // default to 0
-      size_t fv = shape.mesh.num_face_vertices[f];
+      int mat_id = std::max(0, mesh.material_ids[f_index]);  // default to 0
+      size_t bucket = std::min<size_t>(mat_id, materials.size());
 
-      if (fv == 3) {
-        for (size_t v = 0; v < 3; v++) {
-          material_triangles[mat_id].push_back(
-              shape.mesh.indices[index_offset + v]);
-        }
-      } else {
-        std::cout << "WARN: Face with unsupported vertices: " << fv
-                  << std::endl;
-      }
-      index_offset += fv;
+      bool triangle = mesh.num_face_vertices[f_index] == 3;
+      f(bucket, triangle ? &mesh.indices[index_offsets[s][f_index]] : nullptr);
     }
+  };
+
+  // 1. count
+  std::vector<size_t> block_triangles(block_count * bucket_count, 0);
+  std::atomic<size_t> skipped_faces{0};
+  std::for_each(std::execution::par, blocks.begin(), blocks.end(),
+                [&](size_t block) {
+                  size_t* counts = &block_triangles[block * bucket_count];
+                  for_each_face(block, [&](size_t bucket, const auto* face) {
+                    if (face) {
+                      ++counts[bucket];
+                    } else {
+                      ++skipped_faces;
+                    }
+                  });
+                });
+
+  if (skipped_faces > 0) {
+    std::cout << "WARN: Faces with unsupported vertices: " << skipped_faces
+              << std::endl;
   }
 
-  model.meshes.reserve(material_triangles.size());
-  for (const auto& [mat_id, indices] : material_triangles) {
-    Mesh mesh;
-    if (mat_id < model.materials.size()) {
-      mesh.material = model.materials[mat_id];
+  // 2. prefix sum over blocks
+  std::vector<size_t> bucket_triangles(bucket_count, 0);
+  for (size_t block = 0; block < block_count; ++block) {
+    for (size_t bucket = 0; bucket < bucket_count; ++bucket) {
+      size_t& count = block_triangles[block * bucket_count + bucket];
+      size_t offset = bucket_triangles[bucket];
+      bucket_triangles[bucket] += count;
+      count = offset;
     }
+  }
 
-    std::mutex mesh_mutex;
-    std::unordered_map<PackedVertex, size_t> unique_vertices;
-    mesh.indices.reserve(indices.size());
-
-    const size_t block_size = 1024;
-    const size_t blocks = (indices.size() + block_size - 1) / block_size;
-    std::vector<size_t> blocks_vec(blocks);
-    std::iota(blocks_vec.begin(), blocks_vec.end(), 0);
-
-    const auto& local_indices = indices;
-    const auto& local_attrib = attrib;
-
-    std::for_each(
-        std::execution::par, blocks_vec.begin(), blocks_vec.end(),
-        [&](size_t block) {
-          size_t start = block * block_size;
-          size_t end = std::min(start + block_size, local_indices.size());
-
-          for (size_t i = start; i < end; i++) {
-            const auto& idx = local_indices[i];
-
-            PackedVertex vertex;
-            memcpy(vertex.position.data(),
-                   &local_attrib.vertices[3 * idx.vertex_index], 12);
-            if (idx.normal_index >= 0)
-              memcpy(vertex.normal.data(),
-                     &local_attrib.normals[3 * idx.normal_index], 12);
-            if (idx.texcoord_index >= 0)
-              memcpy(vertex.texcoord.data(),
-                     &local_attrib.texcoords[2 * idx.texcoord_index], 8);
-
-            {
-              std::lock_guard<std::mutex> lock(mesh_mutex);
-
-              if (auto it = unique_vertices.find(vertex);
-                  it != unique_vertices.end()) {
-                mesh.indices.push_back(it->second);
-              } else {
-                uint32_t new_idx = mesh.vertexes.size();
-                mesh.vertexes.push_back(vertex);
-                unique_vertices[vertex] = new_idx;
-                mesh.indices.push_back(new_idx);
-              }
-            }
-          }
-        });
-
-    mesh.bvh = std::make_shared<BVHAccel>(mesh.vertexes, mesh.indices);
-
-    model.meshes.emplace_back(std::move(mesh));
+  // 3. scatter
+  std::vector<std::vector<ObjIndex>> material_triangles(bucket_count);
+  for (size_t bucket = 0; bucket < bucket_count; ++bucket) {
+    material_triangles[bucket].resize(3 * bucket_triangles[bucket]);
   }
+  std::for_each(std::execution::par, blocks.begin(), blocks.end(),
+                [&](size_t block) {
+                  size_t* offsets = &block_triangles[block * bucket_count];
+                  for_each_face(block, [&](size_t bucket, const auto* face) {
+                    if (face) {
+                      auto& triangles = material_triangles[bucket];
+                      std::transform(
+                          face, face + 3,
+                          triangles.begin() + 3 * offsets[bucket]++,
+                          [](const tinyobj::index_t& idx) {
+                            return ObjIndex{idx.vertex_index,
+                                            idx.normal_index,
+                                            idx.texcoord_index};
+                          });
+                    }
+                  });
+                });
+
+  model.materials = finish_materials(pending);
+  model.meshes = build_meshes(model.materials, attrib.vertices,
+                              attrib.normals, attrib.texcoords,
+                              material_triangles, options);
 
   return model;
 }
 
-}  // namespace rtr
\ No newline at end of file
+}  // namespace rtr
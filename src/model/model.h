@@ -1,29 +1,121 @@
 #pragma once
 
 #include <filesystem>
+#include <map>
 #include <memory>
 #include <optional>
+#include <string>
 #include <vector>
 
 #include "material.h"
 #include "mesh.h"
+#include "texture_cache.h"
+#include "texture_stream.h"
 
 namespace fs = std::filesystem;
 
 namespace rtr {
 
+/// @brief Use of the binary model cache on import
+enum class CacheMode {
+  Off,      // always import the model file
+  On,       // load a valid cache, write it after import otherwise
+  Refresh,  // import the model file and rewrite the cache
+};
+
+struct ImportOptions {
+  CacheMode cache = CacheMode::Off;
+  // streams the textures within its budget, null decodes them on import
+  std::shared_ptr<TextureStreamer> texture_streamer;
+  // storage of the textures decoded on import
+  TextureFormat texture_format = TextureFormat::RGB8;
+  VertexFormat vertex_format = VertexFormat::Full;
+  // builds the BVH of a mesh when a ray first reaches its bounds. The cache
+  // stores such meshes without BVHs, an import without it reads them again.
+  bool defer_bvh = false;
+  // construction of the mesh BVHs; a cache built with other options is
+  // imported again
+  BVHBuildOptions bvh;
+  // reorders the triangles and vertexes of each mesh to the BVH leaf order,
+  // so the vertexes a ray reads are close in memory
+  bool optimize_layout = true;
+  // levels of detail built per mesh, 0 builds none. They aren't cached, a
+  // model loaded from the cache builds them again.
+  size_t lod_levels = 0;
+  // pages the geometry of each mesh out to cluster files as soon as it's
+  // built, null keeps it in memory. Such models are neither compacted nor
+  // cached.
+  std::shared_ptr<GeometryPager> geometry_pager;
+  // moves the geometry built on import into one arena per model, freed at
+  // once with the model. Geometry mapped from the cache stays in place.
+  bool pack_geometry = true;
+  // maps the arena with huge pages, transparent ones if there are no
+  // explicit ones
+  bool huge_pages = false;
+};
+
 class Model {
  public:
   Model() {}
   ~Model() = default;
 
   [[nodiscard]] const std::vector<Mesh>& get_meshes() const { return meshes; }
+  [[nodiscard]] const std::vector<std::shared_ptr<Material>>& get_materials()
+      const {
+    return materials;
+  }
+  /// @brief Files the model was imported from: OBJ, MTL and textures
+  [[nodiscard]] const std::vector<fs::path>& get_sources() const {
+    return sources;
+  }
+  /// @brief Bytes of the decoded textures, shared ones counted once.
+  /// Streamed textures aren't counted.
+  [[nodiscard]] size_t get_texture_memory() const;
+  /// @brief Bytes of the vertexes, indices and BVHs of the meshes
+  [[nodiscard]] size_t get_geometry_memory() const;
+  /// @brief Arena of the geometry, null if none was packed
+  [[nodiscard]] const Arena* get_arena() const { return arena.get(); }
+  /// @brief MTL files among the sources, to be watched for reload
+  [[nodiscard]] std::vector<fs::path> get_material_sources() const;
 
-  [[nodiscard]] static std::optional<Model> import(const fs::path& path);
+  /// @brief Parses the MTL files again and updates the materials in place,
+  /// matched by name. Only newly referenced textures are decoded, meshes and
+  /// BVHs aren't touched. Fails if a material some mesh uses is gone, the
+  /// model must be imported again then. Must not be called while a frame is
+  /// being rendered.
+  bool reload_materials();
+
+  /// @brief Imports an OBJ file with the native parser, falls back to
+  /// tinyobjloader if it fails
+  [[nodiscard]] static std::optional<Model> import(
+      const fs::path& path, const ImportOptions& options = {});
+
+  /// @brief Cache file of a model file
+  [[nodiscard]] static fs::path cache_path(const fs::path& path);
+  /// @brief Maps a cache file and uses its data in place. Fails if the
+  /// cache is of another version or any source file has changed.
+  [[nodiscard]] static std::optional<Model> load_cache(
+      const fs::path& path, const ImportOptions& options = {});
+  bool save_cache(const fs::path& path) const;
+
+ private:
+  static std::optional<Model> import_obj(const fs::path& path,
+                                         const ImportOptions& options);
+  static std::optional<Model> import_tinyobj(const fs::path& path,
+                                             const ImportOptions& options);
+  /// @brief Moves the geometry the meshes own into the arena of the model
+  void pack_geometry(bool huge_pages);
 
  private:
   std::vector<Mesh> meshes;
   std::vector<std::shared_ptr<Material>> materials;
+  // ids of the materials by MTL name, reload_materials() matches by them
+  std::map<std::string, int> material_ids;
+  std::vector<fs::path> sources;
+  // textures decoded on import, reused by reload_materials()
+  std::shared_ptr<TextureCache> textures;
+  // owns the packed geometry, the meshes view it
+  std::shared_ptr<Arena> arena;
 };
 
 }  // namespace rtr
\ No newline at end of file
@@ -0,0 +1,540 @@
+#include "model.h"
+
+#include <algorithm>
+#include <cstring>
+#include <execution>
+#include <fstream>
+#include <iostream>
+#include <numeric>
+#include <type_traits>
+#include <unordered_map>
+
+#include "mapped_file.h"
+#include "texture_cache.h"
+
+namespace rtr {
+
+namespace {
+
+constexpr char cache_magic[8] = {'R', 'T', 'R', 'C', 'A', 'C', 'H', 'E'};
+/// @brief Bumped on any change of the layout or of the data it stores
+constexpr uint32_t cache_version = 9;
+/// @brief Alignment of every section, keeps the mapped data usable in place
+constexpr uint64_t cache_alignment = 64;
+/// @brief Bytes per task when hashing source files
+constexpr size_t hash_block_size = 1 << 24;
+
+struct CacheSection {
+  uint64_t offset = 0;
+  uint64_t size = 0;  // bytes
+};
+
+struct CacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t index_size;  // sizeof(VertexIndex) of the writer
+  CacheSection sources;
+  CacheSection textures;
+  CacheSection materials;
+  CacheSection meshes;
+};
+
+struct SourceRecord {
+  CacheSection path;
+  uint64_t size;
+  int64_t write_time;
+  uint64_t hash;
+};
+
+struct TextureRecord {
+  int32_t width;
+  int32_t height;
+  TextureFormat format;
+  uint32_t reserved;
+  CacheSection data;    // tiled pyramid, empty for streamed textures
+  CacheSection source;  // file of the texture, empty if unknown
+};
+
+struct MaterialRecord {
+  float ambient[3];
+  float diffuse[3];
+  float specular[3];
+  float transmittance[3];
+  float emission[3];
+  float ior;
+  float shininess;
+  float transparency;
+  float reflectivity;
+  int32_t diffuse_texture;  // -1 if absent
+  int32_t ambient_texture;  // -1 if absent
+  CacheSection name;        // in the MTL file, empty if unknown
+};
+
+struct MeshRecord {
+  int32_t material_id;
+  VertexFormat vertex_format;
+  float texcoord_min[2];
+  float texcoord_scale[2];
+  CacheSection vertexes;    // full format
+  CacheSection positions;   // compact format
+  CacheSection attributes;  // compact format
+  CacheSection indices;
+  CacheSection nodes;
+  CacheSection quantized_nodes;
+  float root_min[3];  // bounds the quantized nodes are relative to
+  float root_max[3];
+  CacheSection leaf_indices;
+  CacheSection split_references;
+  float spatial_split_budget;  // BVHBuildOptions the BVH was built with
+  uint32_t reserved;
+};
+
+static_assert(std::is_trivially_copyable_v<PackedVertex>);
+static_assert(sizeof(BVHNode) == 8 * sizeof(float));
+static_assert(sizeof(QuantizedBVHNode) == 16);
+
+/// @brief Content hash, blocks are hashed in parallel
+uint64_t hash_bytes(std::string_view bytes) {
+  size_t block_count = (bytes.size() + hash_block_size - 1) / hash_block_size;
+  std::vector<uint64_t> hashes(block_count);
+  std::vector<size_t> blocks(block_count);
+  std::iota(blocks.begin(), blocks.end(), 0);
+
+  std::for_each(std::execution::par, blocks.begin(), blocks.end(),
+                [&](size_t block) {
+                  auto data = bytes.substr(block * hash_block_size,
+                                           hash_block_size);
+                  uint64_t h = 0x9e3779b97f4a7c15ull ^ data.size();
+                  for (size_t i = 0; i < data.size(); i += 8) {
+                    uint64_t word = 0;
+                    memcpy(&word, data.data() + i,
+                           std::min<size_t>(8, data.size() - i));
+                    h = (h ^ word) * 0xff51afd7ed558ccdull;
+                    h ^= h >> 32;
+                  }
+                  hashes[block] = h;
+                });
+
+  uint64_t h = bytes.size();
+  for (uint64_t block_hash : hashes) {
+    h = (h ^ block_hash) * 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 29;
+  }
+  return h;
+}
+
+std::optional<SourceRecord> source_state(const fs::path& path,
+                                         bool with_hash) {
+  std::error_code ec;
+  SourceRecord record{};
+  record.size = fs::file_size(path, ec);
+  if (ec)
+    return {};
+  record.write_time = fs::last_write_time(path, ec).time_since_epoch().count();
+  if (ec)
+    return {};
+
+  if (with_hash) {
+    MappedFile file(path);
+    if (!file.is_open())
+      return {};
+    record.hash = hash_bytes(file.view());
+  }
+  return record;
+}
+
+/// @brief Appends sections to a cache file, each aligned for in-place use
+class CacheWriter {
+ public:
+  explicit CacheWriter(std::ofstream& out) : out_(out) {}
+
+  CacheSection write(const void* data, size_t size) {
+    static const char zeros[cache_alignment] = {};
+    uint64_t padding =
+        (cache_alignment - position_ % cache_alignment) % cache_alignment;
+    out_.write(zeros, padding);
+    out_.write(static_cast<const char*>(data), size);
+
+    CacheSection section{position_ + padding, size};
+    position_ += padding + size;
+    return section;
+  }
+
+  template <typename T>
+  CacheSection write(std::span<const T> data) {
+    return write(data.data(), data.size_bytes());
+  }
+
+ private:
+  std::ofstream& out_;
+  uint64_t position_ = 0;
+};
+
+/// @brief Views sections of a mapped cache file, any section out of the
+/// file bounds marks the cache invalid
+class CacheReader {
+ public:
+  explicit CacheReader(std::shared_ptr<const MappedFile> file)
+      : file_(std::move(file)) {}
+
+  [[nodiscard]] bool is_valid() const { return valid_; }
+  void invalidate() { valid_ = false; }
+
+  template <typename T>
+  std::span<const T> view(const CacheSection& section) {
+    if (section.offset % alignof(T) != 0 || section.size % sizeof(T) != 0 ||
+        section.offset > file_->size() ||
+        section.size > file_->size() - section.offset) {
+      valid_ = false;
+      return {};
+    }
+    return {reinterpret_cast<const T*>(file_->data() + section.offset),
+            section.size / sizeof(T)};
+  }
+
+  template <typename T>
+  Buffer<T> buffer(const CacheSection& section) {
+    return Buffer<T>(view<T>(section), file_);
+  }
+
+ private:
+  std::shared_ptr<const MappedFile> file_;
+  bool valid_ = true;
+};
+
+Eigen::Vector3f to_vector(const float* v) {
+  return {v[0], v[1], v[2]};
+}
+
+void from_vector(const Eigen::Vector3f& v, float* out) {
+  std::copy(v.data(), v.data() + 3, out);
+}
+
+}  // namespace
+
+fs::path Model::cache_path(const fs::path& path) {
+  fs::path result = path;
+  result += ".rtrcache";
+  return result;
+}
+
+bool Model::save_cache(const fs::path& path) const {
+  std::vector<SourceRecord> source_records;
+  for (const auto& source : sources) {
+    auto record = source_state(source, true);
+    if (!record)
+      return false;
+    source_records.push_back(*record);
+  }
+
+  fs::path temp_path = path;
+  temp_path += ".tmp";
+  std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+  if (!out)
+    return false;
+
+  CacheWriter writer(out);
+
+  CacheHeader header{};
+  std::copy(std::begin(cache_magic), std::end(cache_magic), header.magic);
+  header.version = cache_version;
+  header.index_size = sizeof(VertexIndex);
+  writer.write(&header, sizeof(header));
+
+  // Sources
+  for (size_t i = 0; i < sources.size(); ++i) {
+    std::string source_path = fs::absolute(sources[i]).string();
+    source_records[i].path =
+        writer.write(source_path.data(), source_path.size());
+  }
+
+  // Textures, shared ones are stored once. Their files let a loaded model
+  // reuse them when the materials are reloaded.
+  std::unordered_map<const Image*, std::string> texture_paths;
+  if (textures) {
+    for (const auto& [path, image] : textures->get_textures()) {
+      texture_paths.emplace(image.get(),
+                            fs::absolute(path).lexically_normal().string());
+    }
+  }
+  std::vector<TextureRecord> texture_records;
+  std::unordered_map<const Image*, int32_t> texture_ids;
+  auto add_texture = [&](const std::shared_ptr<Image>& texture) -> int32_t {
+    if (!texture)
+      return -1;
+    auto [it, inserted] = texture_ids.emplace(
+        texture.get(), static_cast<int32_t>(texture_records.size()));
+    if (inserted && texture->stream) {
+      // streamed textures stay streamed, the file is opened again on load
+      std::string source = fs::absolute(texture->stream->get_source()).string();
+      texture_records.push_back({texture->width, texture->height,
+                                 texture->format, 0, {},
+                                 writer.write(source.data(), source.size())});
+    } else if (inserted) {
+      auto path = texture_paths.find(texture.get());
+      std::string source =
+          path != texture_paths.end() ? path->second : std::string();
+      texture_records.push_back({texture->width, texture->height,
+                                 texture->format, 0,
+                                 writer.write(texture->data.span()),
+                                 writer.write(source.data(), source.size())});
+    }
+    return it->second;
+  };
+
+  // Materials
+  std::vector<std::string> material_names(materials.size());
+  for (const auto& [name, id] : material_ids) {
+    if (size_t(id) < material_names.size()) {
+      material_names[id] = name;
+    }
+  }
+  std::vector<MaterialRecord> material_records;
+  for (size_t i = 0; i < materials.size(); ++i) {
+    const auto& material = materials[i];
+    MaterialRecord record{};
+    from_vector(material->ambient, record.ambient);
+    from_vector(material->diffuse, record.diffuse);
+    from_vector(material->specular, record.specular);
+    from_vector(material->transmittance, record.transmittance);
+    from_vector(material->emission, record.emission);
+    record.ior = material->ior;
+    record.shininess = material->shininess;
+    record.transparency = material->transparency;
+    record.reflectivity = material->reflectivity;
+    record.diffuse_texture = add_texture(material->diffuse_texture);
+    record.ambient_texture = add_texture(material->ambient_texture);
+    record.name =
+        writer.write(material_names[i].data(), material_names[i].size());
+    material_records.push_back(record);
+  }
+
+  // Meshes
+  std::vector<MeshRecord> mesh_records;
+  for (const auto& mesh : meshes) {
+    MeshRecord record{};
+    record.material_id = mesh.material_id;
+    record.vertex_format = mesh.vertex_format;
+    std::copy_n(mesh.texcoord_min.begin(), 2, record.texcoord_min);
+    std::copy_n(mesh.texcoord_scale.begin(), 2, record.texcoord_scale);
+    record.vertexes = writer.write(mesh.vertexes.span());
+    record.positions = writer.write(mesh.positions.span());
+    record.attributes = writer.write(mesh.attributes.span());
+    record.indices = writer.write(mesh.indices.span());
+    // a deferred BVH that isn't built yet stays deferred, the mesh is
+    // stored without it
+    if (const auto* bvh = mesh.get_built_bvh()) {
+      record.nodes = writer.write(bvh->get_nodes().span());
+      record.quantized_nodes = writer.write(bvh->get_quantized_nodes().span());
+      from_vector(bvh->get_root_bbox().min, record.root_min);
+      from_vector(bvh->get_root_bbox().max, record.root_max);
+      record.leaf_indices = writer.write(bvh->get_leaf_indices().span());
+      record.split_references =
+          writer.write(bvh->get_split_references().span());
+      record.spatial_split_budget = bvh->get_options().spatial_split_budget;
+    } else if (mesh.deferred_bvh) {
+      record.spatial_split_budget =
+          mesh.deferred_bvh->get_options().spatial_split_budget;
+    }
+    mesh_records.push_back(record);
+  }
+
+  header.sources = writer.write(std::span<const SourceRecord>(source_records));
+  header.textures =
+      writer.write(std::span<const TextureRecord>(texture_records));
+  header.materials =
+      writer.write(std::span<const MaterialRecord>(material_records));
+  header.meshes = writer.write(std::span<const MeshRecord>(mesh_records));
+
+  out.seekp(0);
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  out.close();
+
+  std::error_code ec;
+  if (out) {
+    fs::rename(temp_path, path, ec);
+  }
+  if (!out || ec) {
+    fs::remove(temp_path, ec);
+    return false;
+  }
+  return true;
+}
+
+std::optional<Model> Model::load_cache(const fs::path& path,
+                                       const ImportOptions& options) {
+  auto file = std::make_shared<MappedFile>(path);
+  if (!file->is_open() || file->size() < sizeof(CacheHeader))
+    return {};
+
+  CacheHeader header;
+  memcpy(&header, file->data(), sizeof(header));
+  if (!std::equal(std::begin(cache_magic), std::end(cache_magic),
+                  header.magic) ||
+      header.version != cache_version ||
+      header.index_size != sizeof(VertexIndex))
+    return {};
+
+  CacheReader reader(file);
+  auto source_records = reader.view<SourceRecord>(header.sources);
+  auto texture_records = reader.view<TextureRecord>(header.textures);
+  auto material_records = reader.view<MaterialRecord>(header.materials);
+  auto mesh_records = reader.view<MeshRecord>(header.meshes);
+  if (!reader.is_valid()) {
+    std::cout << "WARN: Corrupted cache " << path.string() << std::endl;
+    return {};
+  }
+
+  Model model;
+
+  // A source with the same size and write time is unchanged, otherwise its
+  // content is compared
+  for (const auto& record : source_records) {
+    auto chars = reader.view<char>(record.path);
+    if (!reader.is_valid())
+      break;
+    fs::path source(std::string(chars.begin(), chars.end()));
+
+    auto state = source_state(source, false);
+    if (!state || state->size != record.size)
+      return {};
+    if (state->write_time != record.write_time) {
+      state = source_state(source, true);
+      if (!state || state->hash != record.hash)
+        return {};
+    }
+    model.sources.push_back(source);
+  }
+
+  // Stored pyramids are used in place even with a streamer: the mapping is
+  // paged in on demand already
+  model.textures = std::make_shared<TextureCache>(options.texture_streamer,
+                                                  options.texture_format);
+  std::vector<std::shared_ptr<Image>> textures;
+  for (const auto& record : texture_records) {
+    auto chars = reader.view<char>(record.source);
+    if (!reader.is_valid())
+      break;
+    std::string source(chars.begin(), chars.end());
+    if (record.data.size == 0) {
+      textures.push_back(model.textures->load({}, source).get());
+      continue;
+    }
+
+    // textures stored in another format are imported again
+    if (record.format != options.texture_format)
+      return {};
+
+    auto data = reader.buffer<unsigned char>(record.data);
+    if (data.size() !=
+        Image::storage_size(record.width, record.height, record.format)) {
+      reader.invalidate();
+      break;
+    }
+    auto image = std::make_shared<Image>(record.width, record.height,
+                                         std::move(data), record.format);
+    // a reload of the materials finds the texture by its file
+    if (!source.empty()) {
+      model.textures->insert(source, image);
+    }
+    textures.push_back(std::move(image));
+  }
+
+  auto texture = [&](int32_t id) -> std::shared_ptr<Image> {
+    if (id < 0 || size_t(id) >= textures.size())
+      return nullptr;
+    return textures[id];
+  };
+  for (const auto& record : material_records) {
+    auto material = std::make_shared<Material>(Material{
+        to_vector(record.ambient),
+        to_vector(record.diffuse),
+        to_vector(record.specular),
+        to_vector(record.transmittance),
+        to_vector(record.emission),
+        record.ior,
+        record.shininess,
+        record.transparency,
+        record.reflectivity,
+    });
+    material->diffuse_texture = texture(record.diffuse_texture);
+    material->ambient_texture = texture(record.ambient_texture);
+    auto name = reader.view<char>(record.name);
+    if (!name.empty()) {
+      model.material_ids.emplace(std::string(name.begin(), name.end()),
+                                 int(model.materials.size()));
+    }
+    model.materials.push_back(material);
+  }
+
+  for (const auto& record : mesh_records) {
+    // meshes stored in another format are imported again
+    if (record.vertex_format != options.vertex_format)
+      return {};
+    if (record.spatial_split_budget != options.bvh.spatial_split_budget)
+      return {};
+
+    Mesh& mesh = model.meshes.emplace_back();
+    mesh.material_id = record.material_id;
+    if (record.material_id >= 0 &&
+        size_t(record.material_id) < model.materials.size()) {
+      mesh.material = model.materials[record.material_id];
+    }
+    mesh.vertex_format = record.vertex_format;
+    std::copy_n(record.texcoord_min, 2, mesh.texcoord_min.begin());
+    std::copy_n(record.texcoord_scale, 2, mesh.texcoord_scale.begin());
+    mesh.vertexes = reader.buffer<PackedVertex>(record.vertexes);
+    mesh.positions = reader.buffer<std::array<float, 3>>(record.positions);
+    mesh.attributes = reader.buffer<CompactAttributes>(record.attributes);
+    mesh.indices = reader.buffer<VertexIndex>(record.indices);
+    if (mesh.positions.size() != mesh.attributes.size()) {
+      reader.invalidate();
+    }
+
+    auto nodes = reader.buffer<BVHNode>(record.nodes);
+    auto quantized_nodes =
+        reader.buffer<QuantizedBVHNode>(record.quantized_nodes);
+    auto leaf_indices = reader.buffer<VertexIndex>(record.leaf_indices);
+    auto split_references = reader.buffer<uint8_t>(record.split_references);
+    BVHBuildOptions bvh_options{record.spatial_split_budget};
+    if (!nodes.empty()) {
+      mesh.bvh = std::make_shared<BVHAccel>(
+          std::move(nodes), std::move(leaf_indices),
+          std::move(split_references), bvh_options);
+    } else if (!quantized_nodes.empty()) {
+      mesh.bvh = std::make_shared<BVHAccel>(
+          std::move(quantized_nodes),
+          AABB(to_vector(record.root_min), to_vector(record.root_max)),
+          std::move(leaf_indices), std::move(split_references), bvh_options);
+    } else if (!mesh.indices.empty()) {
+      // stored without a BVH, an import without deferral builds them all
+      if (!options.defer_bvh)
+        return {};
+      mesh.bbox = mesh.compute_bbox();
+      mesh.deferred_bvh = std::make_shared<DeferredBVH>(bvh_options);
+    }
+
+    // sizes alone don't catch corrupted content with valid framing: every
+    // index traversal may follow is checked, O(n)
+    size_t vertex_count = mesh.vertex_count();
+    bool consistent =
+        mesh.indices.size() % 3 == 0 &&
+        std::all_of(mesh.indices.begin(), mesh.indices.end(),
+                    [vertex_count](VertexIndex index) {
+                      return index < vertex_count;
+                    }) &&
+        (!mesh.bvh || mesh.bvh->is_consistent(vertex_count));
+    if (!consistent) {
+      reader.invalidate();
+      break;
+    }
+  }
+
+  if (!reader.is_valid()) {
+    std::cout << "WARN: Corrupted cache " << path.string() << std::endl;
+    return {};
+  }
+  return model;
+}
+
+}  // namespace rtr
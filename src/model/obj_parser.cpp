@@ -0,0 +1,336 @@
+#include "obj_parser.h"
+
+#include <algorithm>
+#include <charconv>
+#include <execution>
+#include <future>
+#include <iostream>
+#include <limits>
+#include <numeric>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+
+#include "mapped_file.h"
+
+namespace rtr {
+
+namespace {
+
+/// @brief Smallest part of the file parsed by one task
+constexpr size_t min_chunk_size = 1 << 20;
+
+struct AttributeCounts {
+  size_t vertices = 0;
+  size_t normals = 0;
+  size_t texcoords = 0;
+};
+
+struct Chunk {
+  std::string_view text;
+
+  // first pass
+  AttributeCounts counts;
+  std::vector<std::string_view> usemtl;
+  std::vector<std::string_view> mtllibs;
+
+  // second pass
+  AttributeCounts base;  // attributes defined before the chunk
+  uint32_t group = 0;    // group active at the chunk start
+  std::vector<std::vector<ObjIndex>> groups;
+  size_t triangulated_faces = 0;
+  size_t skipped_faces = 0;
+  std::string error;
+};
+
+bool is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+std::string_view trim(std::string_view s) {
+  while (!s.empty() && is_space(s.front()))
+    s.remove_prefix(1);
+  while (!s.empty() && is_space(s.back()))
+    s.remove_suffix(1);
+  return s;
+}
+
+/// @brief Cuts the next whitespace separated token from the front of s
+std::string_view next_token(std::string_view& s) {
+  s = trim(s);
+  size_t end = 0;
+  while (end < s.size() && !is_space(s[end]))
+    ++end;
+  std::string_view token = s.substr(0, end);
+  s.remove_prefix(end);
+  return token;
+}
+
+template <typename F>
+void for_each_line(std::string_view text, F&& f) {
+  while (!text.empty()) {
+    size_t end = text.find('\n');
+    if (end == std::string_view::npos)
+      end = text.size();
+    std::string_view line = text.substr(0, end);
+    text.remove_prefix(std::min(end + 1, text.size()));
+
+    std::string_view keyword = next_token(line);
+    if (!keyword.empty() && keyword.front() != '#')
+      f(keyword, trim(line));
+  }
+}
+
+std::vector<Chunk> split_chunks(std::string_view text) {
+  size_t threads = std::max(1u, std::thread::hardware_concurrency());
+  size_t chunk_size = std::max(min_chunk_size, text.size() / (4 * threads));
+
+  std::vector<Chunk> chunks;
+  size_t begin = 0;
+  while (begin < text.size()) {
+    size_t end = std::min(begin + chunk_size, text.size());
+    end = text.find('\n', end);
+    end = end == std::string_view::npos ? text.size() : end + 1;
+    chunks.push_back({.text = text.substr(begin, end - begin)});
+    begin = end;
+  }
+  return chunks;
+}
+
+bool parse_floats(std::string_view s, float* values, size_t required,
+                  size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    std::string_view token = next_token(s);
+    if (token.empty()) {
+      if (i < required)
+        return false;
+      values[i] = 0.0f;
+      continue;
+    }
+    if (token.front() == '+')
+      token.remove_prefix(1);
+    auto [ptr, ec] =
+        std::from_chars(token.data(), token.data() + token.size(), values[i]);
+    if (ec != std::errc() || ptr != token.data() + token.size())
+      return false;
+  }
+  return true;
+}
+
+/// @brief Resolves a one-based or negative relative OBJ index
+bool resolve_index(std::string_view token, size_t defined, size_t total,
+                   int32_t& index) {
+  int64_t value = 0;
+  auto [ptr, ec] =
+      std::from_chars(token.data(), token.data() + token.size(), value);
+  if (ec != std::errc() || ptr != token.data() + token.size() || value == 0)
+    return false;
+
+  int64_t resolved = value > 0 ? value - 1 : int64_t(defined) + value;
+  if (resolved < 0 || resolved >= int64_t(total))
+    return false;
+
+  index = static_cast<int32_t>(resolved);
+  return true;
+}
+
+/// @brief Parses v, v/vt, v//vn or v/vt/vn
+bool parse_corner(std::string_view token, const AttributeCounts& defined,
+                  const AttributeCounts& total, ObjIndex& corner) {
+  corner = {};
+
+  size_t first = token.find('/');
+  if (!resolve_index(token.substr(0, first), defined.vertices, total.vertices,
+                     corner.vertex_index))
+    return false;
+  if (first == std::string_view::npos)
+    return true;
+
+  token.remove_prefix(first + 1);
+  size_t second = token.find('/');
+  std::string_view texcoord = token.substr(0, second);
+  if (!texcoord.empty() &&
+      !resolve_index(texcoord, defined.texcoords, total.texcoords,
+                     corner.texcoord_index))
+    return false;
+  if (second == std::string_view::npos)
+    return true;
+
+  std::string_view normal = token.substr(second + 1);
+  return normal.empty() || resolve_index(normal, defined.normals,
+                                         total.normals, corner.normal_index);
+}
+
+void count_chunk(Chunk& chunk) {
+  for_each_line(chunk.text, [&](std::string_view keyword,
+                                std::string_view rest) {
+    if (keyword == "v") {
+      ++chunk.counts.vertices;
+    } else if (keyword == "vn") {
+      ++chunk.counts.normals;
+    } else if (keyword == "vt") {
+      ++chunk.counts.texcoords;
+    } else if (keyword == "usemtl") {
+      chunk.usemtl.push_back(rest);
+    } else if (keyword == "mtllib") {
+      for (auto name = next_token(rest); !name.empty();
+           name = next_token(rest)) {
+        chunk.mtllibs.push_back(name);
+      }
+    }
+  });
+}
+
+void parse_chunk(
+    Chunk& chunk, ObjData& data, const AttributeCounts& total,
+    const std::unordered_map<std::string_view, uint32_t>& group_ids) {
+  AttributeCounts defined = chunk.base;
+  uint32_t group = chunk.group;
+  std::vector<ObjIndex> polygon;
+  chunk.groups.resize(group_ids.size() + 1);
+
+  auto fail = [&chunk](std::string_view keyword, std::string_view rest) {
+    chunk.error = "Invalid line: ";
+    chunk.error.append(keyword).append(" ").append(rest);
+  };
+
+  for_each_line(chunk.text, [&](std::string_view keyword,
+                                std::string_view rest) {
+    if (!chunk.error.empty())
+      return;
+
+    if (keyword == "v") {
+      if (!parse_floats(rest, &data.vertices[3 * defined.vertices++], 3, 3))
+        fail(keyword, rest);
+    } else if (keyword == "vn") {
+      if (!parse_floats(rest, &data.normals[3 * defined.normals++], 3, 3))
+        fail(keyword, rest);
+    } else if (keyword == "vt") {
+      if (!parse_floats(rest, &data.texcoords[2 * defined.texcoords++], 1, 2))
+        fail(keyword, rest);
+    } else if (keyword == "usemtl") {
+      group = group_ids.at(rest);
+    } else if (keyword == "f") {
+      polygon.clear();
+      for (auto token = next_token(rest); !token.empty();
+           token = next_token(rest)) {
+        if (!parse_corner(token, defined, total, polygon.emplace_back())) {
+          fail(keyword, token);
+          return;
+        }
+      }
+
+      if (polygon.size() < 3) {
+        ++chunk.skipped_faces;
+        return;
+      }
+      if (polygon.size() > 3)
+        ++chunk.triangulated_faces;
+
+      auto& triangles = chunk.groups[group];
+      for (size_t i = 1; i + 1 < polygon.size(); ++i) {
+        triangles.push_back(polygon[0]);
+        triangles.push_back(polygon[i]);
+        triangles.push_back(polygon[i + 1]);
+      }
+    }
+  });
+}
+
+}  // namespace
+
+std::optional<ObjData> parse_obj(
+    const fs::path& path,
+    const std::function<void(const std::vector<std::string>&)>& on_mtllibs) {
+  MappedFile file(path);
+  if (!file.is_open()) {
+    std::cerr << "ERR: Failed to open " << path.string() << std::endl;
+    return {};
+  }
+
+  std::vector<Chunk> chunks = split_chunks(file.view());
+
+  // 1. count attributes, collect material names
+  std::for_each(std::execution::par, chunks.begin(), chunks.end(),
+                count_chunk);
+
+  ObjData data;
+  AttributeCounts total;
+  std::unordered_map<std::string_view, uint32_t> group_ids;
+  uint32_t group = std::numeric_limits<uint32_t>::max();  // no usemtl yet
+  for (auto& chunk : chunks) {
+    chunk.base = total;
+    chunk.group = group;
+    total.vertices += chunk.counts.vertices;
+    total.normals += chunk.counts.normals;
+    total.texcoords += chunk.counts.texcoords;
+
+    for (auto name : chunk.usemtl) {
+      auto [it, inserted] =
+          group_ids.emplace(name, static_cast<uint32_t>(group_ids.size()));
+      if (inserted)
+        data.materials.emplace_back(name);
+      group = it->second;
+    }
+    for (auto name : chunk.mtllibs) {
+      if (std::find(data.mtllibs.begin(), data.mtllibs.end(), name) ==
+          data.mtllibs.end())
+        data.mtllibs.emplace_back(name);
+    }
+  }
+  for (auto& chunk : chunks) {
+    chunk.group = std::min<uint32_t>(chunk.group, group_ids.size());
+  }
+
+  std::future<void> mtllibs_done;
+  if (on_mtllibs) {
+    mtllibs_done = std::async(std::launch::async, on_mtllibs,
+                              std::cref(data.mtllibs));
+  }
+
+  // 2. parse into place
+  data.vertices.resize(3 * total.vertices);
+  data.normals.resize(3 * total.normals);
+  data.texcoords.resize(2 * total.texcoords);
+  std::for_each(std::execution::par, chunks.begin(), chunks.end(),
+                [&](Chunk& chunk) {
+                  parse_chunk(chunk, data, total, group_ids);
+                });
+
+  if (mtllibs_done.valid()) {
+    mtllibs_done.get();
+  }
+
+  for (const auto& chunk : chunks) {
+    if (!chunk.error.empty()) {
+      std::cerr << "ERR: " << path.string() << ": " << chunk.error
+                << std::endl;
+      return {};
+    }
+    data.triangulated_faces += chunk.triangulated_faces;
+    data.skipped_faces += chunk.skipped_faces;
+  }
+
+  // 3. concatenate the groups of all chunks in file order
+  data.groups.resize(group_ids.size() + 1);
+  std::vector<size_t> group_indices(data.groups.size());
+  std::iota(group_indices.begin(), group_indices.end(), 0);
+  std::for_each(std::execution::par, group_indices.begin(),
+                group_indices.end(), [&](size_t g) {
+                  size_t size = 0;
+                  for (const auto& chunk : chunks)
+                    size += chunk.groups[g].size();
+
+                  auto& triangles = data.groups[g];
+                  triangles.reserve(size);
+                  for (auto& chunk : chunks) {
+                    triangles.insert(triangles.end(), chunk.groups[g].begin(),
+                                     chunk.groups[g].end());
+                    chunk.groups[g] = {};
+                  }
+                });
+
+  return data;
+}
+
+}  // namespace rtr
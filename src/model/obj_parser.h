@@ -0,0 +1,51 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+namespace rtr {
+
+/// @brief Zero-based attribute indices of a face corner, -1 if absent
+struct ObjIndex {
+  int32_t vertex_index = -1;
+  int32_t normal_index = -1;
+  int32_t texcoord_index = -1;
+};
+
+/// @brief Geometry of an OBJ file with triangles grouped by usemtl name
+struct ObjData {
+  std::vector<float> vertices;   // xyz
+  std::vector<float> normals;    // xyz
+  std::vector<float> texcoords;  // uv
+
+  std::vector<std::string> mtllibs;
+  // usemtl names in order of first use
+  std::vector<std::string> materials;
+  // triangle corners of each usemtl name in file order, the last group holds
+  // faces defined before any usemtl
+  std::vector<std::vector<ObjIndex>> groups;
+
+  size_t triangulated_faces = 0;  // polygons split into triangle fans
+  size_t skipped_faces = 0;       // faces with less than three corners
+};
+
+/// @brief Parses an OBJ file mapped into memory
+///
+/// The file is split into chunks at line boundaries. A first parallel pass
+/// counts the attributes of every chunk, a second one parses them straight
+/// into their final place. Polygons are triangulated as fans.
+///
+/// on_mtllibs is called with the material libraries after the first pass
+/// and runs concurrently with the second one.
+[[nodiscard]] std::optional<ObjData> parse_obj(
+    const fs::path& path,
+    const std::function<void(const std::vector<std::string>&)>& on_mtllibs =
+        {});
+
+}  // namespace rtr
@@ -0,0 +1,96 @@
+#include "residency.h"
+
+namespace rtr {
+
+void Residency::attach(const Counters& counters) {
+  std::lock_guard lock(mutex_);
+  counters_.push_back(&counters);
+}
+
+void Residency::detach(const Counters& counters) {
+  std::lock_guard lock(mutex_);
+  std::erase(counters_, &counters);
+  retired_hits_ += counters.hits.load();
+  retired_misses_ += counters.misses.load();
+}
+
+void Residency::remove(Entry& entry) {
+  std::lock_guard lock(mutex_);
+  unlink(entry);
+}
+
+ResidencyStats Residency::get_stats() const {
+  std::lock_guard lock(mutex_);
+
+  ResidencyStats stats;
+  stats.hits = retired_hits_;
+  stats.misses = retired_misses_;
+  for (const Counters* counters : counters_) {
+    stats.hits += counters->hits.load(std::memory_order_relaxed);
+    stats.misses += counters->misses.load(std::memory_order_relaxed);
+  }
+  stats.evictions = evictions_;
+  stats.resident_bytes = resident_bytes_;
+  stats.budget = budget_;
+  return stats;
+}
+
+void Residency::link(Entry& entry, size_t bytes) {
+  resident_bytes_ = resident_bytes_ - entry.bytes_ + bytes;
+  entry.bytes_ = bytes;
+  if (entry.next_) {
+    entry.touch();
+    return;
+  }
+
+  // behind the hand, so the sweep reaches it last
+  entry.referenced_.store(false, std::memory_order_relaxed);
+  if (!hand_) {
+    entry.prev_ = entry.next_ = &entry;
+    hand_ = &entry;
+    return;
+  }
+  entry.next_ = hand_;
+  entry.prev_ = hand_->prev_;
+  hand_->prev_->next_ = &entry;
+  hand_->prev_ = &entry;
+}
+
+void Residency::unlink(Entry& entry) {
+  if (!entry.next_)
+    return;
+
+  if (entry.next_ == &entry) {
+    hand_ = nullptr;
+  } else {
+    entry.prev_->next_ = entry.next_;
+    entry.next_->prev_ = entry.prev_;
+    if (hand_ == &entry) {
+      hand_ = entry.next_;
+    }
+  }
+  entry.prev_ = entry.next_ = nullptr;
+  resident_bytes_ -= entry.bytes_;
+  entry.bytes_ = 0;
+}
+
+void Residency::evict_over_budget(const Entry& kept) {
+  while (resident_bytes_ > budget_) {
+    Entry* entry = hand_;
+    hand_ = entry->next_;
+    if (entry == &kept) {
+      if (hand_ == entry)
+        break;
+      continue;
+    }
+    // used since the last sweep, passed over once
+    if (entry->referenced_.exchange(false, std::memory_order_relaxed))
+      continue;
+
+    unlink(*entry);
+    entry->evict();
+    ++evictions_;
+  }
+}
+
+}  // namespace rtr
@@ -0,0 +1,157 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+namespace rtr {
+
+struct ResidencyStats {
+  uint64_t hits = 0;
+  uint64_t misses = 0;     // loads of entries that weren't resident
+  uint64_t evictions = 0;  // entries dropped to stay within the budget
+  size_t resident_bytes = 0;
+  size_t budget = 0;
+};
+
+/// @brief Keeps loaded entries within a memory budget, the ones unused for
+/// longest are evicted
+///
+/// Resident entries form a ring swept by a clock hand: a load inserts its
+/// entry behind the hand and a hit only sets the entry's reference bit, so
+/// hits take no locks. The hand clears the bits it passes and evicts the
+/// first entry without one, in amortized constant time per eviction.
+class Residency {
+ public:
+  /// @brief Data that is dropped to stay within the budget and loaded again
+  /// by its owner
+  class Entry {
+   public:
+    virtual ~Entry() = default;
+
+    /// @brief Marks the entry as used, doesn't take locks
+    void touch() {
+      if (!referenced_.load(std::memory_order_relaxed))
+        referenced_.store(true, std::memory_order_relaxed);
+    }
+
+   protected:
+    /// @brief Drops the resident data, runs under the residency lock
+    virtual void evict() = 0;
+
+   private:
+    friend class Residency;
+
+    // neighbours in the ring, null while not resident
+    Entry* prev_ = nullptr;
+    Entry* next_ = nullptr;
+    size_t bytes_ = 0;
+    std::atomic<bool> referenced_{false};
+  };
+
+  /// @brief Entry whose data hits read without locks
+  ///
+  /// Concurrent misses of the slot load its data once. An eviction only
+  /// drops the slot's reference, readers still holding the data keep it
+  /// alive until they finish.
+  template <typename T>
+  class Slot final : public Entry {
+   private:
+    friend class Residency;
+
+    void evict() override { data_.store(nullptr, std::memory_order_release); }
+
+    std::atomic<std::shared_ptr<T>> data_;
+    std::mutex load_mutex_;  // one load of the data at a time
+  };
+
+  /// @brief Hits and misses of one owner of entries
+  struct Counters {
+    std::atomic<uint64_t> hits{0};
+    std::atomic<uint64_t> misses{0};
+  };
+
+  /// @brief budget: bytes of resident entries, the last loaded entry is
+  /// kept even if it alone exceeds the budget
+  explicit Residency(size_t budget) : budget_(budget) {}
+
+  Residency(const Residency&) = delete;
+  Residency& operator=(const Residency&) = delete;
+
+  /// @brief Adds the counters to get_stats() until they are detached
+  void attach(const Counters& counters);
+  void detach(const Counters& counters);
+
+  /// @brief Resident data of the slot or null, never loads
+  template <typename T>
+  static std::shared_ptr<T> find(Slot<T>& slot, Counters& counters) {
+    auto data = slot.data_.load(std::memory_order_acquire);
+    if (data) {
+      counters.hits.fetch_add(1, std::memory_order_relaxed);
+      slot.touch();
+    }
+    return data;
+  }
+
+  /// @brief Resident data of the slot that usable(data) accepts, loaded
+  /// otherwise: load() returns the data and its bytes. Others are evicted
+  /// until the budget holds.
+  template <typename T, typename Load, typename Usable>
+  std::shared_ptr<T> acquire(Slot<T>& slot, Counters& counters, Load&& load,
+                             Usable&& usable) {
+    auto data = slot.data_.load(std::memory_order_acquire);
+    if (!data || !usable(*data)) {
+      std::lock_guard load_lock(slot.load_mutex_);
+      data = slot.data_.load(std::memory_order_acquire);
+      if (!data || !usable(*data)) {
+        counters.misses.fetch_add(1, std::memory_order_relaxed);
+        size_t bytes;
+        std::tie(data, bytes) = load();
+
+        std::lock_guard lock(mutex_);
+        slot.data_.store(data, std::memory_order_release);
+        link(slot, bytes);
+        evict_over_budget(slot);
+        return data;
+      }
+    }
+
+    counters.hits.fetch_add(1, std::memory_order_relaxed);
+    slot.touch();
+    return data;
+  }
+  template <typename T, typename Load>
+  std::shared_ptr<T> acquire(Slot<T>& slot, Counters& counters, Load&& load) {
+    return acquire(slot, counters, std::forward<Load>(load),
+                   [](const T&) { return true; });
+  }
+
+  /// @brief Forgets the entry, owners call it before destroying the entry
+  void remove(Entry& entry);
+
+  [[nodiscard]] ResidencyStats get_stats() const;
+
+ private:
+  void link(Entry& entry, size_t bytes);
+  void unlink(Entry& entry);
+  void evict_over_budget(const Entry& kept);
+
+ private:
+  const size_t budget_;
+  // guards the ring and the counters list, taken on loads only
+  mutable std::mutex mutex_;
+  Entry* hand_ = nullptr;
+  size_t resident_bytes_ = 0;
+  uint64_t evictions_ = 0;
+  std::vector<const Counters*> counters_;
+  // counts of detached owners
+  uint64_t retired_hits_ = 0;
+  uint64_t retired_misses_ = 0;
+};
+
+}  // namespace rtr
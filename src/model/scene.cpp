@@ -0,0 +1,256 @@
+#include "scene.h"
+
+#include <Eigen/SVD>
+#include <algorithm>
+
+namespace rtr {
+
+constexpr uint32_t max_instances_in_leaf = 2;
+// growth of the SAH cost of a refitted hierarchy that triggers a rebuild
+constexpr float rebuild_threshold = 0.5f;
+
+namespace {
+
+AABB model_bbox(const Model& model) {
+  AABB bbox;
+  for (const auto& mesh : model.get_meshes()) {
+    bbox.expand(mesh.get_bbox());
+  }
+  return bbox;
+}
+
+float max_scale(const Eigen::Affine3f& transform) {
+  Eigen::JacobiSVD<Eigen::Matrix3f> svd(transform.linear());
+  return svd.singularValues()(0);
+}
+
+/// @brief World bounds of the transformed corners of the box
+AABB transform_bbox(const AABB& bbox, const Eigen::Affine3f& transform) {
+  if (bbox.empty())
+    return bbox;
+
+  AABB result;
+  for (int corner = 0; corner < 8; ++corner) {
+    Eigen::Vector3f point((corner & 1) ? bbox.max.x() : bbox.min.x(),
+                          (corner & 2) ? bbox.max.y() : bbox.min.y(),
+                          (corner & 4) ? bbox.max.z() : bbox.min.z());
+    point = transform * point;
+    result.expand(AABB(point, point));
+  }
+  return result;
+}
+
+}  // namespace
+
+Scene::Scene(std::shared_ptr<const Model> model) {
+  add_instance(std::move(model));
+  build();
+}
+
+uint32_t Scene::add_instance(std::shared_ptr<const Model> model,
+                             const Eigen::Affine3f& transform) {
+  auto it = std::find(models_.begin(), models_.end(), model);
+  uint32_t model_index = static_cast<uint32_t>(it - models_.begin());
+  if (it == models_.end()) {
+    material_offsets_.push_back(static_cast<uint32_t>(materials_.size()));
+    materials_.insert(materials_.end(), model->get_materials().begin(),
+                      model->get_materials().end());
+    model_bboxes_.push_back(model_bbox(*model));
+    models_.push_back(std::move(model));
+  }
+
+  Instance instance;
+  instance.model = model_index;
+  instance.transform = transform;
+  instance.inverse = transform.inverse();
+  instance.scale = max_scale(transform);
+  instance.identity = transform.matrix().isIdentity(0.0f);
+  set_instance_bbox(instance);
+  instances_.push_back(instance);
+  rebuild_needed_ = true;
+  return static_cast<uint32_t>(instances_.size() - 1);
+}
+
+void Scene::remove_instance(uint32_t id) {
+  Instance& instance = instances_[id];
+  if (instance.removed)
+    return;
+  instance.removed = true;
+  instance.bbox.clear();
+  rebuild_needed_ = true;
+
+  uint32_t model = instance.model;
+  bool used = std::any_of(
+      instances_.begin(), instances_.end(), [model](const Instance& other) {
+        return !other.removed && other.model == model;
+      });
+  if (!used) {
+    // the slot stays so the material ids of other models are kept
+    uint32_t begin = material_offsets_[model];
+    std::fill_n(materials_.begin() + begin,
+                models_[model]->get_materials().size(), nullptr);
+    models_[model].reset();
+  }
+}
+
+void Scene::set_transform(uint32_t id, const Eigen::Affine3f& transform) {
+  Instance& instance = instances_[id];
+  if (instance.removed)
+    return;
+  instance.transform = transform;
+  instance.inverse = transform.inverse();
+  instance.scale = max_scale(transform);
+  instance.identity = transform.matrix().isIdentity(0.0f);
+  bool was_empty = instance.bbox.empty();
+  set_instance_bbox(instance);
+  rebuild_needed_ |= was_empty != instance.bbox.empty();
+  refit_needed_ = true;
+}
+
+void Scene::update_model(uint32_t model) {
+  if (!models_[model])
+    return;
+  model_bboxes_[model] = model_bbox(*models_[model]);
+  for (auto& instance : instances_) {
+    if (!instance.removed && instance.model == model) {
+      bool was_empty = instance.bbox.empty();
+      set_instance_bbox(instance);
+      // empty instances are left out of the hierarchy
+      rebuild_needed_ |= was_empty != instance.bbox.empty();
+    }
+  }
+  refit_needed_ = true;
+}
+
+void Scene::set_material(size_t id, const Material& material) const {
+  if (auto target = get_material(id)) {
+    *target = material;
+  }
+}
+
+void Scene::set_instance_bbox(Instance& instance) {
+  instance.bbox =
+      transform_bbox(model_bboxes_[instance.model], instance.transform);
+}
+
+void Scene::build() {
+  rebuild_needed_ = false;
+  refit_needed_ = false;
+  nodes_.clear();
+  order_.clear();
+  bbox_.clear();
+  for (uint32_t i = 0; i < instances_.size(); ++i) {
+    bbox_.expand(instances_[i].bbox);
+    if (!instances_[i].bbox.empty()) {
+      order_.push_back(i);
+    }
+  }
+
+  if (!order_.empty()) {
+    nodes_.reserve(2 * order_.size() / max_instances_in_leaf + 1);
+    build_node(0, static_cast<uint32_t>(order_.size()));
+  }
+  build_cost_ = sah_cost();
+}
+
+void Scene::update() {
+  if (rebuild_needed_) {
+    build();
+    return;
+  }
+  if (!refit_needed_)
+    return;
+
+  refit_needed_ = false;
+  refit();
+  if (sah_cost() > build_cost_ * (1.0f + rebuild_threshold)) {
+    build();
+  }
+}
+
+void Scene::refit() {
+  // children follow their parent
+  for (size_t i = nodes_.size(); i-- > 0;) {
+    BVHNode& node = nodes_[i];
+    AABB bbox;
+    if (node.count > 0) {
+      for (uint32_t k = node.offset; k < node.offset + node.count; ++k) {
+        bbox.expand(instances_[order_[k]].bbox);
+      }
+    } else {
+      bbox = nodes_[i + 1].bbox;
+      bbox.expand(nodes_[node.offset].bbox);
+    }
+    node.bbox = bbox;
+  }
+  bbox_ = nodes_.empty() ? AABB() : nodes_[0].bbox;
+}
+
+float Scene::sah_cost() const {
+  float root_area = nodes_.empty() ? 0.0f : nodes_[0].bbox.surface_area();
+  if (!(root_area > 0.0f))
+    return 0.0f;
+  float cost = 0.0f;
+  for (const auto& node : nodes_) {
+    cost += node.bbox.surface_area() * (node.count > 0 ? node.count : 1);
+  }
+  return cost / root_area;
+}
+
+size_t Scene::get_geometry_memory() const {
+  size_t result = 0;
+  for (const auto& model : models_) {
+    if (model) {
+      result += model->get_geometry_memory();
+    }
+  }
+  return result;
+}
+
+size_t Scene::get_instance_memory() const {
+  return instances_.size() * sizeof(Instance) +
+         nodes_.size() * sizeof(BVHNode) + order_.size() * sizeof(uint32_t);
+}
+
+uint32_t Scene::build_node(uint32_t begin, uint32_t end) {
+  uint32_t index = static_cast<uint32_t>(nodes_.size());
+  nodes_.emplace_back();
+
+  AABB bbox;
+  AABB centers;
+  for (uint32_t i = begin; i < end; ++i) {
+    const AABB& instance_bbox = instances_[order_[i]].bbox;
+    Eigen::Vector3f center = (instance_bbox.min + instance_bbox.max) * 0.5f;
+    bbox.expand(instance_bbox);
+    centers.expand(AABB(center, center));
+  }
+  nodes_[index].bbox = bbox;
+
+  if (end - begin <= max_instances_in_leaf) {
+    nodes_[index].offset = begin;
+    nodes_[index].count = end - begin;
+    return index;
+  }
+
+  Eigen::Vector3f extent = centers.max - centers.min;
+  int axis = (extent[0] > extent[1] && extent[0] > extent[2]) ? 0
+             : (extent[1] > extent[2])                        ? 1
+                                                              : 2;
+
+  uint32_t mid = begin + (end - begin) / 2;
+  std::nth_element(order_.begin() + begin, order_.begin() + mid,
+                   order_.begin() + end, [this, axis](uint32_t a, uint32_t b) {
+                     const AABB& left = instances_[a].bbox;
+                     const AABB& right = instances_[b].bbox;
+                     return left.min[axis] + left.max[axis] <
+                            right.min[axis] + right.max[axis];
+                   });
+
+  build_node(begin, mid);
+  uint32_t right = build_node(mid, end);
+  nodes_[index].offset = right;
+  nodes_[index].count = 0;
+  return index;
+}
+
+}  // namespace rtr
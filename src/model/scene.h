@@ -0,0 +1,148 @@
+#pragma once
+
+#include <cstdint>
+#include <eigen3/Eigen/Geometry>
+#include <memory>
+#include <vector>
+
+#include "aabb.h"
+#include "bvh.h"
+#include "model.h"
+#include "ray.h"
+
+namespace rtr {
+
+/// @brief Placement of a model in the scene, the model is shared
+struct Instance {
+  uint32_t model = 0;  // index in Scene::get_models()
+  Eigen::Affine3f transform = Eigen::Affine3f::Identity();  // to world
+  Eigen::Affine3f inverse = Eigen::Affine3f::Identity();    // to object
+  AABB bbox;  // world bounds
+  float scale = 1.0f;  // largest stretch of the transform, object to world
+  bool identity = true;
+  bool removed = false;
+};
+
+/// @brief Instances of imported models under a top-level hierarchy
+///
+/// Meshes and their BVHs stay in object space and are shared by all
+/// instances of a model: memory grows with the unique models, an instance
+/// costs a transform and its bounds. Rays are moved into object space per
+/// instance without normalizing the direction, so hit distances stay the
+/// world ones.
+///
+/// Edits only touch the top-level hierarchy: update() refits it after
+/// instances were moved and rebuilds it after instances were added or
+/// removed. Edits must not be made while the scene is being traced.
+class Scene {
+ public:
+  Scene() = default;
+  /// @brief Single instance of the model in place, already built
+  explicit Scene(std::shared_ptr<const Model> model);
+
+  /// @brief Adds an instance, update() must be called before tracing
+  uint32_t add_instance(
+      std::shared_ptr<const Model> model,
+      const Eigen::Affine3f& transform = Eigen::Affine3f::Identity());
+  /// @brief Removes the instance, ids of the others are kept. A model is
+  /// released with its last instance.
+  void remove_instance(uint32_t id);
+  /// @brief Moves the instance, the model and its BVHs are not touched
+  void set_transform(uint32_t id, const Eigen::Affine3f& transform);
+  /// @brief Takes the bounds of a model whose meshes were refitted
+  void update_model(uint32_t model);
+  /// @brief Replaces a material in place, geometry is not touched. Ids are
+  /// the ones of get_materials(), unknown ids are ignored. The materials are
+  /// shared with the models, so a const scene updates them as well.
+  void set_material(size_t id, const Material& material) const;
+  /// @brief Material of the id, null for unknown ids
+  [[nodiscard]] std::shared_ptr<Material> get_material(size_t id) const {
+    return id < materials_.size() ? materials_[id] : nullptr;
+  }
+
+  /// @brief Builds the hierarchy over the bounds of the instances
+  void build();
+  /// @brief Applies the edits made since the last build or update
+  void update();
+
+  [[nodiscard]] const std::vector<std::shared_ptr<const Model>>& get_models()
+      const {
+    return models_;
+  }
+  [[nodiscard]] const std::vector<Instance>& get_instances() const {
+    return instances_;
+  }
+  /// @brief Materials of all models, the ids of a model start at its offset
+  [[nodiscard]] const std::vector<std::shared_ptr<Material>>& get_materials()
+      const {
+    return materials_;
+  }
+  [[nodiscard]] uint32_t get_material_offset(uint32_t model) const {
+    return material_offsets_[model];
+  }
+  [[nodiscard]] AABB get_bbox() const { return bbox_; }
+
+  /// @brief Bytes of the geometry of the models, each counted once
+  [[nodiscard]] size_t get_geometry_memory() const;
+  /// @brief Bytes of the top-level hierarchy and the instances
+  [[nodiscard]] size_t get_instance_memory() const;
+
+  /// @brief Calls f(instance) for each instance whose bounds the ray hits.
+  /// t_max is read again after each call, so narrowing it skips the
+  /// farther instances.
+  template <typename F>
+  void for_each_instance(const Ray& ray, float t_min, const float& t_max,
+                         F&& f) const;
+
+ private:
+  uint32_t build_node(uint32_t begin, uint32_t end);
+  /// @brief Recomputes the node bounds bottom-up
+  void refit();
+  [[nodiscard]] float sah_cost() const;
+  void set_instance_bbox(Instance& instance);
+
+ private:
+  std::vector<std::shared_ptr<const Model>> models_;
+  std::vector<uint32_t> material_offsets_;
+  std::vector<std::shared_ptr<Material>> materials_;
+  std::vector<AABB> model_bboxes_;
+  std::vector<Instance> instances_;
+  std::vector<BVHNode> nodes_;
+  std::vector<uint32_t> order_;
+  AABB bbox_;
+  float build_cost_ = 0.0f;
+  bool rebuild_needed_ = false;
+  bool refit_needed_ = false;
+};
+
+template <typename F>
+void Scene::for_each_instance(const Ray& ray, float t_min, const float& t_max,
+                              F&& f) const {
+  if (nodes_.empty())
+    return;
+
+  uint32_t stack[64];
+  int top = 0;
+  stack[top++] = 0;
+
+  while (top > 0) {
+    uint32_t index = stack[--top];
+    const auto& node = nodes_[index];
+    if (!node.bbox.intersect(ray, t_min, t_max))
+      continue;
+
+    if (node.count > 0) {
+      for (uint32_t i = node.offset; i < node.offset + node.count; ++i) {
+        const auto& instance = instances_[order_[i]];
+        if (instance.bbox.intersect(ray, t_min, t_max))
+          f(instance);
+      }
+      continue;
+    }
+
+    stack[top++] = node.offset;
+    stack[top++] = index + 1;
+  }
+}
+
+}  // namespace rtr
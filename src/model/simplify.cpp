@@ -0,0 +1,290 @@
+#include "simplify.h"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <eigen3/Eigen/Geometry>
+#include <execution>
+#include <limits>
+#include <numeric>
+#include <unordered_map>
+
+namespace rtr {
+
+namespace {
+
+using Vector3d = Eigen::Vector3d;
+
+constexpr uint32_t no_vertex = std::numeric_limits<uint32_t>::max();
+/// @brief Weight of the planes keeping open borders in place
+constexpr double border_weight = 10.0;
+
+/// @brief Sum of squared distances to planes, symmetric 4x4 matrix
+struct Quadric {
+  // xx xy xz xw yy yz yw zz zw ww
+  std::array<double, 10> q{};
+
+  static Quadric plane(const Vector3d& n, double d, double weight) {
+    Quadric r;
+    double a = n.x(), b = n.y(), c = n.z();
+    r.q = {a * a, a * b, a * c, a * d, b * b,
+           b * c, b * d, c * c, c * d, d * d};
+    for (auto& value : r.q) {
+      value *= weight;
+    }
+    return r;
+  }
+
+  Quadric& operator+=(const Quadric& other) {
+    for (size_t i = 0; i < q.size(); ++i) {
+      q[i] += other.q[i];
+    }
+    return *this;
+  }
+
+  [[nodiscard]] double error(const Vector3d& p) const {
+    double x = p.x(), y = p.y(), z = p.z();
+    return q[0] * x * x + 2 * q[1] * x * y + 2 * q[2] * x * z +
+           2 * q[3] * x + q[4] * y * y + 2 * q[5] * y * z + 2 * q[6] * y +
+           q[7] * z * z + 2 * q[8] * z + q[9];
+  }
+};
+
+/// @brief Collapse of from into to
+struct Collapse {
+  double cost;
+  uint32_t from, to;
+};
+
+struct PositionHash {
+  size_t operator()(const std::array<float, 3>& p) const {
+    uint64_t h = 0;
+    for (float value : p) {
+      h = h * 0x9E3779B97F4A7C15ull ^ std::bit_cast<uint32_t>(value);
+    }
+    return static_cast<size_t>(h ^ (h >> 29));
+  }
+};
+
+uint64_t edge_key(uint32_t a, uint32_t b) {
+  return a < b ? (uint64_t(a) << 32) | b : (uint64_t(b) << 32) | a;
+}
+
+}  // namespace
+
+float simplify(std::span<const PackedVertex> vertexes,
+               std::span<const VertexIndex> indices, size_t target_triangles,
+               std::vector<PackedVertex>& out_vertexes,
+               std::vector<VertexIndex>& out_indices) {
+  // welded positions
+  std::unordered_map<std::array<float, 3>, uint32_t, PositionHash> welded;
+  std::vector<uint32_t> weld(vertexes.size());
+  std::vector<Vector3d> positions;
+  for (size_t i = 0; i < vertexes.size(); ++i) {
+    auto [it, inserted] =
+        welded.try_emplace(vertexes[i].position, uint32_t(positions.size()));
+    if (inserted) {
+      positions.push_back(vertexes[i].get_position().cast<double>());
+    }
+    weld[i] = it->second;
+  }
+  welded.clear();
+
+  const size_t triangle_count = indices.size() / 3;
+  std::vector<std::array<uint32_t, 3>> triangles(triangle_count);
+  std::vector<bool> alive(triangle_count, false);
+  std::vector<std::vector<uint32_t>> vertex_triangles(positions.size());
+  std::vector<Quadric> quadrics(positions.size());
+  size_t live = 0;
+  for (size_t t = 0; t < triangle_count; ++t) {
+    auto& tri = triangles[t];
+    for (int k = 0; k < 3; ++k) {
+      tri[k] = weld[indices[3 * t + k]];
+    }
+    if (tri[0] == tri[1] || tri[1] == tri[2] || tri[2] == tri[0])
+      continue;
+
+    alive[t] = true;
+    ++live;
+    Vector3d n = (positions[tri[1]] - positions[tri[0]])
+                     .cross(positions[tri[2]] - positions[tri[0]]);
+    double length = n.norm();
+    for (int k = 0; k < 3; ++k) {
+      vertex_triangles[tri[k]].push_back(uint32_t(t));
+    }
+    if (length > 0.0) {
+      n /= length;
+      auto plane = Quadric::plane(n, -n.dot(positions[tri[0]]), 1.0);
+      for (int k = 0; k < 3; ++k) {
+        quadrics[tri[k]] += plane;
+      }
+    }
+  }
+
+  // edges of the live triangles, sorted by key
+  std::vector<uint64_t> edges;
+  auto collect_edges = [&] {
+    edges.clear();
+    for (size_t t = 0; t < triangle_count; ++t) {
+      if (!alive[t])
+        continue;
+      const auto& tri = triangles[t];
+      for (int k = 0; k < 3; ++k) {
+        edges.push_back(edge_key(tri[k], tri[(k + 1) % 3]));
+      }
+    }
+    std::sort(std::execution::par, edges.begin(), edges.end());
+  };
+
+  // open borders: planes through the edges used once, perpendicular to
+  // their triangle
+  collect_edges();
+  std::vector<uint64_t> border;
+  for (size_t i = 0; i < edges.size();) {
+    size_t end = i + 1;
+    while (end < edges.size() && edges[end] == edges[i]) {
+      ++end;
+    }
+    if (end - i == 1) {
+      border.push_back(edges[i]);
+    }
+    i = end;
+  }
+  for (size_t t = 0; t < triangle_count && !border.empty(); ++t) {
+    if (!alive[t])
+      continue;
+    const auto& tri = triangles[t];
+    Vector3d n = (positions[tri[1]] - positions[tri[0]])
+                     .cross(positions[tri[2]] - positions[tri[0]]);
+    for (int k = 0; k < 3; ++k) {
+      uint32_t a = tri[k], b = tri[(k + 1) % 3];
+      if (!std::binary_search(border.begin(), border.end(), edge_key(a, b)))
+        continue;
+      Vector3d side = (positions[b] - positions[a]).cross(n);
+      double length = side.norm();
+      if (length == 0.0)
+        continue;
+      side /= length;
+      auto plane =
+          Quadric::plane(side, -side.dot(positions[a]), border_weight);
+      quadrics[a] += plane;
+      quadrics[b] += plane;
+    }
+  }
+
+  // passes of independent collapses: the edges are sorted by cost and
+  // taken in order while both vertexes are untouched in the pass
+  std::vector<uint32_t> collapsed(positions.size(), no_vertex);
+  std::vector<uint8_t> locked(positions.size());
+  std::vector<Collapse> candidates;
+  double max_error = 0.0;
+  while (live > target_triangles) {
+    if (!edges.empty()) {
+      edges.erase(std::unique(edges.begin(), edges.end()), edges.end());
+    }
+    candidates.resize(edges.size());
+    std::vector<size_t> ids(edges.size());
+    std::iota(ids.begin(), ids.end(), 0);
+    std::for_each(std::execution::par, ids.begin(), ids.end(), [&](size_t i) {
+      uint32_t a = uint32_t(edges[i] >> 32), b = uint32_t(edges[i]);
+      Quadric q = quadrics[a];
+      q += quadrics[b];
+      double into_b = q.error(positions[b]);
+      double into_a = q.error(positions[a]);
+      candidates[i] = into_b <= into_a ? Collapse{into_b, a, b}
+                                       : Collapse{into_a, b, a};
+    });
+    std::sort(std::execution::par, candidates.begin(), candidates.end(),
+              [](const Collapse& x, const Collapse& y) {
+                return x.cost < y.cost;
+              });
+
+    std::fill(locked.begin(), locked.end(), 0);
+    size_t pass_collapses = 0;
+    for (const auto& c : candidates) {
+      if (live <= target_triangles)
+        break;
+      uint32_t a = c.from, b = c.to;
+      if (locked[a] || locked[b])
+        continue;
+
+      // the triangles kept around a must not turn over
+      bool flips = false;
+      for (uint32_t t : vertex_triangles[a]) {
+        const auto& tri = triangles[t];
+        if (!alive[t] || std::find(tri.begin(), tri.end(), b) != tri.end())
+          continue;
+        std::array<Vector3d, 3> p, moved;
+        for (int k = 0; k < 3; ++k) {
+          p[k] = positions[tri[k]];
+          moved[k] = tri[k] == a ? positions[b] : p[k];
+        }
+        Vector3d before = (p[1] - p[0]).cross(p[2] - p[0]);
+        Vector3d after = (moved[1] - moved[0]).cross(moved[2] - moved[0]);
+        if (before.dot(after) <= 0.0) {
+          flips = true;
+          break;
+        }
+      }
+      if (flips)
+        continue;
+
+      max_error = std::max(max_error, c.cost);
+      quadrics[b] += quadrics[a];
+      collapsed[a] = b;
+      locked[a] = locked[b] = 1;
+      ++pass_collapses;
+      for (uint32_t t : vertex_triangles[a]) {
+        if (!alive[t])
+          continue;
+        auto& tri = triangles[t];
+        if (std::find(tri.begin(), tri.end(), b) != tri.end()) {
+          alive[t] = false;
+          --live;
+          continue;
+        }
+        std::replace(tri.begin(), tri.end(), a, b);
+        vertex_triangles[b].push_back(t);
+      }
+      vertex_triangles[a] = {};
+      std::erase_if(vertex_triangles[b],
+                    [&](uint32_t t) { return !alive[t]; });
+    }
+    if (pass_collapses == 0)
+      break;
+    collect_edges();
+  }
+
+  // output vertexes keep their attributes at the position they collapsed to
+  auto final_position = [&](uint32_t p) {
+    while (collapsed[p] != no_vertex) {
+      p = collapsed[p];
+    }
+    return p;
+  };
+  std::vector<uint32_t> remap(vertexes.size(), no_vertex);
+  out_vertexes.clear();
+  out_indices.clear();
+  out_indices.reserve(3 * live);
+  for (size_t t = 0; t < triangle_count; ++t) {
+    if (!alive[t])
+      continue;
+    for (int k = 0; k < 3; ++k) {
+      VertexIndex source = indices[3 * t + k];
+      if (remap[source] == no_vertex) {
+        remap[source] = VertexIndex(out_vertexes.size());
+        PackedVertex vertex = vertexes[source];
+        Eigen::Vector3f p =
+            positions[final_position(weld[source])].cast<float>();
+        vertex.position = {p.x(), p.y(), p.z()};
+        out_vertexes.push_back(vertex);
+      }
+      out_indices.push_back(remap[source]);
+    }
+  }
+  return float(std::sqrt(std::max(max_error, 0.0)));
+}
+
+}  // namespace rtr
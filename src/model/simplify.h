@@ -0,0 +1,22 @@
+#pragma once
+
+#include <span>
+#include <vector>
+
+#include "vertex.h"
+
+namespace rtr {
+
+/// @brief Quadric error edge collapse down to about target_triangles
+///
+/// Vertices sharing a position are welded, so seams of normals and texture
+/// coordinates stay closed; each output vertex keeps the attributes of its
+/// source vertex. Open borders are kept by penalty planes, collapses that
+/// flip a triangle are skipped. Stops earlier if no collapse is left.
+/// Returns an estimate of the largest distance of the result to the input.
+float simplify(std::span<const PackedVertex> vertexes,
+               std::span<const VertexIndex> indices, size_t target_triangles,
+               std::vector<PackedVertex>& out_vertexes,
+               std::vector<VertexIndex>& out_indices);
+
+}  // namespace rtr
@@ -0,0 +1,160 @@
+#include "texture_cache.h"
+
+#include <stb_image.h>
+#include <algorithm>
+#include <iostream>
+
+#include "thread_pool.h"
+
+namespace rtr {
+
+namespace {
+
+/// @brief Decodes of all caches, one worker per hardware thread
+ThreadPool& decode_pool() {
+  static ThreadPool pool;
+  return pool;
+}
+
+std::shared_ptr<Image> decode_texture(const fs::path& path,
+                                      TextureFormat format) {
+  std::string texture_path = path.string();
+  int w, h, channels;
+  unsigned char* data = stbi_load(texture_path.c_str(), &w, &h, &channels, 3);
+
+  if (!data) {
+    std::cerr << "ERR: Failed to load texture: " << texture_path << "\n";
+    return nullptr;
+  }
+
+  auto result = std::make_shared<Image>(w, h, data, format);
+  stbi_image_free(data);
+  return result;
+}
+
+}  // namespace
+
+TextureCache::TextureFuture TextureCache::load(const fs::path& base,
+                                               const std::string& name) {
+  // the file system is searched and read outside the lock, a concurrent
+  // search of the same name only repeats the lookup
+  fs::path path;
+  bool resolved;
+  {
+    std::lock_guard lock(mutex_);
+    auto it = resolved_.find({base, name});
+    resolved = it != resolved_.end();
+    if (resolved) {
+      path = it->second;
+    }
+  }
+  if (!resolved) {
+    path = resolve(base, name);
+    std::lock_guard lock(mutex_);
+    resolved_.try_emplace({base, name}, path);
+  }
+
+  if (path.empty()) {
+    std::promise<std::shared_ptr<Image>> none;
+    none.set_value(nullptr);
+    return none.get_future().share();
+  }
+
+  // the first request of a path claims it, later ones share its future
+  auto promise = std::make_shared<std::promise<std::shared_ptr<Image>>>();
+  TextureFuture future;
+  {
+    std::lock_guard lock(mutex_);
+    auto [it, inserted] = textures_.try_emplace(path);
+    if (!inserted)
+      return it->second;
+    it->second = future = promise->get_future().share();
+  }
+
+  if (streamer_) {
+    promise->set_value(streamer_->open(path));
+  } else {
+    decode_pool().submit([promise, path, format = format_]() {
+      try {
+        promise->set_value(decode_texture(path, format));
+      } catch (...) {
+        promise->set_exception(std::current_exception());
+      }
+    });
+  }
+  return future;
+}
+
+void TextureCache::insert(const fs::path& path, std::shared_ptr<Image> image) {
+  std::promise<std::shared_ptr<Image>> promise;
+  promise.set_value(std::move(image));
+  std::lock_guard lock(mutex_);
+  textures_.insert_or_assign(path, promise.get_future().share());
+}
+
+std::vector<fs::path> TextureCache::get_paths() const {
+  std::lock_guard lock(mutex_);
+
+  std::vector<fs::path> result;
+  for (const auto& [path, texture] : textures_) {
+    if (texture.get()) {
+      result.push_back(path);
+    }
+  }
+  return result;
+}
+
+std::vector<std::pair<fs::path, std::shared_ptr<Image>>>
+TextureCache::get_textures() const {
+  std::lock_guard lock(mutex_);
+
+  std::vector<std::pair<fs::path, std::shared_ptr<Image>>> result;
+  for (const auto& [path, texture] : textures_) {
+    if (auto image = texture.get()) {
+      result.emplace_back(path, std::move(image));
+    }
+  }
+  return result;
+}
+
+void TextureCache::release_unused() {
+  std::lock_guard lock(mutex_);
+
+  std::erase_if(textures_, [](const auto& entry) {
+    const auto& image = entry.second.get();
+    return !image || image.use_count() == 1;
+  });
+}
+
+size_t TextureCache::memory_usage() const {
+  std::lock_guard lock(mutex_);
+
+  size_t result = 0;
+  for (const auto& [path, texture] : textures_) {
+    if (const auto& image = texture.get()) {
+      result += image->data.size();
+    }
+  }
+  return result;
+}
+
+fs::path TextureCache::resolve(const fs::path& base, const std::string& name) {
+  fs::path tex;
+  {
+    std::string s = name;
+    std::replace(s.begin(), s.end(), '\\', '/');
+    tex = s;
+  }
+
+  // strips leading directories until the file is found relative to base
+  fs::path path = tex;
+  while (!fs::exists(path) && !tex.empty()) {
+    fs::path rel = tex.relative_path();
+    path = base / rel;
+    tex = rel.lexically_relative(*rel.begin());
+  }
+
+  return path.lexically_normal();
+}
+
+}  // namespace rtr
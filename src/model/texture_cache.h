@@ -0,0 +1,66 @@
+#pragma once
+
+#include <filesystem>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "image.h"
+#include "texture_stream.h"
+
+namespace fs = std::filesystem;
+
+namespace rtr {
+
+/// @brief Textures keyed by resolved path, each file is decoded once
+///
+/// Decodes run in the background on a pool shared by all caches, one
+/// worker per hardware thread. With a streamer the textures are opened for
+/// streaming instead and decoded when first sampled.
+class TextureCache {
+ public:
+  using TextureFuture = std::shared_future<std::shared_ptr<Image>>;
+
+  /// @brief format: storage of the decoded textures, streamed ones use the
+  /// format of the streamer
+  explicit TextureCache(std::shared_ptr<TextureStreamer> streamer = nullptr,
+                        TextureFormat format = TextureFormat::RGB8)
+      : streamer_(std::move(streamer)), format_(format) {}
+
+  /// @brief Starts decoding the texture referenced from a material file in
+  /// base unless it's already requested. Empty names give null textures.
+  [[nodiscard]] TextureFuture load(const fs::path& base,
+                                   const std::string& name);
+
+  /// @brief Adds a texture decoded elsewhere, load() of its path returns it
+  void insert(const fs::path& path, std::shared_ptr<Image> image);
+
+  /// @brief Paths of the successfully decoded textures, waits for decodes
+  [[nodiscard]] std::vector<fs::path> get_paths() const;
+  /// @brief Successfully decoded textures by path, waits for decodes
+  [[nodiscard]] std::vector<std::pair<fs::path, std::shared_ptr<Image>>>
+  get_textures() const;
+  /// @brief Drops the textures only the cache refers to and the failed
+  /// ones, waits for decodes
+  void release_unused();
+  /// @brief Bytes of the decoded textures, waits for decodes. Streamed
+  /// textures aren't counted.
+  [[nodiscard]] size_t memory_usage() const;
+
+ private:
+  /// @brief Searches the file system for the texture, see load()
+  static fs::path resolve(const fs::path& base, const std::string& name);
+
+ private:
+  std::shared_ptr<TextureStreamer> streamer_;
+  TextureFormat format_;
+  mutable std::mutex mutex_;
+  std::map<std::pair<fs::path, std::string>, fs::path> resolved_;
+  std::map<fs::path, TextureFuture> textures_;
+};
+
+}  // namespace rtr
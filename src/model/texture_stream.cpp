@@ -0,0 +1,87 @@
+#include "texture_stream.h"
+
+#include <stb_image.h>
+#include <iostream>
+#include <utility>
+
+namespace rtr {
+
+struct TextureStreamer::Resident {
+  Image image;   // pyramid from level on
+  size_t level;  // first level of the full pyramid kept
+};
+
+/// @brief Pixels of one texture file, decoded again after an eviction
+class StreamedTexture : public ImageStream {
+ public:
+  StreamedTexture(std::shared_ptr<TextureStreamer> streamer,
+                  const fs::path& path)
+      : streamer_(std::move(streamer)), source_(path.string()) {
+    streamer_->residency_.attach(counters_);
+  }
+
+  ~StreamedTexture() override {
+    streamer_->residency_.remove(slot_);
+    streamer_->residency_.detach(counters_);
+  }
+
+  std::shared_ptr<const Image> acquire(size_t level) override {
+    auto resident = streamer_->residency_.acquire(
+        slot_, counters_,
+        [&] {
+          auto decoded = decode(level);
+          return std::pair(decoded, decoded->image.data.size());
+        },
+        [level](const TextureStreamer::Resident& resident) {
+          return resident.level <= level;
+        });
+    return {resident, &resident->image};
+  }
+
+  const std::string& get_source() const override { return source_; }
+
+ private:
+  std::shared_ptr<TextureStreamer::Resident> decode(size_t level) const {
+    int w, h, channels;
+    unsigned char* data = stbi_load(source_.c_str(), &w, &h, &channels, 3);
+    if (!data) {
+      // grey texel, the file isn't read again
+      std::cerr << "ERR: Failed to load texture: " << source_ << "\n";
+      unsigned char grey[3] = {128, 128, 128};
+      return std::make_shared<TextureStreamer::Resident>(
+          TextureStreamer::Resident{Image(1, 1, grey), 0});
+    }
+
+    Image image(w, h, data, streamer_->format_);
+    stbi_image_free(data);
+    level = std::min(level, image.level_count() - 1);
+    if (level > 0) {
+      image = image.from_level(level);
+    }
+    return std::make_shared<TextureStreamer::Resident>(
+        TextureStreamer::Resident{std::move(image), level});
+  }
+
+ private:
+  std::shared_ptr<TextureStreamer> streamer_;
+  std::string source_;
+  Residency::Slot<TextureStreamer::Resident> slot_;
+  Residency::Counters counters_;
+};
+
+TextureStreamer::TextureStreamer(size_t budget, TextureFormat format)
+    : format_(format), residency_(budget) {}
+
+std::shared_ptr<Image> TextureStreamer::open(const fs::path& path) {
+  std::string source = path.string();
+  int w, h, channels;
+  if (!stbi_info(source.c_str(), &w, &h, &channels)) {
+    std::cerr << "ERR: Failed to load texture: " << source << "\n";
+    return nullptr;
+  }
+
+  auto texture = std::make_shared<StreamedTexture>(shared_from_this(), path);
+  return std::make_shared<Image>(w, h, std::move(texture));
+}
+
+}  // namespace rtr
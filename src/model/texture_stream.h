@@ -0,0 +1,46 @@
+#pragma once
+
+#include <filesystem>
+#include <memory>
+
+#include "image.h"
+#include "residency.h"
+
+namespace fs = std::filesystem;
+
+namespace rtr {
+
+class StreamedTexture;
+
+/// @brief Decodes textures on first sample, Residency decides which stay
+/// in memory
+///
+/// Only the levels a sample needs are kept: a texture seen from far away
+/// stays resident as its coarse levels. A decode only blocks the samples of
+/// its own texture.
+class TextureStreamer : public std::enable_shared_from_this<TextureStreamer> {
+ public:
+  /// @brief budget: bytes of resident pyramids, one texture is kept even if
+  /// it alone exceeds the budget. format: storage of the decoded textures.
+  explicit TextureStreamer(size_t budget,
+                           TextureFormat format = TextureFormat::RGB8);
+
+  /// @brief Streamed image of the file, reads only the file header. Returns
+  /// null if the file isn't a readable image.
+  [[nodiscard]] std::shared_ptr<Image> open(const fs::path& path);
+
+  [[nodiscard]] ResidencyStats get_stats() const {
+    return residency_.get_stats();
+  }
+
+ private:
+  friend class StreamedTexture;
+
+  struct Resident;
+
+ private:
+  const TextureFormat format_;
+  Residency residency_;
+};
+
+}  // namespace rtr
@@ -0,0 +1,95 @@
+#include "batch_renderer.h"
+
+#include <algorithm>
+#include <deque>
+#include <future>
+
+#include "renderer.h"
+
+namespace rtr {
+
+std::vector<Camera> make_orbit(const Camera& start,
+                               const Eigen::Vector3f& center, size_t count,
+                               const Eigen::Vector3f& axis) {
+  std::vector<Camera> cameras;
+  cameras.reserve(count);
+
+  const float step = count > 0 ? 360.0f / count : 0.0f;
+  Camera camera = start;
+  for (size_t i = 0; i < count; ++i) {
+    cameras.push_back(camera);
+    camera.rotate_around_point(center, step, axis);
+  }
+  return cameras;
+}
+
+BatchRenderer::BatchRenderer(std::shared_ptr<const Model> model, size_t width,
+                             size_t height, int num_threads,
+                             size_t frames_in_flight)
+    : BatchRenderer(std::make_shared<Scene>(std::move(model)), width, height,
+                    num_threads, frames_in_flight) {}
+
+BatchRenderer::BatchRenderer(std::shared_ptr<const Scene> scene, size_t width,
+                             size_t height, int num_threads,
+                             size_t frames_in_flight)
+    : scene_(scene),
+      width_(width),
+      height_(height),
+      frames_in_flight_(std::max<size_t>(frames_in_flight, 1)),
+      thread_pool_(std::make_shared<ThreadPool>(std::max(num_threads, 1))) {
+  RayTracer ray_tracer(scene_, nullptr);
+  ray_tracer.build_bvh();
+  bbox_ = ray_tracer.get_root_bbox();
+}
+
+void BatchRenderer::render(const std::vector<Camera>& cameras,
+                           FrameCallback callback) {
+  struct Frame {
+    std::unique_ptr<Renderer> renderer;
+    std::shared_future<bool> result;
+  };
+
+  std::deque<Frame> frames;
+  size_t next = 0;
+
+  auto submit_next = [&]() {
+    auto camera = std::make_shared<const Camera>(cameras[next++]);
+    auto renderer = std::make_unique<Renderer>(scene_, camera, width_,
+                                               height_, thread_pool_);
+    if (setup_) {
+      setup_(renderer->get_ray_tracer());
+    }
+
+    auto result = renderer->render_async(thread_pool_->size());
+    frames.push_back({std::move(renderer), std::move(result)});
+  };
+
+  try {
+    for (size_t index = 0; index < cameras.size(); ++index) {
+      while (next < cameras.size() && frames.size() < frames_in_flight_) {
+        submit_next();
+      }
+
+      auto frame = std::move(frames.front());
+      frames.pop_front();
+      frame.result.get();
+
+      // keep the pool busy while the finished frame is handed out
+      if (next < cameras.size()) {
+        submit_next();
+      }
+
+      if (callback) {
+        callback(index, frame.renderer->get_frame_buffer());
+      }
+    }
+  } catch (...) {
+    // queued tiles still reference their renderers
+    for (auto& frame : frames) {
+      frame.result.wait();
+    }
+    throw;
+  }
+}
+
+}  // namespace rtr
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <eigen3/Eigen/Core>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include "aabb.h"
+#include "camera.h"
+#include "framebuffer.h"
+#include "model.h"
+#include "raytracer.h"
+#include "scene.h"
+#include "thread_pool.h"
+
+namespace rtr {
+
+/// @brief Cameras evenly distributed on an orbit around the point, built by
+/// Camera::rotate_around_point from the start camera
+[[nodiscard]] std::vector<Camera> make_orbit(const Camera& start,
+                                             const Eigen::Vector3f& center,
+                                             size_t count,
+                                             const Eigen::Vector3f& axis);
+
+/// @brief Renders many views of one loaded model or scene
+///
+/// All frames share the models, its BVHs and one thread pool. Tiles of the
+/// next frames are queued while the current one is finishing, so the pool
+/// does not idle between frames.
+class BatchRenderer {
+ public:
+  /// @brief Called in view order as soon as the frame is finished
+  using FrameCallback =
+      std::function<void(size_t index, const FrameBuffer& frame)>;
+  using SetupCallback = std::function<void(RayTracer&)>;
+
+  BatchRenderer(std::shared_ptr<const Model> model, size_t width,
+                size_t height,
+                int num_threads = std::thread::hardware_concurrency(),
+                size_t frames_in_flight = 3);
+  BatchRenderer(std::shared_ptr<const Scene> scene, size_t width,
+                size_t height,
+                int num_threads = std::thread::hardware_concurrency(),
+                size_t frames_in_flight = 3);
+
+  /// @brief Applied to the ray tracer of each view before rendering
+  void set_setup_callback(SetupCallback setup) { setup_ = std::move(setup); }
+
+  void render(const std::vector<Camera>& cameras, FrameCallback callback);
+
+  [[nodiscard]] AABB get_root_bbox() const { return bbox_; }
+
+ private:
+  std::shared_ptr<const Scene> scene_;
+  size_t width_;
+  size_t height_;
+  size_t frames_in_flight_;
+  std::shared_ptr<ThreadPool> thread_pool_;
+  SetupCallback setup_;
+  AABB bbox_;
+};
+
+}  // namespace rtr
@@ -25,4 +25,8 @@ void FrameBuffer::set_point(size_t x, size_t y, const vec3& color) {
   }
 }
 
+const vec3& FrameBuffer::get_point(size_t x, size_t y) const {
+  return *reinterpret_cast<const vec3*>(buffer_ + 3 * (x + y * width_));
+}
+
 }  // namespace rtr
\ No newline at end of file
@@ -16,6 +16,7 @@ class FrameBuffer {
   size_t get_width() const { return width_; }
   size_t get_height() const { return height_; }
   void set_point(size_t x, size_t y, const vec3& color);
+  [[nodiscard]] const vec3& get_point(size_t x, size_t y) const;
 
  public:
   class Iterator {
@@ -0,0 +1,30 @@
+#include "gbuffer.h"
+
+namespace rtr {
+
+void GBuffer::reset(size_t width, size_t height, const Camera& camera) {
+  width_ = width;
+  height_ = height;
+  samples_.assign(width * height, GBufferSample{});
+
+  camera_position_ = camera.get_position();
+  camera_corners_ = {camera.generate_ray(0.0f, 0.0f),
+                     camera.generate_ray(1.0f, 1.0f)};
+}
+
+void GBuffer::clear() {
+  width_ = 0;
+  height_ = 0;
+  samples_.clear();
+  samples_.shrink_to_fit();
+}
+
+bool GBuffer::is_valid(size_t width, size_t height,
+                       const Camera& camera) const {
+  return !samples_.empty() && width == width_ && height == height_ &&
+         camera.get_position() == camera_position_ &&
+         camera.generate_ray(0.0f, 0.0f) == camera_corners_[0] &&
+         camera.generate_ray(1.0f, 1.0f) == camera_corners_[1];
+}
+
+}  // namespace rtr
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <eigen3/Eigen/Core>
+#include <limits>
+#include <vector>
+
+#include "camera.h"
+
+namespace rtr {
+
+/// @brief Primary hit of a pixel kept for re-shading
+struct GBufferSample {
+  Eigen::Vector3f position;
+  Eigen::Vector3f normal;
+  Eigen::Vector2f tex_coord;
+  float footprint = 0.0f;
+  float depth = std::numeric_limits<float>::infinity();
+  int32_t material_id = -1;
+  bool front_face = true;
+
+  [[nodiscard]] bool is_hit() const { return material_id >= 0; }
+};
+
+class GBuffer {
+ public:
+  GBuffer() = default;
+
+  void reset(size_t width, size_t height, const Camera& camera);
+  void clear();
+
+  /// @brief Whether the stored hits were traced with this view
+  [[nodiscard]] bool is_valid(size_t width, size_t height,
+                              const Camera& camera) const;
+
+  [[nodiscard]] bool empty() const { return samples_.empty(); }
+  [[nodiscard]] GBufferSample& at(size_t x, size_t y) {
+    return samples_[x + y * width_];
+  }
+  [[nodiscard]] const GBufferSample& at(size_t x, size_t y) const {
+    return samples_[x + y * width_];
+  }
+
+ private:
+  size_t width_ = 0;
+  size_t height_ = 0;
+  std::vector<GBufferSample> samples_;
+
+  // view the samples belong to
+  Eigen::Vector3f camera_position_;
+  std::array<Eigen::Vector3f, 2> camera_corners_;
+};
+
+}  // namespace rtr
@@ -5,6 +5,7 @@
 #include <eigen3/Eigen/Geometry>
 #include <limits>
 #include <numbers>
+#include <random>
 
 #include "reflect.h"
 
@@ -19,25 +20,72 @@ Vector3f texture_color(const Vector3f& color, std::shared_ptr<Image> texture,
                        const HitRecord& rec) {
   if (!texture)
     return color;
-  return texture->sample(rec.tex_coord.x(), rec.tex_coord.y());
+  return texture->sample(rec.tex_coord.x(), rec.tex_coord.y(), rec.footprint);
+}
+
+/// @brief Candidate triangles of the current query, reused by the queries of
+/// the thread so that tracing doesn't allocate once they have grown
+IntersectIndices& intersect_scratch() {
+  thread_local IntersectIndices indices;
+  return indices;
+}
+
+void RayTracer::add_light(const Light& light) {
+  lights_.push_back(light);
+  invalidate_light_tree();
 }
 
 void RayTracer::remove_light(size_t index) {
   lights_.erase(lights_.begin() + index);
+  invalidate_light_tree();
 }
 
 void RayTracer::remove_light(const Light& light) {
   lights_.erase(std::remove(lights_.begin(), lights_.end(), light),
                 lights_.end());
+  invalidate_light_tree();
 }
 
-void RayTracer::build_bvh() {
-  for (const auto& mesh : model_->get_meshes()) {
-    if (mesh.bvh) {
-      AABB mesh_bbox = mesh.bvh->get_root_bbox();
-      bbox_.expand(mesh_bbox);
+void RayTracer::set_light(size_t index, const Light& light) {
+  lights_[index] = light;
+  invalidate_light_tree();
+}
+
+void RayTracer::set_lights(std::vector<Light> lights) {
+  lights_ = std::move(lights);
+  invalidate_light_tree();
+}
+
+void RayTracer::set_light_cutoff(float cutoff) {
+  light_cutoff_ = cutoff;
+  invalidate_light_tree();
+}
+
+void RayTracer::invalidate_light_tree() {
+  light_tree_dirty_.store(true, std::memory_order_release);
+}
+
+const LightBVH& RayTracer::get_light_tree() {
+  if (light_tree_dirty_.load(std::memory_order_acquire)) {
+    std::lock_guard lock(light_tree_mutex_);
+    if (light_tree_dirty_.load(std::memory_order_relaxed)) {
+      light_tree_ = LightBVH(lights_, light_cutoff_);
+      light_tree_dirty_.store(false, std::memory_order_release);
     }
   }
+  return light_tree_;
+}
+
+void RayTracer::build_bvh() {
+  bbox_.expand(scene_->get_bbox());
+}
+
+void RayTracer::set_material(size_t id, const Material& material) {
+  scene_->set_material(id, material);
+}
+
+std::shared_ptr<Material> RayTracer::get_material(size_t id) const {
+  return scene_->get_material(id);
 }
 
 Vector3f RayTracer::trace_pixel(float u, float v, int max_depth) {
@@ -45,10 +93,52 @@ Vector3f RayTracer::trace_pixel(float u, float v, int max_depth) {
   return trace_ray(ray, max_depth);
 }
 
+bool RayTracer::hit_pixel(float u, float v, HitRecord& rec) const {
+  Ray ray = generate_ray(u, v);
+  return hit_model(ray, bias, std::numeric_limits<float>::max(), rec);
+}
+
+std::vector<bool> RayTracer::hit_pixels(std::span<const Vector2f> pixels,
+                                        std::span<HitRecord> records) const {
+  std::vector<Ray> rays;
+  rays.reserve(pixels.size());
+  for (const auto& pixel : pixels) {
+    rays.push_back(generate_ray(pixel.x(), pixel.y()));
+  }
+  return hit_rays(rays, bias, std::numeric_limits<float>::max(), records);
+}
+
+bool RayTracer::has_paged_geometry() const {
+  for (const auto& model : scene_->get_models()) {
+    if (!model)
+      continue;
+    for (const auto& mesh : model->get_meshes()) {
+      if (mesh.clusters)
+        return true;
+    }
+  }
+  return false;
+}
+
+Vector3f RayTracer::shade_pixel(float u, float v, const HitRecord& rec,
+                                int max_depth) {
+  if (max_depth <= 0) {
+    return Vector3f::Zero();
+  }
+
+  Ray ray = generate_ray(u, v);
+  return shade(ray, rec, max_depth);
+}
+
 Ray RayTracer::generate_ray(float u, float v) const {
   Vector3f origin = camera_->get_position();
   Vector3f direction = camera_->generate_ray(u, v);
-  return Ray(origin, direction);
+  Ray ray(origin, direction);
+  if (image_height_ > 0) {
+    float fov = camera_->get_fov() * std::numbers::pi_v<float> / 180.0f;
+    ray.cone_spread = 2.0f * std::tan(0.5f * fov) / image_height_;
+  }
+  return ray;
 }
 
 Vector3f RayTracer::trace_ray(const Ray& ray, int depth) {
@@ -61,6 +151,10 @@ Vector3f RayTracer::trace_ray(const Ray& ray, int depth) {
     return background_color_;
   }
 
+  return shade(ray, rec, depth);
+}
+
+Vector3f RayTracer::shade(const Ray& ray, const HitRecord& rec, int depth) {
   Vector3f color_from_emission = rec.material->emission;
   Vector3f color_from_reflection = Vector3f::Zero();
   Vector3f color_from_refraction = Vector3f::Zero();
@@ -69,6 +163,8 @@ Vector3f RayTracer::trace_ray(const Ray& ray, int depth) {
     Vector3f reflected_dir = reflect(ray.direction, rec.normal).normalized();
     Vector3f reflected_origin = rec.point + rec.normal * bias;
     Ray reflected_ray(reflected_origin, reflected_dir);
+    reflected_ray.cone_width = ray.cone_width_at(rec.t);
+    reflected_ray.cone_spread = ray.cone_spread;
     color_from_reflection =
         trace_ray(reflected_ray, depth - 1) * rec.material->reflectivity;
   }
@@ -81,6 +177,8 @@ Vector3f RayTracer::trace_ray(const Ray& ray, int depth) {
     if (refracted_dir.norm() > 0) {
       Vector3f refracted_origin = rec.point - rec.normal * bias;
       Ray refracted_ray(refracted_origin, refracted_dir);
+      refracted_ray.cone_width = ray.cone_width_at(rec.t);
+      refracted_ray.cone_spread = ray.cone_spread;
       color_from_refraction =
           trace_ray(refracted_ray, depth - 1) * rec.material->transparency;
     }
@@ -95,44 +193,268 @@ Vector3f RayTracer::trace_ray(const Ray& ray, int depth) {
 
 bool RayTracer::hit_model(const Ray& ray, float t_min, float t_max,
                           HitRecord& rec) const {
+  // Only positions are read while searching, the shading attributes of the
+  // closest hit are interpolated once
+  ClosestHit hit;
+  hit.t = t_max;
+  thread_local std::vector<ClusterRequest> deferred;
+  deferred.clear();
+  hit_scene(ray, t_min, hit, deferred);
+
+  // the nearest clusters first, the rest are culled by their hits
+  std::sort(deferred.begin(), deferred.end(),
+            [](const auto& a, const auto& b) { return a.t_enter < b.t_enter; });
+  for (const auto& request : deferred) {
+    if (request.t_enter >= hit.t)
+      break;
+    hit_cluster(request, request.mesh->clusters->acquire(request.cluster),
+                to_object(*request.instance, ray), t_min, hit);
+  }
 
-  HitRecord temp_rec;
-  float closest_so_far = t_max;
-  bool hit_anything = false;
+  return finish_hit(ray, hit, rec);
+}
 
-  for (const auto& mesh : model_->get_meshes()) {
-    auto material_ptr = mesh.material.lock();
-    if (!material_ptr)
-      continue;
+std::vector<bool> RayTracer::hit_rays(std::span<const Ray> rays, float t_min,
+                                      float t_max,
+                                      std::span<HitRecord> records) const {
+  std::vector<ClosestHit> hits(rays.size());
+  std::vector<std::pair<size_t, ClusterRequest>> deferred;
+  std::vector<ClusterRequest> ray_deferred;
+  for (size_t i = 0; i < rays.size(); ++i) {
+    hits[i].t = t_max;
+    ray_deferred.clear();
+    hit_scene(rays[i], t_min, hits[i], ray_deferred);
+    for (const auto& request : ray_deferred) {
+      deferred.emplace_back(i, request);
+    }
+  }
+
+  // grouped by cluster in file order, so each is read once for the batch
+  auto cluster_key = [](const std::pair<size_t, ClusterRequest>& entry) {
+    return std::make_pair(entry.second.mesh->clusters.get(),
+                          entry.second.cluster);
+  };
+  std::sort(deferred.begin(), deferred.end(),
+            [&](const auto& a, const auto& b) {
+              return cluster_key(a) < cluster_key(b);
+            });
+  for (size_t begin = 0; begin < deferred.size();) {
+    size_t end = begin + 1;
+    while (end < deferred.size() &&
+           cluster_key(deferred[end]) == cluster_key(deferred[begin])) {
+      ++end;
+    }
+
+    // rays that found a closer hit meanwhile don't need the cluster
+    std::shared_ptr<const GeometryCluster> cluster;
+    for (size_t i = begin; i < end; ++i) {
+      const auto& [ray, request] = deferred[i];
+      if (request.t_enter >= hits[ray].t)
+        continue;
+      if (!cluster) {
+        cluster = request.mesh->clusters->acquire(request.cluster);
+      }
+      hit_cluster(request, cluster, to_object(*request.instance, rays[ray]),
+                  t_min, hits[ray]);
+    }
+    begin = end;
+  }
 
-    const auto& indices =
-        mesh.bvh ? mesh.bvh->get_intersect_indices(ray, t_min, t_max)
-                 : IntersectIndices(mesh.indices);
+  std::vector<bool> result(rays.size());
+  for (size_t i = 0; i < rays.size(); ++i) {
+    result[i] = finish_hit(rays[i], hits[i], records[i]);
+  }
+  return result;
+}
 
-    for (size_t i = 0; i < indices.size(); i += 3) {
-      const auto& v0 = mesh.vertexes[indices[i]];
-      const auto& v1 = mesh.vertexes[indices[i + 1]];
-      const auto& v2 = mesh.vertexes[indices[i + 2]];
+void RayTracer::hit_scene(const Ray& ray, float t_min, ClosestHit& hit,
+                          std::vector<ClusterRequest>& deferred) const {
+  scene_->for_each_instance(
+      ray, t_min, hit.t, [&](const Instance& instance) {
+        hit_instance(instance, *scene_->get_models()[instance.model],
+                     to_object(instance, ray), t_min, hit, deferred);
+      });
+}
+
+Ray RayTracer::to_object(const Instance& instance, const Ray& ray) {
+  Ray local = ray;
+  if (!instance.identity) {
+    // the direction isn't normalized, so distances stay world ones
+    local.origin = instance.inverse * ray.origin;
+    local.direction = instance.inverse.linear() * ray.direction;
+  }
+  return local;
+}
+
+bool RayTracer::finish_hit(const Ray& ray, const ClosestHit& hit,
+                           HitRecord& rec) const {
+  if (!hit.mesh)
+    return false;
+
+  std::array<PackedVertex, 3> vertexes;
+  for (size_t i = 0; i < 3; ++i) {
+    if (hit.lod) {
+      vertexes[i] = hit.lod->vertexes[hit.corners[i]];
+    } else if (hit.cluster) {
+      vertexes[i] = hit.cluster->vertexes[hit.corners[i]];
+    } else {
+      vertexes[i] = hit.mesh->get_vertex(hit.corners[i]);
+    }
+    if (!hit.instance->identity) {
+      // normals go with the inverse transpose
+      Vector3f position = hit.instance->transform * vertexes[i].get_position();
+      Vector3f normal = hit.instance->inverse.linear().transpose() *
+                        vertexes[i].get_normal();
+      vertexes[i].position = {position.x(), position.y(), position.z()};
+      vertexes[i].normal = {normal.x(), normal.y(), normal.z()};
+    }
+  }
+
+  fill_hit(ray, vertexes[0], vertexes[1], vertexes[2], hit.t, hit.u, hit.v,
+           rec);
+  rec.material = hit.mesh->material.lock();
+  rec.material_id =
+      hit.mesh->material_id < 0
+          ? hit.mesh->material_id
+          : int32_t(scene_->get_material_offset(hit.instance->model) +
+                    hit.mesh->material_id);
+  return true;
+}
+
+template <typename Position>
+bool RayTracer::closest_triangle(const Ray& ray, float t_min, float& t_max,
+                                 const IntersectIndices& indices,
+                                 const Position& position,
+                                 std::array<VertexIndex, 3>& corners, float& u,
+                                 float& v) {
+  bool found = false;
+  for (size_t i = 0; i < indices.size(); i += 3) {
+    std::array<VertexIndex, 3> triangle{indices[i], indices[i + 1],
+                                        indices[i + 2]};
+    float t, tu, tv;
+    if (intersect_triangle(ray, position(triangle[0]), position(triangle[1]),
+                           position(triangle[2]), t_min, t_max, t, tu, tv)) {
+      t_max = t;
+      corners = triangle;
+      u = tu;
+      v = tv;
+      found = true;
+    }
+  }
+  return found;
+}
+
+const MeshLOD* RayTracer::select_lod(const Mesh& mesh, const Ray& ray,
+                                     float t, float scale) const {
+  float tolerance = lod_error_ * ray.cone_width_at(std::max(t, 0.0f));
+  const MeshLOD* result = nullptr;
+  for (const auto& lod : mesh.lods) {
+    if (lod.error * scale > tolerance)
+      break;
+    result = &lod;
+  }
+  return result;
+}
+
+void RayTracer::hit_instance(const Instance& instance, const Model& model,
+                             const Ray& ray, float t_min, ClosestHit& hit,
+                             std::vector<ClusterRequest>& deferred) const {
+  for (const auto& mesh : model.get_meshes()) {
+    if (mesh.material.expired())
+      continue;
 
-      if (hit_triangle(ray, v0, v1, v2, t_min, closest_so_far, temp_rec)) {
-        closest_so_far = temp_rec.t;
-        rec = temp_rec;
-        rec.material = material_ptr;
-        hit_anything = true;
+    // the level is chosen by the distance the ray reaches the mesh bounds
+    if (lod_error_ > 0.0f && !mesh.lods.empty()) {
+      float t_enter;
+      if (!mesh.get_bbox().intersect(ray, t_min, hit.t, t_enter))
+        continue;
+      if (const auto* lod = select_lod(mesh, ray, t_enter, instance.scale)) {
+        auto& indices = intersect_scratch();
+        lod->bvh->get_intersect_indices(ray, t_min, hit.t, indices);
+        auto position = [lod](VertexIndex i) {
+          return lod->vertexes[i].get_position();
+        };
+        if (closest_triangle(ray, t_min, hit.t, indices, position,
+                             hit.corners, hit.u, hit.v)) {
+          hit.instance = &instance;
+          hit.mesh = &mesh;
+          hit.cluster = nullptr;
+          hit.lod = lod;
+        }
+        continue;
       }
     }
+
+    if (mesh.clusters) {
+      // resident clusters now, the others once they may still be closer
+      mesh.clusters->for_each_cluster(
+          ray, t_min, hit.t, [&](uint32_t id, float t_enter) {
+            ClusterRequest request{&instance, &mesh, id, t_enter};
+            if (auto cluster = mesh.clusters->find(id)) {
+              hit_cluster(request, std::move(cluster), ray, t_min, hit);
+            } else {
+              deferred.push_back(request);
+            }
+          });
+      continue;
+    }
+
+    // a deferred BVH is built once a ray reaches the mesh bounds
+    if (mesh.deferred_bvh && !mesh.bbox.intersect(ray, t_min, hit.t))
+      continue;
+
+    const auto* bvh = mesh.get_bvh();
+    auto& indices = intersect_scratch();
+    if (bvh) {
+      bvh->get_intersect_indices(ray, t_min, hit.t, indices);
+    } else {
+      indices.clear();
+      indices.add(mesh.indices);
+    }
+    auto position = [&mesh](VertexIndex i) { return mesh.get_position(i); };
+    if (closest_triangle(ray, t_min, hit.t, indices, position, hit.corners,
+                         hit.u, hit.v)) {
+      hit.instance = &instance;
+      hit.mesh = &mesh;
+      hit.cluster = nullptr;
+      hit.lod = nullptr;
+    }
   }
+}
 
-  return hit_anything;
+void RayTracer::hit_cluster(const ClusterRequest& request,
+                            std::shared_ptr<const GeometryCluster> cluster,
+                            const Ray& ray, float t_min, ClosestHit& hit) {
+  auto& indices = intersect_scratch();
+  cluster->bvh.get_intersect_indices(ray, t_min, hit.t, indices);
+  auto position = [&cluster](VertexIndex i) {
+    return cluster->vertexes[i].get_position();
+  };
+  if (closest_triangle(ray, t_min, hit.t, indices, position, hit.corners,
+                       hit.u, hit.v)) {
+    hit.instance = request.instance;
+    hit.mesh = request.mesh;
+    hit.cluster = std::move(cluster);
+    hit.lod = nullptr;
+  }
 }
 
 bool RayTracer::hit_triangle(const Ray& ray, const PackedVertex& v0,
                              const PackedVertex& v1, const PackedVertex& v2,
                              float t_min, float t_max, HitRecord& rec) {
-  const auto p0 = v0.get_position();
-  const auto p1 = v1.get_position();
-  const auto p2 = v2.get_position();
+  float t, u, v;
+  if (!intersect_triangle(ray, v0.get_position(), v1.get_position(),
+                          v2.get_position(), t_min, t_max, t, u, v))
+    return false;
+
+  fill_hit(ray, v0, v1, v2, t, u, v, rec);
+  return true;
+}
 
+bool RayTracer::intersect_triangle(const Ray& ray, const Vector3f& p0,
+                                   const Vector3f& p1, const Vector3f& p2,
+                                   float t_min, float t_max, float& t,
+                                   float& u, float& v) {
   // Möller–Trumbore intersection algorithm
   const Vector3f e1 = p1 - p0;
   const Vector3f e2 = p2 - p0;
@@ -146,40 +468,58 @@ bool RayTracer::hit_triangle(const Ray& ray, const PackedVertex& v0,
 
   const float f = 1.0f / a;
   const Vector3f s = ray.origin - p0;
-  const float u = f * s.dot(h);
+  u = f * s.dot(h);
 
   if (u < 0.0f || u > 1.0f) {
     return false;
   }
 
   const Vector3f q = s.cross(e1);
-  const float v = f * ray.direction.dot(q);
+  v = f * ray.direction.dot(q);
 
   if (v < 0.0f || u + v > 1.0f) {
     return false;
   }
 
-  const float t = f * e2.dot(q);
-
-  if (t > t_min && t < t_max) {
-    rec.t = t;
-    rec.point = ray.origin + t * ray.direction;
-
-    // Normal interpolation
-    float w = 1.0f - u - v;
-    rec.normal =
-        (w * v0.get_normal() + u * v1.get_normal() + v * v2.get_normal())
-            .normalized();
-    rec.set_face_normal(ray, rec.normal);
-
-    // Texture coordinate interpolation
-    rec.tex_coord =
-        w * v0.get_texcoord() + u * v1.get_texcoord() + v * v2.get_texcoord();
+  t = f * e2.dot(q);
+  return t > t_min && t < t_max;
+}
 
-    return true;
+void RayTracer::fill_hit(const Ray& ray, const PackedVertex& v0,
+                         const PackedVertex& v1, const PackedVertex& v2,
+                         float t, float u, float v, HitRecord& rec) {
+  rec.t = t;
+  rec.point = ray.origin + t * ray.direction;
+
+  // Normal interpolation
+  float w = 1.0f - u - v;
+  rec.normal =
+      (w * v0.get_normal() + u * v1.get_normal() + v * v2.get_normal())
+          .normalized();
+  rec.set_face_normal(ray, rec.normal);
+
+  // Texture coordinate interpolation
+  rec.tex_coord =
+      w * v0.get_texcoord() + u * v1.get_texcoord() + v * v2.get_texcoord();
+
+  // Ray cone footprint in texture space: the cone width scaled by the
+  // texture to world area ratio of the triangle and by the incidence
+  rec.footprint = 0.0f;
+  float width = ray.cone_width_at(t);
+  if (width > 0.0f) {
+    Vector3f geometric_normal = (v1.get_position() - v0.get_position())
+                                    .cross(v2.get_position() -
+                                           v0.get_position());
+    float world_area = geometric_normal.norm();
+    Vector2f uv1 = v1.get_texcoord() - v0.get_texcoord();
+    Vector2f uv2 = v2.get_texcoord() - v0.get_texcoord();
+    float tex_area = std::abs(uv1.x() * uv2.y() - uv1.y() * uv2.x());
+    float cos_theta =
+        std::abs(ray.direction.dot(geometric_normal)) / world_area;
+    if (tex_area > 0.0f && cos_theta > 0.0f) {
+      rec.footprint = width * std::sqrt(tex_area / world_area) / cos_theta;
+    }
   }
-
-  return false;
 }
 
 /// @brief Light calculation by Phong method
@@ -193,23 +533,24 @@ Vector3f RayTracer::calculate_lighting(const HitRecord& rec) {
 
   Vector3f view_dir = (camera_->get_position() - rec.point).normalized();
 
-  for (const auto& light : lights_) {
+  Vector3f diffuse_color =
+      texture_color(rec.material->diffuse, rec.material->diffuse_texture, rec);
+
+  auto add_light = [&](const Light& light, float weight) {
     Vector3f light_dir = light.position - rec.point;
     float distance = light_dir.norm();
     light_dir = light_dir.normalized();
 
-    float attenuation =
-        1.0f / (1.0f + 0.1f * distance + 0.01f * distance * distance);
+    float attenuation = weight * light_attenuation(distance);
 
     float n_dot_l = light_dir.dot(rec.normal);
     if (n_dot_l <= 0.0f) {
-      continue;
+      return;
     }
 
     // diffuse component
-    diffuse += attenuation * n_dot_l *
-               light.intensity.cwiseProduct(texture_color(
-                   rec.material->diffuse, rec.material->diffuse_texture, rec));
+    diffuse +=
+        attenuation * n_dot_l * light.intensity.cwiseProduct(diffuse_color);
 
     // specular component
     Vector3f reflect_dir = reflect(-light_dir, rec.normal).normalized();
@@ -220,6 +561,57 @@ Vector3f RayTracer::calculate_lighting(const HitRecord& rec) {
     Vector3f material_specular = rec.material->specular;
     specular += attenuation * spec_intensity * n_dot_l *
                 light.intensity.cwiseProduct(material_specular);
+  };
+
+  const auto& light_tree = get_light_tree();
+  if (light_samples_ == 0) {
+    light_tree.for_each_light(
+        rec.point, [&](uint32_t index) { add_light(lights_[index], 1.0f); });
+  } else {
+    // Stochastic selection proportional to the estimated unshadowed
+    // contribution; each sample is weighted by 1 / (samples * pdf)
+    thread_local std::vector<std::pair<uint32_t, float>> candidates;
+    thread_local std::minstd_rand generator(std::random_device{}());
+
+    candidates.clear();
+    float total_weight = 0.0f;
+    light_tree.for_each_light(rec.point, [&](uint32_t index) {
+      const auto& light = lights_[index];
+      Vector3f light_dir = light.position - rec.point;
+      float distance = light_dir.norm();
+      float n_dot_l = light_dir.dot(rec.normal) / std::max(distance, bias);
+      if (n_dot_l <= 0.0f)
+        return;
+
+      float weight =
+          light.intensity.maxCoeff() * light_attenuation(distance) * n_dot_l;
+      if (weight <= 0.0f)
+        return;
+
+      total_weight += weight;
+      candidates.emplace_back(index, total_weight);
+    });
+
+    if (candidates.size() <= light_samples_) {
+      for (const auto& [index, cdf] : candidates) {
+        add_light(lights_[index], 1.0f);
+      }
+    } else {
+      std::uniform_real_distribution<float> distribution(0.0f, total_weight);
+      for (size_t i = 0; i < light_samples_; ++i) {
+        float value = distribution(generator);
+        auto it = std::upper_bound(
+            candidates.begin(), candidates.end(), value,
+            [](float v, const auto& c) { return v < c.second; });
+        if (it == candidates.end())
+          it = std::prev(candidates.end());
+
+        float prev_cdf =
+            it == candidates.begin() ? 0.0f : std::prev(it)->second;
+        float pdf = (it->second - prev_cdf) / total_weight;
+        add_light(lights_[it->first], 1.0f / (light_samples_ * pdf));
+      }
+    }
   }
 
   // Limit result
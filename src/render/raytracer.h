@@ -1,14 +1,22 @@
 #pragma once
 
+#include <array>
+#include <atomic>
 #include <eigen3/Eigen/Core>
+#include <limits>
 #include <memory>
+#include <mutex>
+#include <span>
 #include <vector>
 
 #include "aabb.h"
 #include "camera.h"
+#include "geometry_pager.h"
+#include "light_bvh.h"
 #include "material.h"
 #include "model.h"
 #include "ray.h"
+#include "scene.h"
 
 namespace rtr {
 
@@ -20,15 +28,66 @@ class RayTracer {
   RayTracer(std::shared_ptr<const Model> model,
             std::shared_ptr<const Camera> camera,
             const Vector3f& bg_color = Vector3f(0.898f, 0.95687f, 1.0f))
-      : model_(model), camera_(camera), background_color_(bg_color) {}
+      : RayTracer(std::make_shared<Scene>(std::move(model)), camera,
+                  bg_color) {}
+  /// @brief Traces a built scene
+  RayTracer(std::shared_ptr<const Scene> scene,
+            std::shared_ptr<const Camera> camera,
+            const Vector3f& bg_color = Vector3f(0.898f, 0.95687f, 1.0f))
+      : scene_(scene), camera_(camera), background_color_(bg_color) {}
 
-  void add_light(const Light& light) { lights_.push_back(light); }
+  void add_light(const Light& light);
   [[nodiscard]] const std::vector<Light> get_lights() const { return lights_; }
   void remove_light(size_t index);
   void remove_light(const Light& light);
+  void set_light(size_t index, const Light& light);
+  void set_lights(std::vector<Light> lights);
+
+  /// @brief Lights whose attenuated intensity falls below the cutoff are
+  /// skipped during shading (0 disables culling)
+  void set_light_cutoff(float cutoff);
+  [[nodiscard]] float get_light_cutoff() const { return light_cutoff_; }
+  /// @brief Number of stochastically chosen lights per shading point when
+  /// more lights reach it (0 evaluates all of them)
+  void set_light_samples(size_t samples) { light_samples_ = samples; }
+  [[nodiscard]] size_t get_light_samples() const { return light_samples_; }
+
+  /// @brief Replaces a material of the scene in place; geometry and BVH are
+  /// not touched. Must not be called while a frame is being rendered. Ids
+  /// are the ones of Scene::get_materials(), unknown ids are ignored.
+  void set_material(size_t id, const Material& material);
+  [[nodiscard]] std::shared_ptr<Material> get_material(size_t id) const;
 
   [[nodiscard]] Vector3f trace_pixel(float u, float v, int max_depth = 5);
 
+  /// @brief Closest hit of the primary ray without shading
+  bool hit_pixel(float u, float v, HitRecord& rec) const;
+  /// @brief Closest hits of the primary rays of many pixels, traced as one
+  /// batch, see hit_rays(). Returns per pixel whether its ray hit.
+  [[nodiscard]] std::vector<bool> hit_pixels(std::span<const Vector2f> pixels,
+                                             std::span<HitRecord> records)
+      const;
+  /// @brief Whether any mesh of the scene is out of core
+  [[nodiscard]] bool has_paged_geometry() const;
+  /// @brief Shading of a primary hit, secondary rays are traced as usual
+  [[nodiscard]] Vector3f shade_pixel(float u, float v, const HitRecord& rec,
+                                     int max_depth = 5);
+
+  /// @brief Geometric error tolerated in pixel widths: a mesh is traced at
+  /// its coarsest level of detail whose error stays below it at the
+  /// distance the ray reaches the mesh. 0 always traces full detail. Must
+  /// not be called while a frame is being rendered.
+  void set_lod_error(float pixels) { lod_error_ = pixels; }
+  [[nodiscard]] float get_lod_error() const { return lod_error_; }
+
+  /// @brief Height of the image in pixels, primary rays get the cone of a
+  /// pixel to select texture mip levels (0 samples full resolution)
+  void set_image_height(size_t height) { image_height_ = height; }
+
+  [[nodiscard]] const Vector3f& get_background_color() const {
+    return background_color_;
+  }
+
   void build_bvh();
   [[nodiscard]] AABB get_root_bbox() const { return bbox_; };
 
@@ -37,20 +96,109 @@ class RayTracer {
 
   [[nodiscard]] Vector3f trace_ray(const Ray& ray, int depth);
 
+  [[nodiscard]] Vector3f shade(const Ray& ray, const HitRecord& rec,
+                               int depth);
+
+  /// @brief Clusters of out-of-core meshes that aren't resident are read
+  /// in the order the ray enters them, once the resident geometry is
+  /// tested and only while they may hold a closer hit
   bool hit_model(const Ray& ray, float t_min, float t_max,
                  HitRecord& rec) const;
+  /// @brief Closest hits of a batch of rays. Clusters that aren't resident
+  /// are deferred until every ray has passed the resident geometry, then
+  /// each is read once for all rays it may still give a closer hit.
+  [[nodiscard]] std::vector<bool> hit_rays(std::span<const Ray> rays,
+                                           float t_min, float t_max,
+                                           std::span<HitRecord> records) const;
+
+  /// @brief Closest hit found so far, shading attributes are read once it
+  /// is final
+  struct ClosestHit {
+    float t = std::numeric_limits<float>::max();
+    const Instance* instance = nullptr;
+    const Mesh* mesh = nullptr;
+    // vertexes of out-of-core meshes
+    std::shared_ptr<const GeometryCluster> cluster;
+    const MeshLOD* lod = nullptr;  // level of detail hit
+    std::array<VertexIndex, 3> corners;
+    float u = 0.0f, v = 0.0f;
+  };
+  /// @brief Cluster reached by a ray that wasn't resident
+  struct ClusterRequest {
+    const Instance* instance;
+    const Mesh* mesh;
+    uint32_t cluster;
+    float t_enter;
+  };
+
+  /// @brief Closest hit in the resident geometry of the scene, the
+  /// clusters that aren't resident are appended to deferred
+  void hit_scene(const Ray& ray, float t_min, ClosestHit& hit,
+                 std::vector<ClusterRequest>& deferred) const;
+  /// @brief Closest hit in the meshes of one instance, the ray is in object
+  /// space
+  void hit_instance(const Instance& instance, const Model& model,
+                    const Ray& ray, float t_min, ClosestHit& hit,
+                    std::vector<ClusterRequest>& deferred) const;
+  /// @brief Coarsest level of detail of the mesh within the error
+  /// tolerance at the distance t, null for full detail; the object space
+  /// errors are stretched by scale to compare with the world ray cone
+  [[nodiscard]] const MeshLOD* select_lod(const Mesh& mesh, const Ray& ray,
+                                          float t, float scale) const;
+  /// @brief Closest hit in a paged in cluster, the ray is in object space
+  static void hit_cluster(const ClusterRequest& request,
+                          std::shared_ptr<const GeometryCluster> cluster,
+                          const Ray& ray, float t_min, ClosestHit& hit);
+  /// @brief Fills the record of the final closest hit
+  bool finish_hit(const Ray& ray, const ClosestHit& hit,
+                  HitRecord& rec) const;
+  /// @brief Ray in the object space of the instance
+  static Ray to_object(const Instance& instance, const Ray& ray);
+  /// @brief Tests the triangles of the indices, lowers t_max on a hit
+  template <typename Position>
+  static bool closest_triangle(const Ray& ray, float t_min, float& t_max,
+                               const IntersectIndices& indices,
+                               const Position& position,
+                               std::array<VertexIndex, 3>& corners, float& u,
+                               float& v);
 
   static bool hit_triangle(const Ray& ray, const PackedVertex& v0,
                            const PackedVertex& v1, const PackedVertex& v2,
                            float t_min, float t_max, HitRecord& rec);
 
+  /// @brief Möller–Trumbore test on positions only, gives the distance and
+  /// the barycentric coordinates of v1 and v2
+  static bool intersect_triangle(const Ray& ray, const Vector3f& p0,
+                                 const Vector3f& p1, const Vector3f& p2,
+                                 float t_min, float t_max, float& t, float& u,
+                                 float& v);
+  /// @brief Interpolates the shading attributes of a hit
+  static void fill_hit(const Ray& ray, const PackedVertex& v0,
+                       const PackedVertex& v1, const PackedVertex& v2,
+                       float t, float u, float v, HitRecord& rec);
+
   [[nodiscard]] Vector3f calculate_lighting(const HitRecord& rec);
 
  private:
-  std::shared_ptr<const Model> model_;
+  /// @brief The light tree is built again before the next shading, so a
+  /// series of light edits builds it once
+  void invalidate_light_tree();
+  /// @brief Light tree, built first if the lights changed. Concurrent
+  /// callers wait for one build.
+  const LightBVH& get_light_tree();
+
+ private:
+  std::shared_ptr<const Scene> scene_;
   std::shared_ptr<const Camera> camera_;
   Vector3f background_color_;
   std::vector<Light> lights_;
+  LightBVH light_tree_;
+  std::atomic<bool> light_tree_dirty_{false};
+  std::mutex light_tree_mutex_;
+  float light_cutoff_ = 0.f;
+  size_t light_samples_ = 0;
+  size_t image_height_ = 0;
+  float lod_error_ = 0.f;
   AABB bbox_;
 };
 
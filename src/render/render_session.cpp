@@ -0,0 +1,89 @@
+#include "render_session.h"
+
+namespace rtr {
+
+RenderSession::RenderSession(std::shared_ptr<const Model> model,
+                             std::shared_ptr<Camera> camera, size_t width,
+                             size_t height, FrameCallback callback,
+                             int num_threads, size_t preview_block_size)
+    : camera_(camera),
+      renderer_(model, camera, width, height),
+      callback_(std::move(callback)),
+      num_threads_(num_threads),
+      preview_block_size_(preview_block_size),
+      worker_([this](std::stop_token stop_token) { loop(stop_token); }) {}
+
+RenderSession::~RenderSession() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    frame_stop_.request_stop();
+  }
+  worker_.request_stop();
+  worker_.join();
+}
+
+void RenderSession::update_camera(const std::function<void(Camera&)>& update) {
+  restart([&]() { update(*camera_); });
+}
+
+void RenderSession::update_scene(
+    const std::function<void(RayTracer&)>& update) {
+  restart([&]() { update(renderer_.get_ray_tracer()); });
+}
+
+void RenderSession::wait() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  condition_.wait(lock, [this]() {
+    return rendered_frame_ == requested_frame_ && !rendering_;
+  });
+}
+
+void RenderSession::restart(const std::function<void()>& update) {
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  // the frame in flight stops after its current tiles
+  frame_stop_.request_stop();
+  condition_.wait(lock, [this]() { return !rendering_; });
+
+  update();
+  ++requested_frame_;
+  condition_.notify_all();
+}
+
+void RenderSession::loop(std::stop_token stop_token) {
+  while (!stop_token.stop_requested()) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (!condition_.wait(lock, stop_token, [this]() {
+          return rendered_frame_ != requested_frame_;
+        })) {
+      return;
+    }
+
+    uint64_t frame = requested_frame_;
+    frame_stop_ = std::stop_source();
+    auto frame_stop = frame_stop_.get_token();
+    rendering_ = true;
+    lock.unlock();
+
+    bool completed =
+        renderer_.render_preview(preview_block_size_, num_threads_, frame_stop);
+    if (completed && callback_) {
+      callback_(renderer_.get_frame_buffer(), true);
+    }
+
+    completed =
+        completed && renderer_.render(num_threads_, nullptr, frame_stop);
+    if (completed && callback_) {
+      callback_(renderer_.get_frame_buffer(), false);
+    }
+
+    lock.lock();
+    rendering_ = false;
+    if (completed) {
+      rendered_frame_ = frame;
+    }
+    condition_.notify_all();
+  }
+}
+
+}  // namespace rtr
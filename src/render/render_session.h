@@ -0,0 +1,70 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stop_token>
+#include <thread>
+
+#include "camera.h"
+#include "framebuffer.h"
+#include "model.h"
+#include "renderer.h"
+
+namespace rtr {
+
+/// @brief Long-lived progressive renderer for interactive viewers
+///
+/// Keeps the model, its BVHs and the thread pool alive between frames. Every
+/// change of the view cancels the frame in flight (within one tile) and
+/// restarts it: first a low-resolution preview pass, then the full frame.
+class RenderSession {
+ public:
+  /// @brief Called from the session thread after each finished pass
+  using FrameCallback =
+      std::function<void(const FrameBuffer& frame, bool preview)>;
+
+  RenderSession(std::shared_ptr<const Model> model,
+                std::shared_ptr<Camera> camera, size_t width, size_t height,
+                FrameCallback callback,
+                int num_threads = std::thread::hardware_concurrency(),
+                size_t preview_block_size = 8);
+  ~RenderSession();
+
+  RenderSession(const RenderSession&) = delete;
+  RenderSession& operator=(const RenderSession&) = delete;
+
+  /// @brief Applies a camera change, e.g. Camera::move_forward or
+  /// Camera::rotate, and restarts rendering
+  void update_camera(const std::function<void(Camera&)>& update);
+
+  /// @brief Applies a change of lights or materials and restarts rendering
+  void update_scene(const std::function<void(RayTracer&)>& update);
+
+  /// @brief Blocks until the latest requested frame is fully rendered
+  void wait();
+
+ private:
+  void restart(const std::function<void()>& update);
+  void loop(std::stop_token stop_token);
+
+ private:
+  std::shared_ptr<Camera> camera_;
+  Renderer renderer_;
+  FrameCallback callback_;
+  int num_threads_;
+  size_t preview_block_size_;
+
+  std::mutex mutex_;
+  std::condition_variable_any condition_;
+  std::stop_source frame_stop_;
+  uint64_t requested_frame_ = 1;
+  uint64_t rendered_frame_ = 0;
+  bool rendering_ = false;
+
+  std::jthread worker_;
+};
+
+}  // namespace rtr
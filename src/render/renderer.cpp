@@ -1,6 +1,10 @@
 #include "renderer.h"
 
+#include <algorithm>
 #include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <numeric>
 #include <vector>
 
 namespace rtr {
@@ -8,13 +12,39 @@ namespace rtr {
 constexpr size_t tile_size = 32;
 constexpr float pixel_bias = 0.5f;
 
+/// @brief Tolerates the error of a preview block for one pass
+class PreviewLod {
+ public:
+  PreviewLod(RayTracer& tracer, bool enabled, size_t block_size)
+      : tracer_(tracer), saved_(tracer.get_lod_error()) {
+    if (enabled && block_size > 1) {
+      tracer_.set_lod_error(std::max(saved_, float(block_size)));
+    }
+  }
+  ~PreviewLod() { tracer_.set_lod_error(saved_); }
+
+ private:
+  RayTracer& tracer_;
+  float saved_;
+};
+
 Renderer::Renderer(std::shared_ptr<const Model> model,
                    std::shared_ptr<const Camera> camera, size_t width,
-                   size_t height)
-    : ray_tracer_(model, camera),
+                   size_t height, std::shared_ptr<ThreadPool> thread_pool)
+    : Renderer(std::make_shared<Scene>(std::move(model)), camera, width,
+               height, std::move(thread_pool)) {}
+
+Renderer::Renderer(std::shared_ptr<const Scene> scene,
+                   std::shared_ptr<const Camera> camera, size_t width,
+                   size_t height, std::shared_ptr<ThreadPool> thread_pool)
+    : camera_(camera),
+      ray_tracer_(scene, camera),
       frame_buffer_(width, height),
+      thread_pool_(thread_pool),
+      shared_thread_pool_(thread_pool != nullptr),
       progress_(0.0f) {
   ray_tracer_.build_bvh();
+  ray_tracer_.set_image_height(height);
 
   // automatic lights
 
@@ -42,62 +72,466 @@ Renderer::Renderer(std::shared_ptr<const Model> model,
                 base_intensity * 0.2f)});
 }
 
-void Renderer::render(int num_threads, ProgressCallback callback) {
-  // Tiling
-  std::vector<std::pair<size_t, size_t>> tiles;
-  for (int y = 0; y < frame_buffer_.get_height(); y += tile_size) {
-    for (int x = 0; x < frame_buffer_.get_width(); x += tile_size) {
-      tiles.emplace_back(x, y);
+bool Renderer::render(int num_threads, ProgressCallback callback,
+                      std::stop_token stop_token) {
+  if (ray_tracer_.has_paged_geometry()) {
+    return render_batched(num_threads, callback, stop_token);
+  }
+
+  if (!keep_gbuffer_) {
+    auto trace = [this](size_t x, size_t y) {
+      float u = (x + pixel_bias) / frame_buffer_.get_width();
+      float v = (y + pixel_bias) / frame_buffer_.get_height();
+      return ray_tracer_.trace_pixel(u, v);
+    };
+    return render_tiles(num_threads, callback, trace, stop_token);
+  }
+
+  gbuffer_.reset(frame_buffer_.get_width(), frame_buffer_.get_height(),
+                 *camera_);
+
+  auto trace_and_store = [this](size_t x, size_t y) {
+    float u = (x + pixel_bias) / frame_buffer_.get_width();
+    float v = (y + pixel_bias) / frame_buffer_.get_height();
+
+    HitRecord rec;
+    if (!ray_tracer_.hit_pixel(u, v, rec)) {
+      return ray_tracer_.get_background_color();
     }
+
+    store_sample(x, y, rec);
+    return ray_tracer_.shade_pixel(u, v, rec);
+  };
+  bool completed =
+      render_tiles(num_threads, callback, trace_and_store, stop_token);
+
+  // a partially traced G-buffer can't be re-shaded
+  if (!completed) {
+    gbuffer_.clear();
+  }
+  return completed;
+}
+
+bool Renderer::render_batched(int num_threads, ProgressCallback callback,
+                              std::stop_token stop_token) {
+  if (keep_gbuffer_) {
+    gbuffer_.reset(frame_buffer_.get_width(), frame_buffer_.get_height(),
+                   *camera_);
   }
 
-  // Progress
-  std::atomic<int> tiles_completed{0};
-  const int total_tiles = tiles.size();
+  auto trace_tile = [this](size_t x0, size_t y0, size_t x1, size_t y1) {
+    std::vector<Eigen::Vector2f> pixels;
+    for (size_t y = y0; y < y1; ++y) {
+      for (size_t x = x0; x < x1; ++x) {
+        pixels.emplace_back((x + pixel_bias) / frame_buffer_.get_width(),
+                            (y + pixel_bias) / frame_buffer_.get_height());
+      }
+    }
+    std::vector<HitRecord> records(pixels.size());
+    auto hits = ray_tracer_.hit_pixels(pixels, records);
+
+    std::vector<Vector3f> colors(pixels.size());
+    for (size_t i = 0; i < pixels.size(); ++i) {
+      if (!hits[i]) {
+        colors[i] = ray_tracer_.get_background_color();
+        continue;
+      }
+      if (keep_gbuffer_) {
+        store_sample(x0 + i % (x1 - x0), y0 + i / (x1 - x0), records[i]);
+      }
+      colors[i] =
+          ray_tracer_.shade_pixel(pixels[i].x(), pixels[i].y(), records[i]);
+    }
+    return colors;
+  };
+  bool completed = render_tiles(num_threads, callback, trace_tile, stop_token);
+
+  if (keep_gbuffer_ && !completed) {
+    gbuffer_.clear();
+  }
+  return completed;
+}
+
+void Renderer::store_sample(size_t x, size_t y, const HitRecord& rec) {
+  auto& sample = gbuffer_.at(x, y);
+  sample.position = rec.point;
+  sample.normal = rec.normal;
+  sample.tex_coord = rec.tex_coord;
+  sample.footprint = rec.footprint;
+  sample.depth = rec.t;
+  sample.material_id = rec.material_id;
+  sample.front_face = rec.front_face;
+}
+
+RenderQuality Renderer::render(Clock::time_point deadline, int num_threads,
+                               ProgressCallback callback) {
+  const auto start = Clock::now();
+  RenderQuality quality;
+
+  auto tiles = make_tiles();
+  quality.total_tiles = tiles.size();
+
+  // stops refinement passes once the deadline is reached
+  std::stop_source deadline_source;
+  std::jthread timer([&deadline_source, deadline](std::stop_token stop) {
+    std::mutex mutex;
+    std::condition_variable_any condition;
+    std::unique_lock<std::mutex> lock(mutex);
+    condition.wait_until(lock, stop, deadline, []() { return false; });
+    if (!stop.stop_requested()) {
+      deadline_source.request_stop();
+    }
+  });
+
+  // Sums of the samples traced so far per pixel. A level of the same depth
+  // as the previous one adds its samples to them instead of starting over.
+  const size_t width = frame_buffer_.get_width();
+  std::vector<Vector3f> sums(width * frame_buffer_.get_height(),
+                             Vector3f::Zero());
+  size_t accumulated = 0;  // samples per pixel in the sums
+  int accumulated_depth = -1;
+
+  const float level_count = quality_levels.size();
+  for (size_t level = 0; level < quality_levels.size(); ++level) {
+    const auto& settings = quality_levels[level];
+    // stratified sub-pixel samples
+    const size_t grid = std::max<size_t>(
+        1, static_cast<size_t>(std::sqrt(settings.samples_per_pixel)));
+    const size_t reused =
+        settings.block_size == 1 && settings.max_depth == accumulated_depth
+            ? accumulated
+            : 0;
+
+    auto trace = [this, &settings, &sums, width, grid, reused](size_t x,
+                                                               size_t y) {
+      if (settings.block_size > 1) {
+        float u = (x + 0.5f * settings.block_size) / frame_buffer_.get_width();
+        float v =
+            (y + 0.5f * settings.block_size) / frame_buffer_.get_height();
+        return ray_tracer_.trace_pixel(u, v, settings.max_depth);
+      }
+
+      Vector3f color = Vector3f::Zero();
+      for (size_t sy = 0; sy < grid; ++sy) {
+        for (size_t sx = 0; sx < grid; ++sx) {
+          float u = (x + (sx + 0.5f) / grid) / frame_buffer_.get_width();
+          float v = (y + (sy + 0.5f) / grid) / frame_buffer_.get_height();
+          color += ray_tracer_.trace_pixel(u, v, settings.max_depth);
+        }
+      }
+      Vector3f& sum = sums[y * width + x];
+      sum = reused > 0 ? Vector3f(sum + color) : color;
+      return Vector3f(sum / float(reused + grid * grid));
+    };
+
+    ProgressCallback level_callback = nullptr;
+    if (callback) {
+      level_callback = [&callback, level, level_count](float progress) {
+        callback((level + progress) / level_count);
+      };
+    }
+
+    // the coarse level always completes
+    std::stop_token stop =
+        level == 0 ? std::stop_token{} : deadline_source.get_token();
+    PreviewLod lod(ray_tracer_, preview_lod_, settings.block_size);
+    size_t completed = render_tiles(tiles, num_threads, level_callback, trace,
+                                    stop, settings.block_size);
+
+    if (completed < tiles.size()) {
+      quality.refined_tiles = completed;
+      quality.deadline_reached = true;
+      break;
+    }
+
+    if (settings.block_size == 1) {
+      accumulated = reused + grid * grid;
+      accumulated_depth = settings.max_depth;
+    }
+    quality.level = static_cast<int>(level);
+    quality.samples_per_pixel = settings.block_size == 1 ? accumulated : 1;
+    quality.max_depth = settings.max_depth;
+
+    if (deadline_source.stop_requested()) {
+      quality.deadline_reached = true;
+      break;
+    }
+
+    // refine the most contrasted tiles first
+    std::vector<float> variances(tiles.size());
+    for (size_t i = 0; i < tiles.size(); ++i) {
+      variances[i] = tile_variance(tiles[i]);
+    }
+    std::vector<size_t> order(tiles.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+      return variances[a] > variances[b];
+    });
+
+    std::vector<Tile> sorted_tiles;
+    sorted_tiles.reserve(tiles.size());
+    for (size_t i : order) {
+      sorted_tiles.push_back(tiles[i]);
+    }
+    tiles = std::move(sorted_tiles);
+  }
+
+  quality.elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(
+      Clock::now() - start);
+  return quality;
+}
+
+bool Renderer::render_preview(size_t block_size, int num_threads,
+                              std::stop_token stop_token) {
+  block_size = std::clamp<size_t>(block_size, 1, tile_size);
+
+  auto trace_block = [this, block_size](size_t x, size_t y) {
+    float u = (x + 0.5f * block_size) / frame_buffer_.get_width();
+    float v = (y + 0.5f * block_size) / frame_buffer_.get_height();
+    return ray_tracer_.trace_pixel(u, v);
+  };
+  PreviewLod lod(ray_tracer_, preview_lod_, block_size);
+  return render_tiles(num_threads, nullptr, trace_block, stop_token,
+                      block_size);
+}
+
+bool Renderer::relight(int num_threads, ProgressCallback callback,
+                       std::stop_token stop_token) {
+  if (!gbuffer_.is_valid(frame_buffer_.get_width(),
+                         frame_buffer_.get_height(), *camera_)) {
+    return render(num_threads, callback, stop_token);
+  }
+
+  auto shade_stored = [this](size_t x, size_t y) {
+    const auto& sample = gbuffer_.at(x, y);
+    if (!sample.is_hit()) {
+      return ray_tracer_.get_background_color();
+    }
+
+    HitRecord rec;
+    rec.t = sample.depth;
+    rec.point = sample.position;
+    rec.normal = sample.normal;
+    rec.tex_coord = sample.tex_coord;
+    rec.footprint = sample.footprint;
+    rec.material_id = sample.material_id;
+    rec.material = ray_tracer_.get_material(sample.material_id);
+    rec.front_face = sample.front_face;
+
+    float u = (x + pixel_bias) / frame_buffer_.get_width();
+    float v = (y + pixel_bias) / frame_buffer_.get_height();
+    return ray_tracer_.shade_pixel(u, v, rec);
+  };
+  return render_tiles(num_threads, callback, shade_stored, stop_token);
+}
+
+void Renderer::set_keep_gbuffer(bool keep) {
+  keep_gbuffer_ = keep;
+  if (!keep) {
+    gbuffer_.clear();
+  }
+}
+
+std::vector<Renderer::Tile> Renderer::make_tiles() const {
+  std::vector<Tile> tiles;
+  for (size_t y = 0; y < frame_buffer_.get_height(); y += tile_size) {
+    for (size_t x = 0; x < frame_buffer_.get_width(); x += tile_size) {
+      tiles.push_back({x, y});
+    }
+  }
+  return tiles;
+}
+
+bool Renderer::render_tiles(int num_threads, ProgressCallback callback,
+                            const PixelFunction& pixel_function,
+                            std::stop_token stop_token, size_t block_size) {
+  auto tiles = make_tiles();
+  return render_tiles(tiles, num_threads, callback, pixel_function,
+                      stop_token, block_size) == tiles.size();
+}
+
+struct Renderer::TileJob {
+  PixelFunction pixel_function;
+  TileFunction tile_function;  // replaces pixel_function if set
+  ProgressCallback callback;
+  std::stop_token stop_token;
+  size_t block_size;
+  int total_tiles;
+  std::atomic<int> completed_tiles{0};
+  std::atomic<int> finished_tiles{0};
+  std::mutex error_mutex;
+  std::exception_ptr error;
+  std::promise<bool> promise;
+  std::shared_future<bool> result;
+};
+
+size_t Renderer::render_tiles(const std::vector<Tile>& tiles, int num_threads,
+                              ProgressCallback callback,
+                              const PixelFunction& pixel_function,
+                              std::stop_token stop_token, size_t block_size) {
+  auto job = submit_tiles(tiles, num_threads, callback, pixel_function,
+                          stop_token, block_size);
+  job->result.get();
+  return job->completed_tiles;
+}
+
+bool Renderer::render_tiles(int num_threads, ProgressCallback callback,
+                            const TileFunction& tile_function,
+                            std::stop_token stop_token) {
+  auto tiles = make_tiles();
+  auto job = submit_tiles(tiles, num_threads, callback, nullptr, stop_token,
+                          1, tile_function);
+  job->result.get();
+  return job->completed_tiles == int(tiles.size());
+}
+
+std::shared_future<bool> Renderer::render_async(int num_threads,
+                                                ProgressCallback callback,
+                                                std::stop_token stop_token) {
+  auto trace = [this](size_t x, size_t y) {
+    float u = (x + pixel_bias) / frame_buffer_.get_width();
+    float v = (y + pixel_bias) / frame_buffer_.get_height();
+    return ray_tracer_.trace_pixel(u, v);
+  };
+  auto job = submit_tiles(make_tiles(), num_threads, callback, trace,
+                          stop_token, 1);
+  return job->result;
+}
+
+std::shared_ptr<Renderer::TileJob> Renderer::submit_tiles(
+    const std::vector<Tile>& tiles, int num_threads, ProgressCallback callback,
+    PixelFunction pixel_function, std::stop_token stop_token,
+    size_t block_size, TileFunction tile_function) {
+  auto job = std::make_shared<TileJob>();
+  job->pixel_function = std::move(pixel_function);
+  job->tile_function = std::move(tile_function);
+  job->callback = std::move(callback);
+  job->stop_token = stop_token;
+  job->block_size = block_size;
+  job->total_tiles = tiles.size();
+  job->result = job->promise.get_future().share();
   progress_ = 0.0f;
 
+  // called once per tile, the last one resolves the job
+  auto finish_tile = [this](TileJob& job) {
+    if (++job.finished_tiles != job.total_tiles) {
+      return;
+    }
+
+    if (job.error) {
+      job.promise.set_exception(job.error);
+      return;
+    }
+
+    bool completed = job.completed_tiles == job.total_tiles;
+    if (completed) {
+      progress_ = 1.0f;
+      if (job.callback) {
+        job.callback(1.0f);
+      }
+    }
+    job.promise.set_value(completed);
+  };
+
   // thread function
-  auto render_tile = [&](size_t start_x, size_t start_y) {
-    const int end_x = std::min(start_x + tile_size, frame_buffer_.get_width());
-    const int end_y = std::min(start_y + tile_size, frame_buffer_.get_height());
+  auto render_tile = [this](TileJob& job, size_t start_x, size_t start_y) {
+    // cancellation is checked once per tile
+    if (job.stop_token.stop_requested()) {
+      return;
+    }
 
-    for (int y = start_y; y < end_y; ++y) {
-      for (int x = start_x; x < end_x; ++x) {
-        float u = (x + pixel_bias) / frame_buffer_.get_width();
-        float v = (y + pixel_bias) / frame_buffer_.get_height();
+    const size_t block_size = job.block_size;
+    const size_t end_x =
+        std::min(start_x + tile_size, frame_buffer_.get_width());
+    const size_t end_y =
+        std::min(start_y + tile_size, frame_buffer_.get_height());
 
-        auto pixel = ray_tracer_.trace_pixel(u, v);
-        frame_buffer_.set_point(x, y, {pixel[0], pixel[1], pixel[2]});
+    if (job.tile_function) {
+      auto colors = job.tile_function(start_x, start_y, end_x, end_y);
+      auto color = colors.begin();
+      for (size_t y = start_y; y < end_y; ++y) {
+        for (size_t x = start_x; x < end_x; ++x, ++color) {
+          frame_buffer_.set_point(x, y, {(*color)[0], (*color)[1],
+                                         (*color)[2]});
+        }
       }
     }
 
-    int completed = ++tiles_completed;
-    if (callback) {
+    for (size_t y = start_y; job.pixel_function && y < end_y;
+         y += block_size) {
+      for (size_t x = start_x; x < end_x; x += block_size) {
+        auto pixel = job.pixel_function(x, y);
+        for (size_t by = y; by < std::min(y + block_size, end_y); ++by) {
+          for (size_t bx = x; bx < std::min(x + block_size, end_x); ++bx) {
+            frame_buffer_.set_point(bx, by, {pixel[0], pixel[1], pixel[2]});
+          }
+        }
+      }
+    }
+
+    int completed = ++job.completed_tiles;
+    if (job.callback) {
       std::lock_guard<std::mutex> lock(progress_mutex_);
-      progress_ = static_cast<float>(completed) / total_tiles;
-      callback(progress_);
+      progress_ = static_cast<float>(completed) / job.total_tiles;
+      job.callback(progress_);
     }
   };
 
+  if (tiles.empty()) {
+    job->promise.set_value(true);
+    return job;
+  }
+
   // thread parallel
-  std::vector<std::thread> threads;
-  for (int i = 0; i < num_threads; ++i) {
-    threads.emplace_back([&, i]() {
-      for (int tile_idx = i; tile_idx < total_tiles; tile_idx += num_threads) {
-        const auto& [x, y] = tiles[tile_idx];
-        render_tile(x, y);
+  auto& pool = get_thread_pool(num_threads);
+  for (const auto& [x, y] : tiles) {
+    pool.submit([job, x, y, render_tile, finish_tile]() {
+      try {
+        render_tile(*job, x, y);
+      } catch (...) {
+        std::lock_guard<std::mutex> lock(job->error_mutex);
+        if (!job->error) {
+          job->error = std::current_exception();
+        }
       }
+      finish_tile(*job);
     });
   }
 
-  for (auto& thread : threads) {
-    thread.join();
+  return job;
+}
+
+float Renderer::tile_variance(const Tile& tile) const {
+  const size_t end_x = std::min(tile.x + tile_size, frame_buffer_.get_width());
+  const size_t end_y =
+      std::min(tile.y + tile_size, frame_buffer_.get_height());
+
+  float sum = 0.0f;
+  float sum_sq = 0.0f;
+  for (size_t y = tile.y; y < end_y; ++y) {
+    for (size_t x = tile.x; x < end_x; ++x) {
+      const auto& color = frame_buffer_.get_point(x, y);
+      float luminance =
+          0.2126f * color[0] + 0.7152f * color[1] + 0.0722f * color[2];
+      sum += luminance;
+      sum_sq += luminance * luminance;
+    }
   }
 
-  progress_ = 1.0f;
-  if (callback) {
-    callback(1.0f);
+  float count = float((end_x - tile.x) * (end_y - tile.y));
+  float mean = sum / count;
+  return sum_sq / count - mean * mean;
+}
+
+ThreadPool& Renderer::get_thread_pool(int num_threads) {
+  // the own pool outlives a single render, it is recreated only when the
+  // requested thread count changes
+  size_t size = std::max(num_threads, 1);
+  if (!shared_thread_pool_ &&
+      (!thread_pool_ || thread_pool_->size() != size)) {
+    thread_pool_ = std::make_shared<ThreadPool>(size);
   }
+  return *thread_pool_;
 }
 
-}  // namespace rtr
\ No newline at end of file
+}  // namespace rtr
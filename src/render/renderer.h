@@ -1,26 +1,114 @@
 #pragma once
 
+#include <array>
+#include <chrono>
 #include <functional>
+#include <future>
 #include <memory>
 #include <mutex>
+#include <stop_token>
 #include <thread>
 #include "aabb.h"
 #include "camera.h"
 #include "framebuffer.h"
+#include "gbuffer.h"
 #include "model.h"
 #include "raytracer.h"
+#include "scene.h"
+#include "thread_pool.h"
 
 namespace rtr {
 
+/// @brief Settings of one progressive refinement level
+struct QualityLevel {
+  size_t block_size;  // pixels sharing one primary ray
+  size_t samples_per_pixel;
+  int max_depth;
+};
+
+/// @brief Quality reached by a deadline-bounded render
+struct RenderQuality {
+  int level = -1;  // level completed on every tile, -1 if none
+  size_t samples_per_pixel = 0;  // with those reused from earlier levels
+  int max_depth = 0;
+  size_t refined_tiles = 0;  // tiles already at the next level
+  size_t total_tiles = 0;
+  bool deadline_reached = false;
+  std::chrono::milliseconds elapsed{0};
+};
+
 class Renderer {
  public:
   using ProgressCallback = std::function<void(float)>;
+  using Vector3f = Eigen::Vector3f;
+  using Clock = std::chrono::steady_clock;
+
+  static constexpr std::array<QualityLevel, 5> quality_levels{{
+      {8, 1, 1},   // coarse preview, direct lighting only
+      {1, 1, 2},   // full resolution, single bounce
+      {1, 1, 5},   // same as render()
+      {1, 4, 5},   // 2x2 supersampling
+      {1, 16, 8},  // 4x4 supersampling, deep recursion
+  }};
 
+  /// @brief Renderers may share one thread pool, otherwise each render
+  /// uses an own pool of the requested size
   Renderer(std::shared_ptr<const Model> model,
-           std::shared_ptr<const Camera> camera, size_t width, size_t height);
+           std::shared_ptr<const Camera> camera, size_t width, size_t height,
+           std::shared_ptr<ThreadPool> thread_pool = nullptr);
+  /// @brief Renders the instances of a built scene
+  Renderer(std::shared_ptr<const Scene> scene,
+           std::shared_ptr<const Camera> camera, size_t width, size_t height,
+           std::shared_ptr<ThreadPool> thread_pool = nullptr);
+
+  /// @brief Renders the frame; returns false if stopped before completion.
+  /// Primary rays of scenes with out-of-core meshes are traced a tile at a
+  /// time, so a cluster missing from memory is read once per tile.
+  bool render(int num_threads = std::thread::hardware_concurrency(),
+              ProgressCallback callback = nullptr,
+              std::stop_token stop_token = {});
+
+  /// @brief Queues all tiles of the frame and returns without waiting; the
+  /// future holds false if the render was stopped. The renderer must outlive
+  /// the render. The G-buffer is not filled.
+  std::shared_future<bool> render_async(
+      int num_threads = std::thread::hardware_concurrency(),
+      ProgressCallback callback = nullptr, std::stop_token stop_token = {});
+
+  /// @brief Renders the coarse level and refines tiles, most contrasted
+  /// first, level by level until the deadline. The coarse level is always
+  /// completed, the frame buffer keeps the best image reached. A level of
+  /// the same depth as the previous one adds its samples to the previous
+  /// ones, levels of another depth trace every pixel again.
+  RenderQuality render(Clock::time_point deadline,
+                       int num_threads = std::thread::hardware_concurrency(),
+                       ProgressCallback callback = nullptr);
+
+  /// @brief Low-resolution pass: one ray per block_size x block_size block
+  bool render_preview(size_t block_size,
+                      int num_threads = std::thread::hardware_concurrency(),
+                      std::stop_token stop_token = {});
+
+  /// @brief Re-shades the frame from the G-buffer of the previous render
+  /// after light or material edits; primary rays are not traced again.
+  /// Falls back to render() if the G-buffer is missing or the view changed.
+  bool relight(int num_threads = std::thread::hardware_concurrency(),
+               ProgressCallback callback = nullptr,
+               std::stop_token stop_token = {});
+
+  /// @brief Preview passes, render_preview() and the coarse level of a
+  /// deadline render, trace meshes at levels of detail whose error stays
+  /// within a preview block
+  void set_preview_lod(bool enabled) { preview_lod_ = enabled; }
+  [[nodiscard]] bool get_preview_lod() const { return preview_lod_; }
+
+  /// @brief Keep primary hits of render() for relight()
+  void set_keep_gbuffer(bool keep);
+  [[nodiscard]] bool get_keep_gbuffer() const { return keep_gbuffer_; }
+  [[nodiscard]] const GBuffer& get_gbuffer() const { return gbuffer_; }
 
-  void render(int num_threads = std::thread::hardware_concurrency(),
-              ProgressCallback callback = nullptr);
+  [[nodiscard]] RayTracer& get_ray_tracer() { return ray_tracer_; }
+  [[nodiscard]] const RayTracer& get_ray_tracer() const { return ray_tracer_; }
 
   [[nodiscard]] const FrameBuffer& get_frame_buffer() const {
     return frame_buffer_;
@@ -31,8 +119,63 @@ class Renderer {
   };
 
  private:
+  using PixelFunction = std::function<Vector3f(size_t x, size_t y)>;
+  /// @brief Colors of the pixels [x0, x1) x [y0, y1), row by row
+  using TileFunction = std::function<std::vector<Vector3f>(
+      size_t x0, size_t y0, size_t x1, size_t y1)>;
+
+  struct Tile {
+    size_t x;
+    size_t y;
+  };
+
+  struct TileJob;
+
+  [[nodiscard]] std::vector<Tile> make_tiles() const;
+
+  std::shared_ptr<TileJob> submit_tiles(const std::vector<Tile>& tiles,
+                                        int num_threads,
+                                        ProgressCallback callback,
+                                        PixelFunction pixel_function,
+                                        std::stop_token stop_token,
+                                        size_t block_size,
+                                        TileFunction tile_function = nullptr);
+
+  bool render_tiles(int num_threads, ProgressCallback callback,
+                    const PixelFunction& pixel_function,
+                    std::stop_token stop_token, size_t block_size = 1);
+  /// @brief Renders tiles in the given order; returns the number of tiles
+  /// finished before the stop request
+  size_t render_tiles(const std::vector<Tile>& tiles, int num_threads,
+                      ProgressCallback callback,
+                      const PixelFunction& pixel_function,
+                      std::stop_token stop_token, size_t block_size = 1);
+
+  /// @brief Renders whole tiles at once instead of pixel by pixel
+  bool render_tiles(int num_threads, ProgressCallback callback,
+                    const TileFunction& tile_function,
+                    std::stop_token stop_token);
+
+  /// @brief Primary rays of a tile traced as one batch
+  bool render_batched(int num_threads, ProgressCallback callback,
+                      std::stop_token stop_token);
+  /// @brief Keeps a primary hit in the G-buffer
+  void store_sample(size_t x, size_t y, const HitRecord& rec);
+
+  /// @brief Luminance variance of the tile in the current frame
+  [[nodiscard]] float tile_variance(const Tile& tile) const;
+
+  ThreadPool& get_thread_pool(int num_threads);
+
+ private:
+  std::shared_ptr<const Camera> camera_;
   RayTracer ray_tracer_;
   FrameBuffer frame_buffer_;
+  GBuffer gbuffer_;
+  bool keep_gbuffer_ = false;
+  bool preview_lod_ = false;
+  std::shared_ptr<ThreadPool> thread_pool_;
+  bool shared_thread_pool_;
   std::mutex progress_mutex_;
   float progress_;
 };
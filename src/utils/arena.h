@@ -0,0 +1,163 @@
+#pragma once
+
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <new>
+#include <span>
+#include <type_traits>
+#include <vector>
+
+#include "buffer.h"
+
+namespace rtr {
+
+/// @brief Bump allocator over large mapped blocks, everything is freed at
+/// once with the arena
+///
+/// Allocation is thread-safe and deallocation a no-op, so freeing the
+/// arena costs one unmap per block whatever number of objects it holds.
+/// Objects created in it aren't destroyed.
+class Arena : public std::pmr::memory_resource {
+ public:
+  /// @brief block_size: bytes mapped at a time, larger allocations get a
+  /// block of their own. huge_pages: blocks are mapped with explicit huge
+  /// pages if the system has them, transparent ones are asked for otherwise.
+  explicit Arena(size_t block_size = size_t(1) << 20, bool huge_pages = false)
+      : block_size_(std::max<size_t>(block_size, 4096)),
+        huge_pages_(huge_pages) {}
+  ~Arena() override {
+    for (const auto& block : blocks_) {
+      ::munmap(block.data, block.size);
+    }
+  }
+
+  Arena(const Arena&) = delete;
+  Arena& operator=(const Arena&) = delete;
+
+  /// @brief Uninitialized storage for count elements
+  template <typename T>
+  [[nodiscard]] std::span<T> allocate_array(size_t count) {
+    static_assert(std::is_trivially_destructible_v<T>);
+    if (count == 0)
+      return {};
+    return {static_cast<T*>(allocate(count * sizeof(T), alignof(T))), count};
+  }
+  /// @brief Object that is never destroyed
+  template <typename T, typename... Args>
+  [[nodiscard]] T* create(Args&&... args) {
+    static_assert(std::is_trivially_destructible_v<T>);
+    return new (allocate(sizeof(T), alignof(T)))
+        T(std::forward<Args>(args)...);
+  }
+
+  /// @brief Copy of the elements viewed by a buffer that keeps the arena
+  /// alive
+  template <typename T>
+  [[nodiscard]] static Buffer<T> copy(const std::shared_ptr<Arena>& arena,
+                                      std::span<const T> elements) {
+    if (elements.empty())
+      return {};
+    auto storage = arena->allocate_array<T>(elements.size());
+    std::uninitialized_copy(elements.begin(), elements.end(), storage.begin());
+    return Buffer<T>(std::span<const T>(storage), arena);
+  }
+
+  /// @brief Moves the elements a buffer owns into the arena, views are
+  /// left as they are
+  template <typename T>
+  static void move_to(const std::shared_ptr<Arena>& arena, Buffer<T>& buffer) {
+    if (!buffer.is_view() && !buffer.empty()) {
+      buffer = copy(arena, buffer.span());
+    }
+  }
+
+  /// @brief Bytes handed out, with alignment padding
+  [[nodiscard]] size_t used_bytes() const {
+    std::lock_guard lock(mutex_);
+    return used_;
+  }
+  /// @brief Bytes mapped for the blocks
+  [[nodiscard]] size_t reserved_bytes() const {
+    std::lock_guard lock(mutex_);
+    size_t result = 0;
+    for (const auto& block : blocks_) {
+      result += block.size;
+    }
+    return result;
+  }
+  [[nodiscard]] size_t block_count() const {
+    std::lock_guard lock(mutex_);
+    return blocks_.size();
+  }
+
+ private:
+  struct Block {
+    void* data;
+    size_t size;
+  };
+
+  static constexpr size_t huge_page_size = size_t(2) << 20;
+
+  void* do_allocate(size_t bytes, size_t alignment) override {
+    std::lock_guard lock(mutex_);
+    size_t padding = (alignment - reinterpret_cast<uintptr_t>(cursor_) %
+                                      alignment) % alignment;
+    if (!cursor_ || padding + bytes > size_t(end_ - cursor_)) {
+      map_block(bytes + alignment);
+      padding = (alignment - reinterpret_cast<uintptr_t>(cursor_) %
+                                 alignment) % alignment;
+    }
+    char* result = cursor_ + padding;
+    cursor_ = result + bytes;
+    used_ += padding + bytes;
+    return result;
+  }
+  void do_deallocate(void*, size_t, size_t) override {}
+  bool do_is_equal(const std::pmr::memory_resource& other)
+      const noexcept override {
+    return this == &other;
+  }
+
+  void map_block(size_t min_size) {
+    size_t size = std::max(block_size_, min_size);
+    void* data = MAP_FAILED;
+    if (huge_pages_) {
+      size = (size + huge_page_size - 1) / huge_page_size * huge_page_size;
+#ifdef MAP_HUGETLB
+      data = ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    }
+    if (data == MAP_FAILED) {
+      data = ::mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (data == MAP_FAILED)
+        throw std::bad_alloc();
+#ifdef MADV_HUGEPAGE
+      if (huge_pages_) {
+        ::madvise(data, size, MADV_HUGEPAGE);
+      }
+#endif
+    }
+    blocks_.push_back({data, size});
+    cursor_ = static_cast<char*>(data);
+    end_ = cursor_ + size;
+  }
+
+ private:
+  const size_t block_size_;
+  const bool huge_pages_;
+  mutable std::mutex mutex_;
+  std::vector<Block> blocks_;
+  char* cursor_ = nullptr;
+  char* end_ = nullptr;
+  size_t used_ = 0;
+};
+
+}  // namespace rtr
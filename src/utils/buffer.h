@@ -0,0 +1,51 @@
+#pragma once
+
+#include <memory>
+#include <span>
+#include <vector>
+
+namespace rtr {
+
+/// @brief Contiguous array that owns its elements or views memory kept
+/// alive by an owner, e.g. a memory mapped cache file
+template <typename T>
+class Buffer {
+ public:
+  Buffer() = default;
+  Buffer(std::vector<T> data) : storage_(std::move(data)) {}
+  Buffer(std::span<const T> view, std::shared_ptr<const void> owner)
+      : owner_(std::move(owner)), view_(view) {}
+
+  [[nodiscard]] const T* data() const {
+    return owner_ ? view_.data() : storage_.data();
+  }
+  [[nodiscard]] size_t size() const {
+    return owner_ ? view_.size() : storage_.size();
+  }
+  [[nodiscard]] bool empty() const { return size() == 0; }
+  [[nodiscard]] bool is_view() const { return owner_ != nullptr; }
+
+  [[nodiscard]] const T* begin() const { return data(); }
+  [[nodiscard]] const T* end() const { return data() + size(); }
+  [[nodiscard]] const T& operator[](size_t i) const { return data()[i]; }
+
+  [[nodiscard]] std::span<const T> span() const { return {data(), size()}; }
+  operator std::span<const T>() const { return span(); }
+
+  /// @brief Owned elements for modification, a view is copied first
+  std::vector<T>& vector() {
+    if (owner_) {
+      storage_.assign(view_.begin(), view_.end());
+      owner_.reset();
+      view_ = {};
+    }
+    return storage_;
+  }
+
+ private:
+  std::vector<T> storage_;
+  std::shared_ptr<const void> owner_;
+  std::span<const T> view_;
+};
+
+}  // namespace rtr
@@ -1,28 +1,350 @@
 #pragma once
 
 #include <algorithm>
+#include <cmath>
+#include <cstdint>
 #include <eigen3/Eigen/Core>
+#include <execution>
+#include <memory>
+#include <numeric>
+#include <string>
 #include <vector>
 
+#include "buffer.h"
+
 namespace rtr {
 
+struct Image;
+
+/// @brief Storage of the texels of a 4x4 tile
+enum class TextureFormat : uint32_t {
+  RGB8,  // 48 bytes, exact
+  BC1,   // 8 bytes: two RGB565 endpoints and 2-bit indices
+};
+
+/// @brief Makes the pixels of a streamed image resident on demand
+class ImageStream {
+ public:
+  virtual ~ImageStream() = default;
+
+  /// @brief Pyramid of the image from the given level on, valid while the
+  /// pointer is held even if the stream evicts it
+  [[nodiscard]] virtual std::shared_ptr<const Image> acquire(
+      size_t level) = 0;
+  /// @brief File the pixels are read from
+  [[nodiscard]] virtual const std::string& get_source() const = 0;
+};
+
+/// @brief RGB texture with a mip pyramid stored in tiles
+///
+/// Every level is split into 4x4 texel tiles of 48 bytes, so the texels of a
+/// bilinear lookup mostly share a cache line. Levels follow each other in
+/// data, from the full resolution down to 1x1. In the BC1 format every tile
+/// is compressed to 8 bytes and decoded per texel when sampled.
 struct Image {
+  static constexpr int tile_size = 4;
+  static constexpr size_t tile_bytes = tile_size * tile_size * 3;
+  static constexpr size_t bc1_block_bytes = 8;
+
+  struct Level {
+    int width;
+    int height;
+    int tiles_x;
+    size_t first_tile;
+  };
+
   int width, height;
-  std::vector<unsigned char> data;
+  TextureFormat format = TextureFormat::RGB8;
+  Buffer<unsigned char> data;  // tiled levels, empty if streamed
+  std::shared_ptr<ImageStream> stream;
+
+  /// @brief Builds the pyramid from rows of RGB texels, BC1 tiles are
+  /// compressed in parallel
+  Image(int w, int h, unsigned char* src,
+        TextureFormat texture_format = TextureFormat::RGB8)
+      : width(w), height(h), format(texture_format) {
+    init_levels();
+    std::vector<unsigned char> tiled(storage_size(w, h));
+    for (int y = 0; y < h; ++y) {
+      for (int x = 0; x < w; ++x) {
+        std::copy_n(src + (y * w + x) * 3, 3,
+                    &tiled[texel_offset(levels_[0], x, y)]);
+      }
+    }
+    for (size_t level = 1; level < levels_.size(); ++level) {
+      downsample(tiled, levels_[level - 1], levels_[level]);
+    }
+    if (format == TextureFormat::BC1) {
+      data = compress_bc1(tiled);
+    } else {
+      data = std::move(tiled);
+    }
+  }
+  /// @brief Uses an already built pyramid, e.g. from a cache
+  Image(int w, int h, Buffer<unsigned char> tiled,
+        TextureFormat texture_format = TextureFormat::RGB8)
+      : width(w), height(h), format(texture_format), data(std::move(tiled)) {
+    init_levels();
+  }
+  /// @brief Image whose pixels are loaded by the stream when sampled
+  Image(int w, int h, std::shared_ptr<ImageStream> source)
+      : width(w), height(h), stream(std::move(source)) {
+    init_levels();
+  }
+
+  /// @brief Bytes of the tiled pyramid of a w x h image
+  static size_t storage_size(
+      int w, int h, TextureFormat texture_format = TextureFormat::RGB8) {
+    size_t tiles = 0;
+    for (;; w = std::max(1, w / 2), h = std::max(1, h / 2)) {
+      tiles += tile_count(w) * tile_count(h);
+      if (w == 1 && h == 1)
+        return tiles * block_bytes(texture_format);
+    }
+  }
+
+  [[nodiscard]] size_t level_count() const { return levels_.size(); }
 
-  Image(int w, int h, unsigned char* src)
-      : width(w), height(h), data(src, src + w * h * 3) {}
+  /// @brief Copy of the pyramid from the given level on
+  [[nodiscard]] Image from_level(size_t level) const {
+    const Level& first = levels_[level];
+    size_t offset = first.first_tile * block_bytes(format);
+    return Image(first.width, first.height,
+                 std::vector<unsigned char>(data.begin() + offset, data.end()),
+                 format);
+  }
 
+  /// @brief Bilinear lookup in the full resolution level
   Eigen::Vector3f sample(float u, float v) const {
-    u = u - floor(u);
-    v = v - floor(v);
+    if (stream)
+      return stream->acquire(0)->sample(u, v);
+    return sample_level(0, u, v);
+  }
+
+  /// @brief Trilinear lookup, the level is chosen by the footprint: the
+  /// width of the sampled area in texture coordinates
+  Eigen::Vector3f sample(float u, float v, float footprint) const {
+    float lod = std::log2(footprint * std::max(width, height));
+    if (stream) {
+      // the acquired pyramid is smaller, so the level is chosen relative
+      // to its own size
+      size_t level = lod > 0.0f ? std::min(size_t(lod), levels_.size() - 1)
+                                : 0;
+      return stream->acquire(level)->sample(u, v, footprint);
+    }
+    if (!(lod > 0.0f))
+      return sample_level(0, u, v);
+
+    float max_lod = float(levels_.size() - 1);
+    if (lod >= max_lod)
+      return sample_level(levels_.size() - 1, u, v);
+
+    size_t level = size_t(lod);
+    float t = lod - level;
+    return (1.0f - t) * sample_level(level, u, v) +
+           t * sample_level(level + 1, u, v);
+  }
+
+ private:
+  static size_t tile_count(int size) {
+    return (size + tile_size - 1) / tile_size;
+  }
+
+  static size_t block_bytes(TextureFormat texture_format) {
+    return texture_format == TextureFormat::BC1 ? bc1_block_bytes
+                                                : tile_bytes;
+  }
+
+  static size_t tile_index(const Level& level, int x, int y) {
+    return level.first_tile + size_t(y / tile_size) * level.tiles_x +
+           x / tile_size;
+  }
 
-    int x = std::clamp(int(u * width), 0, width - 1);
-    int y = std::clamp(int((1 - v) * height), 0, height - 1);  // Flip Y
+  static int texel_index(int x, int y) {
+    return (y % tile_size) * tile_size + x % tile_size;
+  }
+
+  /// @brief Byte offset of a texel in the uncompressed layout
+  static size_t texel_offset(const Level& level, int x, int y) {
+    return tile_index(level, x, y) * tile_bytes + texel_index(x, y) * 3;
+  }
+
+  void init_levels() {
+    size_t first_tile = 0;
+    for (int w = width, h = height;;
+         w = std::max(1, w / 2), h = std::max(1, h / 2)) {
+      int tiles_x = int(tile_count(w));
+      levels_.push_back({w, h, tiles_x, first_tile});
+      first_tile += tiles_x * tile_count(h);
+      if (w == 1 && h == 1)
+        break;
+    }
+  }
+
+  static uint16_t pack_565(const int* rgb) {
+    return uint16_t(((rgb[0] * 31 + 127) / 255) << 11 |
+                    ((rgb[1] * 63 + 127) / 255) << 5 |
+                    ((rgb[2] * 31 + 127) / 255));
+  }
+
+  static void unpack_565(uint16_t c, int* rgb) {
+    int r = c >> 11, g = (c >> 5) & 63, b = c & 31;
+    rgb[0] = (r << 3) | (r >> 2);
+    rgb[1] = (g << 2) | (g >> 4);
+    rgb[2] = (b << 3) | (b >> 2);
+  }
+
+  /// @brief Palette of a BC1 block: the endpoints and two colors between.
+  /// The encoder keeps c0 >= c1, so the three color mode isn't used.
+  static void bc1_palette(uint16_t c0, uint16_t c1, int (*palette)[3]) {
+    unpack_565(c0, palette[0]);
+    unpack_565(c1, palette[1]);
+    for (int c = 0; c < 3; ++c) {
+      palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+      palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+    }
+  }
+
+  /// @brief Endpoints are the corners of the color bounding box along the
+  /// diagonal the texels follow, every texel takes the nearest of the four
+  /// palette colors
+  static void encode_bc1(const unsigned char* texels, unsigned char* block) {
+    int lo[3] = {255, 255, 255}, hi[3] = {0, 0, 0};
+    float mean[3] = {};
+    for (int i = 0; i < tile_size * tile_size; ++i) {
+      for (int c = 0; c < 3; ++c) {
+        lo[c] = std::min<int>(lo[c], texels[i * 3 + c]);
+        hi[c] = std::max<int>(hi[c], texels[i * 3 + c]);
+        mean[c] += texels[i * 3 + c] / 16.0f;
+      }
+    }
+    // red and blue run against green: swap their ends
+    for (int c : {0, 2}) {
+      float covariance = 0.0f;
+      for (int i = 0; i < tile_size * tile_size; ++i) {
+        covariance +=
+            (texels[i * 3 + c] - mean[c]) * (texels[i * 3 + 1] - mean[1]);
+      }
+      if (covariance < 0.0f) {
+        std::swap(lo[c], hi[c]);
+      }
+    }
+
+    uint16_t c0 = pack_565(hi), c1 = pack_565(lo);
+    if (c0 < c1) {
+      std::swap(c0, c1);
+    }
+    int palette[4][3];
+    bc1_palette(c0, c1, palette);
+
+    uint32_t indices = 0;
+    for (int i = 0; c0 != c1 && i < tile_size * tile_size; ++i) {
+      int best = 0, best_distance = 1 << 30;
+      for (int p = 0; p < 4; ++p) {
+        int distance = 0;
+        for (int c = 0; c < 3; ++c) {
+          int d = texels[i * 3 + c] - palette[p][c];
+          distance += d * d;
+        }
+        if (distance < best_distance) {
+          best_distance = distance;
+          best = p;
+        }
+      }
+      indices |= uint32_t(best) << (2 * i);
+    }
 
-    int idx = (y * width + x) * 3;
-    return {data[idx] / 255.0f, data[idx + 1] / 255.0f, data[idx + 2] / 255.0f};
+    block[0] = c0 & 0xff;
+    block[1] = c0 >> 8;
+    block[2] = c1 & 0xff;
+    block[3] = c1 >> 8;
+    for (int i = 0; i < 4; ++i) {
+      block[4 + i] = (indices >> (8 * i)) & 0xff;
+    }
   }
+
+  static std::vector<unsigned char> compress_bc1(
+      const std::vector<unsigned char>& tiled) {
+    std::vector<size_t> tiles(tiled.size() / tile_bytes);
+    std::iota(tiles.begin(), tiles.end(), 0);
+    std::vector<unsigned char> blocks(tiles.size() * bc1_block_bytes);
+    std::for_each(std::execution::par, tiles.begin(), tiles.end(),
+                  [&](size_t tile) {
+                    encode_bc1(&tiled[tile * tile_bytes],
+                               &blocks[tile * bc1_block_bytes]);
+                  });
+    return blocks;
+  }
+
+  static void downsample(std::vector<unsigned char>& tiled, const Level& src,
+                         const Level& dst) {
+    for (int y = 0; y < dst.height; ++y) {
+      for (int x = 0; x < dst.width; ++x) {
+        int x0 = std::min(2 * x, src.width - 1);
+        int x1 = std::min(2 * x + 1, src.width - 1);
+        int y0 = std::min(2 * y, src.height - 1);
+        int y1 = std::min(2 * y + 1, src.height - 1);
+
+        unsigned char* out = &tiled[texel_offset(dst, x, y)];
+        for (int c = 0; c < 3; ++c) {
+          int sum = tiled[texel_offset(src, x0, y0) + c] +
+                    tiled[texel_offset(src, x1, y0) + c] +
+                    tiled[texel_offset(src, x0, y1) + c] +
+                    tiled[texel_offset(src, x1, y1) + c];
+          out[c] = static_cast<unsigned char>((sum + 2) / 4);
+        }
+      }
+    }
+  }
+
+  Eigen::Vector3f texel(const Level& level, int x, int y) const {
+    if (format == TextureFormat::BC1) {
+      const unsigned char* block =
+          &data[tile_index(level, x, y) * bc1_block_bytes];
+      uint16_t c0 = uint16_t(block[0] | block[1] << 8);
+      uint16_t c1 = uint16_t(block[2] | block[3] << 8);
+      int texel = texel_index(x, y);
+      int index = (block[4 + texel / 4] >> (2 * (texel % 4))) & 3;
+
+      // thirds of the first endpoint per index, as in bc1_palette
+      static constexpr int weights[4] = {3, 0, 2, 1};
+      int e0[3], e1[3];
+      unpack_565(c0, e0);
+      unpack_565(c1, e1);
+      int w = weights[index];
+      return {(w * e0[0] + (3 - w) * e1[0]) / 3 / 255.0f,
+              (w * e0[1] + (3 - w) * e1[1]) / 3 / 255.0f,
+              (w * e0[2] + (3 - w) * e1[2]) / 3 / 255.0f};
+    }
+    const unsigned char* p = &data[texel_offset(level, x, y)];
+    return {p[0] / 255.0f, p[1] / 255.0f, p[2] / 255.0f};
+  }
+
+  Eigen::Vector3f sample_level(size_t index, float u, float v) const {
+    const Level& level = levels_[index];
+    u = std::isfinite(u) ? u - std::floor(u) : 0.0f;
+    v = std::isfinite(v) ? v - std::floor(v) : 0.0f;
+
+    // texel centers are at half-integer coordinates, Y is flipped
+    float x = u * level.width - 0.5f;
+    float y = (1.0f - v) * level.height - 0.5f;
+    float fx = x - std::floor(x);
+    float fy = y - std::floor(y);
+
+    auto wrap = [](int i, int size) { return ((i % size) + size) % size; };
+    int x0 = wrap(int(std::floor(x)), level.width);
+    int y0 = wrap(int(std::floor(y)), level.height);
+    int x1 = wrap(x0 + 1, level.width);
+    int y1 = wrap(y0 + 1, level.height);
+
+    return (1.0f - fy) * ((1.0f - fx) * texel(level, x0, y0) +
+                          fx * texel(level, x1, y0)) +
+           fy * ((1.0f - fx) * texel(level, x0, y1) +
+                 fx * texel(level, x1, y1));
+  }
+
+ private:
+  std::vector<Level> levels_;
 };
 
-}  // namespace rtr
\ No newline at end of file
+}  // namespace rtr
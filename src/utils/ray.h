@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <eigen3/Eigen/Core>
 #include <memory>
 
@@ -17,8 +18,16 @@ struct Light {
 struct Ray {
   Vector3f origin;
   Vector3f direction;
+  // ray cone: width at the origin and its growth per unit of distance
+  float cone_width = 0.0f;
+  float cone_spread = 0.0f;
+
   Ray(const Vector3f& o, const Vector3f& d)
       : origin(o), direction(d.normalized()) {}
+
+  [[nodiscard]] float cone_width_at(float t) const {
+    return cone_width + t * cone_spread;
+  }
 };
 
 struct HitRecord {
@@ -26,7 +35,9 @@ struct HitRecord {
   Vector3f point;
   Vector3f normal;
   Vector2f tex_coord;
+  float footprint = 0.0f;  // ray cone width in texture coordinates
   std::shared_ptr<Material> material;
+  int32_t material_id = -1;
   bool front_face;
 
   inline void set_face_normal(const Ray& ray, const Vector3f& outward_normal) {
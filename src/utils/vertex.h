@@ -1,11 +1,17 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
+#include <bit>
+#include <cmath>
+#include <cstdint>
 #include <eigen3/Eigen/Core>
-#include <type_traits>
 
 namespace rtr {
 
+/// @brief Index of a vertex in a mesh, meshes are limited to 2^32 vertexes
+using VertexIndex = uint32_t;
+
 struct PackedVertex {
   std::array<float, 3> position;
   std::array<float, 3> normal;
@@ -24,24 +30,78 @@ struct PackedVertex {
   }
 };
 
+/// @brief Shading attributes of a compact vertex, 8 bytes
+struct CompactAttributes {
+  std::array<int16_t, 2> normal;     // octahedral, signed normalized
+  std::array<uint16_t, 2> texcoord;  // normalized over the mesh range
+};
+
+/// @brief Encoding of a zero normal, out of the range of unit vectors
+constexpr std::array<int16_t, 2> zero_octahedral = {INT16_MIN, INT16_MIN};
+
+/// @brief Maps a unit vector onto the octahedron unfolded to [-1, 1]^2
+inline std::array<int16_t, 2> encode_octahedral(const Eigen::Vector3f& n) {
+  float l1 = std::abs(n.x()) + std::abs(n.y()) + std::abs(n.z());
+  if (!(l1 > 0.0f))
+    return zero_octahedral;
+  float x = n.x() / l1, y = n.y() / l1;
+  if (n.z() < 0.0f) {
+    // the lower half folds over the diagonals
+    float fx = (1.0f - std::abs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+    float fy = (1.0f - std::abs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+    x = fx;
+    y = fy;
+  }
+  auto snorm = [](float f) {
+    return static_cast<int16_t>(std::round(std::clamp(f, -1.0f, 1.0f) * 32767));
+  };
+  return {snorm(x), snorm(y)};
+}
+
+inline Eigen::Vector3f decode_octahedral(const std::array<int16_t, 2>& e) {
+  if (e == zero_octahedral)
+    return Eigen::Vector3f::Zero();
+  float x = e[0] / 32767.0f, y = e[1] / 32767.0f;
+  float z = 1.0f - std::abs(x) - std::abs(y);
+  if (z < 0.0f) {
+    float fx = (1.0f - std::abs(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+    float fy = (1.0f - std::abs(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+    x = fx;
+    y = fy;
+  }
+  Eigen::Vector3f n(x, y, z);
+  float norm = n.norm();
+  return norm > 0.0f ? Eigen::Vector3f(n / norm) : n;
+}
+
+/// @brief Bit patterns of the vertex components; +0 and -0 are equal, as in
+/// PackedVertex::operator==
+inline std::array<uint32_t, 8> vertex_bits(const PackedVertex& v) {
+  auto bits = [](float f) {
+    return f == 0.0f ? 0u : std::bit_cast<uint32_t>(f);
+  };
+  return {bits(v.position[0]), bits(v.position[1]), bits(v.position[2]),
+          bits(v.normal[0]),   bits(v.normal[1]),   bits(v.normal[2]),
+          bits(v.texcoord[0]), bits(v.texcoord[1])};
+}
+
+inline uint64_t hash_vertex_bits(const std::array<uint32_t, 8>& bits) {
+  uint64_t h = 0x9e3779b97f4a7c15ull;
+  for (size_t i = 0; i < bits.size(); i += 2) {
+    uint64_t word = (uint64_t(bits[i]) << 32) | bits[i + 1];
+    h = (h ^ word) * 0xff51afd7ed558ccdull;
+    h ^= h >> 32;
+  }
+  return h;
+}
+
 }  // namespace rtr
 
 namespace std {
 template <>
 struct hash<rtr::PackedVertex> {
   size_t operator()(const rtr::PackedVertex& v) const {
-    size_t h = 0;
-    auto hash_combine = [&h](auto val) {
-      h ^= hash<std::decay_t<decltype(val)>>{}(val) + 0x9e3779b9 + (h << 6) +
-           (h >> 2);
-    };
-    for (float f : v.position)
-      hash_combine(f);
-    for (float f : v.normal)
-      hash_combine(f);
-    for (float f : v.texcoord)
-      hash_combine(f);
-    return h;
+    return rtr::hash_vertex_bits(rtr::vertex_bits(v));
   }
 };
 }  // namespace std
\ No newline at end of file
@@ -1,5 +1,7 @@
 #include <gtest/gtest.h>
 #include <memory>
+#include <random>
+#include <set>
 #include <vector>
 #include "bvh.h"
 #include "ray.h"
@@ -7,6 +9,53 @@
 
 using namespace rtr;
 
+namespace {
+
+struct TriangleSoup {
+  std::vector<PackedVertex> vertexes;
+  std::vector<VertexIndex> indices;
+};
+
+/// @brief count треугольников с центрами в случайных точках куба
+/// [-10, 10]^3, corner(center, c) задает вершину c
+template <typename Corner>
+TriangleSoup make_soup(std::mt19937& generator, int count, Corner&& corner) {
+  std::uniform_real_distribution<float> coord(-10.0f, 10.0f);
+  TriangleSoup soup;
+  for (int t = 0; t < count; ++t) {
+    Eigen::Vector3f center(coord(generator), coord(generator),
+                           coord(generator));
+    for (int c = 0; c < 3; ++c) {
+      Eigen::Vector3f p = corner(center, c);
+      soup.indices.push_back(VertexIndex(soup.vertexes.size()));
+      soup.vertexes.push_back({{p.x(), p.y(), p.z()}, {0, 0, 1}, {0, 0}});
+    }
+  }
+  return soup;
+}
+
+/// @brief Маленькие треугольники: вершины сдвинуты от центра не больше чем
+/// на 0.3 по каждой оси
+TriangleSoup make_soup(std::mt19937& generator, int count) {
+  std::uniform_real_distribution<float> offset(-0.3f, 0.3f);
+  return make_soup(generator, count, [&](const Eigen::Vector3f& center, int) {
+    return Eigen::Vector3f(center + Eigen::Vector3f(offset(generator),
+                                                    offset(generator),
+                                                    offset(generator)));
+  });
+}
+
+/// @brief Вершины треугольников-кандидатов без повторов
+std::set<VertexIndex> corners(const IntersectIndices& indices) {
+  std::set<VertexIndex> result;
+  for (size_t i = 0; i < indices.size(); ++i) {
+    result.insert(indices[i]);
+  }
+  return result;
+}
+
+}  // namespace
+
 class BVHTest : public ::testing::Test {
  protected:
   void SetUp() override {
@@ -23,7 +72,7 @@ class BVHTest : public ::testing::Test {
   }
 
   std::vector<PackedVertex> vertices;
-  std::vector<size_t> indices;
+  std::vector<VertexIndex> indices;
 };
 
 // Базовое построение BVH
@@ -37,7 +86,7 @@ TEST_F(BVHTest, ConstructionWithValidData) {
 // Пустые данные
 TEST_F(BVHTest, ConstructionWithEmptyData) {
   std::vector<PackedVertex> empty_vertices;
-  std::vector<size_t> empty_indices;
+  std::vector<VertexIndex> empty_indices;
 
   EXPECT_NO_THROW({
     BVHAccel bvh(empty_vertices, empty_indices);
@@ -54,7 +103,7 @@ TEST_F(BVHTest, ConstructionWithDegenerateTriangles) {
       {{0, 0, 0}, {0, 1, 0}, {0, 0}},  // Та же точка
       {{0, 0, 0}, {0, 1, 0}, {0, 0}}   // Та же точка
   };
-  std::vector<size_t> deg_indices = {0, 1, 2};
+  std::vector<VertexIndex> deg_indices = {0, 1, 2};
 
   EXPECT_NO_THROW({ BVHAccel bvh(deg_vertices, deg_indices); });
 }
@@ -90,4 +139,259 @@ TEST_F(BVHTest, IntersectionWithTRangeLimits) {
   EXPECT_FALSE(indices1.empty());
   EXPECT_TRUE(indices2.empty());
   EXPECT_TRUE(indices3.empty());
-}
\ No newline at end of file
+}
+// Проверка целостности: ссылки узлов и листьев не выходят за массивы
+TEST_F(BVHTest, ConsistencyCheck) {
+  // восемь треугольников вдоль X, два листа
+  vertices.clear();
+  indices.clear();
+  for (int t = 0; t < 8; ++t) {
+    for (auto [x, y] : {std::pair{0.0f, 0.0f}, {1.0f, 0.0f}, {0.0f, 1.0f}}) {
+      indices.push_back(VertexIndex(vertices.size()));
+      vertices.push_back({{2.0f * t + x, y, 0}, {0, 0, 1}, {0, 0}});
+    }
+  }
+  BVHAccel bvh(vertices, indices);
+  EXPECT_TRUE(bvh.is_consistent(vertices.size()));
+  EXPECT_FALSE(bvh.is_consistent(vertices.size() - 1));
+
+  std::vector<BVHNode> nodes(bvh.get_nodes().begin(), bvh.get_nodes().end());
+  std::vector<VertexIndex> leaf_indices(bvh.get_leaf_indices().begin(),
+                                        bvh.get_leaf_indices().end());
+  ASSERT_EQ(nodes.size(), 3);
+  EXPECT_TRUE(BVHAccel(nodes, leaf_indices).is_consistent(vertices.size()));
+
+  // правый потомок указывает назад, на корень
+  auto cycle = nodes;
+  cycle[0].offset = 0;
+  EXPECT_FALSE(BVHAccel(cycle, leaf_indices).is_consistent(vertices.size()));
+  // лист выходит за индексы
+  auto overflow = nodes;
+  overflow[2].count += 3;
+  EXPECT_FALSE(
+      BVHAccel(overflow, leaf_indices).is_consistent(vertices.size()));
+  // флаги разделенных треугольников не по числу треугольников
+  EXPECT_FALSE(BVHAccel(nodes, leaf_indices, std::vector<uint8_t>(1))
+                   .is_consistent(vertices.size()));
+}
+
+// Квантованные узлы: вдвое меньше и не теряют пересечений
+TEST(QuantizedBVHTest, ConservativeTraversal) {
+  std::mt19937 generator(3);
+  std::uniform_real_distribution<float> coord(-10.0f, 10.0f);
+  auto soup = make_soup(generator, 3000);
+
+  BVHAccel exact(soup.vertexes, soup.indices);
+  BVHAccel quantized(soup.vertexes, soup.indices);
+  quantized.quantize();
+  ASSERT_TRUE(quantized.is_quantized());
+  EXPECT_TRUE(quantized.get_nodes().empty());
+  EXPECT_EQ(quantized.get_quantized_nodes().size() * sizeof(QuantizedBVHNode),
+            exact.get_nodes().size() * sizeof(BVHNode) / 2);
+  EXPECT_TRUE(quantized.get_root_bbox().min.isApprox(
+      exact.get_root_bbox().min));
+
+  size_t exact_total = 0, quantized_total = 0;
+  for (int r = 0; r < 500; ++r) {
+    Eigen::Vector3f origin(coord(generator), coord(generator), -20.0f);
+    Eigen::Vector3f target(coord(generator), coord(generator), 20.0f);
+    Ray ray(origin, (target - origin).normalized());
+
+    auto expected = corners(exact.get_intersect_indices(ray, 0.0f, 100.0f));
+    auto found = corners(quantized.get_intersect_indices(ray, 0.0f, 100.0f));
+    EXPECT_TRUE(std::includes(found.begin(), found.end(), expected.begin(),
+                              expected.end()));
+    exact_total += expected.size();
+    quantized_total += found.size();
+  }
+  // огрубленные границы добавляют немного лишних кандидатов
+  EXPECT_LT(quantized_total, exact_total * 2);
+}
+
+// Refit: после деформации границы совпадают с заново построенным деревом
+TEST(RefitBVHTest, MatchesRebuild) {
+  std::mt19937 generator(7);
+  std::uniform_real_distribution<float> coord(-10.0f, 10.0f);
+  auto soup = make_soup(generator, 2000);
+
+  BVHAccel bvh(soup.vertexes, soup.indices);
+  BVHAccel quantized(soup.vertexes, soup.indices);
+  quantized.quantize();
+  size_t node_count = bvh.get_nodes().size();
+
+  // плавная деформация: волна вдоль X
+  for (auto& vertex : soup.vertexes) {
+    vertex.position[2] += std::sin(vertex.position[0] * 0.3f);
+  }
+  EXPECT_EQ(bvh.refit(soup.vertexes), RefitResult::Refitted);
+  EXPECT_EQ(quantized.refit(soup.vertexes), RefitResult::Refitted);
+  EXPECT_EQ(bvh.get_nodes().size(), node_count);
+  EXPECT_TRUE(quantized.is_quantized());
+
+  BVHAccel rebuilt(soup.vertexes, soup.indices);
+  EXPECT_TRUE(bvh.get_root_bbox().min.isApprox(rebuilt.get_root_bbox().min));
+  EXPECT_TRUE(bvh.get_root_bbox().max.isApprox(rebuilt.get_root_bbox().max));
+
+  for (int r = 0; r < 200; ++r) {
+    Eigen::Vector3f origin(coord(generator), coord(generator), -20.0f);
+    Eigen::Vector3f target(coord(generator), coord(generator), 20.0f);
+    Ray ray(origin, (target - origin).normalized());
+
+    // каждый треугольник на пути луча остается в кандидатах
+    auto found = corners(bvh.get_intersect_indices(ray, 0.0f, 100.0f));
+    auto found_quantized =
+        corners(quantized.get_intersect_indices(ray, 0.0f, 100.0f));
+    for (size_t i = 0; i < soup.indices.size(); i += 3) {
+      AABB bbox;
+      for (size_t c = 0; c < 3; ++c) {
+        Eigen::Vector3f p = soup.vertexes[soup.indices[i + c]].get_position();
+        bbox.expand(AABB(p, p));
+      }
+      if (bbox.intersect(ray, 0.0f, 100.0f)) {
+        EXPECT_TRUE(found.contains(soup.indices[i]));
+      }
+    }
+    EXPECT_TRUE(std::includes(found_quantized.begin(), found_quantized.end(),
+                              found.begin(), found.end()));
+  }
+}
+
+// Монитор качества: перемешанные треугольники приводят к перестроению
+TEST(RefitBVHTest, RebuildsWhenDegraded) {
+  std::mt19937 generator(11);
+  std::uniform_real_distribution<float> coord(-10.0f, 10.0f);
+  // вершины на одной диагонали с центром
+  auto soup =
+      make_soup(generator, 2000, [](const Eigen::Vector3f& center, int c) {
+        return Eigen::Vector3f(center + Eigen::Vector3f::Constant(0.1f * c));
+      });
+
+  BVHAccel bvh(soup.vertexes, soup.indices);
+  float built_cost = bvh.sah_cost();
+
+  // треугольники меняются местами, дерево после refit становится плохим
+  std::vector<PackedVertex> shuffled = soup.vertexes;
+  for (size_t t = 0; t < 2000; ++t) {
+    size_t other = generator() % 2000;
+    for (int c = 0; c < 3; ++c) {
+      std::swap(shuffled[3 * t + c], shuffled[3 * other + c]);
+    }
+  }
+
+  BVHAccel refitted(soup.vertexes, soup.indices);
+  EXPECT_EQ(refitted.refit(shuffled), RefitResult::Refitted);
+  EXPECT_GT(refitted.sah_cost(), 2.0f * built_cost);
+
+  EXPECT_EQ(bvh.refit(shuffled, 0.5f), RefitResult::FullRebuild);
+  EXPECT_LT(bvh.sah_cost(), 1.5f * built_cost);
+  std::multiset<VertexIndex> leaf_indices(bvh.get_leaf_indices().begin(),
+                                          bvh.get_leaf_indices().end());
+  EXPECT_EQ(leaf_indices, std::multiset<VertexIndex>(soup.indices.begin(),
+                                                     soup.indices.end()));
+
+  // локальное перемешивание перестраивает только часть дерева
+  std::vector<PackedVertex> local = shuffled;
+  std::vector<size_t> near;
+  for (size_t t = 0; t < 2000; ++t) {
+    if (local[3 * t].position[0] < -8.0f) {
+      near.push_back(t);
+    }
+  }
+  for (size_t i = 0; i < near.size(); ++i) {
+    size_t other = near[generator() % near.size()];
+    for (int c = 0; c < 3; ++c) {
+      std::swap(local[3 * near[i] + c].position[1],
+                local[3 * other + c].position[1]);
+      std::swap(local[3 * near[i] + c].position[2],
+                local[3 * other + c].position[2]);
+    }
+  }
+  EXPECT_EQ(bvh.refit(local, 0.05f), RefitResult::PartialRebuild);
+  BVHAccel rebuilt(local, soup.indices);
+  EXPECT_LT(bvh.sah_cost(), 1.5f * rebuilt.sah_cost());
+}
+
+// SBVH: длинные диагональные треугольники, каждый кандидат ровно один раз
+TEST(SpatialSplitBVHTest, SliversTestedOnce) {
+  std::mt19937 generator(5);
+  std::uniform_real_distribution<float> coord(-10.0f, 10.0f);
+  // вторая вершина далеко от первой, третья рядом с ней
+  auto slivers =
+      make_soup(generator, 2000, [&](const Eigen::Vector3f& a, int c) {
+        if (c == 0)
+          return a;
+        if (c == 1)
+          return Eigen::Vector3f(coord(generator), coord(generator),
+                                 coord(generator));
+        return Eigen::Vector3f(a + Eigen::Vector3f(0.05f, 0.05f, 0.0f));
+      });
+
+  BVHAccel plain(slivers.vertexes, slivers.indices);
+  BVHAccel split(slivers.vertexes, slivers.indices, BVHBuildOptions{0.5f});
+  ASSERT_FALSE(split.get_split_references().empty());
+  // ссылок не больше, чем позволяет бюджет
+  EXPECT_LE(split.get_leaf_indices().size(), slivers.indices.size() * 3 / 2);
+  EXPECT_EQ(split.get_split_references().size(),
+            split.get_leaf_indices().size() / 3);
+
+  auto triangles = [](const IntersectIndices& indices) {
+    std::vector<std::array<VertexIndex, 3>> result;
+    for (size_t i = 0; i < indices.size(); i += 3) {
+      result.push_back({indices[i], indices[i + 1], indices[i + 2]});
+    }
+    std::sort(result.begin(), result.end());
+    return result;
+  };
+  size_t plain_total = 0, split_total = 0;
+  for (int r = 0; r < 300; ++r) {
+    Eigen::Vector3f origin(coord(generator), coord(generator), -20.0f);
+    Eigen::Vector3f target(coord(generator), coord(generator), 20.0f);
+    Ray ray(origin, (target - origin).normalized());
+
+    auto expected = triangles(plain.get_intersect_indices(ray, 0.0f, 100.0f));
+    auto found = triangles(split.get_intersect_indices(ray, 0.0f, 100.0f));
+    EXPECT_EQ(std::adjacent_find(found.begin(), found.end()), found.end());
+
+    // треугольники, которые луч пересекает, остаются в кандидатах
+    const auto& vertexes = slivers.vertexes;
+    for (size_t i = 0; i < slivers.indices.size(); i += 3) {
+      Eigen::Vector3f p0 = vertexes[slivers.indices[i]].get_position();
+      Eigen::Vector3f e1 = vertexes[slivers.indices[i + 1]].get_position() - p0;
+      Eigen::Vector3f e2 = vertexes[slivers.indices[i + 2]].get_position() - p0;
+      Eigen::Vector3f h(ray.direction.y() * e2.z() - ray.direction.z() * e2.y(),
+                        ray.direction.z() * e2.x() - ray.direction.x() * e2.z(),
+                        ray.direction.x() * e2.y() - ray.direction.y() * e2.x());
+      float det = e1.dot(h);
+      if (std::fabs(det) < 1e-12f)
+        continue;
+      Eigen::Vector3f s = ray.origin - p0;
+      float u = s.dot(h) / det;
+      Eigen::Vector3f q(s.y() * e1.z() - s.z() * e1.y(),
+                        s.z() * e1.x() - s.x() * e1.z(),
+                        s.x() * e1.y() - s.y() * e1.x());
+      float v = ray.direction.dot(q) / det;
+      if (u < 0.0f || v < 0.0f || u + v > 1.0f || e2.dot(q) / det < 0.0f)
+        continue;
+      std::array<VertexIndex, 3> triangle{slivers.indices[i],
+                                          slivers.indices[i + 1],
+                                          slivers.indices[i + 2]};
+      EXPECT_TRUE(std::binary_search(found.begin(), found.end(), triangle));
+    }
+    plain_total += expected.size();
+    split_total += found.size();
+  }
+  EXPECT_LT(split_total, plain_total);
+
+  // после деформации дерево со сплитами перестраивается целиком
+  for (auto& vertex : slivers.vertexes) {
+    std::swap(vertex.position[0], vertex.position[2]);
+  }
+  EXPECT_EQ(split.refit(slivers.vertexes, 0.1f), RefitResult::FullRebuild);
+  std::set<std::array<VertexIndex, 3>> unique_triangles;
+  const auto& leaf_indices = split.get_leaf_indices();
+  for (size_t i = 0; i < leaf_indices.size(); i += 3) {
+    unique_triangles.insert(
+        {leaf_indices[i], leaf_indices[i + 1], leaf_indices[i + 2]});
+  }
+  EXPECT_EQ(unique_triangles.size(), slivers.indices.size() / 3);
+}
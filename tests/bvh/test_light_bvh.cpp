@@ -0,0 +1,82 @@
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <eigen3/Eigen/Core>
+#include <random>
+#include <vector>
+#include "light_bvh.h"
+
+using namespace rtr;
+using namespace Eigen;
+
+class LightBVHTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    // Сетка из 10x10 тусклых источников
+    for (int x = 0; x < 10; ++x) {
+      for (int z = 0; z < 10; ++z) {
+        lights.push_back({Vector3f(x * 10.0f, 1.0f, z * 10.0f),
+                          Vector3f(0.5f, 0.5f, 0.5f)});
+      }
+    }
+  }
+
+  std::vector<uint32_t> query(const LightBVH& bvh, const Vector3f& point) {
+    std::vector<uint32_t> result;
+    bvh.for_each_light(point, [&](uint32_t index) { result.push_back(index); });
+    std::sort(result.begin(), result.end());
+    return result;
+  }
+
+  std::vector<Light> lights;
+};
+
+// Радиус влияния соответствует порогу затухания
+TEST_F(LightBVHTest, InfluenceRadiusMatchesCutoff) {
+  Light light{Vector3f::Zero(), Vector3f(1.0f, 2.0f, 0.5f)};
+  float radius = LightBVH::influence_radius(light, 0.1f);
+
+  EXPECT_GT(radius, 0.0f);
+  EXPECT_NEAR(2.0f * light_attenuation(radius), 0.1f, 1e-4f);
+}
+
+// Без порога все источники влияют на любую точку
+TEST_F(LightBVHTest, NoCutoffReturnsAllLights) {
+  LightBVH bvh(lights, 0.0f);
+
+  EXPECT_EQ(query(bvh, Vector3f(1000.0f, 0.0f, 1000.0f)).size(),
+            lights.size());
+}
+
+// Слишком тусклые источники отбрасываются полностью
+TEST_F(LightBVHTest, DimLightsAreCulled) {
+  LightBVH bvh(lights, 1.0f);
+
+  EXPECT_TRUE(bvh.empty());
+  EXPECT_TRUE(query(bvh, Vector3f(0.0f, 1.0f, 0.0f)).empty());
+}
+
+// Результат совпадает с полным перебором
+TEST_F(LightBVHTest, MatchesBruteForce) {
+  const float cutoff = 0.05f;
+  LightBVH bvh(lights, cutoff);
+
+  std::mt19937 generator(42);
+  std::uniform_real_distribution<float> coord(-10.0f, 100.0f);
+
+  for (int i = 0; i < 200; ++i) {
+    Vector3f point(coord(generator), 0.0f, coord(generator));
+
+    std::vector<uint32_t> expected;
+    for (uint32_t j = 0; j < lights.size(); ++j) {
+      float distance = (lights[j].position - point).norm();
+      if (lights[j].intensity.maxCoeff() * light_attenuation(distance) >=
+          cutoff) {
+        expected.push_back(j);
+      }
+    }
+
+    auto result = query(bvh, point);
+    EXPECT_EQ(result, expected);
+    EXPECT_LT(result.size(), lights.size());
+  }
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <filesystem>
+#include <fstream>
+#include <vector>
+#include "vertex.h"
+
+namespace fs = std::filesystem;
+
+/// @brief Сетка size x size квадратов со стороной extent от начала
+/// координат, высота узла задается функцией height(x, y)
+template <typename Height>
+void make_grid(int size, float extent, Height height,
+               std::vector<rtr::PackedVertex>& vertexes,
+               std::vector<rtr::VertexIndex>& indices) {
+  for (int y = 0; y <= size; ++y) {
+    for (int x = 0; x <= size; ++x) {
+      float u = float(x) / size, v = float(y) / size;
+      float px = u * extent, py = v * extent;
+      vertexes.push_back({{px, py, height(px, py)}, {0, 0, 1}, {u, v}});
+    }
+  }
+  rtr::VertexIndex row = rtr::VertexIndex(size + 1);
+  for (int y = 0; y < size; ++y) {
+    for (int x = 0; x < size; ++x) {
+      rtr::VertexIndex i = rtr::VertexIndex(y) * row + rtr::VertexIndex(x);
+      indices.insert(indices.end(),
+                     {i, i + 1, i + row, i + 1, i + row + 1, i + row});
+    }
+  }
+}
+
+/// @brief Плоская сетка в плоскости z = 0
+inline void make_grid(int size, float extent,
+                      std::vector<rtr::PackedVertex>& vertexes,
+                      std::vector<rtr::VertexIndex>& indices) {
+  make_grid(size, extent, [](float, float) { return 0.0f; }, vertexes,
+            indices);
+}
+
+/// @brief Пишет сетку из единичных квадратов в OBJ с материалом gray из
+/// MTL рядом с ним
+template <typename Height>
+void write_grid_obj(const fs::path& path, int size, Height height) {
+  std::vector<rtr::PackedVertex> vertexes;
+  std::vector<rtr::VertexIndex> indices;
+  make_grid(size, float(size), height, vertexes, indices);
+
+  fs::path mtl = fs::path(path).replace_extension(".mtl");
+  std::ofstream(mtl) << "newmtl gray\nKd 0.5 0.5 0.5\n";
+  std::ofstream obj(path);
+  obj << "mtllib " << mtl.filename().string() << "\nusemtl gray\n";
+  for (const auto& vertex : vertexes) {
+    obj << "v " << vertex.position[0] << " " << vertex.position[1] << " "
+        << vertex.position[2] << "\n";
+  }
+  obj << "vn 0 0 1\n";
+  for (size_t i = 0; i < indices.size(); i += 3) {
+    obj << "f " << indices[i] + 1 << "//1 " << indices[i + 1] + 1 << "//1 "
+        << indices[i + 2] + 1 << "//1\n";
+  }
+}
+
+inline void write_grid_obj(const fs::path& path, int size) {
+  write_grid_obj(path, size, [](float, float) { return 0.0f; });
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <gtest/gtest.h>
+#include <unistd.h>
+#include <filesystem>
+#include <string>
+
+namespace fs = std::filesystem;
+
+/// @brief Тест с пустым временным каталогом dir, удаляемым после теста
+///
+/// Имя каталога включает набор тестов и pid процесса, так что параллельные
+/// запуски не пересекаются. Наследники с собственным SetUp сначала вызывают
+/// TempDirTest::SetUp().
+class TempDirTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    const auto* unit = ::testing::UnitTest::GetInstance();
+    dir = fs::temp_directory_path() /
+          ("rtr_" + std::string(unit->current_test_info()->test_suite_name()) +
+           "_" + std::to_string(::getpid()));
+    fs::create_directories(dir);
+  }
+
+  void TearDown() override { fs::remove_all(dir); }
+
+  fs::path dir;
+};
@@ -0,0 +1,96 @@
+#include <gtest/gtest.h>
+#include <random>
+#include <unordered_map>
+#include <vector>
+#include "dedup.h"
+#include "vertex.h"
+
+using namespace rtr;
+
+class DedupTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    // Два треугольника с общим ребром
+    corners = {
+        {{0, 0, 0}, {0, 0, 1}, {0, 0}},  // v0
+        {{1, 0, 0}, {0, 0, 1}, {1, 0}},  // v1
+        {{0, 1, 0}, {0, 0, 1}, {0, 1}},  // v2
+        {{1, 0, 0}, {0, 0, 1}, {1, 0}},  // v1
+        {{1, 1, 0}, {0, 0, 1}, {1, 1}},  // v3
+        {{0, 1, 0}, {0, 0, 1}, {0, 1}},  // v2
+    };
+  }
+
+  std::vector<PackedVertex> corners;
+};
+
+// Общие вершины объединяются, порядок - по первому использованию
+TEST_F(DedupTest, SharedVerticesMerged) {
+  std::vector<PackedVertex> vertexes;
+  std::vector<VertexIndex> indices;
+  deduplicate_vertices(corners, vertexes, indices);
+
+  ASSERT_EQ(vertexes.size(), 4);
+  EXPECT_EQ(indices, (std::vector<VertexIndex>{0, 1, 2, 1, 3, 2}));
+  for (size_t i = 0; i < corners.size(); ++i) {
+    EXPECT_EQ(vertexes[indices[i]], corners[i]);
+  }
+}
+
+// Пустой вход
+TEST_F(DedupTest, EmptyInput) {
+  std::vector<PackedVertex> vertexes{corners[0]};
+  std::vector<VertexIndex> indices{0};
+  deduplicate_vertices({}, vertexes, indices);
+
+  EXPECT_TRUE(vertexes.empty());
+  EXPECT_TRUE(indices.empty());
+}
+
+// +0 и -0 считаются одной вершиной, как в operator==
+TEST_F(DedupTest, SignedZeroMerged) {
+  std::vector<PackedVertex> input = {{{0.0f, 1, 2}, {0, 0, 1}, {0, 0}},
+                                     {{-0.0f, 1, 2}, {0, 0, 1}, {0, 0}}};
+  EXPECT_EQ(std::hash<PackedVertex>{}(input[0]),
+            std::hash<PackedVertex>{}(input[1]));
+
+  std::vector<PackedVertex> vertexes;
+  std::vector<VertexIndex> indices;
+  deduplicate_vertices(input, vertexes, indices);
+
+  EXPECT_EQ(vertexes.size(), 1);
+}
+
+// Большой случайный вход: результат совпадает с последовательной
+// дедупликацией через хеш-таблицу и детерминирован
+TEST_F(DedupTest, MatchesSerialHashMap) {
+  std::mt19937 generator(7);
+  std::uniform_int_distribution<int> coord(0, 30);
+
+  std::vector<PackedVertex> input(200000);
+  for (auto& vertex : input) {
+    vertex = {{float(coord(generator)), float(coord(generator)), 0.0f},
+              {0, 0, 1},
+              {float(coord(generator)) / 30.0f, 0.0f}};
+  }
+
+  std::vector<PackedVertex> expected_vertexes;
+  std::vector<VertexIndex> expected_indices;
+  std::unordered_map<PackedVertex, VertexIndex> unique;
+  for (const auto& vertex : input) {
+    auto [it, inserted] = unique.emplace(vertex, expected_vertexes.size());
+    if (inserted) {
+      expected_vertexes.push_back(vertex);
+    }
+    expected_indices.push_back(it->second);
+  }
+
+  for (int run = 0; run < 2; ++run) {
+    std::vector<PackedVertex> vertexes;
+    std::vector<VertexIndex> indices;
+    deduplicate_vertices(input, vertexes, indices);
+
+    EXPECT_EQ(vertexes, expected_vertexes);
+    EXPECT_EQ(indices, expected_indices);
+  }
+}
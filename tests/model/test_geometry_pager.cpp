@@ -0,0 +1,104 @@
+#include <gtest/gtest.h>
+#include <filesystem>
+#include <string>
+#include <vector>
+#include "geometry_pager.h"
+#include "grid.h"
+#include "mesh.h"
+#include "temp_dir.h"
+
+using namespace rtr;
+using Eigen::Vector3f;
+
+class GeometryPagerTest : public TempDirTest {
+ protected:
+  void SetUp() override {
+    TempDirTest::SetUp();
+
+    // сетка 16 x 16 квадратов в плоскости z = 0
+    make_grid(16, 16.0f, mesh.vertexes.vector(), mesh.indices.vector());
+    mesh.bvh = std::make_shared<BVHAccel>(mesh.vertexes, mesh.indices);
+  }
+
+  /// @brief Число треугольников, пересеченных лучом, по кластерам
+  static size_t count_hits(ClusteredGeometry& geometry, const Ray& ray) {
+    size_t result = 0;
+    float t_max = 100.0f;
+    geometry.for_each_cluster(ray, 0.0f, t_max, [&](uint32_t id, float) {
+      auto cluster = geometry.acquire(id);
+      result += cluster->bvh.get_intersect_indices(ray, 0.0f, t_max).size();
+    });
+    return result;
+  }
+
+  Mesh mesh;
+};
+
+// Тест 1: Кластеры покрывают все треугольники меша
+TEST_F(GeometryPagerTest, ClustersCoverMesh) {
+  auto pager = std::make_shared<GeometryPager>(1 << 20, dir, 32);
+  auto geometry = pager->page_out(mesh);
+  ASSERT_NE(geometry, nullptr);
+  EXPECT_GT(geometry->cluster_count(), 1);
+  EXPECT_EQ(pager->get_stats().resident_bytes, 0);
+
+  size_t indices = 0;
+  for (uint32_t id = 0; id < geometry->cluster_count(); ++id) {
+    const auto& record = geometry->get_record(id);
+    EXPECT_LE(record.index_count, 3 * 32);
+    auto cluster = geometry->acquire(id);
+    EXPECT_EQ(cluster->vertexes.size(), record.vertex_count);
+    indices += cluster->bvh.get_leaf_indices().size();
+    for (auto index : cluster->bvh.get_leaf_indices()) {
+      EXPECT_LT(index, cluster->vertexes.size());
+    }
+  }
+  EXPECT_EQ(indices, mesh.indices.size());
+
+  // лучи находят те же листья, что и BVH меша
+  for (float x : {0.3f, 4.6f, 11.2f, 15.9f}) {
+    Ray ray({x, x * 0.7f, 1.0f}, {0, 0, -1});
+    EXPECT_EQ(count_hits(*geometry, ray) > 0,
+              mesh.bvh->get_intersect_indices(ray, 0.0f, 100.0f).size() > 0);
+  }
+
+  // меш после выгрузки держит только верх иерархии
+  size_t resident_memory = mesh.memory_usage();
+  AABB bbox = mesh.get_bbox();
+  ASSERT_TRUE(mesh.page_out(*pager));
+  EXPECT_TRUE(mesh.indices.empty());
+  EXPECT_EQ(mesh.get_bvh(), nullptr);
+  EXPECT_LT(mesh.memory_usage(), resident_memory / 4);
+  EXPECT_TRUE(mesh.get_bbox().max.isApprox(bbox.max));
+}
+
+// Тест 2: Давно не используемые кластеры вытесняются по бюджету
+TEST_F(GeometryPagerTest, EvictsWithinBudget) {
+  auto sizer = std::make_shared<GeometryPager>(0, dir, 32);
+  size_t cluster_size = sizer->page_out(mesh)->get_record(0).size();
+
+  auto pager = std::make_shared<GeometryPager>(3 * cluster_size, dir, 32);
+  auto geometry = pager->page_out(mesh);
+  ASSERT_NE(geometry, nullptr);
+  for (uint32_t id = 0; id < geometry->cluster_count(); ++id) {
+    EXPECT_NE(geometry->acquire(id), nullptr);
+    EXPECT_LE(pager->get_stats().resident_bytes, 4 * cluster_size);
+  }
+
+  auto stats = pager->get_stats();
+  EXPECT_EQ(stats.misses, geometry->cluster_count());
+  EXPECT_GT(stats.evictions, 0);
+
+  // последний кластер остается, первый читается заново
+  uint32_t last = uint32_t(geometry->cluster_count() - 1);
+  EXPECT_NE(geometry->find(last), nullptr);
+  EXPECT_EQ(geometry->find(0), nullptr);
+  EXPECT_NE(geometry->acquire(0), nullptr);
+  EXPECT_EQ(pager->get_stats().misses, stats.misses + 1);
+
+  // файлы удаляются вместе с геометрией
+  geometry.reset();
+  EXPECT_EQ(pager->get_stats().resident_bytes, 0);
+  EXPECT_EQ(pager->get_stats().misses, stats.misses + 1);
+  EXPECT_TRUE(fs::is_empty(dir));
+}
@@ -0,0 +1,257 @@
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <numeric>
+#include <random>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include "mesh.h"
+#include "model.h"
+
+using namespace rtr;
+using namespace Eigen;
+
+// Тест 1: Октаэдрическое кодирование нормалей
+TEST(CompactVertexTest, OctahedralNormals) {
+  std::mt19937 generator(7);
+  std::normal_distribution<float> coord;
+  for (int i = 0; i < 10000; ++i) {
+    Vector3f n(coord(generator), coord(generator), coord(generator));
+    n.normalize();
+    Vector3f decoded = decode_octahedral(encode_octahedral(n));
+    EXPECT_GT(decoded.dot(n), 0.99999f);
+  }
+
+  for (const Vector3f& axis : {Vector3f(0, 0, -1), Vector3f(-1, 0, 0),
+                               Vector3f(0, 1, 0)}) {
+    EXPECT_TRUE(decode_octahedral(encode_octahedral(axis))
+                    .isApprox(axis, 1e-4f));
+  }
+  // нулевая нормаль (модель без нормалей) остается нулевой
+  EXPECT_EQ(decode_octahedral(encode_octahedral(Vector3f::Zero())),
+            Vector3f::Zero());
+}
+
+// Тест 2: Компактный меш сохраняет геометрию, узлы BVH квантуются
+TEST(CompactVertexTest, CompactMesh) {
+  std::vector<PackedVertex> vertexes = {
+      {{0, 0, 0}, {0, 0, 1}, {0.0f, 0.0f}},
+      {{1, 0, 0}, {0, 0.6f, 0.8f}, {4.0f, 0.0f}},
+      {{1, 1, 0}, {0, 0, -1}, {4.0f, 2.0f}},
+      {{0, 1, 0}, {0, 0, 0}, {0.25f, 2.0f}},
+  };
+  std::vector<VertexIndex> indices = {0, 1, 2, 0, 2, 3};
+
+  Mesh mesh;
+  mesh.vertexes = vertexes;
+  mesh.indices = indices;
+  mesh.bvh = std::make_shared<BVHAccel>(mesh.vertexes, mesh.indices);
+  size_t full_memory = mesh.memory_usage();
+  size_t node_bytes = mesh.bvh->get_nodes().size() * sizeof(BVHNode);
+  Ray ray({0.75f, 0.25f, 5.0f}, {0, 0, -1});
+  size_t candidates = mesh.bvh->get_intersect_indices(ray, 0.0f, 10.0f).size();
+
+  mesh.compact();
+  EXPECT_EQ(mesh.vertex_format, VertexFormat::Compact);
+  EXPECT_TRUE(mesh.vertexes.empty());
+  ASSERT_EQ(mesh.vertex_count(), vertexes.size());
+  EXPECT_TRUE(mesh.bvh->is_quantized());
+  EXPECT_EQ(full_memory - mesh.memory_usage(),
+            vertexes.size() * 12 + node_bytes / 2);
+
+  for (VertexIndex i = 0; i < vertexes.size(); ++i) {
+    PackedVertex vertex = mesh.get_vertex(i);
+    EXPECT_EQ(vertex.position, vertexes[i].position);
+    EXPECT_EQ(mesh.get_position(i), vertexes[i].get_position());
+    EXPECT_TRUE(vertex.get_normal().isApprox(vertexes[i].get_normal(), 1e-4f) ||
+                vertexes[i].get_normal().isZero());
+    EXPECT_NEAR(vertex.texcoord[0], vertexes[i].texcoord[0], 1e-4f);
+    EXPECT_NEAR(vertex.texcoord[1], vertexes[i].texcoord[1], 1e-4f);
+  }
+  EXPECT_TRUE(mesh.get_vertex(3).get_normal().isZero());
+
+  EXPECT_EQ(mesh.bvh->get_intersect_indices(ray, 0.0f, 10.0f).size(),
+            candidates);
+}
+
+// Тест 3: Формат вершин хранится в кэше модели
+TEST(CompactVertexTest, CachedCompactModel) {
+  int seed = ::testing::UnitTest::GetInstance()->random_seed();
+  fs::path dir = fs::temp_directory_path() /
+                 ("rtr_compact_mesh_" + std::to_string(seed));
+  fs::create_directories(dir);
+  fs::path path = dir / "model.obj";
+  std::ofstream(path) << "v 0 0 0\nv 1 0 0\nv 1 1 0\nvt 0 0\nvt 1 0\nvt 1 1\n"
+                         "vn 0 0 1\nf 1/1/1 2/2/1 3/3/1\n";
+
+  ImportOptions options{.cache = CacheMode::On,
+                        .vertex_format = VertexFormat::Compact};
+  auto imported = Model::import(path, options);
+  ASSERT_TRUE(imported.has_value());
+  ASSERT_EQ(imported->get_meshes().size(), 1);
+  EXPECT_EQ(imported->get_meshes()[0].vertex_format, VertexFormat::Compact);
+
+  auto cached = Model::load_cache(Model::cache_path(path), options);
+  ASSERT_TRUE(cached.has_value());
+  const auto& mesh = cached->get_meshes()[0];
+  EXPECT_TRUE(mesh.positions.is_view());
+  EXPECT_NEAR(mesh.get_vertex(2).texcoord[1], 1.0f, 1e-4f);
+  EXPECT_EQ(cached->get_geometry_memory(), imported->get_geometry_memory());
+
+  // другой формат вершин требует нового импорта
+  EXPECT_FALSE(Model::load_cache(Model::cache_path(path)).has_value());
+
+  fs::remove_all(dir);
+}
+
+// Тест 4: Отложенный BVH строится один раз при первом обращении
+TEST(DeferredBVHTest, BuiltOnce) {
+  std::vector<PackedVertex> vertexes;
+  std::vector<VertexIndex> indices;
+  for (int i = 0; i < 100; ++i) {
+    float x = float(i);
+    for (const auto& p : {Vector3f(x, 0, 0), Vector3f(x + 1, 0, 0),
+                          Vector3f(x, 1, 0)}) {
+      indices.push_back(VertexIndex(vertexes.size()));
+      vertexes.push_back({{p.x(), p.y(), p.z()}, {0, 0, 1}, {0, 0}});
+    }
+  }
+
+  Mesh mesh;
+  mesh.vertexes = vertexes;
+  mesh.indices = indices;
+  mesh.deferred_bvh = std::make_shared<DeferredBVH>();
+  mesh.bbox = mesh.compute_bbox();
+  size_t unbuilt_memory = mesh.memory_usage();
+  EXPECT_EQ(mesh.get_built_bvh(), nullptr);
+  EXPECT_TRUE(mesh.get_bbox().max.isApprox(Vector3f(100, 1, 0)));
+
+  // копия меша разделяет сборку
+  Mesh copy = mesh;
+  std::vector<BVHAccel*> built(8);
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < built.size(); ++i) {
+    threads.emplace_back([&, i] {
+      built[i] = (i % 2 ? copy : mesh).get_bvh();
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  ASSERT_NE(built[0], nullptr);
+  for (auto* bvh : built) {
+    EXPECT_EQ(bvh, built[0]);
+  }
+  EXPECT_EQ(mesh.get_built_bvh(), built[0]);
+  EXPECT_GT(mesh.memory_usage(), unbuilt_memory);
+  EXPECT_TRUE(mesh.get_bbox().max.isApprox(Vector3f(100, 1, 0)));
+
+  // компактный меш строит квантованный BVH
+  Mesh compact;
+  compact.vertexes = vertexes;
+  compact.indices = indices;
+  compact.deferred_bvh = std::make_shared<DeferredBVH>();
+  compact.bbox = compact.compute_bbox();
+  compact.compact();
+  EXPECT_EQ(compact.get_built_bvh(), nullptr);
+  ASSERT_NE(compact.get_bvh(), nullptr);
+  EXPECT_TRUE(compact.get_bvh()->is_quantized());
+  Ray ray({50.25f, 0.25f, 5.0f}, {0, 0, -1});
+  EXPECT_EQ(compact.get_bvh()->get_intersect_indices(ray, 0.0f, 10.0f).size(),
+            built[0]->get_intersect_indices(ray, 0.0f, 10.0f).size());
+}
+
+// Тест 5: Перестановка треугольников в порядок листьев BVH
+TEST(MeshLayoutTest, FollowsLeafOrder) {
+  std::mt19937 generator(3);
+  const int size = 40;
+  std::vector<PackedVertex> vertexes;
+  for (int y = 0; y <= size; ++y) {
+    for (int x = 0; x <= size; ++x) {
+      vertexes.push_back({{float(x), float(y), 0.0f}, {0, 0, 1}, {0, 0}});
+    }
+  }
+  // вершины и треугольники в случайном порядке
+  std::vector<VertexIndex> order(vertexes.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::shuffle(order.begin(), order.end(), generator);
+  std::vector<PackedVertex> shuffled(vertexes.size());
+  for (size_t i = 0; i < order.size(); ++i) {
+    shuffled[order[i]] = vertexes[i];
+  }
+  std::vector<std::array<VertexIndex, 3>> triangles;
+  VertexIndex row = size + 1;
+  for (int y = 0; y < size; ++y) {
+    for (int x = 0; x < size; ++x) {
+      VertexIndex i = y * row + x;
+      triangles.push_back({order[i], order[i + 1], order[i + row]});
+      triangles.push_back({order[i + 1], order[i + row + 1], order[i + row]});
+    }
+  }
+  std::shuffle(triangles.begin(), triangles.end(), generator);
+  std::vector<VertexIndex> indices;
+  for (const auto& triangle : triangles) {
+    indices.insert(indices.end(), triangle.begin(), triangle.end());
+  }
+
+  auto corners = [](const Mesh& mesh) {
+    std::multiset<std::array<float, 9>> result;
+    for (size_t i = 0; i < mesh.indices.size(); i += 3) {
+      std::array<float, 9> corner;
+      for (int c = 0; c < 3; ++c) {
+        Vector3f p = mesh.get_position(mesh.indices[i + c]);
+        std::copy(p.data(), p.data() + 3, corner.begin() + 3 * c);
+      }
+      result.insert(corner);
+    }
+    return result;
+  };
+  auto first_use = [](const Mesh& mesh) {
+    VertexIndex next = 0;
+    for (VertexIndex index : mesh.indices) {
+      if (index > next)
+        return false;
+      next = std::max<VertexIndex>(next, index + 1);
+    }
+    return true;
+  };
+
+  for (bool deferred : {false, true}) {
+    Mesh mesh;
+    mesh.vertexes = shuffled;
+    mesh.indices = indices;
+    if (deferred) {
+      mesh.bbox = mesh.compute_bbox();
+      mesh.deferred_bvh = std::make_shared<DeferredBVH>();
+    } else {
+      mesh.bvh = std::make_shared<BVHAccel>(mesh.vertexes, mesh.indices);
+    }
+    auto expected = corners(mesh);
+    Ray ray({10.25f, 20.75f, 5.0f}, {0, 0, -1});
+
+    mesh.optimize_layout();
+    EXPECT_EQ(corners(mesh), expected);
+    EXPECT_TRUE(first_use(mesh));
+    if (!deferred) {
+      // треугольники идут в порядке листьев
+      EXPECT_TRUE(std::equal(mesh.indices.begin(), mesh.indices.end(),
+                             mesh.bvh->get_leaf_indices().begin(),
+                             mesh.bvh->get_leaf_indices().end()));
+    }
+
+    auto found = mesh.get_bvh()->get_intersect_indices(ray, 0.0f, 10.0f);
+    bool hit = false;
+    for (size_t i = 0; i < found.size(); i += 3) {
+      Vector3f a = mesh.get_position(found[i]);
+      Vector3f b = mesh.get_position(found[i + 1]);
+      Vector3f c = mesh.get_position(found[i + 2]);
+      float min_x = std::min({a.x(), b.x(), c.x()});
+      float min_y = std::min({a.y(), b.y(), c.y()});
+      hit |= min_x == 10.0f && min_y == 20.0f;
+    }
+    EXPECT_TRUE(hit);
+  }
+}
@@ -0,0 +1,127 @@
+#include <gtest/gtest.h>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+#include "model.h"
+#include "temp_dir.h"
+
+using namespace rtr;
+
+class ModelTest : public TempDirTest {
+ protected:
+  void SetUp() override {
+    TempDirTest::SetUp();
+    model_path = dir / "model.obj";
+    std::ofstream(model_path) << "mtllib model.mtl\n"
+                                 "v 0 0 0\nv 1 0 0\nv 1 1 0\nv 0 1 0\n"
+                                 "usemtl matte\nf 1 2 3\n"
+                                 "usemtl shiny\nf 1 3 4\n";
+    write_texture("a.ppm", std::string("\xff\x00\x00", 3));
+    write_texture("b.ppm", std::string("\x00\x00\xff", 3));
+    write_materials("newmtl matte\nKd 0.5 0.5 0.5\nmap_Kd a.ppm\n"
+                    "newmtl shiny\nKd 0.2 0.2 0.2\nKs 0.1 0.1 0.1\n");
+  }
+
+  void write_materials(const std::string& text) {
+    std::ofstream(dir / "model.mtl") << text;
+  }
+
+  void write_texture(const std::string& name, const std::string& pixel) {
+    std::ofstream(dir / name, std::ios::binary) << "P6\n1 1\n255\n" << pixel;
+  }
+
+  fs::path model_path;
+};
+
+// Тест 1: Перезагрузка MTL меняет материалы на месте, геометрия та же
+TEST_F(ModelTest, ReloadMaterials) {
+  auto imported = Model::import(model_path);
+  ASSERT_TRUE(imported.has_value());
+  auto model = std::make_shared<Model>(std::move(*imported));
+  ASSERT_EQ(model->get_materials().size(), 2);
+  EXPECT_EQ(model->get_material_sources(),
+            std::vector<fs::path>{dir / "model.mtl"});
+
+  auto matte = model->get_materials()[0];
+  auto shiny = model->get_materials()[1];
+  auto texture = matte->diffuse_texture;
+  auto bvh = model->get_meshes()[0].bvh;
+  ASSERT_TRUE(texture != nullptr);
+
+  // тот же файл текстуры не декодируется заново, новый загружается
+  write_materials("newmtl matte\nKd 0.9 0.1 0.1\nmap_Kd a.ppm\n"
+                  "map_Ka b.ppm\n"
+                  "newmtl shiny\nKd 0.2 0.2 0.2\nKs 1 1 1\nNs 100\n");
+  ASSERT_TRUE(model->reload_materials());
+
+  EXPECT_EQ(model->get_materials()[0], matte);
+  EXPECT_TRUE(matte->diffuse.isApprox(Eigen::Vector3f(0.9f, 0.1f, 0.1f)));
+  EXPECT_EQ(matte->diffuse_texture, texture);
+  ASSERT_TRUE(matte->ambient_texture != nullptr);
+  EXPECT_GT(matte->ambient_texture->sample(0.5f, 0.5f).z(), 0.9f);
+  // эвристика отражения пересчитывается: зеркало
+  EXPECT_FLOAT_EQ(shiny->reflectivity, 0.9f);
+  EXPECT_EQ(model->get_meshes()[0].bvh, bvh);
+  EXPECT_EQ(model->get_meshes()[0].material.lock(),
+            model->get_materials()[model->get_meshes()[0].material_id]);
+}
+
+// Тест 2: Пропавший материал меша требует полного импорта
+TEST_F(ModelTest, ReloadRemovedMaterial) {
+  auto model = Model::import(model_path);
+  ASSERT_TRUE(model.has_value());
+  auto diffuse = model->get_materials()[0]->diffuse;
+
+  write_materials("newmtl matte\nKd 1 1 1\n");
+  EXPECT_FALSE(model->reload_materials());
+  EXPECT_TRUE(model->get_materials()[0]->diffuse.isApprox(diffuse));
+}
+
+// Тест 3: Материалы сопоставляются по имени, порядок и новые записи MTL не
+// важны, в том числе для модели из кэша
+TEST_F(ModelTest, ReloadReorderedMaterials) {
+  auto imported = Model::import(model_path, {.cache = CacheMode::On});
+  ASSERT_TRUE(imported.has_value());
+  auto cached = Model::load_cache(Model::cache_path(model_path));
+  ASSERT_TRUE(cached.has_value());
+
+  write_materials("newmtl unused\nKd 0 1 0\n"
+                  "newmtl shiny\nKd 0.3 0.3 0.3\nKs 0.1 0.1 0.1\n"
+                  "newmtl matte\nKd 0.7 0.7 0.7\n");
+  for (Model* model : {&*imported, &*cached}) {
+    auto before = model->get_materials();
+    ASSERT_TRUE(model->reload_materials());
+    EXPECT_EQ(model->get_materials(), before);
+    ASSERT_EQ(model->get_meshes().size(), 2);
+    for (const auto& mesh : model->get_meshes()) {
+      // matte у треугольника под диагональю квадрата, shiny над ней
+      auto material = mesh.material.lock();
+      ASSERT_TRUE(material != nullptr);
+      float below = 0.0f;
+      for (size_t c = 0; c < 3; ++c) {
+        const auto& position = mesh.get_vertex(mesh.indices[c]).position;
+        below += position[0] - position[1];
+      }
+      EXPECT_FLOAT_EQ(material->diffuse.x(), below > 0.0f ? 0.7f : 0.3f);
+    }
+  }
+}
+
+// Тест 4: Модель из кэша при перезагрузке не декодирует свои текстуры заново
+TEST_F(ModelTest, ReloadCachedTextures) {
+  ASSERT_TRUE(Model::import(model_path, {.cache = CacheMode::On}).has_value());
+  auto cached = Model::load_cache(Model::cache_path(model_path));
+  ASSERT_TRUE(cached.has_value());
+  auto matte = cached->get_materials()[0];
+  auto texture = matte->diffuse_texture;
+  ASSERT_TRUE(texture != nullptr);
+
+  write_materials("newmtl matte\nKd 0.9 0.1 0.1\nmap_Kd a.ppm\n"
+                  "map_Ka b.ppm\n"
+                  "newmtl shiny\nKd 0.2 0.2 0.2\n");
+  ASSERT_TRUE(cached->reload_materials());
+  EXPECT_EQ(matte->diffuse_texture, texture);
+  ASSERT_TRUE(matte->ambient_texture != nullptr);
+  EXPECT_GT(matte->ambient_texture->sample(0.5f, 0.5f).z(), 0.9f);
+}
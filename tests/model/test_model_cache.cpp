@@ -0,0 +1,167 @@
+#include <gtest/gtest.h>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include "model.h"
+#include "temp_dir.h"
+
+using namespace rtr;
+
+class ModelCacheTest : public TempDirTest {
+ protected:
+  void SetUp() override {
+    TempDirTest::SetUp();
+    model_path = dir / "model.obj";
+    write_model("v 0 0 0\nv 1 0 0\nv 1 1 0\nv 0 1 0\nv 0 0 1\n"
+                "vn 0 0 1\n"
+                "f 1//1 2//1 3//1 4//1\n"
+                "f 1//1 2//1 5//1\n");
+  }
+
+  void write_model(const std::string& text) {
+    std::ofstream(model_path) << text;
+  }
+
+  fs::path model_path;
+};
+
+// Тест 1: Кэш записывается при импорте и загружается без разбора файла
+TEST_F(ModelCacheTest, RoundTrip) {
+  auto imported = Model::import(model_path, {.cache = CacheMode::On});
+  ASSERT_TRUE(imported.has_value());
+  ASSERT_TRUE(fs::exists(Model::cache_path(model_path)));
+
+  auto cached = Model::load_cache(Model::cache_path(model_path));
+  ASSERT_TRUE(cached.has_value());
+  EXPECT_EQ(cached->get_sources(), imported->get_sources());
+  ASSERT_EQ(cached->get_meshes().size(), imported->get_meshes().size());
+
+  for (size_t m = 0; m < imported->get_meshes().size(); ++m) {
+    const auto& expected = imported->get_meshes()[m];
+    const auto& mesh = cached->get_meshes()[m];
+
+    EXPECT_TRUE(mesh.vertexes.is_view());
+    EXPECT_TRUE(std::equal(mesh.vertexes.begin(), mesh.vertexes.end(),
+                           expected.vertexes.begin(), expected.vertexes.end()));
+    EXPECT_TRUE(std::equal(mesh.indices.begin(), mesh.indices.end(),
+                           expected.indices.begin(), expected.indices.end()));
+    EXPECT_EQ(mesh.material_id, expected.material_id);
+
+    ASSERT_TRUE(mesh.bvh != nullptr);
+    EXPECT_EQ(mesh.bvh->get_nodes().size(),
+              expected.bvh->get_nodes().size());
+    EXPECT_TRUE(mesh.bvh->get_root_bbox().min.isApprox(
+        expected.bvh->get_root_bbox().min));
+
+    Ray ray({0.25f, 0.25f, 5.0f}, {0, 0, -1});
+    EXPECT_EQ(mesh.bvh->get_intersect_indices(ray, 0.0f, 10.0f).size(),
+              expected.bvh->get_intersect_indices(ray, 0.0f, 10.0f).size());
+  }
+
+  auto again = Model::import(model_path, {.cache = CacheMode::On});
+  ASSERT_TRUE(again.has_value());
+  EXPECT_TRUE(again->get_meshes()[0].vertexes.is_view());
+  // отображенная из кэша геометрия не копируется в арену
+  EXPECT_EQ(again->get_arena(), nullptr);
+}
+
+// Тест 2: Изменение исходного файла делает кэш недействительным
+TEST_F(ModelCacheTest, InvalidatedBySourceChange) {
+  ASSERT_TRUE(Model::import(model_path, {.cache = CacheMode::On}).has_value());
+
+  write_model("v 0 0 0\nv 2 0 0\nv 0 2 0\nf 1 2 3\n");
+  EXPECT_FALSE(Model::load_cache(Model::cache_path(model_path)).has_value());
+
+  auto model = Model::import(model_path, {.cache = CacheMode::On});
+  ASSERT_TRUE(model.has_value());
+  ASSERT_EQ(model->get_meshes().size(), 1);
+  // импортирована заново: геометрия в арене модели, а не в файле кэша
+  EXPECT_NE(model->get_arena(), nullptr);
+  EXPECT_EQ(model->get_meshes()[0].vertexes[1].position[0], 2.0f);
+
+  // кэш перезаписан
+  EXPECT_TRUE(Model::load_cache(Model::cache_path(model_path)).has_value());
+}
+
+// Тест 3: Поврежденный или чужой файл не используется
+TEST_F(ModelCacheTest, CorruptedCache) {
+  fs::path cache_path = Model::cache_path(model_path);
+  std::ofstream(cache_path) << "not a cache";
+  EXPECT_FALSE(Model::load_cache(cache_path).has_value());
+  EXPECT_FALSE(Model::load_cache(dir / "missing.rtrcache").has_value());
+
+  ASSERT_TRUE(Model::import(model_path, {.cache = CacheMode::On}).has_value());
+  auto size = fs::file_size(cache_path);
+  fs::resize_file(cache_path, size / 2);
+  EXPECT_FALSE(Model::load_cache(cache_path).has_value());
+}
+
+// Тест 4: Испорченный индекс внутри целого раздела отвергается при загрузке,
+// модель импортируется заново
+TEST_F(ModelCacheTest, CorruptedIndex) {
+  auto imported = Model::import(model_path, {.cache = CacheMode::On});
+  ASSERT_TRUE(imported.has_value());
+  fs::path cache_path = Model::cache_path(model_path);
+  const auto& indices = imported->get_meshes()[0].indices;
+  std::string pattern(reinterpret_cast<const char*>(indices.data()),
+                      indices.size() * sizeof(VertexIndex));
+
+  std::string original;
+  {
+    std::ifstream in(cache_path, std::ios::binary);
+    original.assign(std::istreambuf_iterator<char>(in), {});
+  }
+  // индексы сетки и листьев BVH, каждое вхождение портится отдельно
+  size_t occurrences = 0;
+  for (size_t at = original.find(pattern); at != std::string::npos;
+       at = original.find(pattern, at + 1)) {
+    ++occurrences;
+    std::string corrupted = original;
+    VertexIndex bad = 1000;
+    corrupted.replace(at + sizeof(VertexIndex), sizeof(bad),
+                      reinterpret_cast<const char*>(&bad), sizeof(bad));
+    std::ofstream(cache_path, std::ios::binary) << corrupted;
+    EXPECT_FALSE(Model::load_cache(cache_path).has_value());
+  }
+  EXPECT_GE(occurrences, 1);
+
+  auto reimported = Model::import(model_path, {.cache = CacheMode::On});
+  ASSERT_TRUE(reimported.has_value());
+  EXPECT_NE(reimported->get_arena(), nullptr);
+  EXPECT_TRUE(Model::load_cache(cache_path).has_value());
+}
+
+// Тест 5: Режим Off не создает кэш
+TEST_F(ModelCacheTest, CacheOff) {
+  ASSERT_TRUE(Model::import(model_path).has_value());
+  EXPECT_FALSE(fs::exists(Model::cache_path(model_path)));
+}
+
+// Тест 6: Кэш не строит отложенные BVH, загруженный меш откладывает их снова
+TEST_F(ModelCacheTest, DeferredBVH) {
+  ImportOptions deferred{.cache = CacheMode::On, .defer_bvh = true};
+  auto imported = Model::import(model_path, deferred);
+  ASSERT_TRUE(imported.has_value());
+  ASSERT_TRUE(fs::exists(Model::cache_path(model_path)));
+  EXPECT_EQ(imported->get_meshes()[0].get_built_bvh(), nullptr);
+
+  auto cached = Model::import(model_path, deferred);
+  ASSERT_TRUE(cached.has_value());
+  EXPECT_EQ(cached->get_arena(), nullptr);  // загружена из кэша
+  const auto& mesh = cached->get_meshes()[0];
+  EXPECT_EQ(mesh.get_built_bvh(), nullptr);
+  ASSERT_NE(mesh.get_bvh(), nullptr);
+  Ray ray({0.25f, 0.25f, 5.0f}, {0, 0, -1});
+  EXPECT_GT(mesh.get_bvh()->get_intersect_indices(ray, 0.0f, 10.0f).size(),
+            0);
+
+  // импорт без отложенных BVH разбирает файл заново и кэширует их
+  auto eager = Model::import(model_path, {.cache = CacheMode::On});
+  ASSERT_TRUE(eager.has_value());
+  EXPECT_NE(eager->get_arena(), nullptr);
+  EXPECT_NE(eager->get_meshes()[0].get_built_bvh(), nullptr);
+  auto loaded = Model::load_cache(Model::cache_path(model_path));
+  ASSERT_TRUE(loaded.has_value());
+  EXPECT_NE(loaded->get_meshes()[0].bvh, nullptr);
+}
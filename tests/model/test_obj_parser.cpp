@@ -0,0 +1,166 @@
+#include <gtest/gtest.h>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include "model.h"
+#include "obj_parser.h"
+#include "temp_dir.h"
+
+using namespace rtr;
+
+class ObjParserTest : public TempDirTest {
+ protected:
+  fs::path write(const std::string& name, const std::string& text) {
+    fs::path path = dir / name;
+    std::ofstream(path) << text;
+    return path;
+  }
+};
+
+// Тест 1: Треугольник с текстурными координатами и нормалями
+TEST_F(ObjParserTest, Triangle) {
+  auto obj = parse_obj(write("tri.obj",
+                             "# comment\n"
+                             "v 0 0 0\n"
+                             "v 1 0 0\n"
+                             "v 0 1.5 -2e-1\n"
+                             "vt 0.5 1\n"
+                             "vn 0 0 1\n"
+                             "f 1/1/1 2/1/1 3/1/1\n"));
+  ASSERT_TRUE(obj.has_value());
+
+  EXPECT_EQ(obj->vertices,
+            (std::vector<float>{0, 0, 0, 1, 0, 0, 0, 1.5f, -0.2f}));
+  EXPECT_EQ(obj->texcoords, (std::vector<float>{0.5f, 1}));
+  EXPECT_EQ(obj->normals, (std::vector<float>{0, 0, 1}));
+
+  ASSERT_EQ(obj->groups.size(), 1);
+  ASSERT_EQ(obj->groups[0].size(), 3);
+  EXPECT_EQ(obj->groups[0][2].vertex_index, 2);
+  EXPECT_EQ(obj->groups[0][2].texcoord_index, 0);
+  EXPECT_EQ(obj->groups[0][2].normal_index, 0);
+}
+
+// Тест 2: Многоугольники разбиваются веером, вырожденные грани пропускаются
+TEST_F(ObjParserTest, PolygonsTriangulated) {
+  auto obj = parse_obj(write("quad.obj",
+                             "v 0 0 0\nv 1 0 0\nv 1 1 0\nv 0 1 0\nv 0 2 0\n"
+                             "f 1 2 3 4 5\n"
+                             "f 1 2\n"));
+  ASSERT_TRUE(obj.has_value());
+
+  const auto& corners = obj->groups.back();
+  ASSERT_EQ(corners.size(), 9);
+  std::vector<int32_t> indices;
+  for (const auto& corner : corners) {
+    indices.push_back(corner.vertex_index);
+    EXPECT_EQ(corner.normal_index, -1);
+    EXPECT_EQ(corner.texcoord_index, -1);
+  }
+  EXPECT_EQ(indices, (std::vector<int32_t>{0, 1, 2, 0, 2, 3, 0, 3, 4}));
+  EXPECT_EQ(obj->triangulated_faces, 1);
+  EXPECT_EQ(obj->skipped_faces, 1);
+}
+
+// Тест 3: Относительные индексы и формат v//vn
+TEST_F(ObjParserTest, RelativeIndices) {
+  auto obj = parse_obj(write("rel.obj",
+                             "v 0 0 0\nv 1 0 0\nv 0 1 0\nvn 0 0 1\n"
+                             "f -3//-1 -2//-1 -1//-1\n"
+                             "v 1 1 0\n"
+                             "f -3//1 -2//1 -1//1\n"));
+  ASSERT_TRUE(obj.has_value());
+
+  const auto& corners = obj->groups.back();
+  ASSERT_EQ(corners.size(), 6);
+  EXPECT_EQ(corners[0].vertex_index, 0);
+  EXPECT_EQ(corners[3].vertex_index, 1);
+  EXPECT_EQ(corners[5].vertex_index, 3);
+  EXPECT_EQ(corners[5].normal_index, 0);
+  EXPECT_EQ(corners[5].texcoord_index, -1);
+}
+
+// Тест 4: Грани группируются по usemtl в порядке первого использования
+TEST_F(ObjParserTest, MaterialGroups) {
+  auto obj = parse_obj(write("mtl.obj",
+                             "mtllib scene.mtl\n"
+                             "v 0 0 0\nv 1 0 0\nv 0 1 0\n"
+                             "f 1 2 3\n"
+                             "usemtl red\n"
+                             "f 1 2 3\n"
+                             "usemtl blue\n"
+                             "f 3 2 1\n"
+                             "usemtl red\n"
+                             "f 2 3 1\n"));
+  ASSERT_TRUE(obj.has_value());
+
+  EXPECT_EQ(obj->mtllibs, (std::vector<std::string>{"scene.mtl"}));
+  EXPECT_EQ(obj->materials, (std::vector<std::string>{"red", "blue"}));
+  ASSERT_EQ(obj->groups.size(), 3);
+  ASSERT_EQ(obj->groups[0].size(), 6);  // red
+  EXPECT_EQ(obj->groups[0][3].vertex_index, 1);
+  EXPECT_EQ(obj->groups[1].size(), 3);  // blue
+  EXPECT_EQ(obj->groups[2].size(), 3);  // без материала
+}
+
+// Тест 5: Ошибки разбора и индексы вне диапазона
+TEST_F(ObjParserTest, InvalidInput) {
+  EXPECT_FALSE(parse_obj(dir / "missing.obj").has_value());
+  EXPECT_FALSE(parse_obj(write("bad_v.obj", "v 0 x 0\n")).has_value());
+  EXPECT_FALSE(
+      parse_obj(write("bad_f.obj", "v 0 0 0\nf 1 2 3\n")).has_value());
+  EXPECT_FALSE(parse_obj(write("zero.obj", "v 0 0 0\nf 0 1 1\n")).has_value());
+}
+
+// Тест 6: Файл из нескольких фрагментов разбирается как единое целое
+TEST_F(ObjParserTest, ManyChunks) {
+  const int quads = 80000;
+  std::string text = "usemtl a\n";
+  for (int i = 0; i < quads; ++i) {
+    text += "v " + std::to_string(i) + " 0 0\n";
+    text += "v " + std::to_string(i) + " 1 0\n";
+    if (i > 0) {
+      text += "f -4 -3 -1 -2\n";
+    }
+    if (i == quads / 2) {
+      text += "usemtl b\n";
+    }
+  }
+  ASSERT_GT(text.size(), 2u << 20);
+
+  auto obj = parse_obj(write("big.obj", text));
+  ASSERT_TRUE(obj.has_value());
+
+  ASSERT_EQ(obj->vertices.size(), 3 * 2 * quads);
+  EXPECT_EQ(obj->vertices[3 * (2 * quads - 1)], float(quads - 1));
+  EXPECT_EQ(obj->triangulated_faces, quads - 1);
+  ASSERT_EQ(obj->groups.size(), 3);
+  EXPECT_EQ(obj->groups[0].size(), 6 * (quads / 2));
+  EXPECT_EQ(obj->groups[1].size(), 6 * (quads / 2 - 1));
+
+  // четырехугольник i ссылается на вершины 2i-2 .. 2i+1, веер от 2i-2
+  for (size_t g = 0; g < 2; ++g) {
+    int first = g == 0 ? 1 : quads / 2 + 1;
+    for (size_t q = 0; q < obj->groups[g].size() / 6; ++q) {
+      int32_t base = 2 * (first + int(q)) - 2;
+      ASSERT_EQ(obj->groups[g][6 * q].vertex_index, base);
+      ASSERT_EQ(obj->groups[g][6 * q + 5].vertex_index, base + 2);
+    }
+  }
+}
+
+// Тест 7: Импорт модели через собственный парсер
+TEST_F(ObjParserTest, ImportModel) {
+  auto model = Model::import(write("model.obj",
+                                   "v 0 0 0\nv 1 0 0\nv 1 1 0\nv 0 1 0\n"
+                                   "vn 0 0 1\n"
+                                   "f 1//1 2//1 3//1 4//1\n"));
+  ASSERT_TRUE(model.has_value());
+
+  ASSERT_EQ(model->get_meshes().size(), 1);
+  const auto& mesh = model->get_meshes()[0];
+  EXPECT_EQ(mesh.vertexes.size(), 4);
+  EXPECT_EQ(mesh.indices.size(), 6);
+  EXPECT_EQ(mesh.material_id, -1);
+  EXPECT_TRUE(mesh.bvh != nullptr);
+}
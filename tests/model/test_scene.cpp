@@ -0,0 +1,164 @@
+#include <gtest/gtest.h>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "scene.h"
+#include "temp_dir.h"
+
+using namespace rtr;
+using namespace Eigen;
+
+class SceneTest : public TempDirTest {
+ protected:
+  void SetUp() override {
+    TempDirTest::SetUp();
+
+    // единичный квадрат в плоскости XY
+    std::ofstream(dir / "quad.obj") << "v 0 0 0\nv 1 0 0\nv 1 1 0\nv 0 1 0\n"
+                                       "f 1 2 3 4\n";
+    auto imported = Model::import(dir / "quad.obj");
+    ASSERT_TRUE(imported.has_value());
+    model = std::make_shared<const Model>(std::move(*imported));
+  }
+
+  std::shared_ptr<const Model> model;
+};
+
+// Тест 1: Экземпляры разделяют геометрию модели
+TEST_F(SceneTest, SharedGeometry) {
+  Scene single(model);
+  Scene scene;
+  for (int i = 0; i < 100; ++i) {
+    scene.add_instance(model, Affine3f(Translation3f(2.0f * i, 0.0f, 0.0f)));
+  }
+  scene.build();
+
+  EXPECT_EQ(scene.get_models().size(), 1);
+  EXPECT_EQ(scene.get_instances().size(), 100);
+  EXPECT_EQ(scene.get_materials().size(), model->get_materials().size());
+  EXPECT_EQ(scene.get_geometry_memory(), single.get_geometry_memory());
+  EXPECT_EQ(scene.get_geometry_memory(), model->get_geometry_memory());
+  EXPECT_GT(scene.get_instance_memory(), single.get_instance_memory());
+}
+
+// Тест 2: Границы экземпляров в мировых координатах
+TEST_F(SceneTest, InstanceBounds) {
+  Scene scene;
+  Affine3f transform = Translation3f(10.0f, 0.0f, 0.0f) * Scaling(2.0f);
+  scene.add_instance(model, transform);
+  scene.add_instance(model);
+  scene.build();
+
+  const auto& moved = scene.get_instances()[0];
+  EXPECT_FALSE(moved.identity);
+  EXPECT_TRUE(moved.bbox.min.isApprox(Vector3f(10.0f, 0.0f, 0.0f)));
+  EXPECT_TRUE(moved.bbox.max.isApprox(Vector3f(12.0f, 2.0f, 0.0f)));
+  EXPECT_TRUE(scene.get_instances()[1].identity);
+
+  EXPECT_TRUE(scene.get_bbox().min.isApprox(Vector3f(0.0f, 0.0f, 0.0f)));
+  EXPECT_TRUE(scene.get_bbox().max.isApprox(Vector3f(12.0f, 2.0f, 0.0f)));
+}
+
+// Тест 3: Обход верхнего уровня находит только экземпляры на пути луча
+TEST_F(SceneTest, InstanceTraversal) {
+  Scene scene;
+  for (int i = 0; i < 16; ++i) {
+    scene.add_instance(model, Affine3f(Translation3f(0.0f, 0.0f, -1.0f * i)));
+    scene.add_instance(model, Affine3f(Translation3f(5.0f, 0.0f, -1.0f * i)));
+  }
+  scene.build();
+
+  Ray ray(Vector3f(0.5f, 0.5f, 1.0f), Vector3f(0.0f, 0.0f, -1.0f));
+  std::vector<float> depths;
+  float t_max = 100.0f;
+  scene.for_each_instance(ray, 0.0f, t_max, [&](const Instance& instance) {
+    depths.push_back(instance.transform.translation().z());
+    EXPECT_EQ(instance.transform.translation().x(), 0.0f);
+  });
+  EXPECT_EQ(depths.size(), 16);
+
+  // после сужения t_max дальние экземпляры пропускаются
+  depths.clear();
+  t_max = 100.0f;
+  scene.for_each_instance(ray, 0.0f, t_max, [&](const Instance& instance) {
+    depths.push_back(instance.transform.translation().z());
+    t_max = 1.5f;
+  });
+  ASSERT_LT(depths.size(), 16);
+  for (size_t i = 1; i < depths.size(); ++i) {
+    EXPECT_GE(depths[i], -0.5f);
+  }
+}
+
+// Тест 4: Правки сцены перестраивают только верхний уровень
+TEST_F(SceneTest, EditInstances) {
+  Scene scene;
+  uint32_t first = scene.add_instance(model);
+  uint32_t second =
+      scene.add_instance(model, Affine3f(Translation3f(4.0f, 0.0f, 0.0f)));
+  scene.update();
+  auto bvh = model->get_meshes()[0].bvh;
+
+  Ray ray(Vector3f(8.5f, 0.5f, 1.0f), Vector3f(0.0f, 0.0f, -1.0f));
+  size_t hits = 0;
+  float t_max = 100.0f;
+  scene.for_each_instance(ray, 0.0f, t_max, [&](const Instance&) { ++hits; });
+  EXPECT_EQ(hits, 0);
+
+  // перемещение уточняет границы без перестроения геометрии
+  scene.set_transform(second, Affine3f(Translation3f(8.0f, 0.0f, 0.0f)));
+  scene.update();
+  EXPECT_TRUE(scene.get_bbox().max.isApprox(Vector3f(9.0f, 1.0f, 0.0f)));
+  scene.for_each_instance(ray, 0.0f, t_max, [&](const Instance& instance) {
+    EXPECT_EQ(&instance, &scene.get_instances()[second]);
+    ++hits;
+  });
+  EXPECT_EQ(hits, 1);
+  EXPECT_EQ(model->get_meshes()[0].bvh, bvh);
+
+  // удаленный экземпляр не попадается лучам, id остальных сохраняются
+  scene.remove_instance(second);
+  scene.update();
+  hits = 0;
+  scene.for_each_instance(ray, 0.0f, t_max, [&](const Instance&) { ++hits; });
+  EXPECT_EQ(hits, 0);
+  EXPECT_FALSE(scene.get_instances()[first].removed);
+  EXPECT_TRUE(scene.get_bbox().max.isApprox(Vector3f(1.0f, 1.0f, 0.0f)));
+
+  // модель освобождается вместе с последним экземпляром
+  scene.remove_instance(first);
+  scene.update();
+  EXPECT_EQ(scene.get_models()[0], nullptr);
+  EXPECT_EQ(scene.get_geometry_memory(), 0);
+}
+
+// Тест 5: Материал меняется на месте, общий для всех экземпляров
+TEST_F(SceneTest, EditMaterial) {
+  std::ofstream(dir / "quad.mtl") << "newmtl grey\nKd 0.5 0.5 0.5\n";
+  std::ofstream(dir / "material.obj")
+      << "mtllib quad.mtl\nv 0 0 0\nv 1 0 0\nv 1 1 0\nusemtl grey\n"
+         "f 1 2 3\n";
+  auto imported = Model::import(dir / "material.obj");
+  ASSERT_TRUE(imported.has_value());
+  auto model = std::make_shared<const Model>(std::move(*imported));
+
+  Scene scene;
+  scene.add_instance(model);
+  scene.add_instance(model, Affine3f(Translation3f(2.0f, 0.0f, 0.0f)));
+  scene.update();
+  ASSERT_EQ(scene.get_materials().size(), 1);
+  auto material = scene.get_materials()[0];
+
+  Material red;
+  red.diffuse = Vector3f(1.0f, 0.0f, 0.0f);
+  scene.set_material(0, red);
+  EXPECT_EQ(scene.get_materials()[0], material);
+  EXPECT_TRUE(model->get_materials()[0]->diffuse.isApprox(red.diffuse));
+
+  // неизвестный id игнорируется
+  scene.set_material(1, Material());
+  EXPECT_EQ(scene.get_material(1), nullptr);
+  EXPECT_EQ(scene.get_material(0), material);
+}
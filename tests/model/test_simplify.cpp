@@ -0,0 +1,90 @@
+#include <gtest/gtest.h>
+#include <cmath>
+#include <eigen3/Eigen/Geometry>
+#include <vector>
+#include "grid.h"
+#include "mesh.h"
+#include "simplify.h"
+
+using namespace rtr;
+using Eigen::Vector3f;
+
+// Тест 1: Плоская сетка упрощается без ошибки и сохраняет границы
+TEST(SimplifyTest, FlatGrid) {
+  std::vector<PackedVertex> vertexes, out_vertexes;
+  std::vector<VertexIndex> indices, out_indices;
+  make_grid(16, 1.0f, vertexes, indices);
+
+  float error = simplify(vertexes, indices, 64, out_vertexes, out_indices);
+  EXPECT_LE(out_indices.size() / 3, 64);
+  EXPECT_GT(out_indices.size(), 0);
+  EXPECT_NEAR(error, 0.0f, 1e-4f);
+
+  // площадь и углы квадрата остаются на месте
+  float area = 0.0f;
+  Vector3f min = Vector3f::Constant(1e9f), max = Vector3f::Constant(-1e9f);
+  for (size_t i = 0; i < out_indices.size(); i += 3) {
+    Vector3f p0 = out_vertexes[out_indices[i]].get_position();
+    Vector3f p1 = out_vertexes[out_indices[i + 1]].get_position();
+    Vector3f p2 = out_vertexes[out_indices[i + 2]].get_position();
+    Vector3f n = (p1 - p0).cross(p2 - p0);
+    EXPECT_GT(n.z(), 0.0f);
+    area += 0.5f * n.norm();
+    for (const auto& p : {p0, p1, p2}) {
+      min = min.cwiseMin(p);
+      max = max.cwiseMax(p);
+    }
+  }
+  EXPECT_NEAR(area, 1.0f, 1e-4f);
+  EXPECT_TRUE(min.isApprox(Vector3f(0, 0, 0)));
+  EXPECT_TRUE(max.isApprox(Vector3f(1, 1, 0)));
+}
+
+// Тест 2: Ошибка кривой поверхности ограничивает отклонение вершин
+TEST(SimplifyTest, BoundedError) {
+  std::vector<PackedVertex> vertexes, out_vertexes;
+  std::vector<VertexIndex> indices, out_indices;
+  auto height = [](float u, float v) {
+    return 0.1f * std::sin(6.0f * u) * std::cos(4.0f * v);
+  };
+  make_grid(32, 1.0f, height, vertexes, indices);
+
+  float error = simplify(vertexes, indices, indices.size() / 12,
+                         out_vertexes, out_indices);
+  EXPECT_LE(out_indices.size(), indices.size() / 4);
+  EXPECT_GT(error, 0.0f);
+  EXPECT_LT(error, 0.1f);
+  for (const auto& vertex : out_vertexes) {
+    Vector3f p = vertex.get_position();
+    EXPECT_LE(std::abs(p.z() - height(p.x(), p.y())), error);
+  }
+}
+
+// Тест 3: Цепочка уровней детализации меша
+TEST(SimplifyTest, MeshLODChain) {
+  Mesh mesh;
+  make_grid(
+      32, 1.0f, [](float u, float v) { return 0.05f * std::sin(8.0f * u * v); },
+      mesh.vertexes.vector(), mesh.indices.vector());
+  mesh.bvh = std::make_shared<BVHAccel>(mesh.vertexes, mesh.indices);
+  size_t full_memory = mesh.memory_usage();
+
+  mesh.build_lods(3);
+  ASSERT_EQ(mesh.lods.size(), 3);
+  size_t triangles = mesh.indices.size() / 3;
+  float error = 0.0f;
+  for (const auto& lod : mesh.lods) {
+    EXPECT_LE(lod.indices.size() / 3, triangles / 2);
+    EXPECT_GE(lod.error, error);
+    ASSERT_NE(lod.bvh, nullptr);
+    EXPECT_EQ(lod.bvh->get_leaf_indices().size(), lod.indices.size());
+    triangles = lod.indices.size() / 3;
+    error = lod.error;
+  }
+  EXPECT_GT(mesh.memory_usage(), full_memory);
+  EXPECT_LT(mesh.memory_usage(), 2 * full_memory);
+
+  // уровни строятся по старым позициям и сбрасываются при рефите
+  mesh.refit();
+  EXPECT_TRUE(mesh.lods.empty());
+}
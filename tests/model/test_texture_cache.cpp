@@ -0,0 +1,88 @@
+#include <gtest/gtest.h>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "temp_dir.h"
+#include "texture_cache.h"
+
+using namespace rtr;
+
+class TextureCacheTest : public TempDirTest {
+ protected:
+  void SetUp() override {
+    TempDirTest::SetUp();
+    fs::create_directories(dir / "textures");
+
+    // PPM 2x1: красный и синий пиксели
+    std::ofstream(dir / "textures" / "red_blue.ppm", std::ios::binary)
+        << "P6\n2 1\n255\n"
+        << std::string("\xff\x00\x00\x00\x00\xff", 6);
+  }
+};
+
+// Тест 1: Один файл декодируется один раз для всех материалов
+TEST_F(TextureCacheTest, SharedTexture) {
+  TextureCache cache;
+  auto first = cache.load(dir, "textures/red_blue.ppm");
+  auto second = cache.load(dir, "textures/red_blue.ppm");
+  // путь из другой системы с обратными слешами
+  auto third = cache.load(dir, "C:\\assets\\textures\\red_blue.ppm");
+
+  ASSERT_TRUE(first.get() != nullptr);
+  EXPECT_EQ(first.get(), second.get());
+  EXPECT_EQ(first.get(), third.get());
+  EXPECT_EQ(first.get()->width, 2);
+  EXPECT_GT(first.get()->sample(0.75f, 0.5f).z(), 0.9f);
+
+  EXPECT_EQ(cache.get_paths().size(), 1);
+  EXPECT_EQ(cache.memory_usage(), Image::storage_size(2, 1));
+}
+
+// Тест 2: Пустое имя и отсутствующий файл дают пустую текстуру
+TEST_F(TextureCacheTest, MissingTexture) {
+  TextureCache cache;
+  EXPECT_EQ(cache.load(dir, "").get(), nullptr);
+  EXPECT_EQ(cache.load(dir, "missing.ppm").get(), nullptr);
+
+  EXPECT_TRUE(cache.get_paths().empty());
+  EXPECT_EQ(cache.memory_usage(), 0);
+}
+
+// Тест 3: Параллельные запросы из разных потоков
+TEST_F(TextureCacheTest, ConcurrentRequests) {
+  TextureCache cache;
+  std::vector<TextureCache::TextureFuture> futures(16);
+  std::vector<std::thread> threads;
+  for (size_t i = 0; i < futures.size(); ++i) {
+    threads.emplace_back([&, i] {
+      futures[i] = cache.load(dir, "textures/red_blue.ppm");
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  for (const auto& future : futures) {
+    EXPECT_EQ(future.get(), futures[0].get());
+  }
+  EXPECT_EQ(cache.get_paths().size(), 1);
+}
+
+// Тест 4: Текстуры без внешних ссылок освобождаются
+TEST_F(TextureCacheTest, ReleaseUnused) {
+  TextureCache cache;
+  auto kept = cache.load(dir, "textures/red_blue.ppm").get();
+  cache.load(dir, "missing.ppm").wait();
+  ASSERT_TRUE(kept != nullptr);
+
+  cache.release_unused();
+  EXPECT_EQ(cache.get_paths().size(), 1);
+  EXPECT_EQ(cache.load(dir, "textures/red_blue.ppm").get(), kept);
+
+  kept.reset();
+  cache.release_unused();
+  EXPECT_TRUE(cache.get_paths().empty());
+  EXPECT_EQ(cache.memory_usage(), 0);
+}
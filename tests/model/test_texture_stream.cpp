@@ -0,0 +1,123 @@
+#include <gtest/gtest.h>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "temp_dir.h"
+#include "texture_stream.h"
+
+using namespace rtr;
+
+class TextureStreamTest : public TempDirTest {
+ protected:
+  /// @brief PPM size x size одного цвета
+  fs::path write_texture(const std::string& name, int size,
+                         unsigned char red) {
+    fs::path path = dir / name;
+    std::string pixels;
+    for (int i = 0; i < size * size; ++i) {
+      pixels += std::string{char(red), 0, 0};
+    }
+    std::ofstream(path, std::ios::binary)
+        << "P6\n" << size << " " << size << "\n255\n" << pixels;
+    return path;
+  }
+};
+
+// Тест 1: Текстура декодируется только при первой выборке
+TEST_F(TextureStreamTest, DecodedOnFirstSample) {
+  auto streamer = std::make_shared<TextureStreamer>(1 << 20);
+  auto image = streamer->open(write_texture("red.ppm", 8, 255));
+  ASSERT_TRUE(image != nullptr);
+  EXPECT_EQ(image->width, 8);
+  EXPECT_TRUE(image->data.empty());
+  EXPECT_EQ(streamer->get_stats().resident_bytes, 0);
+
+  EXPECT_GT(image->sample(0.5f, 0.5f).x(), 0.9f);
+  EXPECT_GT(image->sample(0.25f, 0.5f).x(), 0.9f);
+
+  auto stats = streamer->get_stats();
+  EXPECT_EQ(stats.misses, 1);
+  EXPECT_EQ(stats.hits, 1);
+  EXPECT_EQ(stats.resident_bytes, Image::storage_size(8, 8));
+
+  EXPECT_EQ(streamer->open(dir / "missing.ppm"), nullptr);
+}
+
+// Тест 2: Давно не используемая текстура вытесняется по бюджету
+TEST_F(TextureStreamTest, EvictsLeastRecentlyUsed) {
+  size_t size = Image::storage_size(8, 8);
+  auto streamer = std::make_shared<TextureStreamer>(2 * size);
+  auto first = streamer->open(write_texture("first.ppm", 8, 255));
+  auto second = streamer->open(write_texture("second.ppm", 8, 128));
+  auto third = streamer->open(write_texture("third.ppm", 8, 0));
+
+  first->sample(0.5f, 0.5f);
+  second->sample(0.5f, 0.5f);
+  first->sample(0.5f, 0.5f);
+  third->sample(0.5f, 0.5f);  // вытесняет second
+
+  auto stats = streamer->get_stats();
+  EXPECT_EQ(stats.misses, 3);
+  EXPECT_EQ(stats.evictions, 1);
+  EXPECT_EQ(stats.resident_bytes, 2 * size);
+
+  first->sample(0.5f, 0.5f);
+  EXPECT_EQ(streamer->get_stats().misses, 3);
+  EXPECT_NEAR(second->sample(0.5f, 0.5f).x(), 128 / 255.0f, 1e-3f);
+  EXPECT_EQ(streamer->get_stats().misses, 4);
+  EXPECT_LE(streamer->get_stats().resident_bytes, 2 * size);
+}
+
+// Тест 3: Для далекой выборки загружаются только грубые уровни
+TEST_F(TextureStreamTest, CoarseLevelsOnly) {
+  auto streamer = std::make_shared<TextureStreamer>(1 << 20);
+  auto image = streamer->open(write_texture("red.ppm", 16, 255));
+
+  // footprint 1/4 текстуры: уровень 2, 4x4
+  EXPECT_GT(image->sample(0.5f, 0.5f, 0.25f).x(), 0.9f);
+  EXPECT_EQ(streamer->get_stats().resident_bytes, Image::storage_size(4, 4));
+
+  // более детальная выборка загружает текстуру заново
+  EXPECT_GT(image->sample(0.5f, 0.5f).x(), 0.9f);
+  auto stats = streamer->get_stats();
+  EXPECT_EQ(stats.misses, 2);
+  EXPECT_EQ(stats.resident_bytes, Image::storage_size(16, 16));
+
+  image->sample(0.5f, 0.5f, 0.25f);
+  EXPECT_EQ(streamer->get_stats().misses, 2);
+}
+
+// Тест 4: Параллельные выборки при бюджете меньше набора текстур
+TEST_F(TextureStreamTest, ConcurrentSamples) {
+  auto streamer =
+      std::make_shared<TextureStreamer>(Image::storage_size(8, 8));
+  std::vector<std::shared_ptr<Image>> images;
+  for (int i = 0; i < 4; ++i) {
+    images.push_back(streamer->open(
+        write_texture("t" + std::to_string(i) + ".ppm", 8, 60 * i)));
+  }
+
+  std::vector<std::thread> threads;
+  std::atomic<int> errors{0};
+  for (int t = 0; t < 8; ++t) {
+    threads.emplace_back([&, t] {
+      for (int i = 0; i < 200; ++i) {
+        int texture = (t + i) % images.size();
+        float red = images[texture]->sample(0.5f, 0.5f).x();
+        if (std::abs(red - 60 * texture / 255.0f) > 1e-3f) {
+          ++errors;
+        }
+      }
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  EXPECT_EQ(errors, 0);
+  auto stats = streamer->get_stats();
+  EXPECT_EQ(stats.hits + stats.misses, 8 * 200);
+  EXPECT_LE(stats.resident_bytes, Image::storage_size(8, 8));
+}
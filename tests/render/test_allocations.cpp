@@ -0,0 +1,70 @@
+#include <gtest/gtest.h>
+#include <atomic>
+#include <cstdlib>
+#include <memory>
+#include <new>
+#include "grid.h"
+#include "raytracer.h"
+#include "temp_dir.h"
+
+using namespace rtr;
+using namespace Eigen;
+
+// Счетчик выделений кучи всего процесса
+static std::atomic<size_t> heap_allocations{0};
+
+void* operator new(std::size_t size) {
+  heap_allocations.fetch_add(1, std::memory_order_relaxed);
+  if (void* p = std::malloc(size ? size : 1))
+    return p;
+  throw std::bad_alloc();
+}
+void* operator new(std::size_t size, std::align_val_t alignment) {
+  heap_allocations.fetch_add(1, std::memory_order_relaxed);
+  size_t a = static_cast<size_t>(alignment);
+  if (void* p = std::aligned_alloc(a, (size + a - 1) / a * a))
+    return p;
+  throw std::bad_alloc();
+}
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
+void operator delete(void* p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t, std::align_val_t) noexcept {
+  std::free(p);
+}
+
+class AllocationTest : public TempDirTest {};
+
+// После прогрева трассировка пикселей не выделяет память в куче
+TEST_F(AllocationTest, TracingDoesNotAllocate) {
+  // сетка 16 x 16 квадратов в плоскости z = 0
+  write_grid_obj(dir / "grid.obj", 16);
+  auto imported = Model::import(dir / "grid.obj");
+  ASSERT_TRUE(imported.has_value());
+  // геометрия собрана в арену модели
+  ASSERT_NE(imported->get_arena(), nullptr);
+  EXPECT_GT(imported->get_arena()->used_bytes(), 0);
+
+  auto model = std::make_shared<const Model>(std::move(*imported));
+  auto camera = std::make_shared<const Camera>(Vector3f(8.0f, 8.0f, 10.0f),
+                                               Vector3f(8.0f, 8.0f, 0.0f));
+  RayTracer tracer(model, camera);
+  tracer.add_light({Vector3f(10.0f, 11.0f, 5.0f), Vector3f(1.0f, 1.0f, 1.0f)});
+
+  auto trace = [&tracer]() {
+    Vector3f sum = Vector3f::Zero();
+    for (int y = 0; y < 32; ++y) {
+      for (int x = 0; x < 32; ++x) {
+        sum += tracer.trace_pixel((x + 0.5f) / 32.0f, (y + 0.5f) / 32.0f);
+      }
+    }
+    return sum;
+  };
+  // первый проход наращивает буферы потока
+  Vector3f warm = trace();
+
+  size_t before = heap_allocations.load();
+  Vector3f steady = trace();
+  EXPECT_EQ(heap_allocations.load() - before, 0);
+  EXPECT_TRUE(steady.isApprox(warm, 1e-3f));
+}
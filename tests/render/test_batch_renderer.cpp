@@ -0,0 +1,40 @@
+#include <gtest/gtest.h>
+#include <eigen3/Eigen/Core>
+#include <memory>
+#include <vector>
+#include "batch_renderer.h"
+
+using namespace rtr;
+using namespace Eigen;
+
+// Камеры орбиты равномерно распределены вокруг центра
+TEST(BatchRendererTest, OrbitKeepsDistanceToCenter) {
+  Camera start(Vector3f(0.0f, 0.0f, 5.0f), Vector3f::Zero());
+  auto cameras = make_orbit(start, Vector3f::Zero(), 8, Vector3f::UnitY());
+
+  ASSERT_EQ(cameras.size(), 8);
+  EXPECT_TRUE(cameras[0].get_position().isApprox(start.get_position()));
+  for (const auto& camera : cameras) {
+    EXPECT_NEAR(camera.get_position().norm(), 5.0f, 1e-4f);
+  }
+  // половина оборота - противоположная сторона
+  EXPECT_TRUE(cameras[4].get_position().isApprox(Vector3f(0.0f, 0.0f, -5.0f),
+                                                 1e-4f));
+}
+
+// Все кадры отдаются по порядку
+TEST(BatchRendererTest, FramesAreReportedInOrder) {
+  auto model = std::make_shared<const Model>();
+  BatchRenderer batch(model, 40, 30, 2, 2);
+
+  auto cameras = make_orbit(Camera(), Vector3f(0.0f, 0.0f, -1.0f), 5,
+                            Vector3f::UnitY());
+  std::vector<size_t> indices;
+  batch.render(cameras, [&indices](size_t index, const FrameBuffer& frame) {
+    EXPECT_EQ(frame.get_width(), 40);
+    EXPECT_EQ(frame.get_height(), 30);
+    indices.push_back(index);
+  });
+
+  EXPECT_EQ(indices, (std::vector<size_t>{0, 1, 2, 3, 4}));
+}
@@ -239,4 +239,47 @@ TEST_F(CalculateLightingTest, VeryDimLight) {
   EXPECT_LT(result.x(), material->ambient.x() + 0.1f);
   EXPECT_LT(result.y(), material->ambient.y() + 0.1f);
   EXPECT_LT(result.z(), material->ambient.z() + 0.1f);
-}
\ No newline at end of file
+}
+
+// Тест 11: Свет за пределами радиуса отсечения не учитывается
+TEST_F(CalculateLightingTest, LightCutoffSkipsDistantLights) {
+  Light light;
+  light.position = Vector3f(0.0f, 50.0f, 0.0f);
+  light.intensity = Vector3f(1.0f, 1.0f, 1.0f);
+
+  rayTracer->add_light(light);
+  rayTracer->set_light_cutoff(0.05f);
+
+  Vector3f result = rayTracer->calculate(hit);
+
+  EXPECT_FLOAT_EQ(result.x(), material->ambient.x());
+  EXPECT_FLOAT_EQ(result.y(), material->ambient.y());
+  EXPECT_FLOAT_EQ(result.z(), material->ambient.z());
+}
+
+// Тест 12: Стохастическая выборка источников в среднем совпадает с полной
+TEST_F(CalculateLightingTest, StochasticSamplingMatchesFullSum) {
+  material->specular = Vector3f::Zero();
+  material->ambient = Vector3f::Zero();
+
+  for (int i = 0; i < 16; ++i) {
+    Light light;
+    light.position = Vector3f(float(i % 4) - 1.5f, 3.0f, float(i / 4) - 1.5f);
+    light.intensity = Vector3f(0.02f, 0.02f, 0.02f) * float(i + 1);
+    rayTracer->add_light(light);
+  }
+
+  Vector3f expected = rayTracer->calculate(hit);
+
+  rayTracer->set_light_samples(4);
+  Vector3f sum = Vector3f::Zero();
+  const int iterations = 4000;
+  for (int i = 0; i < iterations; ++i) {
+    sum += rayTracer->calculate(hit);
+  }
+  Vector3f mean = sum / iterations;
+
+  EXPECT_NEAR(mean.x(), expected.x(), 0.02f);
+  EXPECT_NEAR(mean.y(), expected.y(), 0.02f);
+  EXPECT_NEAR(mean.z(), expected.z(), 0.02f);
+}
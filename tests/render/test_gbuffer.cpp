@@ -0,0 +1,56 @@
+#include <gtest/gtest.h>
+#include <eigen3/Eigen/Core>
+#include "camera.h"
+#include "gbuffer.h"
+
+using namespace rtr;
+using namespace Eigen;
+
+class GBufferTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    camera = Camera(Vector3f(0.0f, 0.0f, 5.0f), Vector3f(0.0f, 0.0f, 0.0f));
+  }
+
+  Camera camera;
+  GBuffer gbuffer;
+};
+
+// Пустой G-buffer невалиден
+TEST_F(GBufferTest, EmptyIsInvalid) {
+  EXPECT_TRUE(gbuffer.empty());
+  EXPECT_FALSE(gbuffer.is_valid(4, 4, camera));
+}
+
+// После reset хранит промахи для всех пикселей
+TEST_F(GBufferTest, ResetFillsMisses) {
+  gbuffer.reset(4, 3, camera);
+
+  EXPECT_TRUE(gbuffer.is_valid(4, 3, camera));
+  for (size_t y = 0; y < 3; ++y) {
+    for (size_t x = 0; x < 4; ++x) {
+      EXPECT_FALSE(gbuffer.at(x, y).is_hit());
+    }
+  }
+}
+
+// Изменение размера или камеры делает G-buffer невалидным
+TEST_F(GBufferTest, ViewChangeInvalidates) {
+  gbuffer.reset(4, 4, camera);
+  EXPECT_FALSE(gbuffer.is_valid(8, 4, camera));
+
+  Camera moved = camera;
+  moved.move_forward(1.0f);
+  EXPECT_FALSE(gbuffer.is_valid(4, 4, moved));
+
+  Camera rotated = camera;
+  rotated.rotate(10.0f, 0.0f);
+  EXPECT_FALSE(gbuffer.is_valid(4, 4, rotated));
+
+  Camera zoomed = camera;
+  zoomed.set_fov(30.0f);
+  EXPECT_FALSE(gbuffer.is_valid(4, 4, zoomed));
+
+  gbuffer.clear();
+  EXPECT_FALSE(gbuffer.is_valid(4, 4, camera));
+}
@@ -1,6 +1,11 @@
 #include <gtest/gtest.h>
+#include <algorithm>
+#include <cmath>
+#include <fstream>
 #include <memory>
+#include "grid.h"
 #include "raytracer.h"
+#include "temp_dir.h"
 #include "vertex.h"
 
 using namespace rtr;
@@ -20,11 +25,17 @@ class TestRayTracer : public RayTracer {
                                          float t_max, HitRecord& rec) {
     return RayTracer::hit_triangle(ray, v0, v1, v2, t_min, t_max, rec);
   }
+
+  using RayTracer::RayTracer;
+  using RayTracer::hit_model;
+  using RayTracer::hit_rays;
 };
 
-class TriangleIntersectionTest : public ::testing::Test {
+class TriangleIntersectionTest : public TempDirTest {
  protected:
   void SetUp() override {
+    TempDirTest::SetUp();
+
     // Простой треугольник в плоскости XY
     v0 = {{0, 0, 0}, {0, 0, 1}, {0, 0}};
     v1 = {{1, 0, 0}, {0, 0, 1}, {1, 0}};
@@ -112,4 +123,165 @@ TEST_F(TriangleIntersectionTest, TRangeLimits) {
   EXPECT_TRUE(result1);
   EXPECT_FALSE(result2);
   EXPECT_FALSE(result3);
-}
\ No newline at end of file
+}
+// Ширина конуса луча переводится в текстурные координаты
+TEST_F(TriangleIntersectionTest, RayConeFootprint) {
+  Ray ray = *ray_through_center;
+  HitRecord rec;
+  ASSERT_TRUE(
+      TestRayTracer::hit_triangle(ray, v0, v1, v2, 0.0f, 10.0f, rec));
+  EXPECT_EQ(rec.footprint, 0.0f);  // без конуса
+
+  // площадь в текстуре равна площади треугольника, падение по нормали
+  ray.cone_width = 0.01f;
+  ray.cone_spread = 0.02f;
+  ASSERT_TRUE(
+      TestRayTracer::hit_triangle(ray, v0, v1, v2, 0.0f, 10.0f, rec));
+  EXPECT_NEAR(rec.footprint, 0.03f, 1e-5f);
+
+  // под углом 60 градусов к нормали след вдвое шире
+  Vector3f direction(0.0f, std::sqrt(3.0f) / 2.0f, 0.5f);
+  Ray oblique(Vector3f{0.3f, 0.3f, 0.0f} - direction, direction);
+  oblique.cone_width = 0.01f;
+  ASSERT_TRUE(
+      TestRayTracer::hit_triangle(oblique, v0, v1, v2, 0.0f, 10.0f, rec));
+  EXPECT_NEAR(rec.footprint, 0.02f, 1e-5f);
+}
+
+// Экземпляры: луч переводится в пространство объекта, t остается мировым
+TEST_F(TriangleIntersectionTest, InstanceHit) {
+  std::ofstream(dir / "triangle.mtl") << "newmtl gray\nKd 0.5 0.5 0.5\n";
+  std::ofstream(dir / "triangle.obj") << "mtllib triangle.mtl\nusemtl gray\n"
+                                         "v 0 0 0\nv 1 0 0\nv 0 1 0\n"
+                                         "vn 0 0 1\nf 1//1 2//1 3//1\n";
+  auto imported = Model::import(dir / "triangle.obj");
+  ASSERT_TRUE(imported.has_value());
+  auto model = std::make_shared<const Model>(std::move(*imported));
+
+  // повернут на 90 градусов вокруг Y, увеличен и сдвинут
+  auto scene = std::make_shared<Scene>();
+  Affine3f transform = Translation3f(5.0f, 0.0f, 0.0f) *
+                       AngleAxisf(0.5f * EIGEN_PI, Vector3f::UnitY()) *
+                       Scaling(2.0f);
+  scene->add_instance(model, transform);
+  scene->add_instance(model);
+  scene->build();
+  TestRayTracer tracer(scene, nullptr);
+
+  // треугольник лежит в плоскости x = 5 и смотрит вдоль +X
+  Ray ray(Vector3f(8.0f, 0.5f, -0.5f), Vector3f(-1.0f, 0.0f, 0.0f));
+  HitRecord rec;
+  ASSERT_TRUE(tracer.hit_model(ray, 0.001f, 100.0f, rec));
+  EXPECT_NEAR(rec.t, 3.0f, 1e-4f);
+  EXPECT_TRUE(rec.point.isApprox(Vector3f(5.0f, 0.5f, -0.5f), 1e-4f));
+  EXPECT_TRUE(rec.normal.isApprox(Vector3f(1.0f, 0.0f, 0.0f), 1e-4f));
+  EXPECT_EQ(rec.material_id, 0);
+
+  // второй экземпляр на месте модели, ближний из двух перекрывает
+  Ray along_z(Vector3f(0.25f, 0.25f, 3.0f), Vector3f(0.0f, 0.0f, -1.0f));
+  ASSERT_TRUE(tracer.hit_model(along_z, 0.001f, 100.0f, rec));
+  EXPECT_NEAR(rec.t, 3.0f, 1e-4f);
+  EXPECT_FALSE(tracer.hit_model(along_z, 0.001f, 2.0f, rec));
+}
+
+// Ошибка упрощения растягивается масштабом экземпляра: конус уже ошибки в
+// мировых единицах оставляет полную детализацию
+TEST_F(TriangleIntersectionTest, ScaledInstanceLOD) {
+  // сетка 16 x 16 квадратов с пиками в нечетных узлах
+  write_grid_obj(dir / "grid.obj", 16, [](float x, float y) {
+    return 0.25f * (int(x) % 2) * (int(y) % 2);
+  });
+  ImportOptions options;
+  options.lod_levels = 2;
+  auto imported = Model::import(dir / "grid.obj", options);
+  ASSERT_TRUE(imported.has_value());
+  const auto& lods = imported->get_meshes()[0].lods;
+  ASSERT_FALSE(lods.empty());
+  float finest = lods.front().error;
+  float coarsest = lods.back().error;
+  ASSERT_GT(finest, 0.0f);
+
+  const float scale = 4.0f;
+  auto scene = std::make_shared<Scene>();
+  scene->add_instance(std::make_shared<const Model>(std::move(*imported)),
+                      Affine3f(Scaling(scale)));
+  scene->build();
+  TestRayTracer full(scene, nullptr);
+  TestRayTracer tracer(scene, nullptr);
+  tracer.set_lod_error(1.0f);
+
+  // лучи сверху рядом с пиками, которые упрощение сглаживает
+  auto hit_difference = [&](float cone_width) {
+    float difference = 0.0f;
+    for (int y = 1; y < 16; y += 2) {
+      for (int x = 1; x < 16; x += 2) {
+        Ray ray(Vector3f(x + 0.1f, y + 0.05f, 10.0f) * scale,
+                Vector3f(0.0f, 0.0f, -1.0f));
+        ray.cone_width = cone_width;
+        HitRecord expected, rec;
+        EXPECT_TRUE(full.hit_model(ray, 0.001f, 1000.0f, expected));
+        EXPECT_TRUE(tracer.hit_model(ray, 0.001f, 1000.0f, rec));
+        difference = std::max(difference, std::abs(rec.t - expected.t));
+      }
+    }
+    return difference;
+  };
+  // ошибка уровней в объекте меньше конуса, но в мире больше
+  EXPECT_EQ(hit_difference(0.5f * finest * scale), 0.0f);
+  // конус шире ошибки грубого уровня в мире
+  EXPECT_GT(hit_difference(2.0f * coarsest * scale), 0.0f);
+}
+
+// Геометрия вне памяти: попадания совпадают с резидентной моделью, а
+// пакет лучей читает каждый кластер один раз
+TEST_F(TriangleIntersectionTest, PagedGeometryHit) {
+  // сетка 8 x 8 квадратов в плоскости z = 0
+  write_grid_obj(dir / "grid.obj", 8);
+
+  auto resident = Model::import(dir / "grid.obj");
+  ImportOptions options;
+  auto pager = std::make_shared<GeometryPager>(1 << 20, dir / "clusters", 8);
+  options.geometry_pager = pager;
+  auto paged = Model::import(dir / "grid.obj", options);
+  ASSERT_TRUE(resident.has_value());
+  ASSERT_TRUE(paged.has_value());
+  ASSERT_NE(paged->get_meshes()[0].clusters, nullptr);
+  size_t cluster_count = paged->get_meshes()[0].clusters->cluster_count();
+  EXPECT_GT(cluster_count, 1);
+
+  TestRayTracer resident_tracer(
+      std::make_shared<const Model>(std::move(*resident)), nullptr);
+  TestRayTracer paged_tracer(std::make_shared<const Model>(std::move(*paged)),
+                             nullptr);
+  EXPECT_TRUE(paged_tracer.has_paged_geometry());
+  EXPECT_FALSE(resident_tracer.has_paged_geometry());
+
+  std::vector<Ray> rays;
+  for (int i = 0; i < 16; ++i) {
+    rays.emplace_back(Vector3f(0.3f + i * 0.5f, 7.7f - i * 0.45f, 2.0f),
+                      Vector3f(0.0f, 0.0f, -1.0f));
+  }
+  std::vector<HitRecord> records(rays.size());
+  auto hits = paged_tracer.hit_rays(rays, 0.001f, 100.0f, records);
+  size_t batch_misses = pager->get_stats().misses;
+  EXPECT_GT(batch_misses, 0);
+  EXPECT_LE(batch_misses, cluster_count);
+
+  for (size_t i = 0; i < rays.size(); ++i) {
+    HitRecord expected, single;
+    ASSERT_TRUE(resident_tracer.hit_model(rays[i], 0.001f, 100.0f, expected));
+    ASSERT_TRUE(paged_tracer.hit_model(rays[i], 0.001f, 100.0f, single));
+    ASSERT_TRUE(hits[i]);
+    EXPECT_NEAR(records[i].t, expected.t, 1e-5f);
+    EXPECT_NEAR(single.t, expected.t, 1e-5f);
+    EXPECT_TRUE(records[i].point.isApprox(expected.point, 1e-5f));
+    EXPECT_EQ(records[i].material_id, expected.material_id);
+  }
+
+  // промах не читает кластеры
+  HitRecord rec;
+  Ray miss(Vector3f(20.0f, 20.0f, 2.0f), Vector3f(0.0f, 0.0f, -1.0f));
+  size_t misses = pager->get_stats().misses;
+  EXPECT_FALSE(paged_tracer.hit_model(miss, 0.001f, 100.0f, rec));
+  EXPECT_EQ(pager->get_stats().misses, misses);
+}
@@ -0,0 +1,123 @@
+#include <gtest/gtest.h>
+#include <atomic>
+#include <eigen3/Eigen/Core>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "render_session.h"
+#include "thread_pool.h"
+
+using namespace rtr;
+using namespace Eigen;
+
+// Пул выполняет все задачи
+TEST(ThreadPoolTest, ExecutesAllTasks) {
+  ThreadPool pool(4);
+  std::atomic<int> counter{0};
+
+  std::vector<std::future<void>> futures;
+  for (int i = 0; i < 100; ++i) {
+    futures.push_back(pool.submit([&counter]() { ++counter; }));
+  }
+  for (auto& future : futures) {
+    future.get();
+  }
+
+  EXPECT_EQ(pool.size(), 4);
+  EXPECT_EQ(counter, 100);
+}
+
+// Остановленный рендер прерывается и сообщает об этом
+TEST(RendererCancelTest, StoppedRenderReturnsFalse) {
+  auto model = std::make_shared<const Model>();
+  auto camera = std::make_shared<const Camera>();
+  Renderer renderer(model, camera, 64, 64);
+
+  std::stop_source stop;
+  stop.request_stop();
+  EXPECT_FALSE(renderer.render(2, nullptr, stop.get_token()));
+  EXPECT_TRUE(renderer.render(2));
+  EXPECT_TRUE(renderer.render_preview(8, 2));
+}
+
+class RenderSessionTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    model = std::make_shared<const Model>();
+    camera = std::make_shared<Camera>();
+  }
+
+  std::shared_ptr<const Model> model;
+  std::shared_ptr<Camera> camera;
+  std::mutex mutex;
+  std::vector<bool> passes;
+};
+
+// Сессия рендерит превью, затем полный кадр
+TEST_F(RenderSessionTest, RendersPreviewThenFinalFrame) {
+  RenderSession session(model, camera, 64, 48,
+                        [this](const FrameBuffer& frame, bool preview) {
+                          EXPECT_EQ(frame.get_width(), 64);
+                          std::lock_guard<std::mutex> lock(mutex);
+                          passes.push_back(preview);
+                        });
+  session.wait();
+
+  std::lock_guard<std::mutex> lock(mutex);
+  ASSERT_EQ(passes.size(), 2);
+  EXPECT_TRUE(passes[0]);
+  EXPECT_FALSE(passes[1]);
+}
+
+// Движение камеры перезапускает рендер
+TEST_F(RenderSessionTest, CameraUpdateRestartsFrame) {
+  RenderSession session(model, camera, 64, 48,
+                        [this](const FrameBuffer&, bool preview) {
+                          std::lock_guard<std::mutex> lock(mutex);
+                          passes.push_back(preview);
+                        });
+
+  for (int i = 0; i < 5; ++i) {
+    session.update_camera([](Camera& c) { c.move_forward(1.0f); });
+  }
+  session.wait();
+
+  EXPECT_TRUE(camera->get_position().isApprox(5.0f * camera->get_forward()));
+
+  std::lock_guard<std::mutex> lock(mutex);
+  ASSERT_GE(passes.size(), 2);
+  EXPECT_FALSE(passes.back());
+}
+
+// Рендер с истекшим сроком выполняет только грубый проход
+TEST(RendererDeadlineTest, ExpiredDeadlineKeepsCoarseLevel) {
+  auto model = std::make_shared<const Model>();
+  auto camera = std::make_shared<const Camera>();
+  Renderer renderer(model, camera, 96, 64);
+
+  auto quality = renderer.render(Renderer::Clock::now(), 2);
+
+  EXPECT_EQ(quality.level, 0);
+  EXPECT_TRUE(quality.deadline_reached);
+  EXPECT_EQ(quality.total_tiles, 6);
+  EXPECT_LT(quality.refined_tiles, quality.total_tiles);
+}
+
+// При достаточном времени достигается максимальное качество
+TEST(RendererDeadlineTest, DistantDeadlineReachesTopLevel) {
+  auto model = std::make_shared<const Model>();
+  auto camera = std::make_shared<const Camera>();
+  Renderer renderer(model, camera, 96, 64);
+
+  std::vector<float> progress;
+  auto quality = renderer.render(
+      Renderer::Clock::now() + std::chrono::hours(1), 2,
+      [&progress](float value) { progress.push_back(value); });
+
+  EXPECT_EQ(quality.level, int(Renderer::quality_levels.size()) - 1);
+  EXPECT_FALSE(quality.deadline_reached);
+  EXPECT_EQ(quality.samples_per_pixel,
+            Renderer::quality_levels.back().samples_per_pixel);
+  ASSERT_FALSE(progress.empty());
+  EXPECT_FLOAT_EQ(progress.back(), 1.0f);
+}
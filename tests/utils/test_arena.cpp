@@ -0,0 +1,56 @@
+#include <gtest/gtest.h>
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "arena.h"
+
+using namespace rtr;
+
+// Выделения выровнены и берутся из одного блока, пока он не заполнен
+TEST(ArenaTest, AllocationsShareBlocks) {
+  Arena arena(4096);
+  auto bytes = arena.allocate_array<uint8_t>(3);
+  auto doubles = arena.allocate_array<double>(10);
+  auto* value = arena.create<std::array<float, 4>>();
+
+  EXPECT_EQ(bytes.size(), 3);
+  EXPECT_EQ(doubles.size(), 10);
+  EXPECT_EQ(reinterpret_cast<uintptr_t>(doubles.data()) % alignof(double), 0);
+  EXPECT_EQ(reinterpret_cast<uintptr_t>(value) % alignof(float), 0);
+  EXPECT_EQ(arena.block_count(), 1);
+  EXPECT_GE(arena.used_bytes(), 3 + 10 * sizeof(double) + sizeof(*value));
+  EXPECT_TRUE(arena.allocate_array<int>(0).empty());
+
+  // большое выделение получает свой блок
+  auto large = arena.allocate_array<uint32_t>(4096);
+  large[4095] = 1;
+  EXPECT_EQ(arena.block_count(), 2);
+  EXPECT_GE(arena.reserved_bytes(), 4096 + 4096 * sizeof(uint32_t));
+}
+
+// Буфер в арене держит ее, пока жив сам
+TEST(ArenaTest, BufferKeepsArena) {
+  std::vector<int> values = {1, 2, 3, 4};
+  Buffer<int> owned(values);
+
+  auto arena = std::make_shared<Arena>();
+  std::weak_ptr<Arena> weak = arena;
+  Arena::move_to(arena, owned);
+  Buffer<int> view = Arena::copy(arena, std::span<const int>(values));
+  arena.reset();
+
+  EXPECT_FALSE(weak.expired());
+  EXPECT_TRUE(owned.is_view());
+  EXPECT_EQ(std::vector<int>(owned.begin(), owned.end()), values);
+  EXPECT_EQ(std::vector<int>(view.begin(), view.end()), values);
+
+  // представление не копируется повторно
+  const int* data = owned.data();
+  Arena::move_to(weak.lock(), owned);
+  EXPECT_EQ(owned.data(), data);
+
+  owned = Buffer<int>();
+  view = Buffer<int>();
+  EXPECT_TRUE(weak.expired());
+}
@@ -71,4 +71,92 @@ TEST_F(ImageTest, SpecialCoordinateValues) {
     EXPECT_TRUE(color.y() >= 0.0f && color.y() <= 1.0f);
     EXPECT_TRUE(color.z() >= 0.0f && color.z() <= 1.0f);
   }
-}
\ No newline at end of file
+}
+
+// Тест: пирамида уровней до 1x1
+TEST_F(ImageTest, MipLevels) {
+  EXPECT_EQ(test_image->level_count(), 2);
+  EXPECT_EQ(test_image->data.size(), Image::storage_size(2, 2));
+
+  std::vector<unsigned char> pixels(5 * 3 * 3, 0);
+  Image image(5, 3, pixels.data());
+  EXPECT_EQ(image.level_count(), 3);  // 5x3, 2x1, 1x1
+}
+
+// Тест: билинейная интерполяция между центрами текселей
+TEST_F(ImageTest, BilinearSampling) {
+  // середина между синим (0,0) и белым (1,0) нижней строки
+  Vector3f color = test_image->sample(0.5f, 0.25f);
+  EXPECT_NEAR(color.x(), 0.5f, 0.01f);
+  EXPECT_NEAR(color.y(), 0.5f, 0.01f);
+  EXPECT_NEAR(color.z(), 1.0f, 0.01f);
+}
+
+// Тест: большой след выбирает уменьшенный уровень со средним цветом
+TEST_F(ImageTest, TrilinearSampling) {
+  Vector3f average(0.5f, 0.5f, 0.5f);
+  EXPECT_TRUE(test_image->sample(0.25f, 0.25f, 1.0f).isApprox(average, 0.01f));
+  EXPECT_TRUE(test_image->sample(0.25f, 0.25f, 100.0f).isApprox(average,
+                                                                0.01f));
+
+  // нулевой след - полное разрешение
+  EXPECT_TRUE(test_image->sample(0.25f, 0.25f, 0.0f)
+                  .isApprox(test_image->sample(0.25f, 0.25f)));
+
+  // между уровнями - смесь
+  Vector3f color = test_image->sample(0.25f, 0.25f, 0.75f);
+  EXPECT_GT(color.x(), 0.1f);
+  EXPECT_LT(color.x(), 0.5f);
+}
+
+// Тест: BC1 хранит плитку 4x4 в 8 байтах с малой ошибкой
+TEST_F(ImageTest, BC1Compression) {
+  // градиент 16x16, синий убывает навстречу красному
+  std::vector<unsigned char> pixels(16 * 16 * 3);
+  for (int y = 0; y < 16; ++y) {
+    for (int x = 0; x < 16; ++x) {
+      unsigned char* p = &pixels[(y * 16 + x) * 3];
+      p[0] = static_cast<unsigned char>(x * 16);
+      p[1] = static_cast<unsigned char>(x * 8 + 64);
+      p[2] = static_cast<unsigned char>(255 - x * 16);
+    }
+  }
+  Image raw(16, 16, pixels.data());
+  Image bc1(16, 16, pixels.data(), TextureFormat::BC1);
+
+  EXPECT_EQ(bc1.data.size(),
+            Image::storage_size(16, 16, TextureFormat::BC1));
+  EXPECT_EQ(raw.data.size(), 6 * bc1.data.size());
+
+  float max_error = 0.0f;
+  for (int y = 0; y < 16; ++y) {
+    for (int x = 0; x < 16; ++x) {
+      float u = (x + 0.5f) / 16, v = 1.0f - (y + 0.5f) / 16;
+      Vector3f error = raw.sample(u, v) - bc1.sample(u, v);
+      max_error = std::max(max_error, error.cwiseAbs().maxCoeff());
+    }
+  }
+  EXPECT_LT(max_error, 0.05f);
+
+  // уровни пирамиды тоже сжаты
+  Image coarse = bc1.from_level(2);
+  EXPECT_EQ(coarse.format, TextureFormat::BC1);
+  EXPECT_EQ(coarse.width, 4);
+  EXPECT_TRUE(coarse.sample(0.5f, 0.5f).isApprox(
+      bc1.sample(0.5f, 0.5f, 0.25f), 1e-3f));
+}
+
+// Тест: однотонная плитка BC1 передается без потерь в пределах RGB565
+TEST_F(ImageTest, BC1SolidColor) {
+  std::vector<unsigned char> pixels(4 * 4 * 3);
+  for (size_t i = 0; i < pixels.size(); i += 3) {
+    pixels[i] = 255;
+    pixels[i + 1] = 128;
+    pixels[i + 2] = 0;
+  }
+  Image bc1(4, 4, pixels.data(), TextureFormat::BC1);
+  Vector3f color = bc1.sample(0.3f, 0.6f);
+  EXPECT_NEAR(color.x(), 1.0f, 1e-3f);
+  EXPECT_NEAR(color.y(), 128 / 255.0f, 0.01f);
+  EXPECT_NEAR(color.z(), 0.0f, 1e-3f);
+}